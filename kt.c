@@ -1,14 +1,42 @@
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <strings.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <math.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <curl/curl.h>
+#include <zlib.h>
+#ifdef KT_WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include "kt.h"
 
+/* AWS service name used in credential scopes */
+static const char *service = "kinesis";
+
+/* request encodings, sent as Content-Type and signed with it */
+static const char *jsonContentType = "application/x-amz-json-1.1";
+static const char *cborContentType = "application/x-amz-cbor-1.1";
+
 /*************************/
 /* Print error then exit */
 /*************************/
@@ -31,6 +59,42 @@ void* malloct(size_t bytes){
 	return ptr;
 }
 
+/*****************************************************************************************************************/
+/* Scratch allocation for request building. With an arena, memory is bumped off the caller's buffer, 16 byte     */
+/* aligned, and NULL comes back once it is used up; nothing is freed individually, the caller releases the lot  */
+/* by restoring arena->used. Without one (arena NULL) this is malloct, and scratchFree frees as usual.          */
+/*****************************************************************************************************************/
+void* scratchAlloc(ScratchArena *arena, size_t bytes){
+
+	if(!arena)
+		return malloct(bytes);
+
+	size_t start = (arena->used + 15) & ~(size_t)15;
+
+	if(start > arena->size || bytes > arena->size - start)
+		return NULL;
+
+	arena->used = start + bytes;
+
+	return arena->base + start;
+}
+
+void scratchFree(ScratchArena *arena, void *ptr){
+
+	if(!arena)
+		free(ptr);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktInitScratchArena(ScratchArena *arena, void *buffer, size_t size){
+
+	arena->base = (char*)buffer;
+	arena->size = size;
+	arena->used = 0;
+}
+
 /**************************************************/
 /* Simple binary to lower case hex converter util */
 /**************************************************/
@@ -59,6 +123,65 @@ char* string2HexSHA256(const char *s){
 	return hex;
 }
 
+/***************************************************************************************/
+/* Write lower case hex SHA-256 of len bytes of data to hex, which must hold 65 chars. */
+/***************************************************************************************/
+void data2HexSHA256(const void *data, size_t len, char *hex){
+
+	unsigned char hash[32];
+
+	if(!SHA256(data, len, hash))
+		errorExit("OpenSSL library error", "SHA256 returned NULL");
+
+	digest2Hex(hash, 32, hex);
+}
+
+/************************************************************************************************/
+/* Incremental SHA-256. Wraps the OpenSSL EVP digest so payload builders can hash as they go. */
+/* beginSHA256 returns NULL if OpenSSL can't allocate or initialize the digest.               */
+/************************************************************************************************/
+EVP_MD_CTX* beginSHA256(){
+
+	EVP_MD_CTX *md = EVP_MD_CTX_new();
+
+	if(md && !EVP_DigestInit_ex(md, EVP_sha256(), NULL)){
+		EVP_MD_CTX_free(md);
+		md = NULL;
+	}
+
+	return md;
+}
+
+void updateSHA256(EVP_MD_CTX *md, const void *data, size_t len){
+
+	if(len && !EVP_DigestUpdate(md, data, len))
+		errorExit("OpenSSL library error", "SHA256 update failed");
+}
+
+/**********************************************************************************/
+/* Finish hash and write lower case hex (65 chars with null) to hex. Frees md.   */
+/**********************************************************************************/
+void finishHexSHA256(EVP_MD_CTX *md, char *hex){
+
+	unsigned char hash[32];
+
+	if(!EVP_DigestFinal_ex(md, hash, NULL))
+		errorExit("OpenSSL library error", "SHA256 final failed");
+
+	EVP_MD_CTX_free(md);
+
+	digest2Hex(hash, 32, hex);
+}
+
+/*********************************************************************************/
+/* Convert string and key (with length len) to binary hash in hash, 32 bytes.   */
+/*********************************************************************************/
+void string2HMACSHA256To(const char *s, const unsigned char *key, int len, unsigned char *hash){
+
+	if(NULL == HMAC(EVP_sha256(), key, len, s, strlen(s), hash, NULL))
+		errorExit("OpenSSL library error", "HMAC returned NULL");
+}
+
 /*****************************************************************************************/
 /* Convert string and key (with length len) to binary hash. Caller frees returned buffer */
 /*****************************************************************************************/
@@ -66,16 +189,25 @@ unsigned char* string2HMACSHA256(const char *s, const unsigned char *key, int le
 
 	unsigned char* hash=(unsigned char*)malloct(32);
 
-	if(NULL == HMAC(EVP_sha256(), key, len, s, strlen(s), hash, NULL))
-		errorExit("OpenSSL library error", "HMAC returned NULL");
+	string2HMACSHA256To(s, key, len, hash);
 
 	return hash;
 }
 
-/*************************************************************************************************/
-/* Simple base64 encoder per https://en.wikipedia.org/wiki/Base64 . Caller frees returned buffer */
-/*************************************************************************************************/
-char* base64Encode(const unsigned char *data, int len){
+/*************************************************************************/
+/* Number of chars base64Encode produces for len bytes, excluding null. */
+/*************************************************************************/
+size_t base64Length(int len){
+
+	return 4 * (((size_t)len + 2) / 3);
+}
+
+/***************************************************************************************************************/
+/* Simple base64 encoder per https://en.wikipedia.org/wiki/Base64 . Writes base64Length(len) chars to data64, */
+/* which must be big enough, without null terminating. Returns the number of chars written.                    */
+/* Portable fallback for base64EncodeTo, also used for the tails the vector encoders leave.                    */
+/***************************************************************************************************************/
+static size_t base64EncodeScalar(const unsigned char *data, int len, char *data64){
 
 	const static char *lookupTable="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 	
@@ -84,11 +216,8 @@ char* base64Encode(const unsigned char *data, int len){
 	if(len % 3 > 0)
 		padding = 3 - (len % 3);
 	
-	int len64 = 4 * (len + padding) / 3;
-	char *data64 = (char*) malloct(len64 + 1);
-	
 	int in=0;
-	int out=0;
+	size_t out=0;
 	
 	while(in < len){
 		
@@ -113,625 +242,8842 @@ char* base64Encode(const unsigned char *data, int len){
 		data64[out++] = lookupTable[(threeBytes >>  0) & 0x3F];
 	}
 	
-	data64[out] = '\0';
-	
 	if(padding >= 1)
 		data64[out-1] = '=';
 		
 	if(padding == 2)
 		data64[out-2] = '=';
 	
-	return data64;
+	return out;
 }
 
-/*************************************************************************************************************************************/
-/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_PutRecord.html . Caller frees returned buffer */
-/*************************************************************************************************************************************/
-char* makePutRecordPayload(const unsigned char *data, int len, const char *streamName, const char *partitionKey){
-
-	static const char *template =
-		"{"	
-		"\"StreamName\":\"%s\","
-		"\"PartitionKey\":\"%s\","
-		"\"Data\":\"%s\""
-		"}";
-	
-	char *encData=base64Encode(data, len);
+#if defined(__x86_64__) || defined(__i386__)
 
-	char *payload=(char*)malloct(strlen(template)+strlen(streamName)+strlen(partitionKey)+strlen(encData) + 1);
+/*****************************************************************************************************************/
+/* Vector base64 per http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html . Each 16 byte lane takes 12    */
+/* input bytes, reshuffles them so every 32 bit word holds 3 bytes, splits those into four 6 bit indices with    */
+/* two multiplies, then maps indices to ASCII by adding an offset looked up from the index range.               */
+/*****************************************************************************************************************/
+__attribute__((target("ssse3")))
+static inline __m128i base64LookupSSSE3(__m128i indices){
 
-	sprintf(
-		payload,
-		template,
-		streamName,
-		partitionKey,
-		encData
-		);
+	const __m128i shiftLUT = _mm_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0);
 
-	free(encData);
+	/* 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12 */
+	__m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	range = _mm_or_si128(range, _mm_and_si128(less, _mm_set1_epi8(13)));
 
-	return payload;
+	return _mm_add_epi8(_mm_shuffle_epi8(shiftLUT, range), indices);
 }
 
-/**************************************************************************************************************************************************/
-/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_PutRecordsRequestEntry.html . Caller frees returned buffer */
-/**************************************************************************************************************************************************/
-char* makePutRecordsRequestEntry(const unsigned char *data, int len, const char *partitionKey){
-
-	static const char *template =
-		"{"	
-		"\"PartitionKey\":\"%s\","
-		"\"Data\":\"%s\""
-		"}";
-		
-	char *encData=base64Encode(data, len);
-	char *payload=(char*)malloct(strlen(template)+strlen(partitionKey)+strlen(encData) + 1);
+__attribute__((target("ssse3")))
+static size_t base64EncodeSSSE3(const unsigned char *data, int len, char *data64){
 
-	sprintf(
-		payload,
-		template,
-		partitionKey,
-		encData
-		);
+	const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
 
-	free(encData);
+	int in = 0;
+	size_t out = 0;
 
-	return payload;		
-}
+	/* loads are 16 bytes wide but only 12 are consumed, so stop while 16 remain readable */
+	while(len - in >= 16){
 
-/***************************************************************************************************************************************/
-/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_PutRecords.html . Caller frees returned buffer. */
-/***************************************************************************************************************************************/
-char* makePutRecordsPayload(const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray){
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + in)), shuffle);
 
-	static const char *templateStart =
-		"{"
-			"\"StreamName\": \"%s\","
-			"\"Records\": [";
-	
-	static const char *templateEnd =
-			"]"
-		"}";
-	
-	
-	char *payloadStart = (char*)malloct(strlen(streamName) + strlen(templateStart) + 1);
-	const char *payloadEnd = templateEnd;
-	
-	sprintf(
-		payloadStart,
-		templateStart,
-		streamName
-		);
+		__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+		__m128i t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
 
-	int bufferSize=strlen(payloadStart) + strlen(payloadEnd) + 1;
-	
-	char **payloadEntry = malloct(recordCount * sizeof(char*));
-	
-	int i;
-	for(i=0; i<recordCount; i++){
-		
-		payloadEntry[i] = makePutRecordsRequestEntry(dataArray[i], lenArray[i], partitionKeyArray[i]);
+		_mm_storeu_si128((__m128i*)(data64 + out), base64LookupSSSE3(_mm_or_si128(t0, t1)));
 
-		bufferSize+=strlen(payloadEntry[i]) + 1;
+		in += 12;
+		out += 16;
 	}
-	
-	char *payload = malloct(bufferSize);
-	*payload='\0';
-	strcat(payload, payloadStart);
-	free(payloadStart);
 
-	for(i=0; i<recordCount; i++){
-		
-		if(i>0)
-			strcat(payload,",");
-		strcat(payload, payloadEntry[i]);
-		free(payloadEntry[i]);
-	}
-	
-	strcat(payload, payloadEnd);
-	
-	
-	return payload;
+	return out + base64EncodeScalar(data + in, len - in, data64 + out);
 }
 
+__attribute__((target("avx2")))
+static inline __m256i base64LookupAVX2(__m256i indices){
 
-/******************************************************************************************************************************************/
-/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_DescribeStream.html . Caller frees returned buffer */
-/******************************************************************************************************************************************/
-char* makeDescribeStreamPayload(const char *streamName){
+	const __m256i shiftLUT = _mm256_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0);
 
-	static const char *template =
-		"{"	
-		"\"StreamName\":\"%s\""
-		"}";
+	__m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+	__m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+	range = _mm256_or_si256(range, _mm256_and_si256(less, _mm256_set1_epi8(13)));
 
-	char *payload=(char*)malloct(strlen(template)+strlen(streamName) + 1);
+	return _mm256_add_epi8(_mm256_shuffle_epi8(shiftLUT, range), indices);
+}
 
-	sprintf(
-		payload,
-		template,
-		streamName
-		);
+__attribute__((target("avx2")))
+static size_t base64EncodeAVX2(const unsigned char *data, int len, char *data64){
 
-	return payload;
-}
+	const __m256i shuffle = _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
 
-/***************************************************************************************************************************************/
-/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_ListStreams.html . Caller frees returned buffer */
-/***************************************************************************************************************************************/
-char* makeListStreamsPayload(){
+	int in = 0;
+	size_t out = 0;
 
-	static const char *template = "{}";
+	/* two 16 byte loads, 12 bytes apart, feed the two 128 bit lanes; the second must stay readable */
+	while(len - in >= 28){
 
-	char *payload=(char*)malloct(strlen(template) + 1);
+		__m128i lo = _mm_loadu_si128((const __m128i*)(data + in));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(data + in + 12));
+		__m256i v = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), shuffle);
 
-	sprintf(
-		payload,
-		template,
-		""
-		);
+		__m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+		__m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
 
-	return payload;
+		_mm256_storeu_si256((__m256i*)(data64 + out), base64LookupAVX2(_mm256_or_si256(t0, t1)));
+
+		in += 24;
+		out += 32;
+	}
+
+	return out + base64EncodeSSSE3(data + in, len - in, data64 + out);
 }
 
-/*************************************************************************************************************************************************/
-/* Creates Canonical Request per http://docs.aws.amazon.com/general/latest/gr/sigv4-create-canonical-request.html . Caller frees returned buffer */
-/*************************************************************************************************************************************************/
-char* makeCanonicalRequest(const char *host, const char *longDate, const char *payload){
+#elif defined(__aarch64__)
 
-	static const char *template =
-		"POST\n"
-		"/\n"
-		"\n"
-		"content-type:application/x-amz-json-1.1\n"
-		"host:%s\n"
-		"x-amz-date:%s\n"
-		"\n"
-		"content-type;host;x-amz-date\n"
-		"%s";
+/*****************************************************************************************************/
+/* NEON base64. vld3q de-interleaves 48 input bytes into three vectors, the four 6 bit indices are  */
+/* formed with shifts and masks and mapped to ASCII with a 64 byte table lookup, then re-interleaved */
+/* by vst4q into 64 output chars.                                                                    */
+/*****************************************************************************************************/
+static size_t base64EncodeNEON(const unsigned char *data, int len, char *data64){
 
-	char *hash = string2HexSHA256(payload);
+	static const unsigned char lookupTable[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-	char *creq=(char*)malloct(strlen(template)+strlen(host)+strlen(longDate)+strlen(hash) + 1);
+	const uint8x16x4_t table = vld1q_u8_x4(lookupTable);
+	const uint8x16_t mask = vdupq_n_u8(0x3F);
 
-	sprintf(
-		creq,
-		template,
-		host,
-		longDate,
-		hash	
-		);
+	int in = 0;
+	size_t out = 0;
 
-	free(hash);
+	while(len - in >= 48){
 
-	return creq;
-}
+		uint8x16x3_t v = vld3q_u8(data + in);
+		uint8x16x4_t r;
 
-/*******************************************************************************************************************************************/
-/* Creates String to Sign per http://docs.aws.amazon.com/general/latest/gr/sigv4-create-string-to-sign.html . Caller frees returned buffer */
-/*******************************************************************************************************************************************/
-char* makeStringToSign(const char *longDate, const char *shortDate, const char *region, const char *service, const char *canonicalRequest){
+		r.val[0] = vshrq_n_u8(v.val[0], 2);
+		r.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[0], 4), vshrq_n_u8(v.val[1], 4)), mask);
+		r.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[1], 2), vshrq_n_u8(v.val[2], 6)), mask);
+		r.val[3] = vandq_u8(v.val[2], mask);
 
-	static const char *template =
-		"AWS4-HMAC-SHA256\n"
-		"%s\n"
-		"%s/%s/%s/aws4_request\n"
-		"%s";
+		r.val[0] = vqtbl4q_u8(table, r.val[0]);
+		r.val[1] = vqtbl4q_u8(table, r.val[1]);
+		r.val[2] = vqtbl4q_u8(table, r.val[2]);
+		r.val[3] = vqtbl4q_u8(table, r.val[3]);
 
-	char *hash = string2HexSHA256(canonicalRequest);
+		vst4q_u8((uint8_t*)(data64 + out), r);
 
-	char *str=(char*)malloct(strlen(template)+strlen(longDate)+strlen(shortDate)+strlen(service)+strlen(region)+strlen(hash) + 1);
+		in += 48;
+		out += 64;
+	}
 
-	sprintf(
-		str,
-		template,
-		longDate,
-		shortDate,
-		region,
-		service,
-		hash	
-		);
+	return out + base64EncodeScalar(data + in, len - in, data64 + out);
+}
 
-	free(hash);
+#endif
 
-	return str;
+/*****************************************************************************************/
+/* base64EncodeTo implementation chosen once, on first use, from the CPU's capabilities. */
+/*****************************************************************************************/
+static size_t (*base64EncodeImpl)(const unsigned char *data, int len, char *data64) = base64EncodeScalar;
+static pthread_once_t base64EncodeOnce = PTHREAD_ONCE_INIT;
+
+static void selectBase64Encoder(){
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		base64EncodeImpl = base64EncodeAVX2;
+	else if(__builtin_cpu_supports("ssse3"))
+		base64EncodeImpl = base64EncodeSSSE3;
+#elif defined(__aarch64__)
+	base64EncodeImpl = base64EncodeNEON; /* NEON is mandatory on AArch64 */
+#endif
 }
 
-/**************************************************************************************************************************************/
-/* Calculate signature per http://docs.aws.amazon.com/general/latest/gr/sigv4-calculate-signature.html . Caller frees returned buffer */
-/**************************************************************************************************************************************/
-char* makeSignature(const char *key, const char *shortDate, const char *region, const char *service, const char *stringToSign){
+/***************************************************************************************************************/
+/* Base64 encode per https://en.wikipedia.org/wiki/Base64 . Writes base64Length(len) chars to data64, which   */
+/* must be big enough, without null terminating. Returns the number of chars written. Uses AVX2, SSSE3 or     */
+/* NEON where the CPU supports them, otherwise the scalar encoder.                                             */
+/***************************************************************************************************************/
+size_t base64EncodeTo(const unsigned char *data, int len, char *data64){
 
-	unsigned char *kSecret, *kDate, *kRegion, *kService, *kSigning, *sig;
+	pthread_once(&base64EncodeOnce, selectBase64Encoder);
 
-	kSecret=(unsigned char*)malloct(strlen(key) + 5);
-	sprintf(kSecret, "AWS4%s", key);
-	kDate=string2HMACSHA256(shortDate, kSecret, strlen(kSecret));
-	kRegion=string2HMACSHA256(region, kDate, 32);
-	kService=string2HMACSHA256(service, kRegion, 32);
-	kSigning=string2HMACSHA256("aws4_request", kService, 32);
-	sig=string2HMACSHA256(stringToSign, kSigning, 32);
+	return base64EncodeImpl(data, len, data64);
+}
 
-	char *hex = (char*)malloct(65);
-	digest2Hex(sig, 32, hex);
+/*************************************************************************************************/
+/* Simple base64 encoder per https://en.wikipedia.org/wiki/Base64 . Caller frees returned buffer */
+/*************************************************************************************************/
+char* base64Encode(const unsigned char *data, int len){
 
-	free(kSecret);
-	free(kDate);
-	free(kRegion);
-	free(kService);
-	free(kSigning);
-	free(sig);
-	
-	return hex;
+	char *data64 = (char*) malloct(base64Length(len) + 1);
+
+	data64[base64EncodeTo(data, len, data64)] = '\0';
+
+	return data64;
 }
 
-/*****************************************************************************************************************************************************/
-/* Create Authentication Header per http://docs.aws.amazon.com/general/latest/gr/sigv4-add-signature-to-request.html . Caller frees returned buffer  */
-/*****************************************************************************************************************************************************/
-char* makeAuthHeader(const char *key, const char *keyId, const char *longDate, const char *shortDate, const char *region,  const char *endpoint, const char *payload){
+/*************************************************************************/
+/* Value of each char in the base64 alphabet, 0xFF for every other char. */
+/*************************************************************************/
+static const unsigned char base64Values[256] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+	0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
 
-	static const char *service = "kinesis";
-	
-	static const char *template =
-		"Authorization: AWS4-HMAC-SHA256 "
-		"Credential=%s/%s/%s/%s/aws4_request, "
-		"SignedHeaders=content-type;host;x-amz-date, "
-		"Signature=%s";
+/***************************************************************************************************************/
+/* Base64 decoder, the inverse of base64EncodeScalar. Decodes len chars of data64 to data, which must hold     */
+/* len / 4 * 3 bytes. Returns the number of bytes written, or -1 unless data64 is padded base64. data may be   */
+/* data64, decoding in place, as each group of 4 chars is read before its 3 bytes are written.                 */
+/* Portable fallback for base64DecodeTo, also used for the tails the vector decoders leave.                    */
+/***************************************************************************************************************/
+static long base64DecodeScalar(const char *data64, size_t len, unsigned char *data){
 
-	/* canonical request */
-	char *creq = makeCanonicalRequest(endpoint, longDate, payload);
-	
-	/* string to sign */
-	char *stringTosign = makeStringToSign(longDate, shortDate, region, service, creq);
-	
-	/* signature */
-	char *sig = makeSignature(key, shortDate, region, service, stringTosign);
+	const unsigned char *s = (const unsigned char*)data64;
 
-	char* header=(char*)malloct(strlen(template)+strlen(keyId)+strlen(shortDate)+strlen(region)+strlen(service)+strlen(sig) + 1);
+	if(len % 4)
+		return -1;
 
-	sprintf(
-		header,
-		template,
-		keyId,
-		shortDate,
-		region,
-		service,
-		sig	
-		);
+	/* a padded final group is decoded on its own */
+	size_t full = len > 0 && s[len-1] == '=' ? len - 4 : len;
+	size_t in = 0, out = 0;
 
-	free(creq);
-	free(stringTosign);
-	free(sig);
-	
-	return header;
-}
+	for(; in < full; in += 4){
 
-/*********************************************************************************/
-/* Prints null terminated short and long form UTC dates in user supplied buffer. */
-/* longDate and shortDate buffers should be 17 and 9 chars respectively.         */
-/*********************************************************************************/
-void makeDateStrings(char *longDate, char *shortDate){
+		uint32_t a = base64Values[s[in]], b = base64Values[s[in+1]], c = base64Values[s[in+2]], d = base64Values[s[in+3]];
+		if((a | b | c | d) & 0x80)
+			return -1;
 
-	time_t time_;
-	struct tm tm_;
+		uint32_t threeBytes = a << 18 | b << 12 | c << 6 | d;
+		data[out++] = threeBytes >> 16;
+		data[out++] = threeBytes >> 8;
+		data[out++] = threeBytes;
+	}
 
-	time(&time_);
-	gmtime_r(&time_, &tm_);
-	strftime(longDate, 17, "%Y%m%dT%H%M%SZ", &tm_);
-	strftime(shortDate, 9, "%Y%m%d", &tm_);
-}
+	if(in < len){
 
-/**************************************************/
-/* See comments in header file for kt* functions  */
-/**************************************************/
-AWSContext* ktMakeAWSContext(const char *key, const char *keyId, const char *sessionToken, const char *region, const char *endpoint){
+		uint32_t a = base64Values[s[in]], b = base64Values[s[in+1]];
+		uint32_t c = s[in+2] == '=' ? 0 : base64Values[s[in+2]];
+		if((a | b | c) & 0x80)
+			return -1;
 
-	AWSContext* ctx = malloct(sizeof(AWSContext));
-	
-	ctx->key = malloct(strlen(key)+1);
-	strcpy(ctx->key, key);
-	ctx->keyId = malloct(strlen(keyId)+1);
-	strcpy(ctx->keyId, keyId);
-	
-	ctx->sessionToken = NULL;
-	if(sessionToken != NULL){
-		ctx->sessionToken = malloct(strlen(sessionToken)+1);
-		strcpy(ctx->sessionToken, sessionToken);
+		uint32_t threeBytes = a << 18 | b << 12 | c << 6;
+		data[out++] = threeBytes >> 16;
+		if(s[in+2] != '=')
+			data[out++] = threeBytes >> 8;
 	}
-	
-	ctx->region = malloct(strlen(region)+1);
-	strcpy(ctx->region, region);
-	ctx->endpoint = malloct(strlen(endpoint)+1);
-	strcpy(ctx->endpoint, endpoint);
-	ctx->url = malloct(strlen(endpoint) + 10);
-	sprintf(ctx->url, "https://%s", endpoint);
-	
-	return ctx;
+
+	return (long)out;
 }
 
-/**************************************************/
-/* See comments in header file for kt* functions  */
-/**************************************************/
-void ktFreeAWSContext(AWSContext* ctx){
+#if defined(__x86_64__) || defined(__i386__)
+
+/*****************************************************************************************************************/
+/* Vector base64 decoding per http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html . Chars are classified  */
+/* by nibble lookups that flag any char outside the alphabet, shifted to their 6 bit values by a per range       */
+/* offset, then packed 4 to 3 with two multiplies and a shuffle. A block with an invalid char, or the padded     */
+/* end, is left to the scalar decoder, which reports the error.                                                  */
+/*****************************************************************************************************************/
+__attribute__((target("ssse3")))
+static long base64DecodeSSSE3(const char *data64, size_t len, unsigned char *data){
+
+	const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask2F = _mm_set1_epi8(0x2F);
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+	size_t in = 0, out = 0;
+
+	/* stores are 16 bytes wide but only 12 are output, so stop while 8 more chars (at least 4 bytes) follow */
+	while(len - in >= 24){
+
+		__m128i v = _mm_loadu_si128((const __m128i*)(data64 + in));
+
+		__m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(v, 4), mask2F);
+		__m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+		__m128i lo = _mm_shuffle_epi8(lutLo, _mm_and_si128(v, mask2F));
+		if(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())))
+			break;
+
+		__m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(_mm_cmpeq_epi8(v, mask2F), hiNibbles));
+		v = _mm_add_epi8(v, roll);
+
+		v = _mm_madd_epi16(_mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128((__m128i*)(data + out), _mm_shuffle_epi8(v, pack));
+
+		in += 16;
+		out += 12;
+	}
+
+	long tail = base64DecodeScalar(data64 + in, len - in, data + out);
+
+	return tail < 0 ? -1 : (long)out + tail;
+}
+
+__attribute__((target("avx2")))
+static long base64DecodeAVX2(const char *data64, size_t len, unsigned char *data){
+
+	const __m256i lutLo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lutHi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lutRoll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask2F = _mm256_set1_epi8(0x2F);
+	const __m256i pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+	size_t in = 0, out = 0;
+
+	/* 32 chars make 24 bytes in a 32 byte store, so stop while 16 more chars (at least 10 bytes) follow */
+	while(len - in >= 48){
+
+		__m256i v = _mm256_loadu_si256((const __m256i*)(data64 + in));
+
+		__m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask2F);
+		__m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+		__m256i lo = _mm256_shuffle_epi8(lutLo, _mm256_and_si256(v, mask2F));
+		if(_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256())))
+			break;
+
+		__m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(_mm256_cmpeq_epi8(v, mask2F), hiNibbles));
+		v = _mm256_add_epi8(v, roll);
+
+		v = _mm256_madd_epi16(_mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+		v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pack), join);
+		_mm256_storeu_si256((__m256i*)(data + out), v);
+
+		in += 32;
+		out += 24;
+	}
+
+	long tail = base64DecodeSSSE3(data64 + in, len - in, data + out);
+
+	return tail < 0 ? -1 : (long)out + tail;
+}
+
+#endif
+
+/*****************************************************************************************/
+/* base64DecodeTo implementation chosen once, on first use, from the CPU's capabilities. */
+/*****************************************************************************************/
+static long (*base64DecodeImpl)(const char *data64, size_t len, unsigned char *data) = base64DecodeScalar;
+static pthread_once_t base64DecodeOnce = PTHREAD_ONCE_INIT;
+
+static void selectBase64Decoder(){
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		base64DecodeImpl = base64DecodeAVX2;
+	else if(__builtin_cpu_supports("ssse3"))
+		base64DecodeImpl = base64DecodeSSSE3;
+#endif
+}
+
+/***************************************************************************************************************/
+/* Base64 decode per https://en.wikipedia.org/wiki/Base64 . Decodes len chars of padded base64 at data64 to    */
+/* data, which must hold len / 4 * 3 bytes and may be data64 itself. Returns the number of bytes written, or   */
+/* -1 if data64 isn't valid. Uses AVX2 or SSSE3 where the CPU supports them, otherwise the scalar decoder.     */
+/***************************************************************************************************************/
+long base64DecodeTo(const char *data64, size_t len, unsigned char *data){
+
+	pthread_once(&base64DecodeOnce, selectBase64Decoder);
+
+	return base64DecodeImpl(data64, len, data);
+}
+
+/*****************************************************************************************************************/
+/* The base64 decoders this CPU can run, the scalar one first, and their names, up to max of them, for kttest to */
+/* check the vector decoders against the scalar one. Returns how many.                                           */
+/*****************************************************************************************************************/
+int base64Decoders(long (**decoders)(const char*, size_t, unsigned char*), const char **names, int max){
+
+	int n = 0;
+
+	if(n < max){
+		decoders[n] = base64DecodeScalar;
+		names[n++] = "scalar";
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(n < max && __builtin_cpu_supports("ssse3")){
+		decoders[n] = base64DecodeSSSE3;
+		names[n++] = "SSSE3";
+	}
+	if(n < max && __builtin_cpu_supports("avx2")){
+		decoders[n] = base64DecodeAVX2;
+		names[n++] = "AVX2";
+	}
+#endif
+
+	return n;
+}
+
+/*****************************************************************************************/
+/* Copy len chars of s to dest without null terminating. Returns the next write position */
+/*****************************************************************************************/
+static char* appendChars(char *dest, const char *s, size_t len){
+
+	memcpy(dest, s, len);
+
+	return dest + len;
+}
+
+/**********************************************************************************************************/
+/* PayloadWriter appends to a presized payload buffer and feeds everything written to SHA-256 while it is */
+/* still in cache, so the payload hash needed for signing is ready as soon as the payload is finished.    */
+/* Written data is hashed in PAYLOAD_HASH_CHUNK sized pieces, and large base64 fields are encoded in      */
+/* pieces of the same size so no part of the payload is read back from main memory.                      */
+/**********************************************************************************************************/
+#define PAYLOAD_HASH_CHUNK 16384
+
+typedef struct{
+	char *p;
+	char *hashed;
+	EVP_MD_CTX *md;
+}PayloadWriter;
+
+/* returns 0 if the digest can't be started; only with an arena, without one this exits as malloct does */
+static int beginPayloadWriter(PayloadWriter *w, char *buffer, const ScratchArena *arena){
+
+	w->p = buffer;
+	w->hashed = buffer;
+	w->md = beginSHA256();
+
+	if(!w->md && !arena)
+		errorExit("OpenSSL library error", "Cannot initialize SHA256");
+
+	return w->md != NULL;
+}
+
+/* hash whatever was written since the last call, if there is enough of it or force is set */
+static void hashPayloadWriter(PayloadWriter *w, int force){
+
+	if(force || w->p - w->hashed >= PAYLOAD_HASH_CHUNK){
+		updateSHA256(w->md, w->hashed, w->p - w->hashed);
+		w->hashed = w->p;
+	}
+}
+
+static void writeChars(PayloadWriter *w, const char *s, size_t len){
+
+	w->p = appendChars(w->p, s, len);
+	hashPayloadWriter(w, 0);
+}
+
+static void writeBase64(PayloadWriter *w, const unsigned char *data, int len){
+
+	/* input piece that encodes to PAYLOAD_HASH_CHUNK chars, a multiple of 3 so only the last piece pads */
+	static const int piece = PAYLOAD_HASH_CHUNK / 4 * 3;
+
+	do{
+		int n = len < piece ? len : piece;
+		w->p += base64EncodeTo(data, n, w->p);
+		hashPayloadWriter(w, 0);
+		data += n;
+		len -= n;
+	}while(len > 0);
+}
+
+/* null terminate, then write the payload's hex SHA-256 (65 chars) to payloadHash */
+static void finishPayloadWriter(PayloadWriter *w, char *payloadHash){
+
+	hashPayloadWriter(w, 1);
+	*w->p = '\0';
+	finishHexSHA256(w->md, payloadHash);
+}
+
+/*************************************************************************************************************************************/
+/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_PutRecord.html . Caller frees returned buffer */
+/* The payload's hex SHA-256 is written to payloadHash, which must hold 65 chars. Allocated with scratchAlloc, so may return NULL     */
+/* if arena is full, or with an arena if the payload's digest can't be started.                                                      */
+/*************************************************************************************************************************************/
+char* makePutRecordPayload(const unsigned char *data, int len, const char *streamName, const char *partitionKey, char *payloadHash, ScratchArena *arena){
+
+	static const char payloadStart[] = "{\"StreamName\":\"";
+	static const char keyStart[] = "\",\"PartitionKey\":\"";
+	static const char dataStart[] = "\",\"Data\":\"";
+	static const char payloadEnd[] = "\"}";
+
+	size_t streamNameLen = strlen(streamName);
+	size_t partitionKeyLen = strlen(partitionKey);
+
+	char *payload=(char*)scratchAlloc(arena, sizeof(payloadStart)-1 + streamNameLen + sizeof(keyStart)-1 + partitionKeyLen + sizeof(dataStart)-1 + base64Length(len) + sizeof(payloadEnd)-1 + 1);
+	if(!payload)
+		return NULL;
+
+	PayloadWriter w;
+	if(!beginPayloadWriter(&w, payload, arena))
+		return NULL;
+
+	writeChars(&w, payloadStart, sizeof(payloadStart)-1);
+	writeChars(&w, streamName, streamNameLen);
+	writeChars(&w, keyStart, sizeof(keyStart)-1);
+	writeChars(&w, partitionKey, partitionKeyLen);
+	writeChars(&w, dataStart, sizeof(dataStart)-1);
+	writeBase64(&w, data, len);
+	writeChars(&w, payloadEnd, sizeof(payloadEnd)-1);
+
+	finishPayloadWriter(&w, payloadHash);
+
+	return payload;
+}
+
+/* fixed parts of a PutRecords payload, shared by the buffer and streaming builders */
+static const char payloadStart[] = "{\"StreamName\": \"";
+static const char recordsStart[] = "\",\"Records\": [";
+static const char entryStart[] = "{\"PartitionKey\":\"";
+static const char entryHashKey[] = "\",\"ExplicitHashKey\":\"";
+static const char entryData[] = "\",\"Data\":\"";
+static const char entryEnd[] = "\"}";
+static const char payloadEnd[] = "]}";
+
+/*******************************************************************************************/
+/* Exact size of a PutRecords payload, without null terminator, including its base64 data. */
+/*******************************************************************************************/
+size_t putRecordsPayloadSize(const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, const int *lenArray){
+
+	/* sizes of the fixed parts exclude null terminators */
+	size_t size = sizeof(payloadStart)-1 + strlen(streamName) + sizeof(recordsStart)-1 + sizeof(payloadEnd)-1;
+
+	int i;
+	for(i=0; i<recordCount; i++){
+
+		if(i>0)
+			size++;
+		size += sizeof(entryStart)-1 + strlen(partitionKeyArray[i]) + sizeof(entryData)-1 + base64Length(lenArray[i]) + sizeof(entryEnd)-1;
+		if(explicitHashKeyArray && explicitHashKeyArray[i])
+			size += sizeof(entryHashKey)-1 + strlen(explicitHashKeyArray[i]);
+	}
+
+	return size;
+}
+
+/***************************************************************************************************************************************/
+/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_PutRecords.html . Caller frees returned buffer. */
+/* The exact payload size, including base64 data, is computed first so the stream name, each                                           */
+/* http://docs.aws.amazon.com/kinesis/latest/APIReference/API_PutRecordsRequestEntry.html and its base64 data are written straight    */
+/* into one buffer in a single linear pass, with no per record allocations. The payload is hashed as it is written and its hex         */
+/* SHA-256 is written to payloadHash, which must hold 65 chars. explicitHashKeyArray, or any entry in it, may be NULL to leave out       */
+/* the optional ExplicitHashKey. Allocated with scratchAlloc, so may return NULL if arena is full, or with an arena if the payload's    */
+/* digest can't be started.                                                                                                            */
+/***************************************************************************************************************************************/
+char* makePutRecordsPayload(const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, char *payloadHash, ScratchArena *arena){
+
+	size_t streamNameLen = strlen(streamName);
+	size_t bufferSize = putRecordsPayloadSize(streamName, recordCount, partitionKeyArray, explicitHashKeyArray, lenArray) + 1;
+
+	int i;
+	char *payload = scratchAlloc(arena, bufferSize);
+	if(!payload)
+		return NULL;
+
+	PayloadWriter w;
+	if(!beginPayloadWriter(&w, payload, arena))
+		return NULL;
+
+	writeChars(&w, payloadStart, sizeof(payloadStart)-1);
+	writeChars(&w, streamName, streamNameLen);
+	writeChars(&w, recordsStart, sizeof(recordsStart)-1);
+
+	for(i=0; i<recordCount; i++){
+
+		if(i>0)
+			writeChars(&w, ",", 1);
+		writeChars(&w, entryStart, sizeof(entryStart)-1);
+		writeChars(&w, partitionKeyArray[i], strlen(partitionKeyArray[i]));
+		if(explicitHashKeyArray && explicitHashKeyArray[i]){
+			writeChars(&w, entryHashKey, sizeof(entryHashKey)-1);
+			writeChars(&w, explicitHashKeyArray[i], strlen(explicitHashKeyArray[i]));
+		}
+		writeChars(&w, entryData, sizeof(entryData)-1);
+		writeBase64(&w, dataArray[i], lenArray[i]);
+		writeChars(&w, entryEnd, sizeof(entryEnd)-1);
+	}
+
+	writeChars(&w, payloadEnd, sizeof(payloadEnd)-1);
+
+	finishPayloadWriter(&w, payloadHash);
+
+	return payload;
+}
+
+/*****************************************************************************************************************/
+/* CBOR (https://www.rfc-editor.org/rfc/rfc8949) encoding of the PutRecord and PutRecords payloads, sent as      */
+/* application/x-amz-cbor-1.1. Record data goes as raw byte strings, so there is no base64 step and the payload */
+/* is about 3/4 the size of the JSON one. Every item is written with its definite length, so sizes are exact.  */
+/*****************************************************************************************************************/
+#define CBOR_UINT 0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7
+
+/* size of the head of an item with value (its length, count or integer) */
+static size_t cborHeadSize(uint64_t value){
+
+	if(value < 24)
+		return 1;
+	if(value <= 0xff)
+		return 2;
+	if(value <= 0xffff)
+		return 3;
+	if(value <= 0xffffffff)
+		return 5;
+	return 9;
+}
+
+/* size of a text item holding s */
+static size_t cborTextSize(const char *s){
+
+	size_t len = strlen(s);
+
+	return cborHeadSize(len) + len;
+}
+
+static void writeCBORHead(PayloadWriter *w, int major, uint64_t value){
+
+	/* additional info 24..27 for 1, 2, 4 or 8 bytes of big endian value */
+	static const unsigned char info[9] = {0, 0, 24, 25, 0, 26, 0, 0, 27};
+
+	unsigned char head[9];
+	size_t size = cborHeadSize(value);
+
+	if(size == 1)
+		head[0] = (unsigned char)(major << 5 | value);
+	else{
+		head[0] = (unsigned char)(major << 5 | info[size]);
+		size_t i;
+		for(i=size-1; i>0; i--, value >>= 8)
+			head[i] = (unsigned char)(value & 0xff);
+	}
+
+	writeChars(w, (const char*)head, size);
+}
+
+static void writeCBORText(PayloadWriter *w, const char *s){
+
+	size_t len = strlen(s);
+
+	writeCBORHead(w, CBOR_TEXT, len);
+	writeChars(w, s, len);
+}
+
+/* data is copied in PAYLOAD_HASH_CHUNK pieces so each is hashed while still in cache */
+static void writeCBORBytes(PayloadWriter *w, const unsigned char *data, int len){
+
+	writeCBORHead(w, CBOR_BYTES, len);
+	while(len > 0){
+		int n = len < PAYLOAD_HASH_CHUNK ? len : PAYLOAD_HASH_CHUNK;
+		writeChars(w, (const char*)data, n);
+		data += n;
+		len -= n;
+	}
+}
+
+/*****************************************************************************************************************/
+/* CBOR payload for PutRecord, a map of StreamName, PartitionKey and Data. As makePutRecordPayload, but as the  */
+/* payload is binary its size is written to payloadLen.                                                         */
+/*****************************************************************************************************************/
+char* makePutRecordCBORPayload(const unsigned char *data, int len, const char *streamName, const char *partitionKey, char *payloadHash, size_t *payloadLen, ScratchArena *arena){
+
+	*payloadLen = 1 + cborTextSize("StreamName") + cborTextSize(streamName) + cborTextSize("PartitionKey") + cborTextSize(partitionKey) + cborTextSize("Data") + cborHeadSize(len) + len;
+
+	char *payload = (char*)scratchAlloc(arena, *payloadLen + 1);
+	if(!payload)
+		return NULL;
+
+	PayloadWriter w;
+	if(!beginPayloadWriter(&w, payload, arena))
+		return NULL;
+
+	writeCBORHead(&w, CBOR_MAP, 3);
+	writeCBORText(&w, "StreamName");
+	writeCBORText(&w, streamName);
+	writeCBORText(&w, "PartitionKey");
+	writeCBORText(&w, partitionKey);
+	writeCBORText(&w, "Data");
+	writeCBORBytes(&w, data, len);
+
+	finishPayloadWriter(&w, payloadHash);
+
+	return payload;
+}
+
+/*******************************************************************************/
+/* Exact size of a PutRecords CBOR payload, as putRecordsPayloadSize for JSON. */
+/*******************************************************************************/
+size_t cborPutRecordsPayloadSize(const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, const int *lenArray){
+
+	size_t size = 1 + cborTextSize("StreamName") + cborTextSize(streamName) + cborTextSize("Records") + cborHeadSize(recordCount);
+
+	int i;
+	for(i=0; i<recordCount; i++){
+
+		size += 1 + cborTextSize("PartitionKey") + cborTextSize(partitionKeyArray[i]) + cborTextSize("Data") + cborHeadSize(lenArray[i]) + lenArray[i];
+		if(explicitHashKeyArray && explicitHashKeyArray[i])
+			size += cborTextSize("ExplicitHashKey") + cborTextSize(explicitHashKeyArray[i]);
+	}
+
+	return size;
+}
+
+/*****************************************************************************************************************/
+/* CBOR payload for PutRecords, a map of StreamName and Records, an array of maps of PartitionKey, the optional */
+/* ExplicitHashKey and Data. As makePutRecordsPayload, but as the payload is binary its size is written to      */
+/* payloadLen.                                                                                                  */
+/*****************************************************************************************************************/
+char* makePutRecordsCBORPayload(const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, char *payloadHash, size_t *payloadLen, ScratchArena *arena){
+
+	*payloadLen = cborPutRecordsPayloadSize(streamName, recordCount, partitionKeyArray, explicitHashKeyArray, lenArray);
+
+	char *payload = (char*)scratchAlloc(arena, *payloadLen + 1);
+	if(!payload)
+		return NULL;
+
+	PayloadWriter w;
+	if(!beginPayloadWriter(&w, payload, arena))
+		return NULL;
+
+	writeCBORHead(&w, CBOR_MAP, 2);
+	writeCBORText(&w, "StreamName");
+	writeCBORText(&w, streamName);
+	writeCBORText(&w, "Records");
+	writeCBORHead(&w, CBOR_ARRAY, recordCount);
+
+	int i;
+	for(i=0; i<recordCount; i++){
+
+		int hasHashKey = explicitHashKeyArray && explicitHashKeyArray[i];
+
+		writeCBORHead(&w, CBOR_MAP, hasHashKey ? 3 : 2);
+		writeCBORText(&w, "PartitionKey");
+		writeCBORText(&w, partitionKeyArray[i]);
+		if(hasHashKey){
+			writeCBORText(&w, "ExplicitHashKey");
+			writeCBORText(&w, explicitHashKeyArray[i]);
+		}
+		writeCBORText(&w, "Data");
+		writeCBORBytes(&w, dataArray[i], lenArray[i]);
+	}
+
+	finishPayloadWriter(&w, payloadHash);
+
+	return payload;
+}
+
+
+/*****************************************************************************************************************/
+/* PutRecordsReader produces the same payload as makePutRecordsPayload a piece at a time, straight from the      */
+/* caller's record arrays, so a batch can be sent without its base64 JSON ever existing in memory as a whole.   */
+/* The payload is walked part by part: the opening, then for each record its separator, fixed strings, keys and */
+/* base64 data, then the closing. Base64 data is encoded 3 input bytes to 4 chars at a time; a quad that        */
+/* doesn't fit the caller's buffer is held back and written first on the next read.                            */
+/*****************************************************************************************************************/
+#define READER_RECORD_PARTS 8
+
+typedef struct{
+	const char *streamName;
+	int recordCount;
+	char * const *partitionKeyArray;
+	char * const *explicitHashKeyArray;
+	unsigned char * const *dataArray;
+	const int *lenArray;
+	int record;		/* -1 for the opening, recordCount for the closing */
+	int part;
+	size_t offset;	/* into the current part, in input bytes for base64 data */
+	char quad[4];
+	int quadLen;
+	int quadPos;
+}PutRecordsReader;
+
+void beginPutRecordsReader(PutRecordsReader *r, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray){
+
+	r->streamName = streamName;
+	r->recordCount = recordCount;
+	r->partitionKeyArray = partitionKeyArray;
+	r->explicitHashKeyArray = explicitHashKeyArray;
+	r->dataArray = dataArray;
+	r->lenArray = lenArray;
+	r->record = -1;
+	r->part = 0;
+	r->offset = 0;
+	r->quadLen = 0;
+	r->quadPos = 0;
+}
+
+/* the reader's current part: 1 with its text, 2 for base64 data, 0 at the end of the payload */
+static int readerPart(const PutRecordsReader *r, const char **text, size_t *len){
+
+	*text = "";
+	*len = 0;
+
+	if(r->record < 0){
+		switch(r->part){
+			case 0: *text = payloadStart; *len = sizeof(payloadStart)-1; break;
+			case 1: *text = r->streamName; *len = strlen(r->streamName); break;
+			case 2: *text = recordsStart; *len = sizeof(recordsStart)-1; break;
+		}
+		return 1;
+	}
+
+	if(r->record == r->recordCount){
+		if(r->part > 0)
+			return 0;
+		*text = payloadEnd;
+		*len = sizeof(payloadEnd)-1;
+		return 1;
+	}
+
+	const char *hashKey = r->explicitHashKeyArray ? r->explicitHashKeyArray[r->record] : NULL;
+
+	switch(r->part){
+		case 0: if(r->record > 0){ *text = ","; *len = 1; } break;
+		case 1: *text = entryStart; *len = sizeof(entryStart)-1; break;
+		case 2: *text = r->partitionKeyArray[r->record]; *len = strlen(*text); break;
+		case 3: if(hashKey){ *text = entryHashKey; *len = sizeof(entryHashKey)-1; } break;
+		case 4: if(hashKey){ *text = hashKey; *len = strlen(hashKey); } break;
+		case 5: *text = entryData; *len = sizeof(entryData)-1; break;
+		case 6: return 2;
+		case 7: *text = entryEnd; *len = sizeof(entryEnd)-1; break;
+	}
+
+	return 1;
+}
+
+static void nextReaderPart(PutRecordsReader *r){
+
+	r->offset = 0;
+	r->part++;
+
+	if((r->record < 0 && r->part == 3) || (r->record >= 0 && r->record < r->recordCount && r->part == READER_RECORD_PARTS)){
+		r->record++;
+		r->part = 0;
+	}
+}
+
+/********************************************************************************************/
+/* Write up to size chars of the payload to buffer. Returns the number written, 0 at the end. */
+/********************************************************************************************/
+size_t readPutRecordsPayload(PutRecordsReader *r, char *buffer, size_t size){
+
+	char *p = buffer, *end = buffer + size;
+
+	while(p < end){
+
+		/* a quad held back from the last read goes first */
+		if(r->quadPos < r->quadLen){
+			size_t n = r->quadLen - r->quadPos;
+			if(n > (size_t)(end - p))
+				n = end - p;
+			memcpy(p, r->quad + r->quadPos, n);
+			p += n;
+			r->quadPos += n;
+			continue;
+		}
+
+		const char *text;
+		size_t len;
+		int kind = readerPart(r, &text, &len);
+
+		if(kind == 0)
+			break;
+
+		if(kind == 1){
+			size_t n = len - r->offset;
+			if(n > (size_t)(end - p))
+				n = end - p;
+			p = appendChars(p, text + r->offset, n);
+			r->offset += n;
+			if(r->offset == len)
+				nextReaderPart(r);
+			continue;
+		}
+
+		/* base64 data */
+		const unsigned char *data = r->dataArray[r->record] + r->offset;
+		size_t remaining = r->lenArray[r->record] - r->offset;
+		size_t room = end - p;
+
+		if(remaining == 0){
+			nextReaderPart(r);
+		}
+		else if(base64Length(remaining) <= room){
+			p += base64EncodeTo(data, remaining, p);
+			nextReaderPart(r);
+		}
+		else if(room >= 4){
+			size_t n = room / 4 * 3;
+			p += base64EncodeTo(data, n, p);
+			r->offset += n;
+		}
+		else{
+			size_t n = remaining < 3 ? remaining : 3;
+			r->quadLen = base64EncodeTo(data, n, r->quad);
+			r->quadPos = 0;
+			r->offset += n;
+			if(r->offset == (size_t)r->lenArray[r->record])
+				nextReaderPart(r);
+		}
+	}
+
+	return p - buffer;
+}
+
+/*******************************************************************************************************************/
+/* Hash a payload by reading it through once in PAYLOAD_HASH_CHUNK pieces, then rewind the reader ready to send. */
+/* This costs a second base64 pass over the data in exchange for never holding more than one piece of the payload. */
+/* Returns 0 if the digest can't be started.                                                                       */
+/*******************************************************************************************************************/
+int hashPutRecordsPayload(PutRecordsReader *r, char *payloadHash){
+
+	char piece[PAYLOAD_HASH_CHUNK];
+	EVP_MD_CTX *md = beginSHA256();
+	if(!md)
+		return 0;
+
+	size_t n;
+	while((n = readPutRecordsPayload(r, piece, sizeof(piece))) > 0)
+		updateSHA256(md, piece, n);
+
+	finishHexSHA256(md, payloadHash);
+
+	beginPutRecordsReader(r, r->streamName, r->recordCount, r->partitionKeyArray, r->explicitHashKeyArray, r->dataArray, r->lenArray);
+
+	return 1;
+}
+
+/******************************************************************************************************************************************/
+/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_DescribeStream.html . Caller frees returned buffer */
+/* The payload's hex SHA-256 is written to payloadHash, which must hold 65 chars. exclusiveStartShardId, for paging through shards, may be NULL */
+/******************************************************************************************************************************************/
+char* makeDescribeStreamPayload(const char *streamName, const char *exclusiveStartShardId, char *payloadHash){
+
+	static const char *template =
+		"{"	
+		"\"StreamName\":\"%s\""
+		"}";
+
+	static const char *pageTemplate =
+		"{"
+		"\"StreamName\":\"%s\","
+		"\"ExclusiveStartShardId\":\"%s\""
+		"}";
+
+	char *payload;
+
+	if(exclusiveStartShardId){
+		payload=(char*)malloct(strlen(pageTemplate)+strlen(streamName)+strlen(exclusiveStartShardId) + 1);
+		sprintf(
+			payload,
+			pageTemplate,
+			streamName,
+			exclusiveStartShardId
+			);
+	}
+	else{
+		payload=(char*)malloct(strlen(template)+strlen(streamName) + 1);
+		sprintf(
+			payload,
+			template,
+			streamName
+			);
+	}
+
+	data2HexSHA256(payload, strlen(payload), payloadHash);
+
+	return payload;
+}
+
+/***************************************************************************************************************************************/
+/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_ListStreams.html . Caller frees returned buffer */
+/* The payload's hex SHA-256 is written to payloadHash, which must hold 65 chars.                                                      */
+/***************************************************************************************************************************************/
+char* makeListStreamsPayload(char *payloadHash){
+
+	static const char *template = "{}";
+
+	char *payload=(char*)malloct(strlen(template) + 1);
+
+	sprintf(
+		payload,
+		template,
+		""
+		);
+
+	data2HexSHA256(payload, strlen(payload), payloadHash);
+
+	return payload;
+}
+
+/********************************************************************************************************************************************/
+/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_GetShardIterator.html . Caller frees returned buffer */
+/* The payload's hex SHA-256 is written to payloadHash, which must hold 65 chars. startingSequenceNumber may be NULL                        */
+/********************************************************************************************************************************************/
+char* makeGetShardIteratorPayload(const char *streamName, const char *shardId, const char *iteratorType, const char *startingSequenceNumber, char *payloadHash){
+
+	static const char *template =
+		"{"
+		"\"StreamName\":\"%s\","
+		"\"ShardId\":\"%s\","
+		"\"ShardIteratorType\":\"%s\""
+		"%s%s%s"
+		"}";
+
+	static const char *sequenceOpen = ",\"StartingSequenceNumber\":\"";
+	static const char *sequenceClose = "\"";
+
+	if(!startingSequenceNumber)
+		startingSequenceNumber = "";
+
+	char *payload=(char*)malloct(strlen(template)+strlen(streamName)+strlen(shardId)+strlen(iteratorType)+strlen(sequenceOpen)+strlen(startingSequenceNumber)+strlen(sequenceClose) + 1);
+
+	sprintf(
+		payload,
+		template,
+		streamName,
+		shardId,
+		iteratorType,
+		*startingSequenceNumber ? sequenceOpen : "",
+		startingSequenceNumber,
+		*startingSequenceNumber ? sequenceClose : ""
+		);
+
+	data2HexSHA256(payload, strlen(payload), payloadHash);
+
+	return payload;
+}
+
+/***************************************************************************************************************************************/
+/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_GetRecords.html . Caller frees returned buffer  */
+/* The payload's hex SHA-256 is written to payloadHash, which must hold 65 chars. limit is left out if not positive.                   */
+/***************************************************************************************************************************************/
+char* makeGetRecordsPayload(const char *shardIterator, int limit, char *payloadHash){
+
+	static const char *template =
+		"{"
+		"\"ShardIterator\":\"%s\""
+		"}";
+
+	static const char *limitTemplate =
+		"{"
+		"\"ShardIterator\":\"%s\","
+		"\"Limit\":%d"
+		"}";
+
+	char *payload;
+
+	if(limit > 0){
+		payload=(char*)malloct(strlen(limitTemplate)+strlen(shardIterator) + 12);
+		sprintf(
+			payload,
+			limitTemplate,
+			shardIterator,
+			limit
+			);
+	}
+	else{
+		payload=(char*)malloct(strlen(template)+strlen(shardIterator) + 1);
+		sprintf(
+			payload,
+			template,
+			shardIterator
+			);
+	}
+
+	data2HexSHA256(payload, strlen(payload), payloadHash);
+
+	return payload;
+}
+
+/**********************************************************************************************************************************************/
+/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_SubscribeToShard.html . Caller frees returned buffer   */
+/* The payload's hex SHA-256 is written to payloadHash, which must hold 65 chars. startingSequenceNumber is NULL for the types without one.   */
+/**********************************************************************************************************************************************/
+char* makeSubscribeToShardPayload(const char *consumerARN, const char *shardId, const char *startingPositionType, const char *startingSequenceNumber, char *payloadHash){
+
+	static const char *template =
+		"{"
+		"\"ConsumerARN\":\"%s\","
+		"\"ShardId\":\"%s\","
+		"\"StartingPosition\":{\"Type\":\"%s\"%s%s%s}"
+		"}";
+
+	static const char *sequenceOpen = ",\"SequenceNumber\":\"";
+	static const char *sequenceClose = "\"";
+
+	if(!startingSequenceNumber)
+		startingSequenceNumber = "";
+
+	char *payload=(char*)malloct(strlen(template)+strlen(consumerARN)+strlen(shardId)+strlen(startingPositionType)+strlen(sequenceOpen)+strlen(startingSequenceNumber)+strlen(sequenceClose) + 1);
+
+	sprintf(
+		payload,
+		template,
+		consumerARN,
+		shardId,
+		startingPositionType,
+		*startingSequenceNumber ? sequenceOpen : "",
+		startingSequenceNumber,
+		*startingSequenceNumber ? sequenceClose : ""
+		);
+
+	data2HexSHA256(payload, strlen(payload), payloadHash);
+
+	return payload;
+}
+
+/***************************************************************************************************************************************************/
+/* Creates JSON payload per http://docs.aws.amazon.com/kinesis/latest/APIReference/API_RegisterStreamConsumer.html . Caller frees returned buffer  */
+/* The payload's hex SHA-256 is written to payloadHash, which must hold 65 chars.                                                                  */
+/***************************************************************************************************************************************************/
+char* makeRegisterStreamConsumerPayload(const char *streamARN, const char *consumerName, char *payloadHash){
+
+	static const char *template =
+		"{"
+		"\"StreamARN\":\"%s\","
+		"\"ConsumerName\":\"%s\""
+		"}";
+
+	char *payload=(char*)malloct(strlen(template)+strlen(streamARN)+strlen(consumerName) + 1);
+
+	sprintf(
+		payload,
+		template,
+		streamARN,
+		consumerName
+		);
+
+	data2HexSHA256(payload, strlen(payload), payloadHash);
+
+	return payload;
+}
+
+/*************************************************************************************************************************************************/
+/* Creates Canonical Request per http://docs.aws.amazon.com/general/latest/gr/sigv4-create-canonical-request.html . Caller frees returned buffer */
+/* payloadHash is the hex SHA-256 of the payload, as produced by the payload builders, so the payload is not read again here.                   */
+/* contentType is the request encoding, jsonContentType or cborContentType, which is a signed header.                                          */
+/* Allocated with scratchAlloc, so may return NULL if arena is full.                                                                            */
+/*************************************************************************************************************************************************/
+char* makeCanonicalRequest(const char *host, const char *longDate, const char *payloadHash, const char *contentType, ScratchArena *arena){
+
+	static const char *template =
+		"POST\n"
+		"/\n"
+		"\n"
+		"content-type:%s\n"
+		"host:%s\n"
+		"x-amz-date:%s\n"
+		"\n"
+		"content-type;host;x-amz-date\n"
+		"%s";
+
+	char *creq=(char*)scratchAlloc(arena, strlen(template)+strlen(contentType)+strlen(host)+strlen(longDate)+strlen(payloadHash) + 1);
+	if(!creq)
+		return NULL;
+
+	sprintf(
+		creq,
+		template,
+		contentType,
+		host,
+		longDate,
+		payloadHash
+		);
+
+	return creq;
+}
+
+/*******************************************************************************************************************************************/
+/* Creates String to Sign per http://docs.aws.amazon.com/general/latest/gr/sigv4-create-string-to-sign.html . Caller frees returned buffer */
+/* Allocated with scratchAlloc, so may return NULL if arena is full.                                                                      */
+/*******************************************************************************************************************************************/
+char* makeStringToSign(const char *longDate, const char *shortDate, const char *region, const char *service, const char *canonicalRequest, ScratchArena *arena){
+
+	static const char *template =
+		"AWS4-HMAC-SHA256\n"
+		"%s\n"
+		"%s/%s/%s/aws4_request\n"
+		"%s";
+
+	char hash[65];
+	data2HexSHA256(canonicalRequest, strlen(canonicalRequest), hash);
+
+	char *str=(char*)scratchAlloc(arena, strlen(template)+strlen(longDate)+strlen(shortDate)+strlen(service)+strlen(region)+strlen(hash) + 1);
+	if(!str)
+		return NULL;
+
+	sprintf(
+		str,
+		template,
+		longDate,
+		shortDate,
+		region,
+		service,
+		hash	
+		);
+
+	return str;
+}
+
+/*************************************************************************************************************************/
+/* Derive signing key per http://docs.aws.amazon.com/general/latest/gr/sigv4-calculate-signature.html into kSigning[32]. */
+/*************************************************************************************************************************/
+void makeSigningKey(const char *key, const char *shortDate, const char *region, const char *service, unsigned char *kSigning){
+
+	unsigned char kDate[32], kRegion[32], kService[32];
+
+	/* secret keys are 40 chars, only an unusually long one needs the heap */
+	char secret[128];
+	char *kSecret = strlen(key) + 5 <= sizeof(secret) ? secret : malloct(strlen(key) + 5);
+	sprintf(kSecret, "AWS4%s", key);
+
+	string2HMACSHA256To(shortDate, (unsigned char*)kSecret, strlen(kSecret), kDate);
+	string2HMACSHA256To(region, kDate, 32, kRegion);
+	string2HMACSHA256To(service, kRegion, 32, kService);
+	string2HMACSHA256To("aws4_request", kService, 32, kSigning);
+
+	if(kSecret != secret)
+		free(kSecret);
+}
+
+/**************************************************************************************************************************************/
+/* Calculate signature per http://docs.aws.amazon.com/general/latest/gr/sigv4-calculate-signature.html into hex, 65 chars.            */
+/* kSigning is the 32 byte key from makeSigningKey, normally fetched from the context cache with getSigningKey.                        */
+/**************************************************************************************************************************************/
+void makeSignature(const unsigned char *kSigning, const char *stringToSign, char *hex){
+
+	unsigned char sig[32];
+	string2HMACSHA256To(stringToSign, kSigning, 32, sig);
+
+	digest2Hex(sig, 32, hex);
+}
+
+/*********************************************************************************************************************/
+/* Credentials are immutable once published. A CredentialsCache holds a context's current set behind an atomic       */
+/* pointer: requests load it without locking and sign with it, and a refresh publishes a new set with an atomic      */
+/* swap. Each set has a generation so cached signing keys can tell which one they were derived from. Replaced sets   */
+/* wait on the retired list for CREDENTIALS_GRACE_SECONDS, far longer than a request takes to sign, before they are  */
+/* freed by a later refresh. The grace period is timed on the monotonic clock, as a wall clock step must not free    */
+/* sets still in use. With a provider, a refresh thread fetches ahead of expiry; static credentials have no          */
+/* provider, thread or refreshes.                                                                                    */
+/*********************************************************************************************************************/
+#define CREDENTIALS_GRACE_SECONDS 300
+
+static void monotonicNow(struct timespec *ts);
+
+typedef struct Credentials{
+	char *key;
+	char *keyId;
+	char *sessionToken;
+	time_t expiration;
+	time_t fetched;
+	unsigned long long generation;
+	time_t retiredAt;	/* monotonic seconds */
+	struct Credentials *next;
+}Credentials;
+
+struct CredentialsCache{
+	_Atomic(Credentials*) current;
+	int refreshes;
+	CredentialsOptions opts;
+	pthread_mutex_t refreshLock;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t thread;
+	int stopping;
+	time_t failedAt;
+	unsigned long long generation;
+	Credentials *retired;
+};
+
+/* copy of a string, or NULL */
+static char* copyString(const char *text){
+
+	return text ? strcpy(malloct(strlen(text) + 1), text) : NULL;
+}
+
+/*****************************************************************************/
+/* Credentials constructor. An empty or NULL sessionToken means there is none*/
+/*****************************************************************************/
+Credentials* makeCredentials(const char *key, const char *keyId, const char *sessionToken, time_t expiration){
+
+	Credentials *credentials = malloct(sizeof(Credentials));
+
+	credentials->key = copyString(key);
+	credentials->keyId = copyString(keyId);
+	credentials->sessionToken = sessionToken && *sessionToken ? copyString(sessionToken) : NULL;
+	credentials->expiration = expiration;
+	credentials->fetched = time(NULL);
+	credentials->generation = 0;
+	credentials->retiredAt = 0;
+	credentials->next = NULL;
+
+	return credentials;
+}
+
+/**************************/
+/* Credentials destructor */
+/**************************/
+void freeCredentials(Credentials *credentials){
+
+	free(credentials->key);
+	free(credentials->keyId);
+	free(credentials->sessionToken);
+	free(credentials);
+}
+
+/*****************************************************************************************************************/
+/* Make fresh the current credentials, retiring the old and freeing any retired over CREDENTIALS_GRACE_SECONDS   */
+/* ago, then wake the refresh thread to schedule the next refresh from the new expiry.                           */
+/*****************************************************************************************************************/
+void publishCredentials(CredentialsCache *cache, Credentials *fresh){
+
+	pthread_mutex_lock(&cache->lock);
+
+	struct timespec clock;
+	monotonicNow(&clock);
+	time_t now = clock.tv_sec;
+	fresh->generation = ++cache->generation;
+	Credentials *old = atomic_exchange_explicit(&cache->current, fresh, memory_order_acq_rel);
+	if(old){
+		old->retiredAt = now;
+		old->next = cache->retired;
+		cache->retired = old;
+	}
+
+	Credentials **link = &cache->retired;
+	while(*link){
+		if(now - (*link)->retiredAt > CREDENTIALS_GRACE_SECONDS){
+			Credentials *expired = *link;
+			*link = expired->next;
+			freeCredentials(expired);
+		}
+		else
+			link = &(*link)->next;
+	}
+
+	cache->failedAt = 0;
+	pthread_cond_signal(&cache->wake);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*****************************************************************************************************************/
+/* Fetch credentials from the cache's provider and publish them. Fetches are serialised by refreshLock so a      */
+/* manual refresh and the refresh thread never run the provider at once. Returns 1, or 0 with errorMsg set.      */
+/*****************************************************************************************************************/
+int refreshCredentials(CredentialsCache *cache, char *errorMsg){
+
+	AWSCredentials *fetched = malloct(sizeof(AWSCredentials));
+
+	pthread_mutex_lock(&cache->refreshLock);
+	int ok = ktFetchCredentials(&cache->opts, fetched, errorMsg);
+	if(ok)
+		publishCredentials(cache, makeCredentials(fetched->key, fetched->keyId, fetched->sessionToken, (time_t)fetched->expiration));
+	else{
+		pthread_mutex_lock(&cache->lock);
+		cache->failedAt = time(NULL);
+		pthread_mutex_unlock(&cache->lock);
+	}
+	pthread_mutex_unlock(&cache->refreshLock);
+
+	free(fetched);
+
+	return ok;
+}
+
+/* when the credentials should next be refreshed, or 0 for never. Called with the cache lock held */
+static time_t nextRefresh(const CredentialsCache *cache){
+
+	if(cache->failedAt)
+		return cache->failedAt + cache->opts.retrySeconds;
+
+	const Credentials *current = atomic_load_explicit(&cache->current, memory_order_acquire);
+	if(!current->expiration)
+		return 0;
+
+	time_t lead = (current->expiration - current->fetched) / 2;
+	if(lead > cache->opts.refreshSeconds)
+		lead = cache->opts.refreshSeconds;
+
+	return current->expiration - lead;
+}
+
+/* Refresh thread. Sleeps until the credentials are due a refresh, as wall clock time since that is what expiry is in */
+static void* credentialsRefreshWorker(void *arg){
+
+	CredentialsCache *cache = (CredentialsCache*)arg;
+
+	pthread_mutex_lock(&cache->lock);
+	while(!cache->stopping){
+		time_t refreshAt = nextRefresh(cache);
+		if(!refreshAt){
+			pthread_cond_wait(&cache->wake, &cache->lock);
+			continue;
+		}
+		if(time(NULL) < refreshAt){
+			struct timespec deadline = {refreshAt, 0};
+			pthread_cond_timedwait(&cache->wake, &cache->lock, &deadline);
+			continue;
+		}
+		pthread_mutex_unlock(&cache->lock);
+		char errorMsg[CURL_ERROR_SIZE];
+		refreshCredentials(cache, errorMsg);
+		pthread_mutex_lock(&cache->lock);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return NULL;
+}
+
+/*****************************************************************************************************************/
+/* CredentialsCache constructor, publishing initial. With opts the cache refreshes from that provider, starting  */
+/* its refresh thread; without, initial is static.                                                               */
+/*****************************************************************************************************************/
+CredentialsCache* makeCredentialsCache(Credentials *initial, const CredentialsOptions *opts){
+
+	CredentialsCache *cache = malloct(sizeof(CredentialsCache));
+
+	atomic_init(&cache->current, NULL);
+	cache->refreshes = opts != NULL;
+	pthread_mutex_init(&cache->refreshLock, NULL);
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->wake, NULL);
+	cache->stopping = 0;
+	cache->failedAt = 0;
+	cache->generation = 0;
+	cache->retired = NULL;
+
+	publishCredentials(cache, initial);
+
+	if(opts){
+		cache->opts = *opts;
+		cache->opts.file = copyString(opts->file);
+		cache->opts.profile = copyString(opts->profile);
+		cache->opts.url = copyString(opts->url);
+		cache->opts.authorization = copyString(opts->authorization);
+		if(cache->opts.refreshSeconds < 0)
+			cache->opts.refreshSeconds = 0;
+		if(cache->opts.retrySeconds < 1)
+			cache->opts.retrySeconds = 1;
+		if(pthread_create(&cache->thread, NULL, credentialsRefreshWorker, cache) != 0)
+			errorExit("Fatal error", "Cannot start credentials refresh thread");
+	}
+
+	return cache;
+}
+
+/***************************************************************/
+/* CredentialsCache destructor. Stops any refresh thread first */
+/***************************************************************/
+void freeCredentialsCache(CredentialsCache *cache){
+
+	if(cache->refreshes){
+		pthread_mutex_lock(&cache->lock);
+		cache->stopping = 1;
+		pthread_cond_signal(&cache->wake);
+		pthread_mutex_unlock(&cache->lock);
+		pthread_join(cache->thread, NULL);
+		free((char*)cache->opts.file);
+		free((char*)cache->opts.profile);
+		free((char*)cache->opts.url);
+		free((char*)cache->opts.authorization);
+	}
+
+	freeCredentials(atomic_load(&cache->current));
+	while(cache->retired){
+		Credentials *next = cache->retired->next;
+		freeCredentials(cache->retired);
+		cache->retired = next;
+	}
+
+	pthread_cond_destroy(&cache->wake);
+	pthread_mutex_destroy(&cache->lock);
+	pthread_mutex_destroy(&cache->refreshLock);
+	free(cache);
+}
+
+/**************************************************************************************************************/
+/* The context's current credentials, valid for at least CREDENTIALS_GRACE_SECONDS. One atomic load, no lock  */
+/**************************************************************************************************************/
+const Credentials* currentCredentials(const AWSContext *ctx){
+
+	return atomic_load_explicit(&ctx->credentials->current, memory_order_acquire);
+}
+
+/*****************************************************************************************************************/
+/* Scratch room for the key id and session token in a request's signing strings and headers. Credentials that    */
+/* refresh may come back longer, so those are sized for the longest a provider can return.                       */
+/*****************************************************************************************************************/
+size_t credentialsScratchSize(const AWSContext *ctx){
+
+	if(ctx->credentials->refreshes)
+		return 2 * (sizeof(((AWSCredentials*)0)->keyId) + KT_MAX_SESSION_TOKEN);
+
+	const Credentials *credentials = currentCredentials(ctx);
+
+	return 2 * (strlen(credentials->keyId) + (credentials->sessionToken ? strlen(credentials->sessionToken) : 0));
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktRefreshCredentials(const AWSContext *ctx, char *errorMsg){
+
+	if(!ctx->credentials->refreshes){
+		if(errorMsg)
+			strcpy(errorMsg, "Context has static credentials");
+		return 0;
+	}
+
+	return refreshCredentials(ctx->credentials, errorMsg);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktGetCredentials(const AWSContext *ctx, AWSCredentials *credentials){
+
+	const Credentials *current = currentCredentials(ctx);
+	const char *sessionToken = current->sessionToken ? current->sessionToken : "";
+
+	memset(credentials, 0, sizeof(AWSCredentials));
+
+	if(strlen(current->key) >= sizeof(credentials->key) || strlen(current->keyId) >= sizeof(credentials->keyId) || strlen(sessionToken) >= sizeof(credentials->sessionToken))
+		return 0;
+
+	strcpy(credentials->key, current->key);
+	strcpy(credentials->keyId, current->keyId);
+	strcpy(credentials->sessionToken, sessionToken);
+	credentials->expiration = current->expiration;
+
+	return 1;
+}
+
+/********************************************************************************************************************/
+/* SigningKeyCache holds the signing key for the current UTC day and credentials. current points to an immutable    */
+/* SigningKey and is swapped atomically when the day rolls over or the credentials are refreshed, so readers never  */
+/* lock. Replaced keys are kept on the retired list for CREDENTIALS_GRACE_SECONDS of monotonic time, so a reader    */
+/* still holding an old pointer is never left dangling, then freed by a later swap.                                 */
+/********************************************************************************************************************/
+typedef struct SigningKey{
+	char shortDate[9];
+	unsigned long long generation;
+	unsigned char key[32];
+	time_t retiredAt;	/* monotonic seconds */
+	struct SigningKey *next;
+}SigningKey;
+
+struct SigningKeyCache{
+	_Atomic(SigningKey*) current;
+	pthread_mutex_t lock;
+	SigningKey *retired;
+};
+
+/*******************************/
+/* SigningKeyCache constructor */
+/*******************************/
+SigningKeyCache* makeSigningKeyCache(){
+
+	SigningKeyCache *cache = malloct(sizeof(SigningKeyCache));
+
+	atomic_init(&cache->current, NULL);
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->retired = NULL;
+
+	return cache;
+}
+
+/******************************/
+/* SigningKeyCache destructor */
+/******************************/
+void freeSigningKeyCache(SigningKeyCache *cache){
+
+	free(atomic_load(&cache->current));
+
+	while(cache->retired){
+		SigningKey *next = cache->retired->next;
+		free(cache->retired);
+		cache->retired = next;
+	}
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+/*****************************************************************************************************************/
+/* Copy the signing key for shortDate and credentials into kSigning[32]. Only the first caller after the UTC day */
+/* rolls over or the credentials are refreshed runs the HMAC chain, under the cache lock; everyone else just     */
+/* copies the current key. A caller with an older date (a request straddling midnight) or older credentials      */
+/* than the cached key derives its key without touching the cache.                                               */
+/*****************************************************************************************************************/
+void getSigningKey(const AWSContext *ctx, const Credentials *credentials, const char *shortDate, unsigned char *kSigning){
+
+	SigningKeyCache *cache = ctx->keyCache;
+
+	SigningKey *current = atomic_load_explicit(&cache->current, memory_order_acquire);
+	if(current && current->generation == credentials->generation && strcmp(current->shortDate, shortDate) == 0){
+		memcpy(kSigning, current->key, 32);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	current = atomic_load_explicit(&cache->current, memory_order_acquire);
+	if(current && current->generation == credentials->generation && strcmp(current->shortDate, shortDate) == 0){
+		memcpy(kSigning, current->key, 32);
+	}
+	else if(current && (current->generation > credentials->generation || strcmp(current->shortDate, shortDate) > 0)){
+		makeSigningKey(credentials->key, shortDate, ctx->region, service, kSigning);
+	}
+	else{
+		/* the one allocation of the day or refresh. If it fails, sign with an uncached key rather than exit */
+		SigningKey *fresh = malloc(sizeof(SigningKey));
+		if(!fresh){
+			makeSigningKey(credentials->key, shortDate, ctx->region, service, kSigning);
+			pthread_mutex_unlock(&cache->lock);
+			return;
+		}
+		strcpy(fresh->shortDate, shortDate);
+		fresh->generation = credentials->generation;
+		makeSigningKey(credentials->key, shortDate, ctx->region, service, fresh->key);
+		fresh->next = NULL;
+
+		atomic_store_explicit(&cache->current, fresh, memory_order_release);
+
+		struct timespec clock;
+		monotonicNow(&clock);
+		time_t now = clock.tv_sec;
+		if(current){
+			current->retiredAt = now;
+			current->next = cache->retired;
+			cache->retired = current;
+		}
+
+		SigningKey **link = &cache->retired;
+		while(*link){
+			if(now - (*link)->retiredAt > CREDENTIALS_GRACE_SECONDS){
+				SigningKey *expired = *link;
+				*link = expired->next;
+				free(expired);
+			}
+			else
+				link = &(*link)->next;
+		}
+
+		memcpy(kSigning, fresh->key, 32);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*****************************************************************************************************************************************************/
+/* Create Authentication Header per http://docs.aws.amazon.com/general/latest/gr/sigv4-add-signature-to-request.html . Caller frees returned buffer  */
+/* Allocated with scratchAlloc, so may return NULL if arena is full.                                                                                */
+/*****************************************************************************************************************************************************/
+char* makeAuthHeader(const unsigned char *signingKey, const char *keyId, const char *longDate, const char *shortDate, const char *region,  const char *endpoint, const char *payloadHash, const char *contentType, ScratchArena *arena){
+
+	static const char *template =
+		"Authorization: AWS4-HMAC-SHA256 "
+		"Credential=%s/%s/%s/%s/aws4_request, "
+		"SignedHeaders=content-type;host;x-amz-date, "
+		"Signature=%s";
+
+	/* canonical request */
+	char *creq = makeCanonicalRequest(endpoint, longDate, payloadHash, contentType, arena);
+	if(!creq)
+		return NULL;
+	
+	/* string to sign */
+	char *stringTosign = makeStringToSign(longDate, shortDate, region, service, creq, arena);
+	scratchFree(arena, creq);
+	if(!stringTosign)
+		return NULL;
+	
+	/* signature */
+	char sig[65];
+	makeSignature(signingKey, stringTosign, sig);
+	scratchFree(arena, stringTosign);
+
+	char* header=(char*)scratchAlloc(arena, strlen(template)+strlen(keyId)+strlen(shortDate)+strlen(region)+strlen(service)+strlen(sig) + 1);
+	if(!header)
+		return NULL;
+
+	sprintf(
+		header,
+		template,
+		keyId,
+		shortDate,
+		region,
+		service,
+		sig	
+		);
+	
+	return header;
+}
+
+/*********************************************************************************/
+/* Prints null terminated short and long form UTC dates in user supplied buffer. */
+/* longDate and shortDate buffers should be 17 and 9 chars respectively.         */
+/*********************************************************************************/
+void makeDateStrings(char *longDate, char *shortDate){
+
+	time_t time_;
+	struct tm tm_;
+
+	time(&time_);
+	gmtime_r(&time_, &tm_);
+	strftime(longDate, 17, "%Y%m%dT%H%M%SZ", &tm_);
+	strftime(shortDate, 9, "%Y%m%d", &tm_);
+}
+
+/*********************************************************************/
+/* Monotonic time helpers, used for linger deadlines and wait timers */
+/*********************************************************************/
+static void monotonicNow(struct timespec *ts){
+
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static void addMilliseconds(struct timespec *ts, long ms){
+
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if(ts->tv_nsec >= 1000000000L){
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static int timespecBefore(const struct timespec *a, const struct timespec *b){
+
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*****************************************************************************************************************/
+/* Shard maps. A ShardMap is an immutable, sorted list of a stream's open shards and their hash key ranges,    */
+/* fetched with paged DescribeStream calls. The context keeps the current map per stream in a ShardMapCache.   */
+/* A map is looked up under a mutex but used without one; replaced maps are retired, not freed, until the      */
+/* context is freed, so a batch being formed against an old map is never left dangling. Reshards are rare.    */
+/* DescribeStream is limited to 10 calls a second per account, so one caller fetches while others wait for it, */
+/* and a failed fetch, or a map dropped again soon after it was fetched, is not retried for a backoff doubling */
+/* from SHARD_MAP_MIN_BACKOFF to SHARD_MAP_MAX_BACKOFF seconds; until then callers get the failure's message.  */
+/*****************************************************************************************************************/
+#define SHARD_MAP_MIN_BACKOFF 1
+#define SHARD_MAP_MAX_BACKOFF 60
+
+typedef struct ShardMap{
+	int count;
+	char (*shardIds)[64];
+	unsigned char (*startingHashKeys)[16];
+	unsigned char (*endingHashKeys)[16];
+	struct ShardMap *next;
+}ShardMap;
+
+typedef struct StreamShards{
+	char *streamName;
+	ShardMap *map;
+	int fetching;
+	int shardCount;
+	time_t fetchedAt;
+	int failures;
+	time_t retryAt;
+	char error[CURL_ERROR_SIZE];
+	struct StreamShards *next;
+}StreamShards;
+
+struct ShardMapCache{
+	pthread_mutex_t lock;
+	pthread_cond_t fetched;
+	StreamShards *streams;
+	ShardMap *retired;
+};
+
+static void freeShardMap(ShardMap *map){
+
+	free(map->shardIds);
+	free(map->startingHashKeys);
+	free(map->endingHashKeys);
+	free(map);
+}
+
+/*****************************/
+/* ShardMapCache constructor */
+/*****************************/
+ShardMapCache* makeShardMapCache(){
+
+	ShardMapCache *cache = malloct(sizeof(ShardMapCache));
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->fetched, NULL);
+	cache->streams = NULL;
+	cache->retired = NULL;
+
+	return cache;
+}
+
+/****************************/
+/* ShardMapCache destructor */
+/****************************/
+void freeShardMapCache(ShardMapCache *cache){
+
+	while(cache->streams){
+		StreamShards *next = cache->streams->next;
+		if(cache->streams->map)
+			freeShardMap(cache->streams->map);
+		free(cache->streams->streamName);
+		free(cache->streams);
+		cache->streams = next;
+	}
+
+	while(cache->retired){
+		ShardMap *next = cache->retired->next;
+		freeShardMap(cache->retired);
+		cache->retired = next;
+	}
+
+	pthread_cond_destroy(&cache->fetched);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+/******************************************************************************************************************/
+/* Rate limiting. Each shard takes 1 MiB/s and 1000 records/s; going over costs a throttled round trip and a     */
+/* retry. A RateLimiter keeps a token bucket per stream and shard for each of bytes and records. Buckets hold    */
+/* RATE_LIMIT_BURST_MS worth of tokens, so sends are smoothed rather than let through in one second's burst.    */
+/* A send takes its tokens up front, running the buckets into debt if need be, then sleeps until the deepest    */
+/* debt it caused is repaid. Concurrent senders queue behind one another's debt in the order they arrive.       */
+/* Buckets live as long as the context; a reshard simply leaves the old shards' buckets unused.                 */
+/******************************************************************************************************************/
+#define RATE_LIMIT_BURST_MS 100
+#define RATE_LIMIT_TABLE_SIZE 256
+
+typedef struct TokenBucket{
+	char *streamName;
+	char shardId[64];
+	double bytes;
+	double records;
+	struct timespec updated;
+	struct TokenBucket *next;
+}TokenBucket;
+
+struct RateLimiter{
+	pthread_mutex_t lock;
+	double bytesPerSecond;
+	double recordsPerSecond;
+	TokenBucket *table[RATE_LIMIT_TABLE_SIZE];
+	atomic_llong sends;
+	atomic_llong delayedSends;
+	atomic_llong delayMs;
+	atomic_llong unmappedSends;
+};
+
+/**********************************************************************************************/
+/* RateLimiter constructor. Returns NULL, no limiting, unless opts->rateLimit is set.        */
+/**********************************************************************************************/
+RateLimiter* makeRateLimiter(const AWSContextOptions *opts){
+
+	if(!opts->rateLimit)
+		return NULL;
+
+	RateLimiter *limiter = malloct(sizeof(RateLimiter));
+
+	pthread_mutex_init(&limiter->lock, NULL);
+	limiter->bytesPerSecond = opts->shardBytesPerSecond;
+	limiter->recordsPerSecond = opts->shardRecordsPerSecond;
+	memset(limiter->table, 0, sizeof(limiter->table));
+	atomic_init(&limiter->sends, 0);
+	atomic_init(&limiter->delayedSends, 0);
+	atomic_init(&limiter->delayMs, 0);
+	atomic_init(&limiter->unmappedSends, 0);
+
+	return limiter;
+}
+
+/**************************/
+/* RateLimiter destructor */
+/**************************/
+void freeRateLimiter(RateLimiter *limiter){
+
+	if(!limiter)
+		return;
+
+	int i;
+	for(i=0; i<RATE_LIMIT_TABLE_SIZE; i++){
+		while(limiter->table[i]){
+			TokenBucket *next = limiter->table[i]->next;
+			free(limiter->table[i]->streamName);
+			free(limiter->table[i]);
+			limiter->table[i] = next;
+		}
+	}
+
+	pthread_mutex_destroy(&limiter->lock);
+	free(limiter);
+}
+
+/*****************************************************************************************************************/
+/* Metrics internals. Each thread recording into a context gets its own MetricsSlot, found through a thread     */
+/* local cache or else on the context's slot list, which new slots are pushed onto with a compare and swap.     */
+/* Only the owning thread writes a slot, using relaxed loads and stores rather than locked adds, so recording  */
+/* never contends; snapshots sum every slot. Slots live as long as the context. The thread local cache is      */
+/* keyed by the Metrics id, not its address, so a freed and reallocated Metrics never matches a stale entry.    */
+/*****************************************************************************************************************/
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+typedef struct{
+	atomic_ullong count;
+	atomic_ullong sumNs;
+	atomic_ullong maxNs;
+	atomic_ullong buckets[KT_HISTOGRAM_BUCKETS];
+}SlotHistogram;
+
+typedef struct MetricsSlot{
+	pthread_t owner;
+	atomic_ullong counters[KT_COUNTER_COUNT];
+	SlotHistogram stages[KT_STAGE_COUNT];
+	struct MetricsSlot *next;
+}MetricsSlot;
+
+struct Metrics{
+	unsigned long long id;
+	_Atomic(MetricsSlot*) slots;
+	MetricsExporter exporter;
+	void *userData;
+	int intervalMs;
+	pthread_t exportThread;
+	pthread_mutex_t lock;
+	pthread_cond_t stop;
+	int stopping;
+};
+
+static atomic_ullong nextMetricsId = 1;
+static __thread unsigned long long cachedMetricsId;
+static __thread MetricsSlot *cachedMetricsSlot;
+
+static const char *stageNames[KT_STAGE_COUNT] = {"call", "compress", "payload", "sign", "dns", "connect", "tls", "server", "rate_limit"};
+static const char *counterNames[KT_COUNTER_COUNT] = {"requests", "records", "payload_bytes", "connections", "transport_errors", "http_errors", "failed_records", "retries"};
+
+/* Histogram bucket for ns: exact below HISTOGRAM_SUB_BUCKETS, then HISTOGRAM_SUB_BUCKETS per power of two */
+static int histogramBucket(unsigned long long ns){
+
+	if(ns < HISTOGRAM_SUB_BUCKETS)
+		return (int)ns;
+
+	int exponent = 63 - __builtin_clzll(ns);
+	int bucket = HISTOGRAM_SUB_BUCKETS * (exponent - HISTOGRAM_SUB_BITS + 1) + (int)((ns >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+
+	return bucket < KT_HISTOGRAM_BUCKETS ? bucket : KT_HISTOGRAM_BUCKETS - 1;
+}
+
+/* Largest value histogramBucket puts in bucket */
+static unsigned long long histogramBucketLimit(int bucket){
+
+	if(bucket < HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+
+	int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	unsigned long long mantissa = HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS;
+
+	return ((mantissa + 1) << shift) - 1;
+}
+
+/* Add to a value only this thread writes. Readers may see it a moment late but never torn */
+static inline void addRelaxed(atomic_ullong *value, unsigned long long n){
+
+	atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/* This thread's slot in metrics, made on first use */
+static MetricsSlot* metricsSlot(Metrics *metrics){
+
+	if(cachedMetricsId == metrics->id)
+		return cachedMetricsSlot;
+
+	pthread_t self = pthread_self();
+	MetricsSlot *slot;
+	for(slot = atomic_load_explicit(&metrics->slots, memory_order_acquire); slot; slot = slot->next)
+		if(pthread_equal(slot->owner, self))
+			break;
+
+	if(!slot){
+		slot = malloct(sizeof(MetricsSlot));
+		memset(slot, 0, sizeof(MetricsSlot));
+		slot->owner = self;
+		slot->next = atomic_load_explicit(&metrics->slots, memory_order_relaxed);
+		while(!atomic_compare_exchange_weak_explicit(&metrics->slots, &slot->next, slot, memory_order_release, memory_order_relaxed))
+			;
+	}
+
+	cachedMetricsId = metrics->id;
+	cachedMetricsSlot = slot;
+
+	return slot;
+}
+
+/* Record ns against stage. No-op without metrics */
+void metricsRecord(Metrics *metrics, int stage, unsigned long long ns){
+
+	if(!metrics)
+		return;
+
+	SlotHistogram *histogram = &metricsSlot(metrics)->stages[stage];
+	addRelaxed(&histogram->count, 1);
+	addRelaxed(&histogram->sumNs, ns);
+	if(ns > atomic_load_explicit(&histogram->maxNs, memory_order_relaxed))
+		atomic_store_explicit(&histogram->maxNs, ns, memory_order_relaxed);
+	addRelaxed(&histogram->buckets[histogramBucket(ns)], 1);
+}
+
+/* Add n to counter. No-op without metrics */
+void metricsCount(Metrics *metrics, int counter, unsigned long long n){
+
+	if(metrics)
+		addRelaxed(&metricsSlot(metrics)->counters[counter], n);
+}
+
+/* Start the clock for a stage, if metrics are on */
+static void metricsStart(const Metrics *metrics, struct timespec *start){
+
+	if(metrics)
+		monotonicNow(start);
+}
+
+/* Record the time since start against stage, then restart the clock from now for the next stage */
+static void metricsLap(Metrics *metrics, int stage, struct timespec *start){
+
+	if(!metrics)
+		return;
+
+	struct timespec now;
+	monotonicNow(&now);
+	long long ns = (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+	metricsRecord(metrics, stage, ns > 0 ? (unsigned long long)ns : 0);
+	*start = now;
+}
+
+/***************************************************************************************************************/
+/* Count a finished transfer on curl and record its network stages from curl's own timings (microseconds since  */
+/* the transfer started). Lookup, connect and TLS times are only meaningful when a new connection was made.    */
+/* Everything from pretransfer to the end is one stage: for a POST curl's starttransfer time is taken as the    */
+/* upload begins, so it doesn't separate sending from waiting on the server.                                    */
+/***************************************************************************************************************/
+void metricsRecordTransfer(Metrics *metrics, CURL *curl, long retcode){
+
+	if(!metrics)
+		return;
+
+	metricsCount(metrics, KT_COUNTER_REQUESTS, 1);
+	if(retcode == 0){
+		metricsCount(metrics, KT_COUNTER_TRANSPORT_ERRORS, 1);
+		return;
+	}
+	if(retcode != 200)
+		metricsCount(metrics, KT_COUNTER_HTTP_ERRORS, 1);
+
+	curl_off_t lookup = 0, connect = 0, handshake = 0, pretransfer = 0, total = 0;
+	long connects = 0;
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &handshake);
+	curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+	if(connects > 0){
+		metricsCount(metrics, KT_COUNTER_CONNECTIONS, connects);
+		metricsRecord(metrics, KT_STAGE_DNS, lookup * 1000ULL);
+		if(connect >= lookup)
+			metricsRecord(metrics, KT_STAGE_CONNECT, (connect - lookup) * 1000ULL);
+		if(handshake >= connect && handshake > 0)
+			metricsRecord(metrics, KT_STAGE_TLS, (handshake - connect) * 1000ULL);
+	}
+
+	if(total >= pretransfer)
+		metricsRecord(metrics, KT_STAGE_SERVER, (total - pretransfer) * 1000ULL);
+}
+
+/* Sum every thread's slot into snapshot */
+static void snapshotMetrics(Metrics *metrics, MetricsSnapshot *snapshot){
+
+	memset(snapshot, 0, sizeof(MetricsSnapshot));
+
+	const MetricsSlot *slot;
+	int i, j;
+	for(slot = atomic_load_explicit(&metrics->slots, memory_order_acquire); slot; slot = slot->next){
+		for(i=0; i<KT_COUNTER_COUNT; i++)
+			snapshot->counters[i] += atomic_load_explicit(&slot->counters[i], memory_order_relaxed);
+		for(i=0; i<KT_STAGE_COUNT; i++){
+			const SlotHistogram *from = &slot->stages[i];
+			LatencyHistogram *to = &snapshot->stages[i];
+			to->count += atomic_load_explicit(&from->count, memory_order_relaxed);
+			to->sumNs += atomic_load_explicit(&from->sumNs, memory_order_relaxed);
+			unsigned long long maxNs = atomic_load_explicit(&from->maxNs, memory_order_relaxed);
+			if(maxNs > to->maxNs)
+				to->maxNs = maxNs;
+			for(j=0; j<KT_HISTOGRAM_BUCKETS; j++)
+				to->buckets[j] += atomic_load_explicit(&from->buckets[j], memory_order_relaxed);
+		}
+	}
+}
+
+/* Exporter thread. Hands a snapshot to the exporter every interval, and a last one when the context is freed */
+static void* metricsExportWorker(void *arg){
+
+	Metrics *metrics = (Metrics*)arg;
+	MetricsSnapshot *snapshot = malloct(sizeof(MetricsSnapshot));
+
+	pthread_mutex_lock(&metrics->lock);
+	while(!metrics->stopping){
+		struct timespec deadline;
+		monotonicNow(&deadline);
+		addMilliseconds(&deadline, metrics->intervalMs);
+		while(!metrics->stopping && pthread_cond_timedwait(&metrics->stop, &metrics->lock, &deadline) != ETIMEDOUT)
+			;
+		pthread_mutex_unlock(&metrics->lock);
+		snapshotMetrics(metrics, snapshot);
+		metrics->exporter(snapshot, metrics->userData);
+		pthread_mutex_lock(&metrics->lock);
+	}
+	pthread_mutex_unlock(&metrics->lock);
+
+	free(snapshot);
+
+	return NULL;
+}
+
+/***********************************************************************/
+/* Metrics constructor. Returns NULL, no metrics, unless opts->metrics */
+/***********************************************************************/
+Metrics* makeMetrics(const AWSContextOptions *opts){
+
+	if(!opts->metrics)
+		return NULL;
+
+	Metrics *metrics = malloct(sizeof(Metrics));
+
+	metrics->id = atomic_fetch_add(&nextMetricsId, 1);
+	atomic_init(&metrics->slots, NULL);
+	metrics->exporter = opts->metricsExporter;
+	metrics->userData = opts->metricsUserData;
+	metrics->intervalMs = opts->metricsIntervalMs > 0 ? opts->metricsIntervalMs : 10000;
+	metrics->stopping = 0;
+
+	if(metrics->exporter){
+		pthread_mutex_init(&metrics->lock, NULL);
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&metrics->stop, &attr);
+		pthread_condattr_destroy(&attr);
+		if(pthread_create(&metrics->exportThread, NULL, metricsExportWorker, metrics) != 0)
+			errorExit("Fatal error", "Cannot start metrics export thread");
+	}
+
+	return metrics;
+}
+
+/*******************************************************************/
+/* Metrics destructor. Stops the exporter after its final export. */
+/*******************************************************************/
+void freeMetrics(Metrics *metrics){
+
+	if(!metrics)
+		return;
+
+	if(metrics->exporter){
+		pthread_mutex_lock(&metrics->lock);
+		metrics->stopping = 1;
+		pthread_cond_signal(&metrics->stop);
+		pthread_mutex_unlock(&metrics->lock);
+		pthread_join(metrics->exportThread, NULL);
+		pthread_cond_destroy(&metrics->stop);
+		pthread_mutex_destroy(&metrics->lock);
+	}
+
+	MetricsSlot *slot = atomic_load(&metrics->slots);
+	while(slot){
+		MetricsSlot *next = slot->next;
+		free(slot);
+		slot = next;
+	}
+
+	free(metrics);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktGetMetrics(const AWSContext *ctx, MetricsSnapshot *snapshot){
+
+	if(!ctx->metrics){
+		memset(snapshot, 0, sizeof(MetricsSnapshot));
+		return 0;
+	}
+
+	snapshotMetrics(ctx->metrics, snapshot);
+
+	return 1;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+unsigned long long ktHistogramPercentile(const LatencyHistogram *histogram, double percentile){
+
+	if(histogram->count == 0)
+		return 0;
+
+	unsigned long long rank = (unsigned long long)(histogram->count * percentile / 100 + 0.999999);
+	if(rank < 1)
+		rank = 1;
+
+	unsigned long long seen = 0;
+	int i;
+	for(i=0; i<KT_HISTOGRAM_BUCKETS; i++){
+		seen += histogram->buckets[i];
+		if(seen >= rank)
+			break;
+	}
+
+	unsigned long long limit = histogramBucketLimit(i < KT_HISTOGRAM_BUCKETS ? i : KT_HISTOGRAM_BUCKETS - 1);
+
+	return limit < histogram->maxNs ? limit : histogram->maxNs;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+const char* ktMetricsStageName(int stage){
+
+	return stage >= 0 && stage < KT_STAGE_COUNT ? stageNames[stage] : NULL;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+const char* ktMetricsCounterName(int counter){
+
+	return counter >= 0 && counter < KT_COUNTER_COUNT ? counterNames[counter] : NULL;
+}
+
+/*****************************************************************************************************************/
+/* Multiplexer internals. A thread drives every request of a pool on one curl multi handle, which multiplexes    */
+/* them as HTTP/2 streams over at most maxConnections connections to the endpoint, maxStreams on each, queueing  */
+/* any more. Callers queue a MultiplexTransfer and wait for done; only the thread touches the multi handle,      */
+/* woken by curl_multi_wakeup. PIPEWAIT makes a request wait for a connection still being set up to learn        */
+/* whether it can multiplex rather than opening one of its own. If a new connection comes back in HTTP/1.1, as   */
+/* it does when the server won't speak HTTP/2 in the TLS handshake or the endpoint is http://, the connection    */
+/* limit is lifted for MULTIPLEX_HTTP1_SECONDS so each request in flight gets its own connection, kept for reuse */
+/* as before. Once that passes the limit is restored; live HTTP/1.1 connections are still reused, and the next   */
+/* connection opened negotiates afresh, lifting the limit again only if it too comes back in HTTP/1.1.           */
+/* curl_multi_poll returns on socket activity, on a curl timer or on curl_multi_wakeup, and nothing else.        */
+/* libcurl 8.14 sometimes leaves a stream's response unprocessed on a connection shared by several ~70 KB        */
+/* PutRecords with none of those to come, and the poll sleeps out its whole timeout: about 1 run in 30 of 16     */
+/* such requests stalled for the full second of a 1 s poll. The thread always performs after a poll, so this is  */
+/* not a missed wakeup. So on 8.14 only, multiplexPollMs caps the wait while requests are in flight at           */
+/* MULTIPLEX_POLL_MS, a 20 Hz wakeup; other versions wait on curl's own timers.                                  */
+/*****************************************************************************************************************/
+#define MULTIPLEX_POLL_MS 50
+#define MULTIPLEX_IDLE_POLL_MS 60000
+#define MULTIPLEX_HTTP1_SECONDS 300
+#define MULTIPLEX_STALLING_CURL_MIN 0x080E00
+#define MULTIPLEX_STALLING_CURL_MAX 0x080EFF
+
+/* the longest wait on a poll with requests in flight: timeoutMs, or less on a libcurl that stalls */
+static int multiplexPollMs(int timeoutMs){
+
+	unsigned int version = curl_version_info(CURLVERSION_NOW)->version_num;
+
+	if(version >= MULTIPLEX_STALLING_CURL_MIN && version <= MULTIPLEX_STALLING_CURL_MAX && timeoutMs > MULTIPLEX_POLL_MS)
+		return MULTIPLEX_POLL_MS;
+	return timeoutMs;
+}
+
+typedef struct MultiplexTransfer{
+	CURL *curl;
+	CURLcode result;
+	int done;
+	struct MultiplexTransfer *next;
+}MultiplexTransfer;
+
+typedef struct{
+	CURLM *multi;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	MultiplexTransfer *queue;
+	int maxStreams;
+	long maxConnections;
+	time_t http1Until;
+	int stopping;
+}Multiplexer;
+
+/* hand a transfer's result to the thread waiting for it */
+static void finishMultiplexTransfer(Multiplexer *m, MultiplexTransfer *transfer, CURLcode result){
+
+	pthread_mutex_lock(&m->lock);
+	transfer->result = result;
+	transfer->done = 1;
+	pthread_cond_broadcast(&m->done);
+	pthread_mutex_unlock(&m->lock);
+}
+
+static void* multiplexerWorker(void *arg){
+
+	Multiplexer *m = (Multiplexer*)arg;
+	int running;
+
+	for(;;){
+
+		pthread_mutex_lock(&m->lock);
+		MultiplexTransfer *queue = m->queue;
+		m->queue = NULL;
+		int stopping = m->stopping;
+		pthread_mutex_unlock(&m->lock);
+
+		if(stopping)
+			break;
+
+		while(queue){
+			MultiplexTransfer *transfer = queue;
+			queue = queue->next;
+			CURLMcode added = curl_multi_add_handle(m->multi, transfer->curl);
+			if(added != CURLM_OK)
+				finishMultiplexTransfer(m, transfer, added == CURLM_OUT_OF_MEMORY ? CURLE_OUT_OF_MEMORY : CURLE_FAILED_INIT);
+		}
+
+		curl_multi_perform(m->multi, &running);
+
+		CURLMsg *msg;
+		int remaining;
+		while((msg = curl_multi_info_read(m->multi, &remaining))){
+
+			if(msg->msg != CURLMSG_DONE)
+				continue;
+
+			CURL *curl = msg->easy_handle;
+			CURLcode result = msg->data.result;
+			MultiplexTransfer *transfer;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**)&transfer);
+
+			/* fall back to a connection per request, judging only by connections this transfer opened */
+			long connects = 0, version = 0;
+			if(result == CURLE_OK && curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK && connects > 0
+				&& curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version) == CURLE_OK && version < CURL_HTTP_VERSION_2_0){
+				if(!m->http1Until)
+					curl_multi_setopt(m->multi, CURLMOPT_MAX_HOST_CONNECTIONS, 0L);
+				m->http1Until = time(NULL) + MULTIPLEX_HTTP1_SECONDS;
+			}
+
+			curl_multi_remove_handle(m->multi, curl);
+			finishMultiplexTransfer(m, transfer, result);
+		}
+
+		/* give HTTP/2 another try */
+		if(m->http1Until && time(NULL) >= m->http1Until){
+			m->http1Until = 0;
+			curl_multi_setopt(m->multi, CURLMOPT_MAX_HOST_CONNECTIONS, m->maxConnections);
+		}
+
+		curl_multi_poll(m->multi, NULL, 0, running ? multiplexPollMs(MULTIPLEX_IDLE_POLL_MS) : MULTIPLEX_IDLE_POLL_MS, NULL);
+	}
+
+	return NULL;
+}
+
+/**************************************************************************************************************/
+/* Multiplexer constructor. maxStreams limits the streams on a connection, maxConnections the connections to  */
+/* the endpoint while it speaks HTTP/2. curl sizes the cache of idle connections to the requests in flight.   */
+/**************************************************************************************************************/
+Multiplexer* makeMultiplexer(int maxStreams, int maxConnections){
+
+	Multiplexer *m = malloct(sizeof(Multiplexer));
+
+	m->queue = NULL;
+	m->maxStreams = maxStreams > 0 ? maxStreams : 100;
+	m->maxConnections = maxConnections > 0 ? maxConnections : 1;
+	m->http1Until = 0;
+	m->stopping = 0;
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->done, NULL);
+
+	m->multi = curl_multi_init();
+	if(!m->multi)
+		errorExit("Fatal curl error", "Cannot initialize curl multi");
+
+	curl_multi_setopt(m->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(m->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)m->maxStreams);
+	curl_multi_setopt(m->multi, CURLMOPT_MAX_HOST_CONNECTIONS, m->maxConnections);
+
+	if(pthread_create(&m->thread, NULL, multiplexerWorker, m) != 0)
+		errorExit("Fatal error", "Cannot start multiplexer thread");
+
+	return m;
+}
+
+/*****************************************************************************/
+/* Multiplexer destructor. No requests may be in flight. Closes connections. */
+/*****************************************************************************/
+void freeMultiplexer(Multiplexer *m){
+
+	pthread_mutex_lock(&m->lock);
+	m->stopping = 1;
+	pthread_mutex_unlock(&m->lock);
+	curl_multi_wakeup(m->multi);
+	pthread_join(m->thread, NULL);
+
+	curl_multi_cleanup(m->multi);
+	pthread_cond_destroy(&m->done);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
+
+/* options that let a request share an HTTP/2 connection, for the Multiplexer or a Pipeline */
+void setCurlMultiplexOptions(CURL *curl){
+
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+}
+
+/****************************************************************************************************/
+/* Run the request set up on curl on the multiplexer thread, waiting for it as curl_easy_perform.   */
+/****************************************************************************************************/
+CURLcode multiplexPerform(Multiplexer *m, CURL *curl){
+
+	MultiplexTransfer transfer = {curl, CURLE_OK, 0, NULL};
+
+	setCurlMultiplexOptions(curl);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, (char*)&transfer);
+
+	pthread_mutex_lock(&m->lock);
+	transfer.next = m->queue;
+	m->queue = &transfer;
+	pthread_mutex_unlock(&m->lock);
+	curl_multi_wakeup(m->multi);
+
+	pthread_mutex_lock(&m->lock);
+	while(!transfer.done)
+		pthread_cond_wait(&m->done, &m->lock);
+	pthread_mutex_unlock(&m->lock);
+
+	return transfer.result;
+}
+
+/*********************************************************************************************************/
+/* ConnectionPool is a mutex protected stack of idle curl handles. Handles keep their live connections,  */
+/* and all handles in a pool share one DNS and TLS session cache, so checked out handles skip the DNS    */
+/* lookup and the TCP/TLS handshakes whenever a kept-alive connection to the endpoint is available.      */
+/* With a multiplexer, handles are run by it instead and connections are kept in its multi handle.       */
+/*********************************************************************************************************/
+struct ConnectionPool{
+	pthread_mutex_t lock;
+	CURL **handles;
+	int count;
+	int size;
+	long idleTimeout;
+	CURLSH *share;
+	pthread_mutex_t shareLocks[CURL_LOCK_DATA_LAST];
+	Multiplexer *multiplexer;
+	Metrics *metrics;
+};
+
+/******************************************************************/
+/* Curl share lock callbacks. One mutex per shared data category. */
+/******************************************************************/
+static void curlShareLock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userp){
+
+	(void)curl;
+	(void)access;
+
+	ConnectionPool *pool = (ConnectionPool*)userp;
+	pthread_mutex_lock(&pool->shareLocks[data]);
+}
+
+static void curlShareUnlock(CURL *curl, curl_lock_data data, void *userp){
+
+	(void)curl;
+
+	ConnectionPool *pool = (ConnectionPool*)userp;
+	pthread_mutex_unlock(&pool->shareLocks[data]);
+}
+
+/*****************************************************************************************/
+/* ConnectionPool constructor. size is the maximum number of idle handles kept. If http2 */
+/* is set requests are multiplexed, up to maxStreams on each of maxConnections.          */
+/*****************************************************************************************/
+ConnectionPool* makeConnectionPool(int size, long idleTimeout, int http2, int maxStreams, int maxConnections){
+
+	ConnectionPool *pool = malloct(sizeof(ConnectionPool));
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->size = size > 0 ? size : 0;
+	pool->count = 0;
+	pool->handles = pool->size ? malloct(pool->size * sizeof(CURL*)) : NULL;
+	pool->idleTimeout = idleTimeout;
+	pool->multiplexer = http2 ? makeMultiplexer(maxStreams, maxConnections) : NULL;
+	pool->metrics = NULL;
+
+	int i;
+	for(i=0; i<CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&pool->shareLocks[i], NULL);
+
+	pool->share = curl_share_init();
+	if(!pool->share)
+		errorExit("Fatal curl error", "Cannot initialize curl share");
+
+	curl_share_setopt(pool->share, CURLSHOPT_LOCKFUNC, curlShareLock);
+	curl_share_setopt(pool->share, CURLSHOPT_UNLOCKFUNC, curlShareUnlock);
+	curl_share_setopt(pool->share, CURLSHOPT_USERDATA, (void*)pool);
+	curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	return pool;
+}
+
+/*****************************/
+/* ConnectionPool destructor */
+/*****************************/
+void freeConnectionPool(ConnectionPool *pool){
+
+	/* first, as its connections may use the share */
+	if(pool->multiplexer)
+		freeMultiplexer(pool->multiplexer);
+
+	int i;
+	for(i=0; i<pool->count; i++)
+		curl_easy_cleanup(pool->handles[i]);
+
+	curl_share_cleanup(pool->share);
+
+	for(i=0; i<CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_destroy(&pool->shareLocks[i]);
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->handles);
+	free(pool);
+}
+
+/*******************************************************************************************/
+/* Take an idle handle from the pool, or make a new one if the pool is empty.              */
+/* Handles are returned with default options apart from the share, see checkinCurlHandle. */
+/* Returns NULL, with errorMsg set as for a curl error, if a new handle can't be made.    */
+/*******************************************************************************************/
+CURL* checkoutCurlHandle(ConnectionPool *pool, char *errorMsg){
+
+	CURL *curl = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if(pool->count > 0)
+		curl = pool->handles[--pool->count];
+	pthread_mutex_unlock(&pool->lock);
+
+	if(!curl){
+		curl = curl_easy_init();
+		if(!curl){
+			if(errorMsg)
+				strcpy(errorMsg, "Cannot initialize curl");
+			return NULL;
+		}
+		curl_easy_setopt(curl, CURLOPT_SHARE, pool->share);
+	}
+
+	return curl;
+}
+
+/********************************************************************************************/
+/* Return a handle to the pool. curl_easy_reset clears all per request options (headers,   */
+/* buffers, callbacks) but keeps live connections and the share, ready for the next caller. */
+/* Handles beyond the pool size are cleaned up, closing their connections.                 */
+/********************************************************************************************/
+void checkinCurlHandle(ConnectionPool *pool, CURL *curl){
+
+	curl_easy_reset(curl);
+
+	pthread_mutex_lock(&pool->lock);
+	if(pool->count < pool->size){
+		pool->handles[pool->count++] = curl;
+		curl = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if(curl)
+		curl_easy_cleanup(curl);
+}
+
+/* run the request set up on curl, on the pool's multiplexer if it has one */
+CURLcode performCurlHandle(ConnectionPool *pool, CURL *curl){
+
+	return pool->multiplexer ? multiplexPerform(pool->multiplexer, curl) : curl_easy_perform(curl);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktDefaultAWSContextOptions(AWSContextOptions *opts){
+
+	opts->poolSize = 8;
+	opts->idleTimeout = 60;
+	opts->rateLimit = 0;
+	opts->streamPayloads = 0;
+	opts->compressor = NULL;
+	opts->cbor = 0;
+	opts->metrics = 0;
+	opts->metricsExporter = NULL;
+	opts->metricsUserData = NULL;
+	opts->metricsIntervalMs = 10000;
+	opts->shardBytesPerSecond = 1000000;
+	opts->shardRecordsPerSecond = 950;
+	opts->http2 = 0;
+	opts->http2MaxStreams = 100;
+	opts->http2Connections = 1;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+AWSContext* ktMakeAWSContext(const char *key, const char *keyId, const char *sessionToken, const char *region, const char *endpoint){
+
+	return ktMakeAWSContextEx(key, keyId, sessionToken, region, endpoint, NULL);
+}
+
+/*******************************************************************************************************/
+/* AWSContext constructor shared by the ktMakeAWSContext* functions. The context takes over credentials*/
+/*******************************************************************************************************/
+AWSContext* makeAWSContext(CredentialsCache *credentials, const char *region, const char *endpoint, const AWSContextOptions *opts){
+
+	AWSContextOptions defaults;
+	if(!opts){
+		ktDefaultAWSContextOptions(&defaults);
+		opts = &defaults;
+	}
+
+	AWSContext* ctx = malloct(sizeof(AWSContext));
+	
+	ctx->credentials = credentials;
+	
+	ctx->region = malloct(strlen(region)+1);
+	strcpy(ctx->region, region);
+	/* an http:// or https:// prefix picks the scheme, the host alone is what gets signed */
+	const char *scheme = "https";
+	if(strncmp(endpoint, "http://", 7) == 0){
+		scheme = "http";
+		endpoint += 7;
+	}
+	else if(strncmp(endpoint, "https://", 8) == 0)
+		endpoint += 8;
+	size_t hostLen = strcspn(endpoint, "/");
+	ctx->endpoint = malloct(hostLen+1);
+	memcpy(ctx->endpoint, endpoint, hostLen);
+	ctx->endpoint[hostLen] = '\0';
+	ctx->url = malloct(hostLen + 10);
+	sprintf(ctx->url, "%s://%s", scheme, ctx->endpoint);
+
+	ctx->pool = makeConnectionPool(opts->poolSize, opts->idleTimeout, opts->http2, opts->http2MaxStreams, opts->http2Connections);
+	ctx->keyCache = makeSigningKeyCache();
+	ctx->shardMaps = makeShardMapCache();
+	ctx->limiter = makeRateLimiter(opts);
+	ctx->streamPayloads = opts->streamPayloads;
+	ctx->compressor = opts->compressor;
+	ctx->cbor = opts->cbor;
+	ctx->metrics = makeMetrics(opts);
+	ctx->pool->metrics = ctx->metrics;
+	
+	return ctx;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+AWSContext* ktMakeAWSContextEx(const char *key, const char *keyId, const char *sessionToken, const char *region, const char *endpoint, const AWSContextOptions *opts){
+
+	return makeAWSContext(makeCredentialsCache(makeCredentials(key, keyId, sessionToken, 0), NULL), region, endpoint, opts);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+AWSContext* ktMakeAWSContextWithCredentials(const CredentialsOptions *credentials, const char *region, const char *endpoint, const AWSContextOptions *opts, char *errorMsg){
+
+	CredentialsOptions defaults;
+	if(!credentials){
+		ktDefaultCredentialsOptions(&defaults);
+		credentials = &defaults;
+	}
+
+	/* the first fetch is made here so a context never exists without credentials */
+	AWSCredentials *fetched = malloct(sizeof(AWSCredentials));
+	if(!ktFetchCredentials(credentials, fetched, errorMsg)){
+		free(fetched);
+		return NULL;
+	}
+	Credentials *initial = makeCredentials(fetched->key, fetched->keyId, fetched->sessionToken, (time_t)fetched->expiration);
+	free(fetched);
+
+	return makeAWSContext(makeCredentialsCache(initial, credentials), region, endpoint, opts);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktFreeAWSContext(AWSContext* ctx){
+	
+	free(ctx->region);
+	free(ctx->endpoint);
+	free(ctx->url);
+	freeConnectionPool(ctx->pool);
+	freeSigningKeyCache(ctx->keyCache);
+	freeCredentialsCache(ctx->credentials);
+	freeShardMapCache(ctx->shardMaps);
+	freeRateLimiter(ctx->limiter);
+	freeMetrics(ctx->metrics);
+	free(ctx);
+}
+
+/****************************************************************************************************************/
+/* AWSHeaders wraps headers required for HTTP post. Use makeAWSHeaders to construct and freeAWSHeaders to free. */
+/****************************************************************************************************************/
+typedef struct{
+	char *authorization;
+	char *contentType;
+	char *expect;
+	char *xAMZSecurityToken;
+	char *xAMZTarget;
+	char *xAMZDate;
+	struct curl_slist *list;
+	ScratchArena *arena;
+}AWSHeaders;
+
+/****************************************************************************************************************************************************/
+/* AWSHeaders constructor. Makes all headers need for a successful POST. sessionToken only required for temporary credentials otherwise set to NULL */
+/* The headers and their curl list are allocated with scratchAlloc, so this may return NULL if arena is full; with an arena the list nodes are   */
+/* laid out by hand rather than with curl_slist_append, which would malloc.                                                                       */
+/****************************************************************************************************************************************************/
+AWSHeaders* makeAWSHeaders(const char *authHeader, const char *sessionToken, const char *target, const char *longDate, const char *contentType, ScratchArena *arena){
+
+	AWSHeaders* headers = scratchAlloc(arena, sizeof(AWSHeaders));
+	if(!headers)
+		return NULL;
+
+	headers->arena = arena;
+	headers->list = NULL;
+
+	headers->authorization = scratchAlloc(arena, strlen(authHeader)+1);
+	headers->contentType = (char*) scratchAlloc(arena, strlen(contentType) + 25);
+	headers->xAMZTarget = (char*) scratchAlloc(arena, strlen(target) + 25);
+	headers->xAMZDate = (char*) scratchAlloc(arena, strlen(longDate) + 25);
+	headers->xAMZSecurityToken = sessionToken ? (char*) scratchAlloc(arena, strlen(sessionToken) + 25) : NULL;
+	if(!headers->authorization || !headers->contentType || !headers->xAMZTarget || !headers->xAMZDate || (sessionToken && !headers->xAMZSecurityToken))
+		return NULL;
+
+	strcpy(headers->authorization, authHeader);
+	
+	headers->expect = "Expect:";
+
+	sprintf(headers->contentType, "Content-Type: %s", contentType);
+
+	if(sessionToken)
+		sprintf(headers->xAMZSecurityToken, "x-amz-security-token: %s", sessionToken);
+	
+	sprintf(headers->xAMZTarget, "x-amz-target: %s", target);
+	
+	sprintf(headers->xAMZDate, "x-amz-date: %s", longDate);
+
+	char *lines[6];
+	int count = 0;
+	lines[count++] = headers->authorization;
+	lines[count++] = headers->contentType;
+	lines[count++] = headers->expect;
+	if(headers->xAMZSecurityToken) /* only included for temporary credentials */
+		lines[count++] = headers->xAMZSecurityToken;
+	lines[count++] = headers->xAMZTarget;
+	lines[count++] = headers->xAMZDate;
+
+	int i;
+	if(arena){
+		struct curl_slist *nodes = scratchAlloc(arena, count * sizeof(struct curl_slist));
+		if(!nodes)
+			return NULL;
+		for(i=0; i<count; i++){
+			nodes[i].data = lines[i];
+			nodes[i].next = i+1 < count ? &nodes[i+1] : NULL;
+		}
+		headers->list = nodes;
+	}
+	else{
+		for(i=0; i<count; i++)
+			headers->list = curl_slist_append(headers->list, lines[i]);
+	}
+	
+	return headers;
+};
+
+/*************************/
+/* AWSHeaders destructor */
+/*************************/
+void freeAWSHeaders(AWSHeaders* headers){
+
+	if(!headers || headers->arena)
+		return;
+
+	curl_slist_free_all(headers->list);
+	free(headers->authorization);
+	free(headers->contentType);
+	free(headers->xAMZSecurityToken);
+	free(headers->xAMZTarget);
+	free(headers->xAMZDate);
+	free(headers);
+}
+
+/***********************************************************************************************/
+/* httpResponseSink chunk handler for the fixed size httpResponse. Saves the first             */
+/* MAX_HTTP_RESPONSE_SIZE - 1 chars, null terminated, and quietly drops the rest.              */
+/***********************************************************************************************/
+static size_t fixedResponseChunk(const char *chunk, size_t len, void *userData){
+
+	httpResponse *response = (httpResponse*)userData;
+
+	int realSize = len;
+	int spaceRemaining = MAX_HTTP_RESPONSE_SIZE -1 - response->len;
+	int copySize = 0;
+	
+	if(realSize <= spaceRemaining)
+		copySize=realSize;
+	else
+		copySize=spaceRemaining;
+	
+	/* copy and null terminate */
+	memcpy(&(response->text[response->len]), chunk, copySize);
+	response->len+=copySize;
+	response->text[(response->len)]='\0';
+	
+	return len;
+}
+
+/*****************************************************************************************/
+/* Wrap a fixed size httpResponse, which may be NULL, as a sink. Returns sink, or NULL.  */
+/*****************************************************************************************/
+static httpResponseSink* fixedResponseSink(httpResponse *response, httpResponseSink *sink){
+
+	if(!response)
+		return NULL;
+
+	ktInitResponseSink(sink);
+	sink->onChunk = fixedResponseChunk;
+	sink->userData = response;
+	response->len = 0;
+	response->text[0] = '\0';
+
+	return sink;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktInitResponseSink(httpResponseSink *sink){
+
+	memset(sink, 0, sizeof(httpResponseSink));
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktFreeResponseSink(httpResponseSink *sink){
+
+	if(sink->allocator)
+		sink->allocator(sink->text, 0, sink->userData);
+	else
+		free(sink->text);
+
+	sink->text = NULL;
+	sink->len = sink->capacity = 0;
+}
+
+/*****************************************************************************************************/
+/* Curl specific callback function to process response header and response body data into a sink.  */
+/* Streaming sinks get each fragment straight from curl. Growable sinks keep the whole response,    */
+/* null terminated, doubling their buffer as needed; running out of memory fails the transfer.      */
+/*****************************************************************************************************/
+static size_t curlResponseCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	httpResponseSink *sink = (httpResponseSink*)userp;
+
+	size_t realSize = size*nmemb;
+
+	if(sink->onChunk)
+		return sink->onChunk((const char*)contents, realSize, sink->userData);
+
+	if(sink->len + realSize + 1 > sink->capacity){
+		size_t capacity = sink->capacity ? sink->capacity : 4096;
+		while(sink->len + realSize + 1 > capacity)
+			capacity *= 2;
+		char *text = sink->allocator ? sink->allocator(sink->text, capacity, sink->userData) : realloc(sink->text, capacity);
+		if(!text)
+			return 0;
+		sink->text = text;
+		sink->capacity = capacity;
+	}
+
+	memcpy(sink->text + sink->len, contents, realSize);
+	sink->len += realSize;
+	sink->text[sink->len] = '\0';
+
+	return realSize;
+}
+
+/*****************************************************************************************************************/
+/* Curl specific setup of a HTTP post on curl, shared by curlDoPost and the multi interface Pipeline.            */
+/* Arguments follow curlDoPost. headers, which own the curl header list, must outlive the request. timeout is  */
+/* the seconds the whole request may take, REQUEST_TIMEOUT_SECONDS for replies or 0 for none.                   */
+/*****************************************************************************************************************/
+#define REQUEST_TIMEOUT_SECONDS 20L
+
+void setCurlPostOptions(CURL *curl, long timeout, long idleTimeout, const char *url, const AWSHeaders *headers, const char *payload, size_t payloadLen, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	/* uncomment for verbose */
+	//curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+		
+	/* set url */
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+ 
+ 	/* set timeout */
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+
+	/* keep connections alive between requests, but don't reuse any idle for too long */
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, idleTimeout);
+
+	/* (too) permissive SSL options */
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+
+	/* set headers */
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers->list);
+	
+	/* set post data of payloadLen chars, which may be binary, unless the caller streams it */
+	if(payload){
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)payloadLen);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload);
+	}
+	
+	/* set error message buffer if required */
+	if(errorMsg)
+		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorMsg);
+	
+	/* set callbacks if we want to save response header or body */
+	if(respHeader){
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curlResponseCallback);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)respHeader);
+		respHeader->len=0; /* empty growable buffer prior to call, keeping its capacity */
+		if(respHeader->text)
+			respHeader->text[0]='\0';
+	}
+
+	if(respBody){
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlResponseCallback);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)respBody);
+		respBody->len=0; /* empty growable buffer prior to call, keeping its capacity */
+		if(respBody->text)
+			respBody->text[0]='\0';
+	}
+}
+
+/*****************************************************************************************************************************/
+/* Curl specific HTTP post routine. A curl handle is checked out of pool for the call and returned afterwards.               */
+/* Set respHeader, respBody, errorMsg to NULL to ignore response header, response body and curl error messages respectively. */
+/* If supplied, errorMsg must have minimum size CURL_ERROR_SIZE.                                                             */
+/* Response data goes to the respHeader and respBody sinks, see httpResponseSink.                                           */
+/* Returns 0 for a curl level error (see errorMsg for details) otherwise HTTP status code. 200 indicates success.            */
+/*****************************************************************************************************************************/
+int curlDoPost(ConnectionPool *pool, const char *url, const AWSHeaders *headers, const char *payload, size_t payloadLen, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+	
+	/* take a handle, with any kept-alive connection, from the pool */
+	CURL *curl = checkoutCurlHandle(pool, errorMsg);
+	if(!curl)
+		return 0;
+
+	setCurlPostOptions(curl, REQUEST_TIMEOUT_SECONDS, pool->idleTimeout, url, headers, payload, payloadLen, respHeader, respBody, errorMsg);
+ 
+	long retcode = 0;
+	/* Perform request, on success set retcode to HTTP status code*/
+	if(CURLE_OK == performCurlHandle(pool, curl)){
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &retcode);
+	}
+	metricsRecordTransfer(pool->metrics, curl, retcode);
+	
+	/* Curl cleanup, the handle goes back to the pool for reuse */
+	checkinCurlHandle(pool, curl);
+	
+	return retcode;
+}
+
+/* curl read callback, fills curl's upload buffer from a PutRecordsReader */
+static size_t curlPayloadCallback(char *buffer, size_t size, size_t nitems, void *userp){
+
+	return readPutRecordsPayload((PutRecordsReader*)userp, buffer, size * nitems);
+}
+
+/* curl seek callback, used if curl has to resend the body, say on a kept-alive connection found closed */
+static int curlPayloadSeekCallback(void *userp, curl_off_t offset, int origin){
+
+	PutRecordsReader *r = (PutRecordsReader*)userp;
+
+	if(origin != SEEK_SET)
+		return CURL_SEEKFUNC_CANTSEEK;
+
+	beginPutRecordsReader(r, r->streamName, r->recordCount, r->partitionKeyArray, r->explicitHashKeyArray, r->dataArray, r->lenArray);
+
+	char skip[1024];
+	while(offset > 0){
+		size_t n = readPutRecordsPayload(r, skip, offset < (curl_off_t)sizeof(skip) ? (size_t)offset : sizeof(skip));
+		if(n == 0)
+			return CURL_SEEKFUNC_FAIL;
+		offset -= n;
+	}
+
+	return CURL_SEEKFUNC_OK;
+}
+
+/*****************************************************************************************************************/
+/* As curlDoPost, but the body of payloadSize chars is read from reader as curl sends it rather than passed as   */
+/* one string.                                                                                                   */
+/*****************************************************************************************************************/
+int curlDoStreamingPost(ConnectionPool *pool, const char *url, const AWSHeaders *headers, PutRecordsReader *reader, size_t payloadSize, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	CURL *curl = checkoutCurlHandle(pool, errorMsg);
+	if(!curl)
+		return 0;
+
+	setCurlPostOptions(curl, REQUEST_TIMEOUT_SECONDS, pool->idleTimeout, url, headers, NULL, 0, respHeader, respBody, errorMsg);
+
+	/* POST with a known Content-Length, so the body isn't chunked */
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)payloadSize);
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, curlPayloadCallback);
+	curl_easy_setopt(curl, CURLOPT_READDATA, (void *)reader);
+	curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, curlPayloadSeekCallback);
+	curl_easy_setopt(curl, CURLOPT_SEEKDATA, (void *)reader);
+
+	long retcode = 0;
+	if(CURLE_OK == performCurlHandle(pool, curl)){
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &retcode);
+	}
+	metricsRecordTransfer(pool->metrics, curl, retcode);
+
+	checkinCurlHandle(pool, curl);
+
+	return retcode;
+}
+
+/* curl progress callback for event streams, called about once a second even while idle, stopping the transfer once *cancel is set */
+static int curlCancelCallback(void *userp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow){
+
+	(void)dltotal;
+	(void)dlnow;
+	(void)ultotal;
+	(void)ulnow;
+
+	const int *cancel = (const int*)userp;
+
+	return cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED);
+}
+
+/*****************************************************************************************************************/
+/* As curlDoPost, for a response that is a long lived event stream rather than a reply: no overall timeout, but  */
+/* the connection is dropped if under a byte a second arrives for EVENT_STREAM_STALL_SECONDS, and HTTP/2 is used */
+/* if the https endpoint offers it. If cancel isn't NULL the transfer stops soon after *cancel is set, returning */
+/* 0. Not timed by metrics, where its minutes long exchange would swamp the stage histograms.                    */
+/*****************************************************************************************************************/
+#define EVENT_STREAM_STALL_SECONDS 60L
+
+int curlDoEventStreamPost(ConnectionPool *pool, const char *url, const AWSHeaders *headers, const char *payload, size_t payloadLen, httpResponseSink *respHeader, httpResponseSink *respBody, const int *cancel, char *errorMsg){
+
+	CURL *curl = checkoutCurlHandle(pool, errorMsg);
+	if(!curl)
+		return 0;
+
+	setCurlPostOptions(curl, 0L, pool->idleTimeout, url, headers, payload, payloadLen, respHeader, respBody, errorMsg);
+
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, EVENT_STREAM_STALL_SECONDS);
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, curlCancelCallback);
+	curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)cancel);
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+
+	long retcode = 0;
+	if(CURLE_OK == curl_easy_perform(curl)){
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &retcode);
+	}
+
+	/* the handle goes back to the pool for ordinary requests */
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 0L);
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, NULL);
+
+	checkinCurlHandle(pool, curl);
+
+	return retcode;
+}
+
+/*****************************************************************************************************************/
+/* Curl specific GET or PUT (method) of url for the credential providers, with one extra header line if set.     */
+/* Metadata endpoints are local, so this uses a handle of its own, never a proxy, and gives up quickly: a host   */
+/* that isn't on EC2 or in a container fails within METADATA_CONNECT_SECONDS. Returns as curlDoPost.             */
+/*****************************************************************************************************************/
+#define METADATA_CONNECT_SECONDS 1L
+#define METADATA_TIMEOUT_SECONDS 5L
+
+int curlDoMetadataRequest(const char *method, const char *url, const char *header, httpResponseSink *respBody, char *errorMsg){
+
+	CURL *curl = curl_easy_init();
+	if(!curl){
+		if(errorMsg)
+			strcpy(errorMsg, "Cannot make curl handle");
+		return 0;
+	}
+
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, METADATA_CONNECT_SECONDS);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, METADATA_TIMEOUT_SECONDS);
+	curl_easy_setopt(curl, CURLOPT_NOPROXY, "*");
+	if(strcmp(method, "GET") != 0)
+		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
+
+	struct curl_slist *list = header ? curl_slist_append(NULL, header) : NULL;
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+
+	if(errorMsg)
+		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorMsg);
+
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlResponseCallback);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)respBody);
+	respBody->len = 0;
+	if(respBody->text)
+		respBody->text[0] = '\0';
+
+	long retcode = 0;
+	if(CURLE_OK == curl_easy_perform(curl)){
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &retcode);
+	}
+
+	curl_slist_free_all(list);
+	curl_easy_cleanup(curl);
+
+	return retcode;
+}
+
+/*****************************************************************************************************************/
+/* Record compression. A compressed record is a KT_CODEC_HEADER_SIZE byte header (0xF3 'k' 't' codec) followed   */
+/* by a gzip member or a zstd frame, which carries the id of any dictionary used. A record compression doesn't   */
+/* shrink by more than the header goes as it is, so no record grows; only one that itself starts 0xF3 'k' 't'    */
+/* goes under a KT_CODEC_STORED header, so consumers never take it for compressed. Codec states are expensive to */
+/* set up (a deflate stream is a few hundred KB) so a Compressor keeps a small mutex protected stack of idle     */
+/* ones for reuse across calls and threads, as the ConnectionPool does with curl handles. zstd support is only   */
+/* built with KT_WITH_ZSTD defined.                                                                              */
+/*****************************************************************************************************************/
+#define COMPRESSOR_POOL_SIZE 8
+
+struct Compressor{
+	int codec;
+	int level;
+	pthread_mutex_t lock;
+	void *idle[COMPRESSOR_POOL_SIZE];
+	int idleCount;
+#ifdef KT_WITH_ZSTD
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+#endif
+};
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+Compressor* ktMakeCompressor(int codec, int level, const void *dictionary, size_t dictionaryLen){
+
+	if(codec != KT_CODEC_GZIP && codec != KT_CODEC_ZSTD)
+		return NULL;
+
+	if(codec == KT_CODEC_GZIP && dictionary)
+		return NULL;
+
+#ifndef KT_WITH_ZSTD
+	if(codec == KT_CODEC_ZSTD)
+		return NULL;
+#endif
+
+	Compressor *compressor = malloct(sizeof(Compressor));
+
+	compressor->codec = codec;
+	compressor->level = level;
+	pthread_mutex_init(&compressor->lock, NULL);
+	compressor->idleCount = 0;
+
+#ifdef KT_WITH_ZSTD
+	compressor->cdict = NULL;
+	compressor->ddict = NULL;
+	if(codec == KT_CODEC_ZSTD && dictionary){
+		compressor->cdict = ZSTD_createCDict(dictionary, dictionaryLen, level);
+		compressor->ddict = ZSTD_createDDict(dictionary, dictionaryLen);
+		if(!compressor->cdict || !compressor->ddict){
+			ktFreeCompressor(compressor);
+			return NULL;
+		}
+	}
+#else
+	(void)dictionaryLen;
+#endif
+
+	return compressor;
+}
+
+/* free one codec state */
+static void freeCodecState(const Compressor *compressor, void *state){
+
+	if(compressor->codec == KT_CODEC_GZIP){
+		deflateEnd((z_stream*)state);
+		free(state);
+	}
+#ifdef KT_WITH_ZSTD
+	else
+		ZSTD_freeCCtx((ZSTD_CCtx*)state);
+#endif
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktFreeCompressor(Compressor *compressor){
+
+	if(!compressor)
+		return;
+
+	while(compressor->idleCount > 0)
+		freeCodecState(compressor, compressor->idle[--compressor->idleCount]);
+
+#ifdef KT_WITH_ZSTD
+	ZSTD_freeCDict(compressor->cdict);
+	ZSTD_freeDDict(compressor->ddict);
+#endif
+
+	pthread_mutex_destroy(&compressor->lock);
+	free(compressor);
+}
+
+/* take an idle codec state from the compressor, or make one. Returns NULL if one can't be made */
+static void* checkoutCodecState(Compressor *compressor){
+
+	void *state = NULL;
+
+	pthread_mutex_lock(&compressor->lock);
+	if(compressor->idleCount > 0)
+		state = compressor->idle[--compressor->idleCount];
+	pthread_mutex_unlock(&compressor->lock);
+
+	if(state)
+		return state;
+
+	if(compressor->codec == KT_CODEC_GZIP){
+		z_stream *z = calloc(1, sizeof(z_stream));
+		/* windowBits 15 + 16 for a gzip wrapper */
+		if(z && deflateInit2(z, compressor->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+			free(z);
+			z = NULL;
+		}
+		return z;
+	}
+
+#ifdef KT_WITH_ZSTD
+	return ZSTD_createCCtx();
+#else
+	return NULL;
+#endif
+}
+
+/* return a codec state to the compressor, freeing it if the stack is full */
+static void checkinCodecState(Compressor *compressor, void *state){
+
+	pthread_mutex_lock(&compressor->lock);
+	if(compressor->idleCount < COMPRESSOR_POOL_SIZE){
+		compressor->idle[compressor->idleCount++] = state;
+		state = NULL;
+	}
+	pthread_mutex_unlock(&compressor->lock);
+
+	if(state)
+		freeCodecState(compressor, state);
+}
+
+/* the compressor is shared read only by contexts; only its idle stack changes, under its lock */
+static Compressor* mutableCompressor(const Compressor *compressor){
+
+	return (Compressor*)compressor;
+}
+
+/* codec of a compressed record, or -1 if it has no codec header */
+static int recordCodec(const unsigned char *data, int len){
+
+	if(len < KT_CODEC_HEADER_SIZE || data[0] != 0xF3 || data[1] != 'k' || data[2] != 't')
+		return -1;
+
+	return data[3];
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktCompressRecord(const Compressor *compressor, const unsigned char *data, int len, unsigned char *out){
+
+	size_t packed = 0;
+	void *state = checkoutCodecState(mutableCompressor(compressor));
+
+	if(state && compressor->codec == KT_CODEC_GZIP){
+		z_stream *z = (z_stream*)state;
+		deflateReset(z);
+		z->next_in = (unsigned char*)data;
+		z->avail_in = len;
+		z->next_out = out + KT_CODEC_HEADER_SIZE;
+		z->avail_out = len;
+		if(deflate(z, Z_FINISH) == Z_STREAM_END)
+			packed = z->total_out;
+	}
+#ifdef KT_WITH_ZSTD
+	else if(state){
+		size_t n;
+		if(compressor->cdict)
+			n = ZSTD_compress_usingCDict((ZSTD_CCtx*)state, out + KT_CODEC_HEADER_SIZE, len, data, len, compressor->cdict);
+		else
+			n = ZSTD_compressCCtx((ZSTD_CCtx*)state, out + KT_CODEC_HEADER_SIZE, len, data, len, compressor->level);
+		if(!ZSTD_isError(n))
+			packed = n;
+	}
+#endif
+
+	if(state)
+		checkinCodecState(mutableCompressor(compressor), state);
+
+	out[0] = 0xF3;
+	out[1] = 'k';
+	out[2] = 't';
+
+	/* send it unchanged if compressing didn't shrink it, header and all, so it never grows past the record */
+	/* limit; only data that could pass for a compressed record is stored under a header                    */
+	if(packed == 0 || KT_CODEC_HEADER_SIZE + packed >= (size_t)len){
+		if(recordCodec(data, len) < 0){
+			memcpy(out, data, len);
+			return len;
+		}
+		out[3] = KT_CODEC_STORED;
+		memcpy(out + KT_CODEC_HEADER_SIZE, data, len);
+		return KT_CODEC_HEADER_SIZE + len;
+	}
+
+	out[3] = compressor->codec;
+
+	return KT_CODEC_HEADER_SIZE + packed;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+long ktDecompressedLength(const unsigned char *data, int len){
+
+	const unsigned char *body = data + KT_CODEC_HEADER_SIZE;
+	int bodyLen = len - KT_CODEC_HEADER_SIZE;
+
+	switch(recordCodec(data, len)){
+
+		case -1:
+			return len;
+
+		case KT_CODEC_STORED:
+			return bodyLen;
+
+		case KT_CODEC_GZIP:
+			/* ISIZE, the little endian length mod 2^32 that ends a gzip member */
+			if(bodyLen < 18)
+				return -1;
+			return (long)body[bodyLen-4] | (long)body[bodyLen-3] << 8 | (long)body[bodyLen-2] << 16 | (long)body[bodyLen-1] << 24;
+
+#ifdef KT_WITH_ZSTD
+		case KT_CODEC_ZSTD:{
+			unsigned long long size = ZSTD_getFrameContentSize(body, bodyLen);
+			if(size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR)
+				return -1;
+			return (long)size;
+		}
+#endif
+	}
+
+	return -1;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktDecompressRecord(const Compressor *compressor, const unsigned char *data, int len, unsigned char *out, int outCapacity){
+
+	const unsigned char *body = data + KT_CODEC_HEADER_SIZE;
+	int bodyLen = len - KT_CODEC_HEADER_SIZE;
+
+	switch(recordCodec(data, len)){
+
+		case -1:
+			if(len > outCapacity)
+				return -1;
+			memcpy(out, data, len);
+			return len;
+
+		case KT_CODEC_STORED:
+			if(bodyLen > outCapacity)
+				return -1;
+			memcpy(out, body, bodyLen);
+			return bodyLen;
+
+		case KT_CODEC_GZIP:{
+			z_stream z;
+			memset(&z, 0, sizeof(z));
+			if(inflateInit2(&z, 15 + 16) != Z_OK)
+				return -1;
+			z.next_in = (unsigned char*)body;
+			z.avail_in = bodyLen;
+			z.next_out = out;
+			z.avail_out = outCapacity;
+			int status = inflate(&z, Z_FINISH);
+			int n = z.total_out;
+			inflateEnd(&z);
+			return status == Z_STREAM_END ? n : -1;
+		}
+
+#ifdef KT_WITH_ZSTD
+		case KT_CODEC_ZSTD:{
+			ZSTD_DCtx *dctx = ZSTD_createDCtx();
+			if(!dctx)
+				return -1;
+			size_t n;
+			if(compressor && compressor->ddict)
+				n = ZSTD_decompress_usingDDict(dctx, out, outCapacity, body, bodyLen, compressor->ddict);
+			else
+				n = ZSTD_decompressDCtx(dctx, out, outCapacity, body, bodyLen);
+			ZSTD_freeDCtx(dctx);
+			return ZSTD_isError(n) ? -1 : (int)n;
+		}
+#endif
+	}
+
+	(void)compressor;
+	return -1;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+size_t ktTrainDictionary(unsigned char * const *sampleArray, const int *lenArray, int sampleCount, void *dictionary, size_t capacity){
+
+#ifdef KT_WITH_ZSTD
+	/* ZDICT wants the samples end to end */
+	size_t total = 0;
+	int i;
+	for(i=0; i<sampleCount; i++)
+		total += lenArray[i];
+
+	unsigned char *samples = malloct(total ? total : 1);
+	size_t *sizes = malloct((sampleCount ? sampleCount : 1) * sizeof(size_t));
+	total = 0;
+	for(i=0; i<sampleCount; i++){
+		memcpy(samples + total, sampleArray[i], lenArray[i]);
+		total += lenArray[i];
+		sizes[i] = lenArray[i];
+	}
+
+	size_t n = ZDICT_trainFromBuffer(dictionary, capacity, samples, sizes, sampleCount);
+
+	free(samples);
+	free(sizes);
+
+	return ZDICT_isError(n) ? 0 : n;
+#else
+	(void)sampleArray; (void)lenArray; (void)sampleCount; (void)dictionary; (void)capacity;
+	return 0;
+#endif
+}
+
+int isAggregatedRecord(const unsigned char *data, int len);
+
+/*****************************************************************************************************************/
+/* If the context compresses, compress records into scratch memory for sending and point sendData and sendLens  */
+/* at the results, otherwise at the caller's arrays. Returns 0 if arena is full. Release with freeSendRecords.  */
+/* Aggregated records go unchanged: their user records were compressed before they were packed.                 */
+/*****************************************************************************************************************/
+static int compressSendRecords(const AWSContext *ctx, int recordCount, unsigned char * const *dataArray, const int *lenArray, ScratchArena *arena, unsigned char * const **sendData, const int **sendLens){
+
+	*sendData = dataArray;
+	*sendLens = lenArray;
+
+	if(!ctx->compressor)
+		return 1;
+
+	size_t total = 0;
+	int i;
+	for(i=0; i<recordCount; i++)
+		total += lenArray[i] + KT_CODEC_HEADER_SIZE;
+
+	/* one block holding the pointers, then the lengths, then the records */
+	size_t lensOffset = recordCount * sizeof(unsigned char*);
+	size_t bytesOffset = lensOffset + recordCount * sizeof(int);
+	char *block = scratchAlloc(arena, bytesOffset + total + 1);
+	if(!block)
+		return 0;
+
+	unsigned char **data = (unsigned char**)block;
+	int *lens = (int*)(block + lensOffset);
+	unsigned char *p = (unsigned char*)block + bytesOffset;
+
+	for(i=0; i<recordCount; i++){
+		if(isAggregatedRecord(dataArray[i], lenArray[i])){
+			data[i] = dataArray[i];
+			lens[i] = lenArray[i];
+			continue;
+		}
+		data[i] = p;
+		lens[i] = ktCompressRecord(ctx->compressor, dataArray[i], lenArray[i], p);
+		p += lens[i];
+	}
+
+	*sendData = data;
+	*sendLens = lens;
+
+	return 1;
+}
+
+static void freeSendRecords(ScratchArena *arena, unsigned char * const *sendData, unsigned char * const *dataArray){
+
+	if(sendData != dataArray)
+		scratchFree(arena, (void*)sendData);
+}
+
+/* errorMsg text, as curl's own, for a request that didn't fit its scratch arena or whose digest couldn't be started */
+static int scratchArenaFull(ScratchArena *arena, size_t used, char *errorMsg){
+
+	arena->used = used;
+	if(errorMsg)
+		strcpy(errorMsg, "Scratch arena too small for request, or out of memory");
+
+	return 0;
+}
+
+/*****************************************************************************************************************/
+/* PutRecord. With an arena every temporary is taken from it and released on return; running out returns 0 with */
+/* errorMsg set, as a transport error would, instead of exiting. With arena NULL temporaries come from the heap. */
+/*****************************************************************************************************************/
+int putRecord(const AWSContext *ctx, const char *streamName, const char *partitionKey, const unsigned char *data, int len, ScratchArena *arena, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+	
+	static const char *target = "Kinesis_20131202.PutRecord";
+
+	size_t used = arena ? arena->used : 0;
+
+	/* time each stage if the context keeps metrics */
+	struct timespec callStart, stageStart;
+	metricsStart(ctx->metrics, &stageStart);
+	callStart = stageStart;
+	
+	/* make date strings */
+	char longDate[17], shortDate[9];
+	makeDateStrings(longDate, shortDate);
+
+	/* compress if the context is set to */
+	unsigned char * const *sendData;
+	const int *sendLen;
+	if(!compressSendRecords(ctx, 1, (unsigned char * const *)&data, &len, arena, &sendData, &sendLen))
+		return scratchArenaFull(arena, used, errorMsg);
+	if(ctx->compressor)
+		metricsLap(ctx->metrics, KT_STAGE_COMPRESS, &stageStart);
+
+	/* make payload in the context's encoding, hashed as it is built */
+	const char *contentType = ctx->cbor ? cborContentType : jsonContentType;
+	char payloadHash[65];
+	size_t payloadLen = 0;
+	char *payload;
+	if(ctx->cbor)
+		payload = makePutRecordCBORPayload(sendData[0], sendLen[0], streamName, partitionKey, payloadHash, &payloadLen, arena);
+	else{
+		payload = makePutRecordPayload(sendData[0], sendLen[0], streamName, partitionKey, payloadHash, arena);
+		if(payload)
+			payloadLen = strlen(payload);
+	}
+	freeSendRecords(arena, sendData, (unsigned char * const *)&data);
+	if(!payload)
+		return scratchArenaFull(arena, used, errorMsg);
+	metricsLap(ctx->metrics, KT_STAGE_PAYLOAD, &stageStart);
+	
+	/* make Authorization header, signed with today's cached signing key */
+	unsigned char signingKey[32];
+	const Credentials *credentials = currentCredentials(ctx);
+	getSigningKey(ctx, credentials, shortDate, signingKey);
+	char *authHeader = makeAuthHeader(signingKey, credentials->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payloadHash, contentType, arena);
+	if(!authHeader)
+		return scratchArenaFull(arena, used, errorMsg);
+	
+	/* make all headers */
+	AWSHeaders *headers = makeAWSHeaders(authHeader, credentials->sessionToken, target, longDate, contentType, arena);
+	if(!headers)
+		return scratchArenaFull(arena, used, errorMsg);
+	metricsLap(ctx->metrics, KT_STAGE_SIGN, &stageStart);
+		
+	/* do the post */
+	int retcode = curlDoPost(ctx->pool, ctx->url, headers, payload, payloadLen, respHeader, respBody, errorMsg);
+	metricsCount(ctx->metrics, KT_COUNTER_RECORDS, 1);
+	metricsCount(ctx->metrics, KT_COUNTER_PAYLOAD_BYTES, payloadLen);
+	metricsLap(ctx->metrics, KT_STAGE_CALL, &callStart);
+	
+	/* cleanup */
+	scratchFree(arena, payload);
+	scratchFree(arena, authHeader);
+	freeAWSHeaders(headers);
+	if(arena)
+		arena->used = used;
+	
+	return retcode;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPutRecordSink(const AWSContext *ctx, const char *streamName, const char *partitionKey, const unsigned char *data, int len, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	return putRecord(ctx, streamName, partitionKey, data, len, NULL, respHeader, respBody, errorMsg);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPutRecordArena(const AWSContext *ctx, const char *streamName, const char *partitionKey, const unsigned char *data, int len, ScratchArena *arena, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	return putRecord(ctx, streamName, partitionKey, data, len, arena, respHeader, respBody, errorMsg);
+}
+
+/*****************************************************************************************************************/
+/* PutRecords with optional explicit hash keys. explicitHashKeyArray may be NULL. arena is as for putRecord.     */
+/*****************************************************************************************************************/
+int putRecords(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, ScratchArena *arena, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	static const char *target = "Kinesis_20131202.PutRecords";
+
+	size_t used = arena ? arena->used : 0;
+
+	/* time each stage if the context keeps metrics */
+	struct timespec callStart, stageStart;
+	metricsStart(ctx->metrics, &stageStart);
+	callStart = stageStart;
+	
+	/* make date strings */
+	char longDate[17], shortDate[9];
+	makeDateStrings(longDate, shortDate);
+
+	/* compress if the context is set to */
+	unsigned char * const *sendData;
+	const int *sendLens;
+	if(!compressSendRecords(ctx, recordCount, dataArray, lenArray, arena, &sendData, &sendLens))
+		return scratchArenaFull(arena, used, errorMsg);
+	if(ctx->compressor)
+		metricsLap(ctx->metrics, KT_STAGE_COMPRESS, &stageStart);
+
+	/* make payload in the context's encoding, hashed as it is built, or when streaming JSON hash it in a pre-pass and build it again as it is sent */
+	const char *contentType = ctx->cbor ? cborContentType : jsonContentType;
+	char payloadHash[65];
+	char *payload = NULL;
+	size_t payloadLen = 0;
+	PutRecordsReader reader;
+
+	if(ctx->cbor)
+		payload = makePutRecordsCBORPayload(streamName, recordCount, partitionKeyArray, explicitHashKeyArray, sendData, sendLens, payloadHash, &payloadLen, arena);
+	else if(ctx->streamPayloads){
+		beginPutRecordsReader(&reader, streamName, recordCount, partitionKeyArray, explicitHashKeyArray, sendData, sendLens);
+		if(!hashPutRecordsPayload(&reader, payloadHash)){
+			if(!arena)
+				errorExit("OpenSSL library error", "Cannot initialize SHA256");
+			return scratchArenaFull(arena, used, errorMsg);
+		}
+	}
+	else{
+		payload = makePutRecordsPayload(streamName, recordCount, partitionKeyArray, explicitHashKeyArray, sendData, sendLens, payloadHash, arena);
+		if(payload)
+			payloadLen = strlen(payload);
+	}
+	if(!payload && (ctx->cbor || !ctx->streamPayloads))
+		return scratchArenaFull(arena, used, errorMsg);
+	metricsLap(ctx->metrics, KT_STAGE_PAYLOAD, &stageStart);
+	
+	/* make Authorization header, signed with today's cached signing key */
+	unsigned char signingKey[32];
+	const Credentials *credentials = currentCredentials(ctx);
+	getSigningKey(ctx, credentials, shortDate, signingKey);
+	char *authHeader = makeAuthHeader(signingKey, credentials->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payloadHash, contentType, arena);
+	if(!authHeader)
+		return scratchArenaFull(arena, used, errorMsg);
+	
+	/* make all headers */
+	AWSHeaders *headers = makeAWSHeaders(authHeader, credentials->sessionToken, target, longDate, contentType, arena);
+	if(!headers)
+		return scratchArenaFull(arena, used, errorMsg);
+	metricsLap(ctx->metrics, KT_STAGE_SIGN, &stageStart);
+		
+	/* do the post */
+	int retcode;
+	if(payload)
+		retcode = curlDoPost(ctx->pool, ctx->url, headers, payload, payloadLen, respHeader, respBody, errorMsg);
+	else{
+		payloadLen = putRecordsPayloadSize(streamName, recordCount, partitionKeyArray, explicitHashKeyArray, sendLens);
+		retcode = curlDoStreamingPost(ctx->pool, ctx->url, headers, &reader, payloadLen, respHeader, respBody, errorMsg);
+	}
+	metricsCount(ctx->metrics, KT_COUNTER_RECORDS, recordCount);
+	metricsCount(ctx->metrics, KT_COUNTER_PAYLOAD_BYTES, payloadLen);
+	metricsLap(ctx->metrics, KT_STAGE_CALL, &callStart);
+	
+	/* cleanup */
+	scratchFree(arena, payload);
+	freeSendRecords(arena, sendData, dataArray);
+	scratchFree(arena, authHeader);
+	freeAWSHeaders(headers);
+	if(arena)
+		arena->used = used;
+	
+	return retcode;	
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPutRecordsArena(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, ScratchArena *arena, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	return putRecords(ctx, streamName, recordCount, partitionKeyArray, NULL, dataArray, lenArray, arena, respHeader, respBody, errorMsg);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+size_t ktPutRecordsScratchSize(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, const int *lenArray){
+
+	/* payload, then generous room for the signing strings, headers and list nodes with their alignment */
+	size_t size = 0;
+	if(ctx->cbor){
+		size += cborPutRecordsPayloadSize(streamName, recordCount, partitionKeyArray, NULL, lenArray) + 1 + 16;
+		if(ctx->compressor)
+			size += recordCount * (KT_CODEC_HEADER_SIZE + 8);
+	}
+	else if(!ctx->streamPayloads){
+		if(ctx->compressor){
+			/* compressed records can be KT_CODEC_HEADER_SIZE bigger than they were */
+			int i;
+			for(i=0; i<recordCount; i++)
+				size += base64Length(lenArray[i] + KT_CODEC_HEADER_SIZE) - base64Length(lenArray[i]);
+		}
+		size += putRecordsPayloadSize(streamName, recordCount, partitionKeyArray, NULL, lenArray) + 1 + 16;
+	}
+	if(ctx->compressor){
+		int i;
+		for(i=0; i<recordCount; i++)
+			size += lenArray[i] + KT_CODEC_HEADER_SIZE;
+		size += recordCount * (sizeof(unsigned char*) + sizeof(int)) + 1 + 16;
+	}
+	size += 2048 + strlen(ctx->endpoint) + 2 * strlen(ctx->region) + credentialsScratchSize(ctx);
+
+	return size;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPutRecordsSink(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	return putRecords(ctx, streamName, recordCount, partitionKeyArray, NULL, dataArray, lenArray, NULL, respHeader, respBody, errorMsg);
+}
+
+/******************************************************************************************/
+/* DescribeStream, starting the shard list after exclusiveStartShardId if it is not NULL. */
+/******************************************************************************************/
+int describeStream(const AWSContext *ctx, const char *streamName, const char *exclusiveStartShardId, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	static const char *target = "Kinesis_20131202.DescribeStream";
+	
+	/* make date strings */
+	char longDate[17], shortDate[9];
+	makeDateStrings(longDate, shortDate);
+
+	/* make payload */
+	char payloadHash[65];
+	char *payload = makeDescribeStreamPayload(streamName, exclusiveStartShardId, payloadHash);
+	
+	/* make Authorization header, signed with today's cached signing key */
+	unsigned char signingKey[32];
+	const Credentials *credentials = currentCredentials(ctx);
+	getSigningKey(ctx, credentials, shortDate, signingKey);
+	char *authHeader = makeAuthHeader(signingKey, credentials->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payloadHash, jsonContentType, NULL);
+	
+	/* make all headers */
+	AWSHeaders *headers = makeAWSHeaders(authHeader, credentials->sessionToken, target, longDate, jsonContentType, NULL);
+		
+	/* do the post */
+	int retcode = curlDoPost(ctx->pool, ctx->url, headers, payload, strlen(payload), respHeader, respBody, errorMsg);
+	
+	/* cleanup */
+	free(payload);
+	free(authHeader);
+	freeAWSHeaders(headers);
+	
+	return retcode;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktDescribeStreamSink(const AWSContext *ctx, const char *streamName, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	return describeStream(ctx, streamName, NULL, respHeader, respBody, errorMsg);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktListStreamsSink(const AWSContext *ctx, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	static const char *target = "Kinesis_20131202.ListStreams";
+	
+	/* make date strings */
+	char longDate[17], shortDate[9];
+	makeDateStrings(longDate, shortDate);
+
+	/* make payload */
+	char payloadHash[65];
+	char *payload = makeListStreamsPayload(payloadHash);
+	
+	/* make Authorization header, signed with today's cached signing key */
+	unsigned char signingKey[32];
+	const Credentials *credentials = currentCredentials(ctx);
+	getSigningKey(ctx, credentials, shortDate, signingKey);
+	char *authHeader = makeAuthHeader(signingKey, credentials->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payloadHash, jsonContentType, NULL);
+	
+	/* make all headers */
+	AWSHeaders *headers = makeAWSHeaders(authHeader, credentials->sessionToken, target, longDate, jsonContentType, NULL);
+		
+	/* do the post */
+	int retcode = curlDoPost(ctx->pool, ctx->url, headers, payload, strlen(payload), respHeader, respBody, errorMsg);
+	
+	/* cleanup */
+	free(payload);
+	free(authHeader);
+	freeAWSHeaders(headers);
+	
+	return retcode;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktGetShardIteratorSink(const AWSContext *ctx, const char *streamName, const char *shardId, const char *iteratorType, const char *startingSequenceNumber, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	static const char *target = "Kinesis_20131202.GetShardIterator";
+	
+	/* make date strings */
+	char longDate[17], shortDate[9];
+	makeDateStrings(longDate, shortDate);
+
+	/* make payload */
+	char payloadHash[65];
+	char *payload = makeGetShardIteratorPayload(streamName, shardId, iteratorType, startingSequenceNumber, payloadHash);
+	
+	/* make Authorization header, signed with today's cached signing key */
+	unsigned char signingKey[32];
+	const Credentials *credentials = currentCredentials(ctx);
+	getSigningKey(ctx, credentials, shortDate, signingKey);
+	char *authHeader = makeAuthHeader(signingKey, credentials->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payloadHash, jsonContentType, NULL);
+	
+	/* make all headers */
+	AWSHeaders *headers = makeAWSHeaders(authHeader, credentials->sessionToken, target, longDate, jsonContentType, NULL);
+		
+	/* do the post */
+	int retcode = curlDoPost(ctx->pool, ctx->url, headers, payload, strlen(payload), respHeader, respBody, errorMsg);
+	
+	/* cleanup */
+	free(payload);
+	free(authHeader);
+	freeAWSHeaders(headers);
+	
+	return retcode;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktGetRecordsSink(const AWSContext *ctx, const char *shardIterator, int limit, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	static const char *target = "Kinesis_20131202.GetRecords";
+	
+	/* make date strings */
+	char longDate[17], shortDate[9];
+	makeDateStrings(longDate, shortDate);
+
+	/* make payload */
+	char payloadHash[65];
+	char *payload = makeGetRecordsPayload(shardIterator, limit, payloadHash);
+	
+	/* make Authorization header, signed with today's cached signing key */
+	unsigned char signingKey[32];
+	const Credentials *credentials = currentCredentials(ctx);
+	getSigningKey(ctx, credentials, shortDate, signingKey);
+	char *authHeader = makeAuthHeader(signingKey, credentials->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payloadHash, jsonContentType, NULL);
+	
+	/* make all headers */
+	AWSHeaders *headers = makeAWSHeaders(authHeader, credentials->sessionToken, target, longDate, jsonContentType, NULL);
+		
+	/* do the post */
+	int retcode = curlDoPost(ctx->pool, ctx->url, headers, payload, strlen(payload), respHeader, respBody, errorMsg);
+	
+	/* cleanup */
+	free(payload);
+	free(authHeader);
+	freeAWSHeaders(headers);
+	
+	return retcode;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktRegisterStreamConsumerSink(const AWSContext *ctx, const char *streamARN, const char *consumerName, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg){
+
+	static const char *target = "Kinesis_20131202.RegisterStreamConsumer";
+	
+	/* make date strings */
+	char longDate[17], shortDate[9];
+	makeDateStrings(longDate, shortDate);
+
+	/* make payload */
+	char payloadHash[65];
+	char *payload = makeRegisterStreamConsumerPayload(streamARN, consumerName, payloadHash);
 	
-	free(ctx->key);
-	free(ctx->keyId);
-	free(ctx->sessionToken);
-	free(ctx->region);
-	free(ctx->endpoint);
-	free(ctx->url);
-	free(ctx);
+	/* make Authorization header, signed with today's cached signing key */
+	unsigned char signingKey[32];
+	const Credentials *credentials = currentCredentials(ctx);
+	getSigningKey(ctx, credentials, shortDate, signingKey);
+	char *authHeader = makeAuthHeader(signingKey, credentials->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payloadHash, jsonContentType, NULL);
+	
+	/* make all headers */
+	AWSHeaders *headers = makeAWSHeaders(authHeader, credentials->sessionToken, target, longDate, jsonContentType, NULL);
+		
+	/* do the post */
+	int retcode = curlDoPost(ctx->pool, ctx->url, headers, payload, strlen(payload), respHeader, respBody, errorMsg);
+	
+	/* cleanup */
+	free(payload);
+	free(authHeader);
+	freeAWSHeaders(headers);
+	
+	return retcode;
+}
+
+void cborSinkToResponse(httpResponseSink *body, httpResponse *response);
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPutRecord(const AWSContext *ctx, const char *streamName, const char *partitionKey, const unsigned char *data, int len, httpResponse *respHeader, httpResponse *respBody, char *errorMsg){
+
+	httpResponseSink headerSink, bodySink;
+
+	/* CBOR responses are collected whole so they can be converted to JSON before being cut to fit respBody */
+	if(ctx->cbor && respBody){
+		ktInitResponseSink(&bodySink);
+		int retcode = ktPutRecordSink(ctx, streamName, partitionKey, data, len, fixedResponseSink(respHeader, &headerSink), &bodySink, errorMsg);
+		cborSinkToResponse(&bodySink, respBody);
+		return retcode;
+	}
+
+	return ktPutRecordSink(ctx, streamName, partitionKey, data, len, fixedResponseSink(respHeader, &headerSink), fixedResponseSink(respBody, &bodySink), errorMsg);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPutRecords(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, httpResponse *respHeader, httpResponse *respBody, char *errorMsg){
+
+	httpResponseSink headerSink, bodySink;
+
+	/* as ktPutRecord */
+	if(ctx->cbor && respBody){
+		ktInitResponseSink(&bodySink);
+		int retcode = putRecords(ctx, streamName, recordCount, partitionKeyArray, NULL, dataArray, lenArray, NULL, fixedResponseSink(respHeader, &headerSink), &bodySink, errorMsg);
+		cborSinkToResponse(&bodySink, respBody);
+		return retcode;
+	}
+
+	return putRecords(ctx, streamName, recordCount, partitionKeyArray, NULL, dataArray, lenArray, NULL, fixedResponseSink(respHeader, &headerSink), fixedResponseSink(respBody, &bodySink), errorMsg);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktDescribeStream(const AWSContext *ctx, const char *streamName, httpResponse *respHeader, httpResponse *respBody, char *errorMsg){
+
+	httpResponseSink headerSink, bodySink;
+
+	return ktDescribeStreamSink(ctx, streamName, fixedResponseSink(respHeader, &headerSink), fixedResponseSink(respBody, &bodySink), errorMsg);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktListStreams(const AWSContext *ctx, httpResponse *respHeader, httpResponse *respBody, char *errorMsg){
+
+	httpResponseSink headerSink, bodySink;
+
+	return ktListStreamsSink(ctx, fixedResponseSink(respHeader, &headerSink), fixedResponseSink(respBody, &bodySink), errorMsg);
+}
+
+/* PutRecords request limits: records per call and bytes of data plus partition keys per call */
+#define MAX_PUT_RECORDS_COUNT 500
+#define MAX_PUT_RECORDS_BYTES (5*1024*1024)
+
+/* single record limits: partition key chars and data bytes */
+#define MAX_PARTITION_KEY_LENGTH 256
+#define MAX_RECORD_BYTES (1024*1024)
+
+/*****************************************************************************************************************/
+/* KPL aggregation per https://github.com/awslabs/amazon-kinesis-producer/blob/master/aggregation-format.md .    */
+/* An aggregated record is the magic number, a protobuf encoded AggregatedRecord and the MD5 of the protobuf:   */
+/*   message AggregatedRecord { repeated string partition_key_table = 1; repeated string explicit_hash_key_table = 2; */
+/*                              repeated Record records = 3; }                                                  */
+/*   message Record { required uint64 partition_key_index = 1; optional uint64 explicit_hash_key_index = 2;     */
+/*                    required bytes data = 3; }                                                                */
+/* Partition keys and explicit hash keys are each stored once per aggregated record in a de-duplicated table.   */
+/*****************************************************************************************************************/
+static const unsigned char kplMagic[4] = {0xF3, 0x89, 0x9A, 0xC2};
+
+/* whether data starts as an aggregated record does */
+int isAggregatedRecord(const unsigned char *data, int len){
+
+	return len >= (int)sizeof(kplMagic) && memcmp(data, kplMagic, sizeof(kplMagic)) == 0;
+}
+
+/* largest aggregated record, leaving room for the Kinesis partition key within the 1 MiB record limit */
+#define MAX_AGGREGATED_RECORD_BYTES (1024*1024 - 256)
+
+/* bytes in a protobuf varint */
+static size_t varintLength(uint64_t v){
+
+	size_t n = 1;
+	while(v >= 0x80){
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+static unsigned char* writeVarint(unsigned char *p, uint64_t v){
+
+	while(v >= 0x80){
+		*p++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (unsigned char)v;
+	return p;
+}
+
+/* field tag followed by a length delimited value */
+static unsigned char* writeLengthDelimited(unsigned char *p, int field, const void *data, size_t len){
+
+	*p++ = (unsigned char)(field << 3 | 2);
+	p = writeVarint(p, len);
+	memcpy(p, data, len);
+	return p + len;
+}
+
+/* bytes taken by a length delimited field with a single byte tag */
+static size_t lengthDelimitedSize(size_t len){
+
+	return 1 + varintLength(len) + len;
+}
+
+/************************************************************************************************************/
+/* 128 bit hash key Kinesis maps a partition key to: its MD5, read as a big endian unsigned integer.       */
+/************************************************************************************************************/
+void makeHashKey(const char *partitionKey, unsigned char *hashKey){
+
+	if(!EVP_Digest(partitionKey, strlen(partitionKey), hashKey, NULL, EVP_md5(), NULL))
+		errorExit("OpenSSL library error", "MD5 failed");
+}
+
+/*******************************************************************************************************/
+/* Parse a decimal hash key, as in DescribeStream HashKeyRanges, to 16 big endian bytes. Returns 0 if */
+/* it isn't a decimal number.                                                                         */
+/*******************************************************************************************************/
+int parseHashKey(const char *decimal, unsigned char *hashKey){
+
+	memset(hashKey, 0, 16);
+
+	if(!*decimal)
+		return 0;
+
+	for(; *decimal; decimal++){
+
+		if(*decimal < '0' || *decimal > '9')
+			return 0;
+
+		/* hashKey = hashKey * 10 + digit */
+		int carry = *decimal - '0';
+		int i;
+		for(i=15; i>=0; i--){
+			int v = hashKey[i] * 10 + carry;
+			hashKey[i] = v & 0xFF;
+			carry = v >> 8;
+		}
+	}
+
+	return 1;
+}
+
+/***********************************************************************************************************/
+/* Decimal explicit hash key for a partition key, as Kinesis computes it: the MD5 of the key read as a     */
+/* 128 bit unsigned big endian integer. hashKey must hold 40 chars.                                        */
+/***********************************************************************************************************/
+void makeExplicitHashKey(const char *partitionKey, char *hashKey){
+
+	unsigned char digest[16];
+	char digits[40];
+	int n = 0, i;
+
+	makeHashKey(partitionKey, digest);
+
+	/* repeated long division of the 16 byte number by 10 */
+	int nonZero;
+	do{
+		int remainder = 0;
+		nonZero = 0;
+		for(i=0; i<16; i++){
+			int v = remainder * 256 + digest[i];
+			digest[i] = v / 10;
+			remainder = v % 10;
+			nonZero |= digest[i];
+		}
+		digits[n++] = '0' + remainder;
+	}while(nonZero);
+
+	for(i=0; i<n; i++)
+		hashKey[i] = digits[n - 1 - i];
+	hashKey[n] = '\0';
+}
+
+/**********************************************************************************************************/
+/* StringTable de-duplicates the partition or explicit hash keys of one aggregated record. An open        */
+/* addressed hash of key to table index, cleared between aggregated records through the list of entries. */
+/**********************************************************************************************************/
+typedef struct{
+	const char **slotKeys;
+	int *slotIndices;
+	int slots;
+	const char **entries;
+	int count;
+	size_t encodedSize;
+}StringTable;
+
+static void initStringTable(StringTable *table, int maxEntries){
+
+	table->slots = 16;
+	while(table->slots < 2 * maxEntries)
+		table->slots <<= 1;
+	table->slotKeys = calloc(table->slots, sizeof(char*));
+	if(!table->slotKeys)
+		errorExit("Fatal Error", "Cannot malloc memory");
+	table->slotIndices = malloct(table->slots * sizeof(int));
+	table->entries = malloct(maxEntries * sizeof(char*));
+	table->count = 0;
+	table->encodedSize = 0;
+}
+
+static void freeStringTable(StringTable *table){
+
+	free(table->slotKeys);
+	free(table->slotIndices);
+	free(table->entries);
+}
+
+static int stringTableSlot(const StringTable *table, const char *key){
+
+	uint32_t h = 2166136261u;
+	const char *c;
+	for(c=key; *c; c++)
+		h = (h ^ (unsigned char)*c) * 16777619u;
+
+	int slot = h & (table->slots - 1);
+	while(table->slotKeys[slot] && strcmp(table->slotKeys[slot], key) != 0)
+		slot = (slot + 1) & (table->slots - 1);
+
+	return slot;
+}
+
+/* index of key in the table, or -1 if it isn't there yet */
+static int findStringTable(const StringTable *table, const char *key){
+
+	int slot = stringTableSlot(table, key);
+
+	return table->slotKeys[slot] ? table->slotIndices[slot] : -1;
+}
+
+/* index of key in the table, adding it if it isn't there yet */
+static int addStringTable(StringTable *table, const char *key){
+
+	int slot = stringTableSlot(table, key);
+
+	if(!table->slotKeys[slot]){
+		table->slotKeys[slot] = key;
+		table->slotIndices[slot] = table->count;
+		table->entries[table->count++] = key;
+		table->encodedSize += lengthDelimitedSize(strlen(key));
+	}
+
+	return table->slotIndices[slot];
+}
+
+static void clearStringTable(StringTable *table){
+
+	int i;
+	for(i=0; i<table->count; i++)
+		table->slotKeys[stringTableSlot(table, table->entries[i])] = NULL;
+	table->count = 0;
+	table->encodedSize = 0;
+}
+
+/* encoded size of one Record message, excluding its own tag and length */
+static size_t aggregatedEntrySize(int partitionKeyIndex, int explicitHashKeyIndex, int len){
+
+	size_t size = 1 + varintLength(partitionKeyIndex) + lengthDelimitedSize(len);
+
+	if(explicitHashKeyIndex >= 0)
+		size += 1 + varintLength(explicitHashKeyIndex);
+
+	return size;
+}
+
+/**************************************************************************************************************/
+/* Encode records first..first+count-1 as one aggregated record, with the keys already added to the tables.  */
+/* size is the protobuf size. Caller frees returned buffer, which is 4 + size + 16 bytes long.              */
+/**************************************************************************************************************/
+static unsigned char* makeAggregatedRecord(const StringTable *partitionKeys, const StringTable *explicitHashKeys, int first, int count, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, size_t size){
+
+	unsigned char *record = malloct(sizeof(kplMagic) + size + 16);
+	unsigned char *p = record;
+
+	memcpy(p, kplMagic, sizeof(kplMagic));
+	p += sizeof(kplMagic);
+
+	unsigned char *protobuf = p;
+
+	int i;
+	for(i=0; i<partitionKeys->count; i++)
+		p = writeLengthDelimited(p, 1, partitionKeys->entries[i], strlen(partitionKeys->entries[i]));
+
+	for(i=0; i<explicitHashKeys->count; i++)
+		p = writeLengthDelimited(p, 2, explicitHashKeys->entries[i], strlen(explicitHashKeys->entries[i]));
+
+	for(i=first; i<first+count; i++){
+
+		int partitionKeyIndex = findStringTable(partitionKeys, partitionKeyArray[i]);
+		int explicitHashKeyIndex = -1;
+		if(explicitHashKeyArray && explicitHashKeyArray[i])
+			explicitHashKeyIndex = findStringTable(explicitHashKeys, explicitHashKeyArray[i]);
+
+		*p++ = 3 << 3 | 2;
+		p = writeVarint(p, aggregatedEntrySize(partitionKeyIndex, explicitHashKeyIndex, lenArray[i]));
+
+		*p++ = 1 << 3;
+		p = writeVarint(p, partitionKeyIndex);
+
+		if(explicitHashKeyIndex >= 0){
+			*p++ = 2 << 3;
+			p = writeVarint(p, explicitHashKeyIndex);
+		}
+
+		p = writeLengthDelimited(p, 3, dataArray[i], lenArray[i]);
+	}
+
+	if(!EVP_Digest(protobuf, size, p, NULL, EVP_md5(), NULL))
+		errorExit("OpenSSL library error", "MD5 failed");
+
+	return record;
+}
+
+/**************************************************************************************************************/
+/* Kinesis records built by aggregateRecords. Each has the partition key of its first user record and an     */
+/* explicit hash key (that record's, or one computed from its partition key) so it lands on the same shard   */
+/* the first user record would have. owned marks data allocated here rather than borrowed from the caller.  */
+/* recordArray lists the user records in the order they were packed; aggregated record i holds those at     */
+/* firstArray[i] to firstArray[i] + countArray[i] - 1 in it.                                                 */
+/**************************************************************************************************************/
+typedef struct{
+	int count;
+	char **partitionKeyArray;
+	char **explicitHashKeyArray;
+	unsigned char **dataArray;
+	int *lenArray;
+	char *owned;
+	int *firstArray;
+	int *countArray;
+	int *recordArray;
+}AggregatedRecords;
+
+static void freeAggregatedRecords(AggregatedRecords *records){
+
+	int i;
+	for(i=0; i<records->count; i++){
+		free(records->explicitHashKeyArray[i]);
+		if(records->owned[i])
+			free(records->dataArray[i]);
+	}
+
+	free(records->partitionKeyArray);
+	free(records->explicitHashKeyArray);
+	free(records->dataArray);
+	free(records->lenArray);
+	free(records->owned);
+	free(records->firstArray);
+	free(records->countArray);
+	free(records->recordArray);
+}
+
+int* aggregationGroups(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray);
+
+/*****************************************************************************************************************/
+/* Pack user records, in order, into as few aggregated records of at most MAX_AGGREGATED_RECORD_BYTES as         */
+/* possible. A run of one record (a lone or oversized record) is passed through unaggregated, as the KPL does.  */
+/* If groupArray is given, only records of the same group, from aggregationGroups, share an aggregated record;  */
+/* each group's records are gathered, keeping their order, and the groups packed in order of their ids.         */
+/* With a compressor, user records that may share an aggregated record are compressed before they are packed,   */
+/* so consumers find them compressed once de-aggregated; lone records pass through to be compressed when sent.  */
+/*****************************************************************************************************************/
+static void aggregateRecords(int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, const int *groupArray, const Compressor *compressor, AggregatedRecords *out){
+
+	int i;
+	out->recordArray = malloct((recordCount ? recordCount : 1) * sizeof(int));
+	for(i=0; i<recordCount; i++)
+		out->recordArray[i] = i;
+
+	/* gather each group's records with a counting sort, then pack the records in that order */
+	char **gatheredKeys = NULL, **gatheredHashKeys = NULL;
+	unsigned char **gatheredData = NULL;
+	int *gatheredLens = NULL;
+	if(groupArray && recordCount > 0){
+
+		int groups = 0;
+		for(i=0; i<recordCount; i++)
+			if(groupArray[i] >= groups)
+				groups = groupArray[i] + 1;
+
+		int *groupStart = calloc(groups + 1, sizeof(int));
+		if(!groupStart)
+			errorExit("Fatal Error", "Cannot malloc memory");
+		for(i=0; i<recordCount; i++)
+			groupStart[groupArray[i] + 1]++;
+		for(i=0; i<groups; i++)
+			groupStart[i + 1] += groupStart[i];
+		for(i=0; i<recordCount; i++)
+			out->recordArray[groupStart[groupArray[i]]++] = i;
+		free(groupStart);
+
+		gatheredKeys = malloct(recordCount * sizeof(char*));
+		gatheredHashKeys = explicitHashKeyArray ? malloct(recordCount * sizeof(char*)) : NULL;
+		gatheredData = malloct(recordCount * sizeof(unsigned char*));
+		gatheredLens = malloct(recordCount * sizeof(int));
+		for(i=0; i<recordCount; i++){
+			int r = out->recordArray[i];
+			gatheredKeys[i] = partitionKeyArray[r];
+			if(gatheredHashKeys)
+				gatheredHashKeys[i] = explicitHashKeyArray[r];
+			gatheredData[i] = dataArray[r];
+			gatheredLens[i] = lenArray[r];
+		}
+		partitionKeyArray = gatheredKeys;
+		explicitHashKeyArray = gatheredHashKeys;
+		dataArray = gatheredData;
+		lenArray = gatheredLens;
+	}
+
+	/* the data packed: compressed where a record has a neighbour of its group, else the record itself */
+	unsigned char * const *packData = dataArray;
+	const int *packLens = lenArray;
+	unsigned char **compressedData = NULL;
+	int *compressedLens = NULL;
+	if(compressor && recordCount > 1){
+		compressedData = malloct(recordCount * sizeof(unsigned char*));
+		compressedLens = malloct(recordCount * sizeof(int));
+		for(i=0; i<recordCount; i++){
+			int g = groupArray ? groupArray[out->recordArray[i]] : 0;
+			int shared = !groupArray || (i > 0 && groupArray[out->recordArray[i-1]] == g) || (i + 1 < recordCount && groupArray[out->recordArray[i+1]] == g);
+			if(shared){
+				compressedData[i] = malloct(lenArray[i] + KT_CODEC_HEADER_SIZE);
+				compressedLens[i] = ktCompressRecord(compressor, dataArray[i], lenArray[i], compressedData[i]);
+			}
+			else{
+				compressedData[i] = NULL;
+				compressedLens[i] = lenArray[i];
+			}
+		}
+		packData = compressedData;
+		packLens = compressedLens;
+	}
+
+	out->count = 0;
+	out->partitionKeyArray = malloct(recordCount * sizeof(char*));
+	out->explicitHashKeyArray = malloct(recordCount * sizeof(char*));
+	out->dataArray = malloct(recordCount * sizeof(unsigned char*));
+	out->lenArray = malloct(recordCount * sizeof(int));
+	out->owned = malloct(recordCount);
+	out->firstArray = malloct(recordCount * sizeof(int));
+	out->countArray = malloct(recordCount * sizeof(int));
+
+	StringTable partitionKeys, explicitHashKeys;
+	initStringTable(&partitionKeys, recordCount);
+	initStringTable(&explicitHashKeys, recordCount);
+
+	int first = 0;
+	while(first < recordCount){
+
+		/* grow the run while the encoded size, including the magic number and MD5, stays under the limit */
+		size_t entriesSize = 0;
+		int count = 0;
+
+		while(first + count < recordCount){
+
+			int i = first + count;
+			const char *explicitHashKey = explicitHashKeyArray ? explicitHashKeyArray[i] : NULL;
+
+			int partitionKeyIndex = findStringTable(&partitionKeys, partitionKeyArray[i]);
+			size_t keysSize = partitionKeys.encodedSize + explicitHashKeys.encodedSize;
+			if(partitionKeyIndex < 0){
+				partitionKeyIndex = partitionKeys.count;
+				keysSize += lengthDelimitedSize(strlen(partitionKeyArray[i]));
+			}
+
+			int explicitHashKeyIndex = -1;
+			if(explicitHashKey){
+				explicitHashKeyIndex = findStringTable(&explicitHashKeys, explicitHashKey);
+				if(explicitHashKeyIndex < 0){
+					explicitHashKeyIndex = explicitHashKeys.count;
+					keysSize += lengthDelimitedSize(strlen(explicitHashKey));
+				}
+			}
+
+			size_t entrySize = lengthDelimitedSize(aggregatedEntrySize(partitionKeyIndex, explicitHashKeyIndex, packLens[i]));
+
+			if(count > 0 && sizeof(kplMagic) + keysSize + entriesSize + entrySize + 16 > MAX_AGGREGATED_RECORD_BYTES)
+				break;
+
+			/* records of other groups may go to other shards */
+			if(count > 0 && groupArray && groupArray[out->recordArray[i]] != groupArray[out->recordArray[first]])
+				break;
+
+			addStringTable(&partitionKeys, partitionKeyArray[i]);
+			if(explicitHashKey)
+				addStringTable(&explicitHashKeys, explicitHashKey);
+			entriesSize += entrySize;
+			count++;
+		}
+
+		int n = out->count++;
+		out->firstArray[n] = first;
+		out->countArray[n] = count;
+		out->partitionKeyArray[n] = partitionKeyArray[first];
+		if(explicitHashKeyArray && explicitHashKeyArray[first]){
+			out->explicitHashKeyArray[n] = malloct(strlen(explicitHashKeyArray[first]) + 1);
+			strcpy(out->explicitHashKeyArray[n], explicitHashKeyArray[first]);
+		}
+		else{
+			out->explicitHashKeyArray[n] = malloct(40);
+			makeExplicitHashKey(partitionKeyArray[first], out->explicitHashKeyArray[n]);
+		}
+
+		if(count == 1){
+			out->dataArray[n] = dataArray[first];
+			out->lenArray[n] = lenArray[first];
+			out->owned[n] = 0;
+		}
+		else{
+			size_t size = partitionKeys.encodedSize + explicitHashKeys.encodedSize + entriesSize;
+			out->dataArray[n] = makeAggregatedRecord(&partitionKeys, &explicitHashKeys, first, count, partitionKeyArray, explicitHashKeyArray, packData, packLens, size);
+			out->lenArray[n] = sizeof(kplMagic) + size + 16;
+			out->owned[n] = 1;
+		}
+
+		clearStringTable(&partitionKeys);
+		clearStringTable(&explicitHashKeys);
+		first += count;
+	}
+
+	freeStringTable(&partitionKeys);
+	freeStringTable(&explicitHashKeys);
+	free(gatheredKeys);
+	free(gatheredHashKeys);
+	free(gatheredData);
+	free(gatheredLens);
+	if(compressedData){
+		for(i=0; i<recordCount; i++)
+			free(compressedData[i]);
+		free(compressedData);
+		free(compressedLens);
+	}
+}
+
+/*****************************************************************************************************************/
+/* aggregateRecords without a compressor, for kttest to decode what it packs. The Kinesis records' data and      */
+/* lengths go in *dataArrayOut and *lenArrayOut; the caller frees both arrays and each record's data, copied     */
+/* here for records passed through unaggregated. Returns the number of Kinesis records.                         */
+/*****************************************************************************************************************/
+int aggregateRecordsData(int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, const int *groupArray, unsigned char ***dataArrayOut, int **lenArrayOut){
+
+	AggregatedRecords records;
+	aggregateRecords(recordCount, partitionKeyArray, explicitHashKeyArray, dataArray, lenArray, groupArray, NULL, &records);
+
+	*dataArrayOut = malloct((records.count ? records.count : 1) * sizeof(unsigned char*));
+	*lenArrayOut = malloct((records.count ? records.count : 1) * sizeof(int));
+
+	int i;
+	for(i=0; i<records.count; i++){
+		(*lenArrayOut)[i] = records.lenArray[i];
+		if(records.owned[i]){
+			(*dataArrayOut)[i] = records.dataArray[i];
+			records.owned[i] = 0;
+		}
+		else{
+			(*dataArrayOut)[i] = malloct(records.lenArray[i] ? records.lenArray[i] : 1);
+			memcpy((*dataArrayOut)[i], records.dataArray[i], records.lenArray[i]);
+		}
+	}
+
+	int count = records.count;
+	freeAggregatedRecords(&records);
+
+	return count;
+}
+
+/**************************************************************************************************/
+/* Number of leading records, at least one, that fit in one PutRecords call within its limits. */
+/**************************************************************************************************/
+static int putRecordsBatchSize(int recordCount, char * const *partitionKeyArray, const int *lenArray){
+
+	int count = 0;
+	long bytes = 0;
+
+	while(count < recordCount && count < MAX_PUT_RECORDS_COUNT){
+		long b = lenArray[count] + strlen(partitionKeyArray[count]);
+		if(count > 0 && bytes + b > MAX_PUT_RECORDS_BYTES)
+			break;
+		bytes += b;
+		count++;
+	}
+
+	return count;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPutRecordsAggregated(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, httpResponse *respHeader, httpResponse *respBody, char *errorMsg){
+
+	int *groups = aggregationGroups(ctx, streamName, recordCount, partitionKeyArray, explicitHashKeyArray);
+	AggregatedRecords records;
+	aggregateRecords(recordCount, partitionKeyArray, explicitHashKeyArray, dataArray, lenArray, groups, ctx->compressor, &records);
+	free(groups);
+
+	httpResponseSink headerSink, bodySink;
+
+	/* CBOR responses are collected whole, as in ktPutRecord */
+	int cborBody = ctx->cbor && respBody;
+	if(cborBody)
+		ktInitResponseSink(&bodySink);
+
+	/* send the aggregated records in as many PutRecords calls as the request limits need */
+	int retcode = 200;
+	int first = 0;
+	while(first < records.count && retcode == 200){
+
+		int count = putRecordsBatchSize(records.count - first, records.partitionKeyArray + first, records.lenArray + first);
+
+		retcode = putRecords(ctx, streamName, count, records.partitionKeyArray + first, records.explicitHashKeyArray + first, records.dataArray + first, records.lenArray + first, NULL, fixedResponseSink(respHeader, &headerSink), cborBody ? &bodySink : fixedResponseSink(respBody, &bodySink), errorMsg);
+		first += count;
+	}
+
+	if(cborBody)
+		cborSinkToResponse(&bodySink, respBody);
+	freeAggregatedRecords(&records);
+
+	return retcode;
+}
+
+/*****************************************************************************************************************/
+/* Minimal read only JSON helpers for picking values out of responses. Values are located in place and skipped */
+/* over without building a tree. All take the end of the text so responses need not be null terminated.       */
+/*****************************************************************************************************************/
+static const char* jsonSkipSpace(const char *p, const char *end){
+
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+	return p;
+}
+
+/* pointer just past the value starting at p, or NULL if it is malformed */
+static const char* jsonSkipValue(const char *p, const char *end){
+
+	p = jsonSkipSpace(p, end);
+	if(p >= end)
+		return NULL;
+
+	if(*p == '"'){
+		for(p++; p < end; p++){
+			if(*p == '\\')
+				p++;
+			else if(*p == '"')
+				return p + 1;
+		}
+		return NULL;
+	}
+
+	if(*p == '{' || *p == '['){
+		int depth = 0;
+		while(p < end){
+			if(*p == '"'){
+				p = jsonSkipValue(p, end);
+				if(!p)
+					return NULL;
+				continue;
+			}
+			if(*p == '{' || *p == '[')
+				depth++;
+			else if(*p == '}' || *p == ']'){
+				if(--depth == 0)
+					return p + 1;
+			}
+			p++;
+		}
+		return NULL;
+	}
+
+	/* number, true, false or null */
+	const char *start = p;
+	while(p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+		p++;
+	return p > start ? p : NULL;
+}
+
+/* the value of member key in the object at p, or NULL if p isn't an object or has no such member */
+const char* jsonFindMember(const char *p, const char *end, const char *key){
+
+	size_t keyLen = strlen(key);
+
+	p = jsonSkipSpace(p, end);
+	if(p >= end || *p != '{')
+		return NULL;
+	p++;
+
+	for(;;){
+		p = jsonSkipSpace(p, end);
+		if(p >= end || *p != '"')
+			return NULL;
+
+		const char *name = p + 1;
+		p = jsonSkipValue(p, end);
+		if(!p)
+			return NULL;
+		int match = (size_t)(p - 1 - name) == keyLen && memcmp(name, key, keyLen) == 0;
+
+		p = jsonSkipSpace(p, end);
+		if(p >= end || *p != ':')
+			return NULL;
+		p = jsonSkipSpace(p + 1, end);
+
+		if(match)
+			return p;
+
+		p = jsonSkipValue(p, end);
+		if(!p)
+			return NULL;
+		p = jsonSkipSpace(p, end);
+		if(p >= end || *p != ',')
+			return NULL;
+		p++;
+	}
+}
+
+/* first element of the array at p, or NULL if p isn't an array or it is empty */
+const char* jsonArrayFirst(const char *p, const char *end){
+
+	p = jsonSkipSpace(p, end);
+	if(p >= end || *p != '[')
+		return NULL;
+	p = jsonSkipSpace(p + 1, end);
+
+	return (p < end && *p != ']') ? p : NULL;
+}
+
+/* element following the array element at p, or NULL after the last */
+const char* jsonArrayNext(const char *p, const char *end){
+
+	p = jsonSkipValue(p, end);
+	if(!p)
+		return NULL;
+	p = jsonSkipSpace(p, end);
+	if(p >= end || *p != ',')
+		return NULL;
+
+	return jsonSkipSpace(p + 1, end);
+}
+
+/*********************************************************************************************************/
+/* Copy the string at p into out, unescaped and null terminated, truncating to fit outSize. \u escapes  */
+/* are written as UTF-8. Returns the number of chars written, or -1 if p isn't a string.                */
+/*********************************************************************************************************/
+int jsonCopyString(const char *p, const char *end, char *out, size_t outSize){
+
+	p = jsonSkipSpace(p, end);
+	if(p >= end || *p != '"' || outSize == 0)
+		return -1;
+
+	size_t n = 0;
+	for(p++; p < end && *p != '"'; p++){
+
+		char utf8[4];
+		int len = 1;
+		utf8[0] = *p;
+
+		if(*p == '\\' && p + 1 < end){
+			p++;
+			switch(*p){
+				case 'b': utf8[0] = '\b'; break;
+				case 'f': utf8[0] = '\f'; break;
+				case 'n': utf8[0] = '\n'; break;
+				case 'r': utf8[0] = '\r'; break;
+				case 't': utf8[0] = '\t'; break;
+				case 'u':{
+					unsigned int c = 0;
+					int i;
+					for(i=1; i<=4 && p + i < end; i++){
+						char h = p[i];
+						c = c * 16 + (h >= 'a' ? h - 'a' + 10 : h >= 'A' ? h - 'A' + 10 : h - '0');
+					}
+					p += 4;
+					if(c < 0x80)
+						utf8[0] = c;
+					else if(c < 0x800){
+						utf8[0] = 0xC0 | c >> 6;
+						utf8[1] = 0x80 | (c & 0x3F);
+						len = 2;
+					}
+					else{
+						utf8[0] = 0xE0 | c >> 12;
+						utf8[1] = 0x80 | (c >> 6 & 0x3F);
+						utf8[2] = 0x80 | (c & 0x3F);
+						len = 3;
+					}
+					break;
+				}
+				default: utf8[0] = *p; break;
+			}
+		}
+
+		if(n + len >= outSize)
+			break;
+		memcpy(out + n, utf8, len);
+		n += len;
+	}
+
+	out[n] = '\0';
+
+	return n;
+}
+
+/**************************************************************************************************/
+/* Copy the string member key of the object at p into out as jsonCopyString. Returns -1 if absent */
+/**************************************************************************************************/
+int jsonCopyMember(const char *p, const char *end, const char *key, char *out, size_t outSize){
+
+	const char *value = jsonFindMember(p, end, key);
+
+	return value ? jsonCopyString(value, end, out, outSize) : -1;
+}
+
+/*****************************************************************************************************************/
+/* CBOR to JSON conversion for responses to the CBOR protocol, so they can be read with the JSON helpers above. */
+/* Maps, arrays, integers, floats, true, false and null convert directly; byte strings become base64 strings as */
+/* the JSON protocol sends them; tags (e.g. epoch timestamps) are dropped leaving their value. Text map keys are */
+/* required, integer keys are quoted. Indefinite length items are accepted. Nesting is limited to CBOR_MAX_DEPTH. */
+/*****************************************************************************************************************/
+#define CBOR_MAX_DEPTH 32
+
+typedef struct{
+	const unsigned char *p;
+	const unsigned char *end;
+	char *json;
+	size_t len;
+	size_t capacity;
+}CBORConverter;
+
+/* make room for n more chars and a null terminator */
+static char* cborJSONSpace(CBORConverter *c, size_t n){
+
+	if(c->len + n + 1 > c->capacity){
+		while(c->len + n + 1 > c->capacity)
+			c->capacity = c->capacity ? 2 * c->capacity : 256;
+		c->json = realloc(c->json, c->capacity);
+		if(!c->json)
+			errorExit("Fatal error", "Out of memory");
+	}
+
+	return c->json + c->len;
+}
+
+static void cborJSONChars(CBORConverter *c, const char *s, size_t n){
+
+	memcpy(cborJSONSpace(c, n), s, n);
+	c->len += n;
+}
+
+/* escaped JSON string contents, without quotes */
+static void cborJSONEscaped(CBORConverter *c, const unsigned char *s, size_t n){
+
+	size_t i;
+	for(i=0; i<n; i++){
+		char *out = cborJSONSpace(c, 6);
+		if(s[i] == '"' || s[i] == '\\'){
+			out[0] = '\\';
+			out[1] = s[i];
+			c->len += 2;
+		}
+		else if(s[i] < 0x20)
+			c->len += sprintf(out, "\\u%04x", s[i]);
+		else{
+			out[0] = s[i];
+			c->len++;
+		}
+	}
+}
+
+/* read the head of the next item: its major type and additional info, and for info < 28 its value. 0 if truncated or reserved. */
+static int cborReadHead(CBORConverter *c, int *major, int *info, uint64_t *value){
+
+	if(c->p >= c->end)
+		return 0;
+
+	*major = *c->p >> 5;
+	*info = *c->p & 0x1f;
+	c->p++;
+
+	if(*info < 24){
+		*value = *info;
+		return 1;
+	}
+	if(*info == 31)
+		return 1;
+	if(*info > 27)
+		return 0;
+
+	int bytes = 1 << (*info - 24);
+	if(c->end - c->p < bytes)
+		return 0;
+
+	*value = 0;
+	int i;
+	for(i=0; i<bytes; i++)
+		*value = *value << 8 | *c->p++;
+
+	return 1;
+}
+
+/* append the chunks of a byte or text string of major type, definite or indefinite, to the malloc'd buffer *s of *n bytes */
+static int cborReadString(CBORConverter *c, int major, int info, uint64_t value, unsigned char **s, size_t *n){
+
+	if(info != 31){
+		if((uint64_t)(c->end - c->p) < value)
+			return 0;
+		*s = realloc(*s, *n + value + 1);
+		if(!*s)
+			errorExit("Fatal error", "Out of memory");
+		memcpy(*s + *n, c->p, value);
+		*n += value;
+		c->p += value;
+		return 1;
+	}
+
+	/* indefinite: definite chunks of the same major type until a break */
+	for(;;){
+		if(c->p < c->end && *c->p == 0xff){
+			c->p++;
+			return 1;
+		}
+		int chunkMajor, chunkInfo;
+		uint64_t chunkValue;
+		if(!cborReadHead(c, &chunkMajor, &chunkInfo, &chunkValue) || chunkMajor != major || chunkInfo == 31)
+			return 0;
+		if(!cborReadString(c, major, chunkInfo, chunkValue, s, n))
+			return 0;
+	}
+}
+
+/* half precision float, per RFC 8949 appendix D */
+static double cborHalfToDouble(unsigned int half){
+
+	int exponent = (half >> 10) & 0x1f;
+	uint32_t mantissa = half & 0x3ff;
+	double value;
+
+	if(exponent == 0)
+		value = mantissa / 16777216.0; /* subnormal, mantissa * 2^-24 */
+	else if(exponent == 31)
+		value = mantissa == 0 ? INFINITY : NAN;
+	else{
+		/* normal, rebias the exponent into a single precision float */
+		uint32_t bits = (uint32_t)(exponent - 15 + 127) << 23 | mantissa << 13;
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		value = f;
+	}
+
+	return half & 0x8000 ? -value : value;
+}
+
+static int cborItemToJSON(CBORConverter *c, int depth);
+
+/* the items of an array or the pairs of a map, count of them or up to a break if indefinite */
+static int cborContainerToJSON(CBORConverter *c, int isMap, int indefinite, uint64_t count, int depth){
+
+	cborJSONChars(c, isMap ? "{" : "[", 1);
+
+	uint64_t i;
+	for(i=0; indefinite || i<count; i++){
+
+		if(indefinite && c->p < c->end && *c->p == 0xff){
+			c->p++;
+			break;
+		}
+		if(i > 0)
+			cborJSONChars(c, ",", 1);
+
+		if(isMap){
+			/* JSON keys are strings, so integer keys are quoted */
+			if(c->p >= c->end)
+				return 0;
+			int keyMajor = *c->p >> 5;
+			if(keyMajor == CBOR_UINT || keyMajor == CBOR_NEGINT){
+				cborJSONChars(c, "\"", 1);
+				if(!cborItemToJSON(c, depth + 1))
+					return 0;
+				cborJSONChars(c, "\"", 1);
+			}
+			else if(keyMajor != CBOR_TEXT || !cborItemToJSON(c, depth + 1))
+				return 0;
+			cborJSONChars(c, ":", 1);
+		}
+
+		if(!cborItemToJSON(c, depth + 1))
+			return 0;
+	}
+
+	cborJSONChars(c, isMap ? "}" : "]", 1);
+
+	return 1;
+}
+
+static int cborItemToJSON(CBORConverter *c, int depth){
+
+	int major, info;
+	uint64_t value = 0;
+
+	if(depth > CBOR_MAX_DEPTH || !cborReadHead(c, &major, &info, &value))
+		return 0;
+	if(info == 31 && major != CBOR_BYTES && major != CBOR_TEXT && major != CBOR_ARRAY && major != CBOR_MAP)
+		return 0;
+
+	char number[32];
+
+	switch(major){
+
+		case CBOR_UINT:
+			cborJSONChars(c, number, sprintf(number, "%llu", (unsigned long long)value));
+			return 1;
+
+		case CBOR_NEGINT:
+			/* -1 - value, which for the largest value needs one more digit than 64 bits hold */
+			if(value == UINT64_MAX)
+				cborJSONChars(c, "-18446744073709551616", 21);
+			else
+				cborJSONChars(c, number, sprintf(number, "-%llu", (unsigned long long)value + 1));
+			return 1;
+
+		case CBOR_BYTES:
+		case CBOR_TEXT:{
+			unsigned char *s = NULL;
+			size_t n = 0;
+			if(!cborReadString(c, major, info, value, &s, &n)){
+				free(s);
+				return 0;
+			}
+			cborJSONChars(c, "\"", 1);
+			if(major == CBOR_TEXT)
+				cborJSONEscaped(c, s, n);
+			else{
+				size_t len64 = base64Length(n);
+				base64EncodeTo(s, n, cborJSONSpace(c, len64));
+				c->len += len64;
+			}
+			cborJSONChars(c, "\"", 1);
+			free(s);
+			return 1;
+		}
+
+		case CBOR_ARRAY:
+		case CBOR_MAP:
+			return cborContainerToJSON(c, major == CBOR_MAP, info == 31, value, depth);
+
+		case CBOR_TAG:
+			return cborItemToJSON(c, depth + 1);
+
+		default:{
+			double d;
+			switch(info){
+				case 20: cborJSONChars(c, "false", 5); return 1;
+				case 21: cborJSONChars(c, "true", 4); return 1;
+				case 22:
+				case 23: cborJSONChars(c, "null", 4); return 1;
+				case 25: d = cborHalfToDouble((unsigned int)value); break;
+				case 26:{
+					uint32_t bits = (uint32_t)value;
+					float f;
+					memcpy(&f, &bits, sizeof(f));
+					d = f;
+					break;
+				}
+				case 27: memcpy(&d, &value, sizeof(d)); break;
+				default: return 0;
+			}
+			/* JSON has no NaN or infinity */
+			if(isnan(d) || isinf(d))
+				cborJSONChars(c, "null", 4);
+			else
+				cborJSONChars(c, number, sprintf(number, "%.17g", d));
+			return 1;
+		}
+	}
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+char* ktCBORToJSON(const void *data, size_t len){
+
+	CBORConverter c;
+	c.p = data;
+	c.end = c.p + len;
+	c.json = NULL;
+	c.len = c.capacity = 0;
+
+	if(!cborItemToJSON(&c, 0) || c.p != c.end){
+		free(c.json);
+		return NULL;
+	}
+
+	c.json[c.len] = '\0';
+
+	return c.json;
+}
+
+/*****************************************************************************************************************/
+/* Replace a CBOR response held in body with its JSON form. Bodies that are already JSON, empty, or not well    */
+/* formed CBOR (e.g. from a proxy) are left as they are. body must be a growable sink without an allocator.    */
+/*****************************************************************************************************************/
+static void cborSinkToJSON(httpResponseSink *body){
+
+	if(!body->text || body->len == 0 || body->text[0] == '{')
+		return;
+
+	char *json = ktCBORToJSON(body->text, body->len);
+	if(!json)
+		return;
+
+	free(body->text);
+	body->text = json;
+	body->len = strlen(json);
+	body->capacity = body->len + 1;
+}
+
+/*****************************************************************************************************************/
+/* Convert a CBOR response collected whole in body to JSON and save it in response as fixedResponseSink would,  */
+/* then free body.                                                                                               */
+/*****************************************************************************************************************/
+void cborSinkToResponse(httpResponseSink *body, httpResponse *response){
+
+	httpResponseSink sink;
+
+	cborSinkToJSON(body);
+	fixedResponseSink(response, &sink);
+	if(body->text)
+		fixedResponseChunk(body->text, body->len, response);
+	ktFreeResponseSink(body);
+}
+
+/*****************************************************************************************************************/
+/* Credential providers, run by ktFetchCredentials. Each fills an AWSCredentials and returns 1, or returns 0     */
+/* with the reason in errorMsg, which may be NULL. Container and IMDS endpoints answer in JSON with AccessKeyId, */
+/* SecretAccessKey, Token and an ISO 8601 Expiration, read with the JSON helpers above.                          */
+/*****************************************************************************************************************/
+#define CONTAINER_CREDENTIALS_HOST "http://169.254.170.2"
+#define IMDS_ENDPOINT "http://169.254.169.254"
+#define IMDS_TOKEN_SECONDS 21600
+
+/* format why a provider failed into errorMsg, if set. Returns 0 */
+static int credentialsError(char *errorMsg, const char *format, ...){
+
+	if(errorMsg){
+		va_list args;
+		va_start(args, format);
+		vsnprintf(errorMsg, CURL_ERROR_SIZE, format, args);
+		va_end(args);
+	}
+
+	return 0;
+}
+
+/* seconds since the epoch of an ISO 8601 UTC time such as 2026-10-16T12:00:00Z, or 0 if it isn't one */
+time_t parseISO8601(const char *text){
+
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+
+	if(sscanf(text, "%4d-%2d-%2dT%2d:%2d:%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return 0;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+
+	return timegm(&tm);
+}
+
+/* copy a key pair, and sessionToken if not NULL, into credentials. source names the provider in errors */
+static int setCredentials(AWSCredentials *credentials, const char *key, const char *keyId, const char *sessionToken, time_t expiration, const char *source, char *errorMsg){
+
+	if(!key || !*key || !keyId || !*keyId)
+		return credentialsError(errorMsg, "%s has no access key id and secret access key", source);
+
+	if(strlen(key) >= sizeof(credentials->key) || strlen(keyId) >= sizeof(credentials->keyId) || (sessionToken && strlen(sessionToken) >= sizeof(credentials->sessionToken)))
+		return credentialsError(errorMsg, "%s credentials are too long", source);
+
+	strcpy(credentials->key, key);
+	strcpy(credentials->keyId, keyId);
+	strcpy(credentials->sessionToken, sessionToken ? sessionToken : "");
+	credentials->expiration = expiration;
+
+	return 1;
+}
+
+/* AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY, AWS_SESSION_TOKEN and AWS_CREDENTIAL_EXPIRATION */
+int credentialsFromEnvironment(AWSCredentials *credentials, char *errorMsg){
+
+	const char *expiration = getenv("AWS_CREDENTIAL_EXPIRATION");
+
+	return setCredentials(credentials, getenv("AWS_SECRET_ACCESS_KEY"), getenv("AWS_ACCESS_KEY_ID"), getenv("AWS_SESSION_TOKEN"), expiration ? parseISO8601(expiration) : 0, "The environment", errorMsg);
+}
+
+/* strip leading and trailing blanks, and a line end, from text in place */
+static char* trimBlanks(char *text){
+
+	text += strspn(text, " \t");
+	char *end = text + strcspn(text, "\r\n");
+	while(end > text && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+	*end = '\0';
+
+	return text;
+}
+
+/*****************************************************************************************************************/
+/* A profile of a shared credentials file, INI format: [profile] sections of name = value lines, with # and ;    */
+/* comments. file and profile may be NULL for the environment's or the defaults.                                 */
+/*****************************************************************************************************************/
+int credentialsFromFile(const char *file, const char *profile, AWSCredentials *credentials, char *errorMsg){
+
+	char path[4096];
+	if(file)
+		snprintf(path, sizeof(path), "%s", file);
+	else if(getenv("AWS_SHARED_CREDENTIALS_FILE"))
+		snprintf(path, sizeof(path), "%s", getenv("AWS_SHARED_CREDENTIALS_FILE"));
+	else if(getenv("HOME"))
+		snprintf(path, sizeof(path), "%s/.aws/credentials", getenv("HOME"));
+	else
+		return credentialsError(errorMsg, "No credentials file, HOME is not set");
+
+	if(!profile)
+		profile = getenv("AWS_PROFILE") ? getenv("AWS_PROFILE") : "default";
+
+	FILE *in = fopen(path, "r");
+	if(!in)
+		return credentialsError(errorMsg, "Cannot open credentials file %s: %s", path, strerror(errno));
+
+	char *line = malloct(KT_MAX_SESSION_TOKEN + 256);
+	char *key = NULL, *keyId = NULL, *sessionToken = NULL;
+	int inProfile = 0, found = 0;
+	while(fgets(line, KT_MAX_SESSION_TOKEN + 256, in)){
+		char *p = trimBlanks(line);
+		if(*p == '['){
+			char *close = strchr(p, ']');
+			if(close){
+				*close = '\0';
+				inProfile = strcmp(trimBlanks(p + 1), profile) == 0;
+				found |= inProfile;
+			}
+			continue;
+		}
+		char *equals = strchr(p, '=');
+		if(!inProfile || *p == '#' || *p == ';' || !equals)
+			continue;
+		*equals = '\0';
+		char *name = trimBlanks(p), *value = trimBlanks(equals + 1), **to = NULL;
+		if(strcmp(name, "aws_access_key_id") == 0)
+			to = &keyId;
+		else if(strcmp(name, "aws_secret_access_key") == 0)
+			to = &key;
+		else if(strcmp(name, "aws_session_token") == 0 || strcmp(name, "aws_security_token") == 0)
+			to = &sessionToken;
+		if(to){
+			free(*to);
+			*to = copyString(value);
+		}
+	}
+	fclose(in);
+	free(line);
+
+	char source[4200];
+	snprintf(source, sizeof(source), "Profile %s of credentials file %s", profile, path);
+	int ok = found ? setCredentials(credentials, key, keyId, sessionToken, 0, source, errorMsg) : credentialsError(errorMsg, "Credentials file %s has no profile %s", path, profile);
+
+	free(key);
+	free(keyId);
+	free(sessionToken);
+
+	return ok;
+}
+
+/* credentials from the JSON answer in body of the endpoint named source */
+static int credentialsFromJSON(const httpResponseSink *body, AWSCredentials *credentials, const char *source, char *errorMsg){
+
+	if(!body->text)
+		return credentialsError(errorMsg, "%s gave an empty answer", source);
+
+	const char *p = body->text, *end = body->text + body->len;
+	char code[64], expiration[64];
+	if(jsonCopyMember(p, end, "Code", code, sizeof(code)) > 0 && strcmp(code, "Success") != 0)
+		return credentialsError(errorMsg, "%s answered %s", source, code);
+
+	int keyIdLen = jsonCopyMember(p, end, "AccessKeyId", credentials->keyId, sizeof(credentials->keyId));
+	int keyLen = jsonCopyMember(p, end, "SecretAccessKey", credentials->key, sizeof(credentials->key));
+	int tokenLen = jsonCopyMember(p, end, "Token", credentials->sessionToken, sizeof(credentials->sessionToken));
+	if(keyIdLen <= 0 || keyLen <= 0)
+		return credentialsError(errorMsg, "%s has no access key id and secret access key", source);
+	if(keyIdLen >= (int)sizeof(credentials->keyId) - 1 || keyLen >= (int)sizeof(credentials->key) - 1 || tokenLen >= (int)sizeof(credentials->sessionToken) - 1)
+		return credentialsError(errorMsg, "%s credentials are too long", source);
+	if(tokenLen < 0)
+		credentials->sessionToken[0] = '\0';
+
+	credentials->expiration = jsonCopyMember(p, end, "Expiration", expiration, sizeof(expiration)) > 0 ? parseISO8601(expiration) : 0;
+
+	return 1;
+}
+
+/* a metadata request, returning 1 for a 200 with a body, otherwise 0 with errorMsg set */
+static int metadataRequest(const char *method, const char *url, const char *header, httpResponseSink *body, char *errorMsg){
+
+	int status = curlDoMetadataRequest(method, url, header, body, errorMsg);
+	if(status == 200 && body->len > 0)
+		return 1;
+
+	if(status)
+		credentialsError(errorMsg, "%s %s returned HTTP %d%s", method, url, status, status == 200 ? " with no body" : "");
+
+	return 0;
+}
+
+/*****************************************************************************************************************/
+/* The ECS/EKS container credentials endpoint at url, sending authorization as the Authorization header. Either  */
+/* may be NULL for the environment's.                                                                            */
+/*****************************************************************************************************************/
+int credentialsFromContainer(const char *url, const char *authorization, AWSCredentials *credentials, char *errorMsg){
+
+	char relativeURL[2048];
+	const char *relative = getenv("AWS_CONTAINER_CREDENTIALS_RELATIVE_URI");
+	if(!url)
+		url = getenv("AWS_CONTAINER_CREDENTIALS_FULL_URI");
+	if(!url && relative){
+		snprintf(relativeURL, sizeof(relativeURL), "%s%s", CONTAINER_CREDENTIALS_HOST, relative);
+		url = relativeURL;
+	}
+	if(!url)
+		return credentialsError(errorMsg, "Neither AWS_CONTAINER_CREDENTIALS_FULL_URI nor AWS_CONTAINER_CREDENTIALS_RELATIVE_URI is set");
+
+	/* the token may be in a file, as EKS Pod Identity mounts it, and is reread each time as it rotates */
+	char *header = malloct(KT_MAX_SESSION_TOKEN + 32);
+	const char *tokenFile = getenv("AWS_CONTAINER_AUTHORIZATION_TOKEN_FILE");
+	if(!authorization)
+		authorization = getenv("AWS_CONTAINER_AUTHORIZATION_TOKEN");
+	if(authorization)
+		snprintf(header, KT_MAX_SESSION_TOKEN + 32, "Authorization: %s", authorization);
+	else if(tokenFile){
+		FILE *in = fopen(tokenFile, "r");
+		if(!in){
+			free(header);
+			return credentialsError(errorMsg, "Cannot open authorization token file %s: %s", tokenFile, strerror(errno));
+		}
+		strcpy(header, "Authorization: ");
+		if(!fgets(header + 15, KT_MAX_SESSION_TOKEN, in))
+			header[15] = '\0';
+		fclose(in);
+		header[15 + strcspn(header + 15, "\r\n")] = '\0';
+	}
+
+	httpResponseSink body;
+	ktInitResponseSink(&body);
+
+	int ok = metadataRequest("GET", url, authorization || tokenFile ? header : NULL, &body, errorMsg) && credentialsFromJSON(&body, credentials, "The container credentials endpoint", errorMsg);
+
+	ktFreeResponseSink(&body);
+	free(header);
+
+	return ok;
+}
+
+/*****************************************************************************************************************/
+/* The instance role's credentials from the EC2 instance metadata service at endpoint, or the environment's if   */
+/* NULL. IMDSv2: a session token is PUT for first and sent with the two reads, the role name then its            */
+/* credentials.                                                                                                  */
+/*****************************************************************************************************************/
+int credentialsFromIMDS(const char *endpoint, AWSCredentials *credentials, char *errorMsg){
+
+	if(!endpoint)
+		endpoint = getenv("AWS_EC2_METADATA_SERVICE_ENDPOINT") ? getenv("AWS_EC2_METADATA_SERVICE_ENDPOINT") : IMDS_ENDPOINT;
+	int endpointLen = (int)strlen(endpoint);
+	while(endpointLen > 0 && endpoint[endpointLen-1] == '/')
+		endpointLen--;
+
+	char url[2048], header[256];
+	httpResponseSink body;
+	ktInitResponseSink(&body);
+
+	snprintf(url, sizeof(url), "%.*s/latest/api/token", endpointLen, endpoint);
+	snprintf(header, sizeof(header), "X-aws-ec2-metadata-token-ttl-seconds: %d", IMDS_TOKEN_SECONDS);
+	int ok = metadataRequest("PUT", url, header, &body, errorMsg) && (body.len < 200 || credentialsError(errorMsg, "Instance metadata token is too long"));
+
+	if(ok){
+		snprintf(header, sizeof(header), "X-aws-ec2-metadata-token: %.*s", (int)body.len, body.text);
+		snprintf(url, sizeof(url), "%.*s/latest/meta-data/iam/security-credentials/", endpointLen, endpoint);
+		ok = metadataRequest("GET", url, header, &body, errorMsg) && (body.len < 256 || credentialsError(errorMsg, "Instance metadata role name is too long"));
+	}
+
+	if(ok){
+		/* the first role listed, as an instance profile has one */
+		snprintf(url, sizeof(url), "%.*s/latest/meta-data/iam/security-credentials/%.*s", endpointLen, endpoint, (int)strcspn(body.text, "\r\n"), body.text);
+		ok = metadataRequest("GET", url, header, &body, errorMsg) && credentialsFromJSON(&body, credentials, "Instance metadata", errorMsg);
+	}
+
+	ktFreeResponseSink(&body);
+
+	return ok;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktDefaultCredentialsOptions(CredentialsOptions *opts){
+
+	opts->source = KT_CREDENTIALS_CHAIN;
+	opts->file = NULL;
+	opts->profile = NULL;
+	opts->url = NULL;
+	opts->authorization = NULL;
+	opts->callback = NULL;
+	opts->userData = NULL;
+	opts->refreshSeconds = 300;
+	opts->retrySeconds = 10;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktFetchCredentials(const CredentialsOptions *opts, AWSCredentials *credentials, char *errorMsg){
+
+	CredentialsOptions defaults;
+	if(!opts){
+		ktDefaultCredentialsOptions(&defaults);
+		opts = &defaults;
+	}
+
+	memset(credentials, 0, sizeof(AWSCredentials));
+
+	switch(opts->source){
+		case KT_CREDENTIALS_ENVIRONMENT:
+			return credentialsFromEnvironment(credentials, errorMsg);
+		case KT_CREDENTIALS_FILE:
+			return credentialsFromFile(opts->file, opts->profile, credentials, errorMsg);
+		case KT_CREDENTIALS_CONTAINER:
+			return credentialsFromContainer(opts->url, opts->authorization, credentials, errorMsg);
+		case KT_CREDENTIALS_IMDS:
+			return credentialsFromIMDS(opts->url, credentials, errorMsg);
+		case KT_CREDENTIALS_CALLBACK:
+			if(!opts->callback)
+				return credentialsError(errorMsg, "No credentials callback");
+			if(!opts->callback(credentials, opts->userData, errorMsg))
+				return 0;
+			/* the callback filled the arrays itself, so check they are terminated */
+			if(!memchr(credentials->key, '\0', sizeof(credentials->key)) || !memchr(credentials->keyId, '\0', sizeof(credentials->keyId)) || !memchr(credentials->sessionToken, '\0', sizeof(credentials->sessionToken)))
+				return credentialsError(errorMsg, "Credentials callback credentials are too long");
+			if(!credentials->key[0] || !credentials->keyId[0])
+				return credentialsError(errorMsg, "Credentials callback has no access key id and secret access key");
+			return 1;
+	}
+
+	/* the chain, in the AWS SDKs' order */
+	if(getenv("AWS_ACCESS_KEY_ID") || getenv("AWS_SECRET_ACCESS_KEY"))
+		return credentialsFromEnvironment(credentials, errorMsg);
+	if(credentialsFromFile(opts->file, opts->profile, credentials, NULL))
+		return 1;
+	if(getenv("AWS_CONTAINER_CREDENTIALS_FULL_URI") || getenv("AWS_CONTAINER_CREDENTIALS_RELATIVE_URI"))
+		return credentialsFromContainer(NULL, NULL, credentials, errorMsg);
+	const char *disabled = getenv("AWS_EC2_METADATA_DISABLED");
+	if(disabled && strcasecmp(disabled, "true") == 0)
+		return credentialsError(errorMsg, "No credentials in the environment, credentials file or container endpoint");
+	char reason[CURL_ERROR_SIZE] = "";
+	if(credentialsFromIMDS(NULL, credentials, reason))
+		return 1;
+
+	return credentialsError(errorMsg, "No credentials in the environment, credentials file or container endpoint, nor from instance metadata: %s", reason);
+}
+
+long rateLimitRecords(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, const int *lenArray);
+
+/****************************************************************************************************************/
+/* Retrying PutRecords. Records that come back with an ErrorCode, or all pending records when the whole call   */
+/* fails in a retryable way, are resent alone after an exponential backoff with full jitter: a random wait of  */
+/* up to baseDelayMs * 2^(retry - 1), capped at maxDelayMs.                                                    */
+/****************************************************************************************************************/
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktDefaultRetryPolicy(RetryPolicy *policy){
+
+	policy->maxAttempts = 4;
+	policy->baseDelayMs = 100;
+	policy->maxDelayMs = 5000;
+}
+
+/* wait before retry number retry (1 for the first retry) */
+static void retryBackoff(const RetryPolicy *policy, int retry, unsigned int *seed){
+
+	long delay = policy->baseDelayMs;
+	while(--retry > 0 && delay < policy->maxDelayMs)
+		delay *= 2;
+	if(delay > policy->maxDelayMs)
+		delay = policy->maxDelayMs;
+	if(delay <= 0)
+		return;
+
+	delay = rand_r(seed) % (delay + 1);
+
+	struct timespec ts;
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+/* whether a PutRecords call that didn't return 200 is worth repeating */
+static int retryableCall(int retcode, const httpResponseSink *body){
+
+	if(retcode == 0 || retcode >= 500)
+		return 1;
+
+	return retcode == 400 && body->text &&
+		(strstr(body->text, "ProvisionedThroughputExceededException") || strstr(body->text, "ThrottlingException") || strstr(body->text, "LimitExceededException"));
+}
+
+/*****************************************************************************************************************/
+/* Record the outcome of a PutRecords call that didn't return 200 against every pending record. The error code */
+/* is the AWS error type from the body if there is one, otherwise TransportError or HTTPError.                 */
+/*****************************************************************************************************************/
+static void failPendingRecords(RecordResult *results, const int *pending, int pendingCount, int retcode, const httpResponseSink *body, const char *errorMsg){
+
+	char errorCode[64];
+	char errorMessage[256];
+	const char *end = body->text + body->len;
+
+	if(retcode == 0){
+		strcpy(errorCode, "TransportError");
+		snprintf(errorMessage, sizeof(errorMessage), "%s", errorMsg);
+	}
+	else{
+		if(!body->text || jsonCopyMember(body->text, end, "__type", errorCode, sizeof(errorCode)) < 0)
+			snprintf(errorCode, sizeof(errorCode), "HTTPError");
+		if(!body->text || (jsonCopyMember(body->text, end, "message", errorMessage, sizeof(errorMessage)) < 0 && jsonCopyMember(body->text, end, "Message", errorMessage, sizeof(errorMessage)) < 0))
+			snprintf(errorMessage, sizeof(errorMessage), "HTTP status %d", retcode);
+	}
+
+	/* AWS error types may be qualified, e.g. "namespace#ErrorName" */
+	char *hash = strrchr(errorCode, '#');
+	const char *code = hash ? hash + 1 : errorCode;
+
+	int i;
+	for(i=0; i<pendingCount; i++){
+		snprintf(results[pending[i]].errorCode, sizeof(results[pending[i]].errorCode), "%s", code);
+		snprintf(results[pending[i]].errorMessage, sizeof(results[pending[i]].errorMessage), "%s", errorMessage);
+	}
+}
+
+/*****************************************************************************************************************/
+/* Match the Records array of a 200 response to the pending records, in order. Succeeded records are filled in */
+/* and dropped from pending; records with an ErrorCode stay pending. Returns the number still pending. Records */
+/* whose outcome can't be read, every one of them if the Records array doesn't match the request, get an       */
+/* InvalidResponse error and are dropped too: Kinesis may well have written them, and resending would          */
+/* duplicate them. *invalid is set to the number of those.                                                      */
+/*****************************************************************************************************************/
+static int matchPutRecordsResponse(RecordResult *results, int *pending, int pendingCount, const httpResponseSink *body, int *invalid){
+
+	const char *end = body->text ? body->text + body->len : NULL;
+	const char *records = body->text ? jsonFindMember(body->text, end, "Records") : NULL;
+	const char *entry;
+
+	/* the response has one entry per record sent */
+	int i, entries = 0, stillPending = 0;
+	for(entry = records ? jsonArrayFirst(records, end) : NULL; entry; entry = jsonArrayNext(entry, end))
+		entries++;
+
+	*invalid = 0;
+	if(entries != pendingCount){
+		for(i=0; i<pendingCount; i++){
+			strcpy(results[pending[i]].errorCode, "InvalidResponse");
+			strcpy(results[pending[i]].errorMessage, "PutRecords response does not match request");
+		}
+		*invalid = pendingCount;
+		return 0;
+	}
+
+	entry = jsonArrayFirst(records, end);
+	for(i=0; i<pendingCount; i++){
+
+		RecordResult *result = &results[pending[i]];
+
+		if(jsonCopyMember(entry, end, "ErrorCode", result->errorCode, sizeof(result->errorCode)) >= 0){
+			if(jsonCopyMember(entry, end, "ErrorMessage", result->errorMessage, sizeof(result->errorMessage)) < 0)
+				*result->errorMessage = '\0';
+			pending[stillPending++] = pending[i];
+		}
+		else if(jsonCopyMember(entry, end, "SequenceNumber", result->sequenceNumber, sizeof(result->sequenceNumber)) >= 0){
+			result->success = 1;
+			*result->errorCode = '\0';
+			*result->errorMessage = '\0';
+			jsonCopyMember(entry, end, "ShardId", result->shardId, sizeof(result->shardId));
+		}
+		else{
+			strcpy(result->errorCode, "InvalidResponse");
+			strcpy(result->errorMessage, "PutRecords response entry has neither ErrorCode nor SequenceNumber");
+			(*invalid)++;
+		}
+
+		entry = jsonArrayNext(entry, end);
+	}
+
+	return stillPending;
+}
+
+/*****************************************************************************************************/
+/* ktPutRecordsWithRetry with optional explicit hash keys. explicitHashKeyArray may be NULL.        */
+/*****************************************************************************************************/
+int putRecordsWithRetry(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, const RetryPolicy *policy, RecordResult *results, char *errorMsg){
+
+	RetryPolicy defaults;
+	if(!policy){
+		ktDefaultRetryPolicy(&defaults);
+		policy = &defaults;
+	}
+
+	int *pending = malloct(recordCount * sizeof(int));
+	char **partitionKeys = malloct(recordCount * sizeof(char*));
+	char **explicitHashKeys = malloct(recordCount * sizeof(char*));
+	unsigned char **data = malloct(recordCount * sizeof(unsigned char*));
+	int *lens = malloct(recordCount * sizeof(int));
+
+	int i;
+	for(i=0; i<recordCount; i++){
+		pending[i] = i;
+		memset(&results[i], 0, sizeof(RecordResult));
+	}
+
+	struct timespec now;
+	monotonicNow(&now);
+	unsigned int seed = (unsigned int)(now.tv_nsec ^ (uintptr_t)&now);
+
+	char curlError[CURL_ERROR_SIZE];
+	httpResponseSink body;
+	ktInitResponseSink(&body);
+	int pendingCount = recordCount;
+	int retcode = 0;
+	int attempt;
+
+	for(attempt=1; attempt<=policy->maxAttempts || attempt==1; attempt++){
+
+		if(attempt > 1){
+			retryBackoff(policy, attempt - 1, &seed);
+			metricsCount(ctx->metrics, KT_COUNTER_RETRIES, 1);
+		}
+
+		/* gather the records still to be sent */
+		for(i=0; i<pendingCount; i++){
+			partitionKeys[i] = partitionKeyArray[pending[i]];
+			explicitHashKeys[i] = explicitHashKeyArray ? explicitHashKeyArray[pending[i]] : NULL;
+			data[i] = dataArray[pending[i]];
+			lens[i] = lenArray[pending[i]];
+			results[pending[i]].attempts++;
+		}
+
+		long delayMs = rateLimitRecords(ctx, streamName, pendingCount, partitionKeys, explicitHashKeys, lens);
+		for(i=0; i<pendingCount; i++)
+			results[pending[i]].rateLimitDelayMs += delayMs;
+
+		*curlError = '\0';
+		retcode = putRecords(ctx, streamName, pendingCount, partitionKeys, explicitHashKeys, data, lens, NULL, NULL, &body, curlError);
+		if(ctx->cbor)
+			cborSinkToJSON(&body);
+
+		int invalid = 0;
+		if(retcode == 200)
+			pendingCount = matchPutRecordsResponse(results, pending, pendingCount, &body, &invalid);
+		else
+			failPendingRecords(results, pending, pendingCount, retcode, &body, curlError);
+		metricsCount(ctx->metrics, KT_COUNTER_FAILED_RECORDS, pendingCount + invalid);
+
+		if(pendingCount == 0 || (retcode != 200 && !retryableCall(retcode, &body)))
+			break;
+	}
+
+	if(errorMsg)
+		strcpy(errorMsg, curlError);
+
+	ktFreeResponseSink(&body);
+	free(pending);
+	free(partitionKeys);
+	free(explicitHashKeys);
+	free(data);
+	free(lens);
+
+	return retcode;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPutRecordsWithRetry(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, const RetryPolicy *policy, RecordResult *results, char *errorMsg){
+
+	return putRecordsWithRetry(ctx, streamName, recordCount, partitionKeyArray, NULL, dataArray, lenArray, policy, results, errorMsg);
+}
+
+/*****************************************************************************************************************/
+/* Aggregate user records as ktPutRecordsAggregated does, then send them with retries within the PutRecords     */
+/* limits. results has one entry per user record: the outcome of the aggregated record that carried it.        */
+/* Returns the status of the last call made.                                                                    */
+/*****************************************************************************************************************/
+int putRecordsAggregatedWithRetry(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, const RetryPolicy *policy, RecordResult *results, char *errorMsg){
+
+	int *groups = aggregationGroups(ctx, streamName, recordCount, partitionKeyArray, explicitHashKeyArray);
+	AggregatedRecords records;
+	aggregateRecords(recordCount, partitionKeyArray, explicitHashKeyArray, dataArray, lenArray, groups, ctx->compressor, &records);
+	free(groups);
+
+	RecordResult *aggregatedResults = malloct(records.count * sizeof(RecordResult));
+
+	int retcode = 200;
+	int first = 0;
+	while(first < records.count){
+
+		int count = putRecordsBatchSize(records.count - first, records.partitionKeyArray + first, records.lenArray + first);
+
+		retcode = putRecordsWithRetry(ctx, streamName, count, records.partitionKeyArray + first, records.explicitHashKeyArray + first, records.dataArray + first, records.lenArray + first, policy, aggregatedResults + first, errorMsg);
+		first += count;
+	}
+
+	int i, j;
+	for(i=0; i<records.count; i++)
+		for(j=records.firstArray[i]; j<records.firstArray[i] + records.countArray[i]; j++)
+			results[records.recordArray[j]] = aggregatedResults[i];
+
+	free(aggregatedResults);
+	freeAggregatedRecords(&records);
+
+	return retcode;
+}
+
+/* entry for streamName, made if it doesn't exist. Called with the lock held. */
+static StreamShards* findStreamShards(ShardMapCache *cache, const char *streamName){
+
+	StreamShards *stream;
+	for(stream=cache->streams; stream; stream=stream->next)
+		if(strcmp(stream->streamName, streamName) == 0)
+			return stream;
+
+	stream = malloct(sizeof(StreamShards));
+	stream->streamName = malloct(strlen(streamName)+1);
+	strcpy(stream->streamName, streamName);
+	stream->map = NULL;
+	stream->fetching = 0;
+	stream->shardCount = 0;
+	stream->fetchedAt = 0;
+	stream->failures = 0;
+	stream->retryAt = 0;
+	*stream->error = '\0';
+	stream->next = cache->streams;
+	cache->streams = stream;
+
+	return stream;
+}
+
+/* seconds to wait before fetching again after failures unhelpful fetches in a row */
+static time_t shardMapBackoff(int failures){
+
+	time_t backoff = SHARD_MAP_MIN_BACKOFF;
+	while(--failures > 0 && backoff < SHARD_MAP_MAX_BACKOFF)
+		backoff *= 2;
+
+	return backoff < SHARD_MAP_MAX_BACKOFF ? backoff : SHARD_MAP_MAX_BACKOFF;
+}
+
+/* retire the map of stream, if any, and set map in its place. Called with the lock held. */
+static void replaceShardMap(ShardMapCache *cache, StreamShards *stream, ShardMap *map){
+
+	if(stream->map){
+		stream->map->next = cache->retired;
+		cache->retired = stream->map;
+	}
+	stream->map = map;
+}
+
+/* replace the map for streamName with a freshly fetched one, retiring the old one. A good map clears any backoff. */
+static void publishShardMap(ShardMapCache *cache, const char *streamName, ShardMap *map){
+
+	pthread_mutex_lock(&cache->lock);
+
+	StreamShards *stream = findStreamShards(cache, streamName);
+	replaceShardMap(cache, stream, map);
+	stream->shardCount = map->count;
+	stream->fetchedAt = time(NULL);
+	stream->failures = 0;
+	stream->retryAt = 0;
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**********************************************************************************************************/
+/* Drop the map for streamName after a reshard, so the next call refetches it. A map dropped within       */
+/* SHARD_MAP_MAX_BACKOFF seconds of being fetched, as while DescribeStream still shows the old shards,    */
+/* counts as a failed fetch and backs off.                                                                */
+/**********************************************************************************************************/
+static void dropShardMap(ShardMapCache *cache, const char *streamName){
+
+	pthread_mutex_lock(&cache->lock);
+
+	StreamShards *stream = findStreamShards(cache, streamName);
+	if(stream->map){
+		time_t now = time(NULL);
+		replaceShardMap(cache, stream, NULL);
+		if(now - stream->fetchedAt < SHARD_MAP_MAX_BACKOFF){
+			stream->failures++;
+			stream->retryAt = now + shardMapBackoff(stream->failures);
+			strcpy(stream->error, "Shard map dropped again soon after a reshard");
+		}
+		else{
+			stream->failures = 0;
+			stream->retryAt = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* sort open shards by starting hash key, insertion sort as streams have few shards */
+static void sortShardMap(ShardMap *map){
+
+	int i, j;
+	for(i=1; i<map->count; i++){
+		for(j=i; j>0 && memcmp(map->startingHashKeys[j-1], map->startingHashKeys[j], 16) > 0; j--){
+			char id[64];
+			unsigned char key[16];
+			memcpy(id, map->shardIds[j], 64); memcpy(map->shardIds[j], map->shardIds[j-1], 64); memcpy(map->shardIds[j-1], id, 64);
+			memcpy(key, map->startingHashKeys[j], 16); memcpy(map->startingHashKeys[j], map->startingHashKeys[j-1], 16); memcpy(map->startingHashKeys[j-1], key, 16);
+			memcpy(key, map->endingHashKeys[j], 16); memcpy(map->endingHashKeys[j], map->endingHashKeys[j-1], 16); memcpy(map->endingHashKeys[j-1], key, 16);
+		}
+	}
+}
+
+/*****************************************************************************************************************/
+/* Fetch the open shards of streamName with DescribeStream, following HasMoreShards. Returns the HTTP status of */
+/* the last call, as the kt* functions, and sets *out to a new map when every page returned 200.               */
+/*****************************************************************************************************************/
+static int fetchShardMap(const AWSContext *ctx, const char *streamName, ShardMap **out, char *errorMsg){
+
+	ShardMap *map = malloct(sizeof(ShardMap));
+	int capacity = 16;
+	map->count = 0;
+	map->shardIds = malloct(capacity * sizeof(*map->shardIds));
+	map->startingHashKeys = malloct(capacity * sizeof(*map->startingHashKeys));
+	map->endingHashKeys = malloct(capacity * sizeof(*map->endingHashKeys));
+	map->next = NULL;
+
+	httpResponseSink body;
+	ktInitResponseSink(&body);
+
+	char lastShardId[64] = "";
+	int hasMore = 1, retcode = 200;
+	*out = NULL;
+
+	while(hasMore && retcode == 200){
+
+		retcode = describeStream(ctx, streamName, *lastShardId ? lastShardId : NULL, NULL, &body, errorMsg);
+		if(retcode != 200)
+			break;
+
+		const char *end = body.text + body.len;
+		const char *description = jsonFindMember(body.text, end, "StreamDescription");
+		const char *shards = description ? jsonFindMember(description, end, "Shards") : NULL;
+		const char *more = description ? jsonFindMember(description, end, "HasMoreShards") : NULL;
+		hasMore = more && strncmp(more, "true", 4) == 0;
+
+		if(!shards){
+			if(errorMsg)
+				strcpy(errorMsg, "DescribeStream response has no shard list");
+			retcode = 0;
+			break;
+		}
+
+		const char *shard;
+		*lastShardId = '\0';
+		for(shard = jsonArrayFirst(shards, end); shard; shard = jsonArrayNext(shard, end)){
+
+			char shardId[64], startingHashKey[40], endingHashKey[40];
+			const char *range = jsonFindMember(shard, end, "HashKeyRange");
+			const char *sequenceRange = jsonFindMember(shard, end, "SequenceNumberRange");
+
+			if(jsonCopyMember(shard, end, "ShardId", shardId, sizeof(shardId)) < 0 || !range ||
+				jsonCopyMember(range, end, "StartingHashKey", startingHashKey, sizeof(startingHashKey)) < 0 ||
+				jsonCopyMember(range, end, "EndingHashKey", endingHashKey, sizeof(endingHashKey)) < 0)
+				continue;
+
+			strcpy(lastShardId, shardId);
+
+			/* closed shards, parents of a reshard, have an ending sequence number and take no writes */
+			if(sequenceRange && jsonFindMember(sequenceRange, end, "EndingSequenceNumber"))
+				continue;
+
+			if(map->count == capacity){
+				capacity *= 2;
+				map->shardIds = realloc(map->shardIds, capacity * sizeof(*map->shardIds));
+				map->startingHashKeys = realloc(map->startingHashKeys, capacity * sizeof(*map->startingHashKeys));
+				map->endingHashKeys = realloc(map->endingHashKeys, capacity * sizeof(*map->endingHashKeys));
+				if(!map->shardIds || !map->startingHashKeys || !map->endingHashKeys)
+					errorExit("Fatal Error", "Cannot malloc memory");
+			}
+
+			strcpy(map->shardIds[map->count], shardId);
+			parseHashKey(startingHashKey, map->startingHashKeys[map->count]);
+			parseHashKey(endingHashKey, map->endingHashKeys[map->count]);
+			map->count++;
+		}
+
+		if(hasMore && !*lastShardId)
+			break;
+	}
+
+	ktFreeResponseSink(&body);
+
+	if(retcode != 200 || map->count == 0){
+		if(retcode == 200){
+			if(errorMsg)
+				strcpy(errorMsg, "DescribeStream returned no open shards");
+			retcode = 0;
+		}
+		freeShardMap(map);
+		return retcode;
+	}
+
+	sortShardMap(map);
+	*out = map;
+
+	return retcode;
+}
+
+/*************************************************************************************************************/
+/* Current shard map for streamName, fetching it if the context has none. Returns NULL if it can't be got. */
+/*************************************************************************************************************/
+static const ShardMap* getShardMap(const AWSContext *ctx, const char *streamName, char *errorMsg){
+
+	ShardMapCache *cache = ctx->shardMaps;
+
+	pthread_mutex_lock(&cache->lock);
+
+	StreamShards *stream = findStreamShards(cache, streamName);
+	while(!stream->map && stream->fetching)
+		pthread_cond_wait(&cache->fetched, &cache->lock);
+
+	ShardMap *map = stream->map;
+	time_t now = time(NULL);
+	if(map || now < stream->retryAt){
+		if(!map && errorMsg)
+			snprintf(errorMsg, CURL_ERROR_SIZE, "%.200s, shard map not refetched for %lds", stream->error, (long)(stream->retryAt - now));
+		pthread_mutex_unlock(&cache->lock);
+		return map;
+	}
+
+	stream->fetching = 1;
+	pthread_mutex_unlock(&cache->lock);
+
+	char reason[CURL_ERROR_SIZE] = "";
+	int retcode = fetchShardMap(ctx, streamName, &map, reason);
+
+	pthread_mutex_lock(&cache->lock);
+	stream->fetching = 0;
+	if(retcode == 200){
+		replaceShardMap(cache, stream, map);
+		stream->shardCount = map->count;
+		stream->fetchedAt = time(NULL);
+	}
+	else{
+		stream->failures++;
+		stream->retryAt = time(NULL) + shardMapBackoff(stream->failures);
+		if(*reason)
+			strcpy(stream->error, reason);
+		else
+			sprintf(stream->error, "DescribeStream returned %d", retcode);
+		if(errorMsg)
+			strcpy(errorMsg, stream->error);
+	}
+	pthread_cond_broadcast(&cache->fetched);
+	pthread_mutex_unlock(&cache->lock);
+
+	return map;
+}
+
+/* open shards in the last map fetched for streamName, which may since have been dropped, or 0 if none was */
+static int knownShardCount(ShardMapCache *cache, const char *streamName){
+
+	pthread_mutex_lock(&cache->lock);
+	int count = findStreamShards(cache, streamName)->shardCount;
+	pthread_mutex_unlock(&cache->lock);
+
+	return count;
+}
+
+/* index of the shard whose hash key range holds hashKey, or -1 if none does */
+static int findShard(const ShardMap *map, const unsigned char *hashKey){
+
+	int low = 0, high = map->count - 1;
+
+	while(low <= high){
+		int mid = (low + high) / 2;
+		if(memcmp(hashKey, map->startingHashKeys[mid], 16) < 0)
+			high = mid - 1;
+		else if(memcmp(hashKey, map->endingHashKeys[mid], 16) > 0)
+			low = mid + 1;
+		else
+			return mid;
+	}
+
+	return -1;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktRefreshShardMap(const AWSContext *ctx, const char *streamName, char *errorMsg){
+
+	ShardMap *map;
+	int retcode = fetchShardMap(ctx, streamName, &map, errorMsg);
+
+	if(retcode == 200)
+		publishShardMap(ctx->shardMaps, streamName, map);
+
+	return retcode;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktShardIdForPartitionKey(const AWSContext *ctx, const char *streamName, const char *partitionKey, char *shardId, char *errorMsg){
+
+	const ShardMap *map = getShardMap(ctx, streamName, errorMsg);
+	if(!map)
+		return 0;
+
+	unsigned char hashKey[16];
+	makeHashKey(partitionKey, hashKey);
+
+	int shard = findShard(map, hashKey);
+	if(shard < 0){
+		if(errorMsg)
+			strcpy(errorMsg, "No open shard covers the partition key's hash key");
+		return 0;
+	}
+
+	strcpy(shardId, map->shardIds[shard]);
+
+	return 1;
+}
+
+/* bucket for a stream's shard, made full if it doesn't exist. Called with the lock held. */
+static TokenBucket* findTokenBucket(RateLimiter *limiter, const char *streamName, const char *shardId, const struct timespec *now){
+
+	/* FNV-1a over both names */
+	unsigned int hash = 2166136261u;
+	const char *c;
+	for(c=streamName; *c; c++)
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	for(c=shardId; *c; c++)
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+
+	TokenBucket **slot = &limiter->table[hash % RATE_LIMIT_TABLE_SIZE];
+	TokenBucket *bucket;
+	for(bucket=*slot; bucket; bucket=bucket->next)
+		if(strcmp(bucket->shardId, shardId) == 0 && strcmp(bucket->streamName, streamName) == 0)
+			return bucket;
+
+	bucket = malloct(sizeof(TokenBucket));
+	bucket->streamName = malloct(strlen(streamName)+1);
+	strcpy(bucket->streamName, streamName);
+	strcpy(bucket->shardId, shardId);
+	bucket->bytes = limiter->bytesPerSecond * RATE_LIMIT_BURST_MS / 1000;
+	bucket->records = limiter->recordsPerSecond * RATE_LIMIT_BURST_MS / 1000;
+	bucket->updated = *now;
+	bucket->next = *slot;
+	*slot = bucket;
+
+	return bucket;
+}
+
+/* take bytes and records from a bucket, returning the seconds until its debt, if any, is repaid */
+static double takeTokens(RateLimiter *limiter, TokenBucket *bucket, double bytes, double records, const struct timespec *now){
+
+	double elapsed = (now->tv_sec - bucket->updated.tv_sec) + (now->tv_nsec - bucket->updated.tv_nsec) / 1e9;
+	double maxBytes = limiter->bytesPerSecond * RATE_LIMIT_BURST_MS / 1000;
+	double maxRecords = limiter->recordsPerSecond * RATE_LIMIT_BURST_MS / 1000;
+
+	if(elapsed > 0){
+		bucket->bytes += elapsed * limiter->bytesPerSecond;
+		bucket->records += elapsed * limiter->recordsPerSecond;
+		if(bucket->bytes > maxBytes)
+			bucket->bytes = maxBytes;
+		if(bucket->records > maxRecords)
+			bucket->records = maxRecords;
+		bucket->updated = *now;
+	}
+
+	bucket->bytes -= bytes;
+	bucket->records -= records;
+
+	double wait = 0;
+	if(bucket->bytes < 0)
+		wait = -bucket->bytes / limiter->bytesPerSecond;
+	if(bucket->records < 0 && -bucket->records / limiter->recordsPerSecond > wait)
+		wait = -bucket->records / limiter->recordsPerSecond;
+
+	return wait;
+}
+
+/*******************************************************************************************************************/
+/* Wait until the shards the records map to can take them. Records are charged their data and partition key bytes, */
+/* as Kinesis charges them. Returns the milliseconds waited; 0 straight away if the context has no rate limiter.   */
+/* If the stream's shard map can't be fetched, the stream as a whole is limited to as many shards' worth as it had */
+/* when last mapped, or one, taking an even share of each record from a stream-wide bucket.                       */
+/*******************************************************************************************************************/
+long rateLimitRecords(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, const int *lenArray){
+
+	RateLimiter *limiter = ctx->limiter;
+	if(!limiter || recordCount == 0)
+		return 0;
+
+	const ShardMap *map = getShardMap(ctx, streamName, NULL);
+	int shards = map ? map->count : 1;
+	double share = 1;
+	if(!map){
+		int known = knownShardCount(ctx->shardMaps, streamName);
+		share = 1.0 / (known > 0 ? known : 1);
+		atomic_fetch_add(&limiter->unmappedSends, 1);
+	}
+
+	/* bytes and records per shard */
+	double *bytes = calloc(shards, sizeof(double));
+	int *records = calloc(shards, sizeof(int));
+	if(!bytes || !records)
+		errorExit("Fatal Error", "Cannot malloc memory");
+
+	int i;
+	for(i=0; i<recordCount; i++){
+		int shard = 0;
+		if(map){
+			unsigned char hashKey[16];
+			if(!explicitHashKeyArray || !explicitHashKeyArray[i] || !parseHashKey(explicitHashKeyArray[i], hashKey))
+				makeHashKey(partitionKeyArray[i], hashKey);
+			shard = findShard(map, hashKey);
+		}
+		if(shard >= 0){
+			bytes[shard] += lenArray[i] + strlen(partitionKeyArray[i]);
+			records[shard]++;
+		}
+	}
+
+	struct timespec now;
+	monotonicNow(&now);
+	double wait = 0;
+
+	pthread_mutex_lock(&limiter->lock);
+	for(i=0; i<shards; i++){
+		if(records[i] == 0)
+			continue;
+		TokenBucket *bucket = findTokenBucket(limiter, streamName, map ? map->shardIds[i] : "", &now);
+		double shardWait = takeTokens(limiter, bucket, bytes[i] * share, records[i] * share, &now);
+		if(shardWait > wait)
+			wait = shardWait;
+	}
+	pthread_mutex_unlock(&limiter->lock);
+
+	free(bytes);
+	free(records);
+
+	atomic_fetch_add(&limiter->sends, 1);
+	if(wait <= 0)
+		return 0;
+
+	struct timespec delay;
+	delay.tv_sec = (time_t)wait;
+	delay.tv_nsec = (long)((wait - delay.tv_sec) * 1e9);
+	nanosleep(&delay, NULL);
+	metricsRecord(ctx->metrics, KT_STAGE_RATE_LIMIT, (unsigned long long)(wait * 1e9));
+
+	long delayMs = (long)(wait * 1000 + 0.5);
+	atomic_fetch_add(&limiter->delayedSends, 1);
+	atomic_fetch_add(&limiter->delayMs, delayMs);
+
+	return delayMs;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktGetRateLimitStats(const AWSContext *ctx, RateLimitStats *stats){
+
+	memset(stats, 0, sizeof(RateLimitStats));
+
+	if(!ctx->limiter)
+		return 0;
+
+	stats->sends = atomic_load(&ctx->limiter->sends);
+	stats->delayedSends = atomic_load(&ctx->limiter->delayedSends);
+	stats->delayMs = atomic_load(&ctx->limiter->delayMs);
+	stats->unmappedSends = atomic_load(&ctx->limiter->unmappedSends);
+
+	return 1;
+}
+
+/*****************************************************************************************************************/
+/* Aggregation groups. Records in the same group are sure to go to the same shard and may share an aggregated   */
+/* record. With the stream's shard map a record's group is its shard; without one, or for a hash key no open    */
+/* shard covers, records group by partition key, or by explicit hash key where they have one. Caller frees.     */
+/*****************************************************************************************************************/
+int* aggregationGroups(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray){
+
+	const ShardMap *map = getShardMap(ctx, streamName, NULL);
+	int shards = map ? map->count : 0;
+
+	int *groups = malloct((recordCount ? recordCount : 1) * sizeof(int));
+	StringTable partitionKeys, explicitHashKeys;
+	initStringTable(&partitionKeys, recordCount);
+	initStringTable(&explicitHashKeys, recordCount);
+
+	int i;
+	for(i=0; i<recordCount; i++){
+
+		const char *explicitHashKey = explicitHashKeyArray ? explicitHashKeyArray[i] : NULL;
+		unsigned char hashKey[16];
+		if(!explicitHashKey || !parseHashKey(explicitHashKey, hashKey)){
+			explicitHashKey = NULL;
+			makeHashKey(partitionKeyArray[i], hashKey);
+		}
+
+		int shard = map ? findShard(map, hashKey) : -1;
+		if(shard >= 0)
+			groups[i] = shard;
+		else if(explicitHashKey)
+			groups[i] = shards + 2 * addStringTable(&explicitHashKeys, explicitHashKey) + 1;
+		else
+			groups[i] = shards + 2 * addStringTable(&partitionKeys, partitionKeyArray[i]);
+	}
+
+	freeStringTable(&partitionKeys);
+	freeStringTable(&explicitHashKeys);
+
+	return groups;
+}
+
+/*****************************************************************************************************************/
+/* Shard aware PutRecords. Records are grouped into one queue per predicted shard (aggregated per shard first  */
+/* when aggregate is set, so every aggregated record holds a single shard's records). Batches are then formed   */
+/* by taking one entry from each shard queue in turn, so every batch spreads its load over all the shards with */
+/* pending records instead of piling onto whichever is hot. Batches are sent with retries. If a record lands   */
+/* on a shard other than the predicted one the stream has been resharded, and the map is dropped so the next  */
+/* call refetches it. Without a shard map, records are sent in order as putRecordsWithRetry would.             */
+/*****************************************************************************************************************/
+int putRecordsByShard(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, const RetryPolicy *policy, int aggregate, RecordResult *results, char *errorMsg){
+
+	const ShardMap *map = getShardMap(ctx, streamName, errorMsg);
+	if(!map){
+		if(aggregate)
+			return putRecordsAggregatedWithRetry(ctx, streamName, recordCount, partitionKeyArray, NULL, dataArray, lenArray, policy, results, errorMsg);
+		return putRecordsWithRetry(ctx, streamName, recordCount, partitionKeyArray, NULL, dataArray, lenArray, policy, results, errorMsg);
+	}
+
+	/* predict each record's shard, records no open shard covers go in an extra last queue */
+	int queues = map->count + 1;
+	int *shardOf = malloct(recordCount * sizeof(int));
+	int *queueStart = calloc(queues + 1, sizeof(int));
+	if(!queueStart)
+		errorExit("Fatal Error", "Cannot malloc memory");
+
+	int i;
+	for(i=0; i<recordCount; i++){
+		unsigned char hashKey[16];
+		makeHashKey(partitionKeyArray[i], hashKey);
+		shardOf[i] = findShard(map, hashKey);
+		if(shardOf[i] < 0)
+			shardOf[i] = map->count;
+		queueStart[shardOf[i] + 1]++;
+	}
+
+	/* counting sort record indices into their shard queues, keeping order within each shard */
+	for(i=0; i<queues; i++)
+		queueStart[i + 1] += queueStart[i];
+
+	int *byShard = malloct(recordCount * sizeof(int));
+	int *fill = malloct(queues * sizeof(int));
+	memcpy(fill, queueStart, queues * sizeof(int));
+	for(i=0; i<recordCount; i++)
+		byShard[fill[shardOf[i]]++] = i;
+
+	/* entries to send, queue by queue. Each covers a run of byShard: one record, or an aggregated run */
+	char **entryKeys = malloct(recordCount * sizeof(char*));
+	char **entryHashKeys = malloct(recordCount * sizeof(char*));
+	unsigned char **entryData = malloct(recordCount * sizeof(unsigned char*));
+	int *entryLens = malloct(recordCount * sizeof(int));
+	int *entryFirst = malloct(recordCount * sizeof(int));
+	int *entryCount = malloct(recordCount * sizeof(int));
+	int *entryQueueStart = malloct((queues + 1) * sizeof(int));
+	AggregatedRecords *aggregated = aggregate ? malloct(queues * sizeof(AggregatedRecords)) : NULL;
+	int entries = 0, q;
+
+	for(q=0; q<queues; q++){
+
+		entryQueueStart[q] = entries;
+		int n = queueStart[q + 1] - queueStart[q];
+
+		if(!aggregate){
+			for(i=0; i<n; i++){
+				int r = byShard[queueStart[q] + i];
+				entryKeys[entries] = partitionKeyArray[r];
+				entryHashKeys[entries] = NULL;
+				entryData[entries] = dataArray[r];
+				entryLens[entries] = lenArray[r];
+				entryFirst[entries] = queueStart[q] + i;
+				entryCount[entries] = 1;
+				entries++;
+			}
+			continue;
+		}
+
+		/* aggregate the queue's records, gathered in order */
+		char **keys = malloct((n ? n : 1) * sizeof(char*));
+		unsigned char **data = malloct((n ? n : 1) * sizeof(unsigned char*));
+		int *lens = malloct((n ? n : 1) * sizeof(int));
+		for(i=0; i<n; i++){
+			int r = byShard[queueStart[q] + i];
+			keys[i] = partitionKeyArray[r];
+			data[i] = dataArray[r];
+			lens[i] = lenArray[r];
+		}
+
+		/* a shard's queue is one group; records no open shard covers are grouped by key */
+		int *groups = q == map->count ? aggregationGroups(ctx, streamName, n, keys, NULL) : NULL;
+		aggregateRecords(n, keys, NULL, data, lens, groups, ctx->compressor, &aggregated[q]);
+		free(groups);
+
+		/* put the queue's run of byShard in the order the records were packed */
+		int *packed = malloct((n ? n : 1) * sizeof(int));
+		for(i=0; i<n; i++)
+			packed[i] = byShard[queueStart[q] + aggregated[q].recordArray[i]];
+		memcpy(&byShard[queueStart[q]], packed, n * sizeof(int));
+		free(packed);
+
+		for(i=0; i<aggregated[q].count; i++){
+			entryKeys[entries] = aggregated[q].partitionKeyArray[i];
+			entryHashKeys[entries] = aggregated[q].explicitHashKeyArray[i];
+			entryData[entries] = aggregated[q].dataArray[i];
+			entryLens[entries] = aggregated[q].lenArray[i];
+			entryFirst[entries] = queueStart[q] + aggregated[q].firstArray[i];
+			entryCount[entries] = aggregated[q].countArray[i];
+			entries++;
+		}
+
+		free(keys);
+		free(data);
+		free(lens);
+	}
+	entryQueueStart[queues] = entries;
+
+	/* form batches round robin over the shard queues */
+	int *next = malloct(queues * sizeof(int));
+	memcpy(next, entryQueueStart, queues * sizeof(int));
+
+	int *batch = malloct(MAX_PUT_RECORDS_COUNT * sizeof(int));
+	char **batchKeys = malloct(MAX_PUT_RECORDS_COUNT * sizeof(char*));
+	char **batchHashKeys = malloct(MAX_PUT_RECORDS_COUNT * sizeof(char*));
+	unsigned char **batchData = malloct(MAX_PUT_RECORDS_COUNT * sizeof(unsigned char*));
+	int *batchLens = malloct(MAX_PUT_RECORDS_COUNT * sizeof(int));
+	RecordResult *batchResults = malloct(MAX_PUT_RECORDS_COUNT * sizeof(RecordResult));
+
+	int retcode = 200, sent = 0, resharded = 0;
+
+	while(sent < entries){
+
+		int count = 0;
+		long bytes = 0;
+		int progress = 1;
+
+		while(progress && count < MAX_PUT_RECORDS_COUNT){
+			progress = 0;
+			for(q=0; q<queues && count < MAX_PUT_RECORDS_COUNT; q++){
+				if(next[q] == entryQueueStart[q + 1])
+					continue;
+				int e = next[q];
+				long b = entryLens[e] + strlen(entryKeys[e]);
+				if(count > 0 && bytes + b > MAX_PUT_RECORDS_BYTES)
+					continue;
+				batch[count] = e;
+				batchKeys[count] = entryKeys[e];
+				batchHashKeys[count] = entryHashKeys[e];
+				batchData[count] = entryData[e];
+				batchLens[count] = entryLens[e];
+				bytes += b;
+				count++;
+				next[q]++;
+				progress = 1;
+			}
+		}
+
+		retcode = putRecordsWithRetry(ctx, streamName, count, batchKeys, aggregate ? batchHashKeys : NULL, batchData, batchLens, policy, batchResults, errorMsg);
+
+		/* hand each entry's result to the records it carried, and look for reshards */
+		for(i=0; i<count; i++){
+			int e = batch[i];
+			int j;
+			for(j=entryFirst[e]; j<entryFirst[e] + entryCount[e]; j++)
+				results[byShard[j]] = batchResults[i];
+
+			int predicted = shardOf[byShard[entryFirst[e]]];
+			if(batchResults[i].success && (predicted == map->count || strcmp(batchResults[i].shardId, map->shardIds[predicted]) != 0))
+				resharded = 1;
+		}
+
+		sent += count;
+	}
+
+	if(resharded)
+		dropShardMap(ctx->shardMaps, streamName);
+
+	if(aggregate){
+		for(q=0; q<queues; q++)
+			freeAggregatedRecords(&aggregated[q]);
+		free(aggregated);
+	}
+	free(shardOf);
+	free(queueStart);
+	free(byShard);
+	free(fill);
+	free(entryKeys);
+	free(entryHashKeys);
+	free(entryData);
+	free(entryLens);
+	free(entryFirst);
+	free(entryCount);
+	free(entryQueueStart);
+	free(next);
+	free(batch);
+	free(batchKeys);
+	free(batchHashKeys);
+	free(batchData);
+	free(batchLens);
+	free(batchResults);
+
+	return retcode;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPutRecordsByShard(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, const RetryPolicy *policy, RecordResult *results, char *errorMsg){
+
+	return putRecordsByShard(ctx, streamName, recordCount, partitionKeyArray, dataArray, lenArray, policy, 0, results, errorMsg);
+}
+
+/*****************************************************************************************************************/
+/* Pipeline internals. Each in flight request owns an easy handle, its payload and headers until it completes. */
+/* Finished requests keep their easy handle and go on a free list for reuse. Easy handles share the context's  */
+/* DNS and TLS session caches, and the multi handle keeps connections alive between requests.                  */
+/*****************************************************************************************************************/
+typedef struct PipelineRequest{
+	CURL *curl;
+	char *payload;
+	AWSHeaders *headers;
+	httpResponseSink respBody;
+	RecordResult *results;
+	int *pending;
+	int recordCount;
+	int capacity;
+	char errorMsg[CURL_ERROR_SIZE];
+	PipelineCallback callback;
+	void *userData;
+	struct timespec started;
+	struct PipelineRequest *next;
+}PipelineRequest;
+
+struct Pipeline{
+	const AWSContext *ctx;
+	CURLM *multi;
+	int maxInFlight;
+	int inFlight;
+	PipelineRequest *idle;
+};
+
+/***********************************************************************************/
+/* Deliver completions reported by curl and recycle their requests. Returns count. */
+/***********************************************************************************/
+static int completePipelineRequests(Pipeline *pipeline){
+
+	int completed = 0;
+	int remaining;
+	CURLMsg *msg;
+
+	while((msg = curl_multi_info_read(pipeline->multi, &remaining))){
+
+		if(msg->msg != CURLMSG_DONE)
+			continue;
+
+		PipelineRequest *request;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&request);
+
+		long retcode = 0;
+		if(msg->data.result == CURLE_OK)
+			curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE, &retcode);
+		else if(!*request->errorMsg)
+			snprintf(request->errorMsg, CURL_ERROR_SIZE, "%s", curl_easy_strerror(msg->data.result));
+
+		curl_multi_remove_handle(pipeline->multi, request->curl);
+		pipeline->inFlight--;
+		metricsRecordTransfer(pipeline->ctx->metrics, request->curl, retcode);
+		metricsLap(pipeline->ctx->metrics, KT_STAGE_CALL, &request->started);
+
+		if(request->callback){
+
+			/* each record's outcome after this one attempt, read as ktPutRecordsWithRetry reads it */
+			int i, invalid, failed = request->recordCount;
+			memset(request->results, 0, request->recordCount * sizeof(RecordResult));
+			for(i=0; i<request->recordCount; i++){
+				request->results[i].attempts = 1;
+				request->pending[i] = i;
+			}
+			if(retcode == 200)
+				failed = matchPutRecordsResponse(request->results, request->pending, request->recordCount, &request->respBody, &invalid) + invalid;
+			else
+				failPendingRecords(request->results, request->pending, request->recordCount, retcode, &request->respBody, request->errorMsg);
+
+			PipelineResult result;
+			result.retcode = retcode;
+			result.errorMsg = retcode == 0 ? request->errorMsg : (retcode == 200 ? NULL : request->respBody.text);
+			result.respBody = &request->respBody;
+			result.recordCount = request->recordCount;
+			result.results = request->results;
+			result.failedRecordCount = failed;
+			request->callback(&result, request->userData);
+		}
+
+		free(request->payload);
+		freeAWSHeaders(request->headers);
+		curl_easy_reset(request->curl);
+
+		request->next = pipeline->idle;
+		pipeline->idle = request;
+		completed++;
+	}
+
+	return completed;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+Pipeline* ktMakePipeline(const AWSContext *ctx, int maxInFlight){
+
+	Pipeline *pipeline = malloct(sizeof(Pipeline));
+
+	pipeline->ctx = ctx;
+	pipeline->maxInFlight = maxInFlight > 0 ? maxInFlight : 1;
+	pipeline->inFlight = 0;
+	pipeline->idle = NULL;
+
+	pipeline->multi = curl_multi_init();
+	if(!pipeline->multi)
+		errorExit("Fatal curl error", "Cannot initialize curl multi");
+
+	/* keep a connection per in flight request alive between requests */
+	curl_multi_setopt(pipeline->multi, CURLMOPT_MAXCONNECTS, (long)pipeline->maxInFlight);
+	if(ctx->pool->multiplexer){
+		curl_multi_setopt(pipeline->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+		curl_multi_setopt(pipeline->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)ctx->pool->multiplexer->maxStreams);
+	}
+
+	return pipeline;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPipelinePutRecords(Pipeline *pipeline, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, PipelineCallback callback, void *userData){
+
+	static const char *target = "Kinesis_20131202.PutRecords";
+
+	const AWSContext *ctx = pipeline->ctx;
+
+	/* wait for room in the window */
+	while(pipeline->inFlight >= pipeline->maxInFlight)
+		ktPipelinePoll(pipeline, 1000);
+
+	/* time each stage if the context keeps metrics */
+	struct timespec callStart, stageStart;
+	metricsStart(ctx->metrics, &stageStart);
+	callStart = stageStart;
+
+	/* make date strings */
+	char longDate[17], shortDate[9];
+	makeDateStrings(longDate, shortDate);
+
+	/* make payload, hashed as it is built */
+	char payloadHash[65];
+	unsigned char * const *sendData;
+	const int *sendLens;
+	compressSendRecords(ctx, recordCount, dataArray, lenArray, NULL, &sendData, &sendLens);
+	if(ctx->compressor)
+		metricsLap(ctx->metrics, KT_STAGE_COMPRESS, &stageStart);
+	char *payload = makePutRecordsPayload(streamName, recordCount, partitionKeyArray, NULL, sendData, sendLens, payloadHash, NULL);
+	freeSendRecords(NULL, sendData, dataArray);
+	metricsLap(ctx->metrics, KT_STAGE_PAYLOAD, &stageStart);
+
+	/* make Authorization header, signed with today's cached signing key */
+	unsigned char signingKey[32];
+	const Credentials *credentials = currentCredentials(ctx);
+	getSigningKey(ctx, credentials, shortDate, signingKey);
+	char *authHeader = makeAuthHeader(signingKey, credentials->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payloadHash, jsonContentType, NULL);
+
+	/* reuse a finished request and its easy handle if there is one */
+	PipelineRequest *request = pipeline->idle;
+	if(request)
+		pipeline->idle = request->next;
+	else{
+		request = malloct(sizeof(PipelineRequest));
+		request->curl = curl_easy_init();
+		if(!request->curl)
+			errorExit("Fatal curl error", "Cannot initialize curl");
+		ktInitResponseSink(&request->respBody);
+		request->results = NULL;
+		request->pending = NULL;
+		request->capacity = 0;
+	}
+
+	/* room for the records' results, kept with the request for reuse */
+	if(recordCount > request->capacity){
+		free(request->results);
+		free(request->pending);
+		request->results = malloct(recordCount * sizeof(RecordResult));
+		request->pending = malloct(recordCount * sizeof(int));
+		request->capacity = recordCount;
+	}
+	request->recordCount = recordCount;
+
+	request->payload = payload;
+	request->headers = makeAWSHeaders(authHeader, credentials->sessionToken, target, longDate, jsonContentType, NULL);
+	request->callback = callback;
+	request->userData = userData;
+	request->started = callStart;
+	*request->errorMsg = '\0';
+	free(authHeader);
+	metricsLap(ctx->metrics, KT_STAGE_SIGN, &stageStart);
+	metricsCount(ctx->metrics, KT_COUNTER_RECORDS, recordCount);
+	metricsCount(ctx->metrics, KT_COUNTER_PAYLOAD_BYTES, strlen(payload));
+
+	setCurlPostOptions(request->curl, REQUEST_TIMEOUT_SECONDS, ctx->pool->idleTimeout, ctx->url, request->headers, request->payload, strlen(request->payload), NULL, &request->respBody, request->errorMsg);
+	curl_easy_setopt(request->curl, CURLOPT_SHARE, ctx->pool->share);
+	curl_easy_setopt(request->curl, CURLOPT_PRIVATE, (char*)request);
+	if(ctx->pool->multiplexer)
+		setCurlMultiplexOptions(request->curl);
+
+	curl_multi_add_handle(pipeline->multi, request->curl);
+	pipeline->inFlight++;
+
+	/* get the request going without waiting */
+	int running;
+	curl_multi_perform(pipeline->multi, &running);
+	completePipelineRequests(pipeline);
+
+	return 1;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktPipelinePoll(Pipeline *pipeline, int timeoutMs){
+
+	int running;
+
+	if(pipeline->inFlight == 0)
+		return 0;
+
+	/* libcurl 8.14 can leave a multiplexed stream's response unprocessed with nothing to wake the poll, so */
+	/* the wait is capped there; see Multiplexer                                                             */
+	if(pipeline->ctx->pool->multiplexer)
+		timeoutMs = multiplexPollMs(timeoutMs);
+
+	curl_multi_perform(pipeline->multi, &running);
+	if(completePipelineRequests(pipeline) == 0 && pipeline->inFlight > 0){
+		curl_multi_poll(pipeline->multi, NULL, 0, timeoutMs, NULL);
+		curl_multi_perform(pipeline->multi, &running);
+		completePipelineRequests(pipeline);
+	}
+
+	return pipeline->inFlight;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktPipelineDrain(Pipeline *pipeline){
+
+	while(ktPipelinePoll(pipeline, 1000) > 0)
+		;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktFreePipeline(Pipeline *pipeline){
+
+	ktPipelineDrain(pipeline);
+
+	while(pipeline->idle){
+		PipelineRequest *next = pipeline->idle->next;
+		curl_easy_cleanup(pipeline->idle->curl);
+		ktFreeResponseSink(&pipeline->idle->respBody);
+		free(pipeline->idle->results);
+		free(pipeline->idle->pending);
+		free(pipeline->idle);
+		pipeline->idle = next;
+	}
+
+	curl_multi_cleanup(pipeline->multi);
+	free(pipeline);
+}
+
+/*****************************************************************************************************************/
+/* Spool internals. A spool is a directory of fixed size segment files, each memory mapped whole and named by a */
+/* sequence number in hex so the oldest sorts first. A segment starts with a SpoolSegmentHeader then holds     */
+/* records back to back, each a SpoolRecordHeader, the partition key with its null terminator and the data,    */
+/* padded to 4 bytes. Records are written before their header's crc, so a record cut short by a crash fails    */
+/* its check and recovery stops there; the zero filled space after the last record fails too. Replay takes    */
+/* batches from the oldest segment, passing pointers into the mapping straight to the payload builder, and     */
+/* moves the header's readOffset past what was delivered. lock guards the segment list; replayLock makes      */
+/* replays take turns. A segment is pinned while a batch from it is in flight; if it is evicted meanwhile its  */
+/* file is unlinked at once but the mapping stays until the replay lets go of it.                             */
+/*****************************************************************************************************************/
+#define SPOOL_MAGIC "KTSPOOL1"
+#define SPOOL_SUFFIX ".ktspool"
+
+typedef struct{
+	char magic[8];
+	uint64_t sequence;
+	uint32_t size;
+	uint32_t readOffset;
+}SpoolSegmentHeader;
+
+typedef struct{
+	uint32_t crc;
+	uint32_t dataLen;
+	uint16_t keyLen;
+	uint16_t reserved;
+}SpoolRecordHeader;
+
+typedef struct SpoolSegment{
+	uint64_t sequence;
+	char *path;
+	unsigned char *map;
+	size_t size;
+	size_t writeOffset;
+	long records;
+	long long bytes;
+	int pinned;
+	int evicted;
+	struct SpoolSegment *next;
+}SpoolSegment;
+
+struct Spool{
+	char *directory;
+	SpoolOptions opts;
+	pthread_mutex_t lock;
+	pthread_mutex_t replayLock;
+	SpoolSegment *oldest;
+	SpoolSegment *newest;
+	int segments;
+	uint64_t nextSequence;
+	SpoolStats stats;
+};
+
+/* space a record takes in a segment */
+static size_t spoolRecordSize(size_t keyLen, size_t dataLen){
+
+	return (sizeof(SpoolRecordHeader) + keyLen + dataLen + 3) & ~(size_t)3;
+}
+
+static uint32_t spoolRecordCRC(const SpoolRecordHeader *header, const char *key, const unsigned char *data){
+
+	uLong crc = crc32(0L, (const Bytef*)&header->dataLen, sizeof(SpoolRecordHeader) - sizeof(header->crc));
+	crc = crc32(crc, (const Bytef*)key, header->keyLen);
+
+	return (uint32_t)crc32(crc, data, header->dataLen);
+}
+
+static SpoolSegmentHeader* spoolSegmentHeader(const SpoolSegment *segment){
+
+	return (SpoolSegmentHeader*)segment->map;
+}
+
+/* the valid record at offset, or NULL if there is none */
+static const SpoolRecordHeader* spoolRecordAt(const SpoolSegment *segment, size_t offset){
+
+	if(offset + sizeof(SpoolRecordHeader) > segment->size)
+		return NULL;
+
+	const SpoolRecordHeader *header = (const SpoolRecordHeader*)(segment->map + offset);
+	if(header->keyLen < 2 || offset + spoolRecordSize(header->keyLen, header->dataLen) > segment->size)
+		return NULL;
+
+	const char *key = (const char*)(header + 1);
+	if(key[header->keyLen - 1] != '\0' || header->crc != spoolRecordCRC(header, key, (const unsigned char*)key + header->keyLen))
+		return NULL;
+
+	return header;
+}
+
+/* flush the pages holding len bytes at offset to disk, if the spool is set to */
+static void syncSpoolSegment(const Spool *spool, const SpoolSegment *segment, size_t offset, size_t len){
+
+	if(!spool->opts.sync)
+		return;
+
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start = offset / page * page;
+
+	msync(segment->map + start, offset + len - start, MS_SYNC);
+}
+
+/* unmap and free segment, removing its file if remove is set */
+static void freeSpoolSegment(SpoolSegment *segment, int remove){
+
+	if(remove)
+		unlink(segment->path);
+	munmap(segment->map, segment->size);
+	free(segment->path);
+	free(segment);
+}
+
+/*****************************************************************************************************************/
+/* Map the segment file at path. If create is set the file is made, sized and given a header, otherwise the      */
+/* existing header is checked and the records are scanned to find the end of the valid ones. NULL on failure,   */
+/* with the reason in errorMsg if create is set; existing files that aren't segments are quietly passed over.  */
+/*****************************************************************************************************************/
+static SpoolSegment* mapSpoolSegment(const char *path, uint64_t sequence, size_t size, int create, char *errorMsg){
+
+	int fd = open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+	if(fd < 0){
+		if(errorMsg)
+			snprintf(errorMsg, CURL_ERROR_SIZE, "Cannot open spool segment %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	struct stat st;
+	if(create ? ftruncate(fd, size) != 0 : fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SpoolSegmentHeader)){
+		if(errorMsg)
+			snprintf(errorMsg, CURL_ERROR_SIZE, "Cannot size spool segment %s: %s", path, strerror(errno));
+		close(fd);
+		if(create)
+			unlink(path);
+		return NULL;
+	}
+	if(!create)
+		size = st.st_size;
+
+	unsigned char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		if(errorMsg)
+			snprintf(errorMsg, CURL_ERROR_SIZE, "Cannot map spool segment %s: %s", path, strerror(errno));
+		if(create)
+			unlink(path);
+		return NULL;
+	}
+
+	SpoolSegment *segment = malloct(sizeof(SpoolSegment));
+	segment->sequence = sequence;
+	segment->path = malloct(strlen(path)+1);
+	strcpy(segment->path, path);
+	segment->map = map;
+	segment->size = size;
+	segment->writeOffset = sizeof(SpoolSegmentHeader);
+	segment->records = 0;
+	segment->bytes = 0;
+	segment->pinned = 0;
+	segment->evicted = 0;
+	segment->next = NULL;
+
+	SpoolSegmentHeader *header = spoolSegmentHeader(segment);
+
+	if(create){
+		memcpy(header->magic, SPOOL_MAGIC, sizeof(header->magic));
+		header->sequence = sequence;
+		header->size = (uint32_t)size;
+		header->readOffset = sizeof(SpoolSegmentHeader);
+		return segment;
+	}
+
+	if(memcmp(header->magic, SPOOL_MAGIC, sizeof(header->magic)) != 0 || header->size != size || header->sequence != sequence ||
+		header->readOffset < sizeof(SpoolSegmentHeader) || header->readOffset > size){
+		freeSpoolSegment(segment, 0);
+		return NULL;
+	}
+
+	/* find the end of the valid records, counting those not yet replayed */
+	const SpoolRecordHeader *record;
+	while((record = spoolRecordAt(segment, segment->writeOffset))){
+		if(segment->writeOffset >= header->readOffset){
+			segment->records++;
+			segment->bytes += record->keyLen - 1 + record->dataLen;
+		}
+		segment->writeOffset += spoolRecordSize(record->keyLen, record->dataLen);
+	}
+
+	/* a readOffset past the valid records means they were all replayed */
+	if(header->readOffset > segment->writeOffset)
+		header->readOffset = (uint32_t)segment->writeOffset;
+
+	return segment;
+}
+
+/* unlink segment from the list and account for it, keeping its mapping if a replay has it pinned. Called with the lock held. */
+static void removeSpoolSegment(Spool *spool, SpoolSegment *segment, int evicted){
+
+	SpoolSegment **p = &spool->oldest;
+	SpoolSegment *previous = NULL;
+	while(*p != segment){
+		previous = *p;
+		p = &(*p)->next;
+	}
+	*p = segment->next;
+	if(spool->newest == segment)
+		spool->newest = previous;
+	spool->segments--;
+
+	spool->stats.records -= segment->records;
+	spool->stats.bytes -= segment->bytes;
+	if(evicted)
+		spool->stats.evictedRecords += segment->records;
+
+	if(segment->pinned){
+		segment->evicted = 1;
+		unlink(segment->path);
+	}
+	else
+		freeSpoolSegment(segment, 1);
+}
+
+static void appendSpoolSegment(Spool *spool, SpoolSegment *segment){
+
+	if(spool->newest)
+		spool->newest->next = segment;
+	else
+		spool->oldest = segment;
+	spool->newest = segment;
+	spool->segments++;
+
+	spool->stats.records += segment->records;
+	spool->stats.bytes += segment->bytes;
+}
+
+/* start a new segment, evicting the oldest first if the spool is at its limit. Called with the lock held. */
+static SpoolSegment* addSpoolSegment(Spool *spool, char *errorMsg){
+
+	while(spool->segments >= spool->opts.maxSegments && spool->oldest)
+		removeSpoolSegment(spool, spool->oldest, 1);
+
+	char *path = malloct(strlen(spool->directory) + 32);
+	sprintf(path, "%s/%016llx%s", spool->directory, (unsigned long long)spool->nextSequence, SPOOL_SUFFIX);
+
+	SpoolSegment *segment = mapSpoolSegment(path, spool->nextSequence, spool->opts.segmentSize, 1, errorMsg);
+	free(path);
+	if(!segment)
+		return NULL;
+
+	spool->nextSequence++;
+	appendSpoolSegment(spool, segment);
+
+	return segment;
+}
+
+static int compareSpoolSequences(const void *a, const void *b){
+
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktDefaultSpoolOptions(SpoolOptions *opts){
+
+	opts->segmentSize = 4 * 1024 * 1024;
+	opts->maxSegments = 16;
+	opts->sync = 0;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+Spool* ktOpenSpool(const char *directory, const SpoolOptions *opts, char *errorMsg){
+
+	SpoolOptions defaults;
+	if(!opts){
+		ktDefaultSpoolOptions(&defaults);
+		opts = &defaults;
+	}
+
+	DIR *dir = opendir(directory);
+	if(!dir && errno == ENOENT && mkdir(directory, 0755) == 0)
+		dir = opendir(directory);
+	if(!dir){
+		if(errorMsg)
+			snprintf(errorMsg, CURL_ERROR_SIZE, "Cannot open spool directory %s: %s", directory, strerror(errno));
+		return NULL;
+	}
+
+	Spool *spool = malloct(sizeof(Spool));
+	spool->directory = malloct(strlen(directory)+1);
+	strcpy(spool->directory, directory);
+
+	/* clamp options so a segment holds at least one largest record */
+	spool->opts = *opts;
+	size_t minSize = sizeof(SpoolSegmentHeader) + spoolRecordSize(MAX_PARTITION_KEY_LENGTH + 1, MAX_RECORD_BYTES);
+	if(spool->opts.segmentSize < minSize)
+		spool->opts.segmentSize = minSize;
+	if(spool->opts.segmentSize > UINT32_MAX)
+		spool->opts.segmentSize = UINT32_MAX;
+	if(spool->opts.maxSegments < 2)
+		spool->opts.maxSegments = 2;
+
+	pthread_mutex_init(&spool->lock, NULL);
+	pthread_mutex_init(&spool->replayLock, NULL);
+	spool->oldest = spool->newest = NULL;
+	spool->segments = 0;
+	spool->nextSequence = 0;
+	memset(&spool->stats, 0, sizeof(SpoolStats));
+
+	/* collect the sequence numbers of existing segments, oldest first */
+	uint64_t *sequences = NULL;
+	int count = 0, capacity = 0;
+	struct dirent *entry;
+	while((entry = readdir(dir))){
+		size_t len = strlen(entry->d_name);
+		unsigned long long sequence;
+		char extra;
+		if(len != 16 + strlen(SPOOL_SUFFIX) || strcmp(entry->d_name + 16, SPOOL_SUFFIX) != 0 || sscanf(entry->d_name, "%16llx%c", &sequence, &extra) != 2 || extra != '.')
+			continue;
+		if(count == capacity){
+			capacity = capacity ? 2 * capacity : 16;
+			sequences = realloc(sequences, capacity * sizeof(uint64_t));
+			if(!sequences)
+				errorExit("Fatal error", "Out of memory");
+		}
+		sequences[count++] = sequence;
+	}
+	closedir(dir);
+	qsort(sequences, count, sizeof(uint64_t), compareSpoolSequences);
+
+	/* recover them, dropping fully replayed ones other than the newest, which may still be written to */
+	char *path = malloct(strlen(directory) + 32);
+	int i;
+	for(i=0; i<count; i++){
+		sprintf(path, "%s/%016llx%s", directory, (unsigned long long)sequences[i], SPOOL_SUFFIX);
+		SpoolSegment *segment = mapSpoolSegment(path, sequences[i], 0, 0, NULL);
+		if(!segment)
+			continue;
+		spool->nextSequence = sequences[i] + 1;
+		if(segment->records == 0 && i < count - 1)
+			freeSpoolSegment(segment, 1);
+		else
+			appendSpoolSegment(spool, segment);
+	}
+	free(path);
+	free(sequences);
+
+	/* keep to maxSegments, in case it was lowered */
+	while(spool->segments > spool->opts.maxSegments)
+		removeSpoolSegment(spool, spool->oldest, 1);
+
+	return spool;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktCloseSpool(Spool *spool){
+
+	while(spool->oldest){
+		SpoolSegment *next = spool->oldest->next;
+		freeSpoolSegment(spool->oldest, 0);
+		spool->oldest = next;
+	}
+
+	pthread_mutex_destroy(&spool->lock);
+	pthread_mutex_destroy(&spool->replayLock);
+	free(spool->directory);
+	free(spool);
+}
+
+/*****************************************************************************************************************/
+/* Whether a failed record is worth keeping for later: it failed for want of connectivity or capacity, not      */
+/* because Kinesis rejected it (e.g. an unknown stream), which would only fail again on replay.                  */
+/*****************************************************************************************************************/
+static int spoolableRecord(const RecordResult *result){
+
+	static const char *codes[] = {"TransportError", "HTTPError", "ProvisionedThroughputExceededException", "ThrottlingException", "LimitExceededException", "InternalFailure", "ServiceUnavailable", "InvalidResponse"};
+
+	if(result->success)
+		return 0;
+
+	size_t i;
+	for(i=0; i<sizeof(codes)/sizeof(codes[0]); i++)
+		if(strcmp(result->errorCode, codes[i]) == 0)
+			return 1;
+
+	return 0;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktSpoolRecords(Spool *spool, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, const RecordResult *results, char *errorMsg){
+
+	int spooled = 0;
+
+	pthread_mutex_lock(&spool->lock);
+
+	int i;
+	for(i=0; i<recordCount; i++){
+
+		if(results && !spoolableRecord(&results[i]))
+			continue;
+
+		size_t keyLen = strlen(partitionKeyArray[i]) + 1;
+		if(keyLen > MAX_PARTITION_KEY_LENGTH + 1 || lenArray[i] < 0 || lenArray[i] > MAX_RECORD_BYTES){
+			if(errorMsg)
+				strcpy(errorMsg, "Record too large to spool");
+			break;
+		}
+
+		size_t size = spoolRecordSize(keyLen, lenArray[i]);
+		SpoolSegment *segment = spool->newest;
+		if(!segment || segment->writeOffset + size > segment->size)
+			if(!(segment = addSpoolSegment(spool, errorMsg)))
+				break;
+
+		/* key and data first, then the header whose crc makes the record valid */
+		SpoolRecordHeader *header = (SpoolRecordHeader*)(segment->map + segment->writeOffset);
+		char *key = (char*)(header + 1);
+		memcpy(key, partitionKeyArray[i], keyLen);
+		memcpy(key + keyLen, dataArray[i], lenArray[i]);
+
+		SpoolRecordHeader h;
+		h.dataLen = lenArray[i];
+		h.keyLen = (uint16_t)keyLen;
+		h.reserved = 0;
+		h.crc = spoolRecordCRC(&h, key, (const unsigned char*)key + keyLen);
+		memcpy(header, &h, sizeof(h));
+
+		syncSpoolSegment(spool, segment, segment->writeOffset, size);
+
+		segment->writeOffset += size;
+		segment->records++;
+		segment->bytes += keyLen - 1 + lenArray[i];
+		spool->stats.records++;
+		spool->stats.bytes += keyLen - 1 + lenArray[i];
+		spooled++;
+	}
+
+	pthread_mutex_unlock(&spool->lock);
+
+	return spooled;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktReplaySpool(const AWSContext *ctx, Spool *spool, const char *streamName, const RetryPolicy *policy, char *errorMsg){
+
+	RetryPolicy defaultPolicy;
+	if(!policy){
+		ktDefaultRetryPolicy(&defaultPolicy);
+		policy = &defaultPolicy;
+	}
+
+	char *partitionKeyArray[MAX_PUT_RECORDS_COUNT];
+	unsigned char *dataArray[MAX_PUT_RECORDS_COUNT];
+	int lenArray[MAX_PUT_RECORDS_COUNT];
+	size_t endOffsets[MAX_PUT_RECORDS_COUNT];
+	RecordResult *results = malloct(MAX_PUT_RECORDS_COUNT * sizeof(RecordResult));
+
+	int replayed = 0;
+
+	pthread_mutex_lock(&spool->replayLock);
+
+	for(;;){
+
+		pthread_mutex_lock(&spool->lock);
+
+		/* drop replayed segments from the front, keeping the newest to write to */
+		SpoolSegment *segment = spool->oldest;
+		while(segment && segment->records == 0 && segment != spool->newest){
+			removeSpoolSegment(spool, segment, 0);
+			segment = spool->oldest;
+		}
+
+		if(!segment || segment->records == 0){
+			pthread_mutex_unlock(&spool->lock);
+			break;
+		}
+
+		/* a batch of records from the oldest segment, pointing into its mapping */
+		size_t offset = spoolSegmentHeader(segment)->readOffset;
+		int n = 0;
+		long bytes = 0;
+		while(n < MAX_PUT_RECORDS_COUNT && offset < segment->writeOffset){
+			const SpoolRecordHeader *header = (const SpoolRecordHeader*)(segment->map + offset);
+			long b = header->keyLen - 1 + (long)header->dataLen;
+			if(n > 0 && bytes + b > MAX_PUT_RECORDS_BYTES)
+				break;
+			partitionKeyArray[n] = (char*)(header + 1);
+			dataArray[n] = (unsigned char*)partitionKeyArray[n] + header->keyLen;
+			lenArray[n] = header->dataLen;
+			offset += spoolRecordSize(header->keyLen, header->dataLen);
+			endOffsets[n] = offset;
+			bytes += b;
+			n++;
+		}
+		segment->pinned = 1;
+
+		pthread_mutex_unlock(&spool->lock);
+
+		memset(results, 0, n * sizeof(RecordResult));
+		putRecordsWithRetry(ctx, streamName, n, partitionKeyArray, NULL, dataArray, lenArray, policy, results, errorMsg);
+
+		/* the leading records that are done with, sent or rejected for good, leave the spool; the rest wait to keep order */
+		int done = 0, sent = 0;
+		while(done < n && !spoolableRecord(&results[done]))
+			sent += results[done++].success;
+
+		pthread_mutex_lock(&spool->lock);
+
+		segment->pinned = 0;
+		if(segment->evicted){
+			/* evicted in flight: the records dealt with here were counted as evicted */
+			spool->stats.evictedRecords -= done;
+			freeSpoolSegment(segment, 0);
+		}
+		else if(done > 0){
+			SpoolSegmentHeader *header = spoolSegmentHeader(segment);
+			long long doneBytes = 0;
+			int i;
+			for(i=0; i<done; i++)
+				doneBytes += (long long)strlen(partitionKeyArray[i]) + lenArray[i];
+			header->readOffset = (uint32_t)endOffsets[done - 1];
+			syncSpoolSegment(spool, segment, 0, sizeof(SpoolSegmentHeader));
+			segment->records -= done;
+			segment->bytes -= doneBytes;
+			spool->stats.records -= done;
+			spool->stats.bytes -= doneBytes;
+		}
+		spool->stats.replayedRecords += sent;
+		spool->stats.droppedRecords += done - sent;
+
+		pthread_mutex_unlock(&spool->lock);
+
+		replayed += sent;
+		if(done < n)
+			break;
+	}
+
+	pthread_mutex_unlock(&spool->replayLock);
+
+	free(results);
+
+	return replayed;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktGetSpoolStats(Spool *spool, SpoolStats *stats){
+
+	pthread_mutex_lock(&spool->lock);
+
+	*stats = spool->stats;
+	stats->segments = spool->segments;
+
+	pthread_mutex_unlock(&spool->lock);
+}
+
+/*********************************************************************************************************/
+/* Producer internals. Records wait in a ring buffer guarded by lock. Workers sleep on workAvailable     */
+/* until a batch is due, take up to a batch worth of records off the head of the queue, post them with */
+/* ktPutRecords and report each record to its callback. spaceAvailable wakes blocked ktProducerPut     */
+/* callers and allDone wakes ktProducerFlush. Each record is one allocation holding data and key.      */
+/*********************************************************************************************************/
+typedef struct{
+	char *partitionKey;
+	unsigned char *data;
+	int len;
+	ProducerCallback callback;
+	void *userData;
+	struct timespec queued;
+}QueuedRecord;
+
+struct Producer{
+	const AWSContext *ctx;
+	char *streamName;
+	ProducerOptions opts;
+	int batchLimit;
+
+	pthread_mutex_t lock;
+	pthread_cond_t workAvailable;
+	pthread_cond_t spaceAvailable;
+	pthread_cond_t allDone;
+
+	QueuedRecord *queue;
+	int head;
+	int count;
+	long queuedBytes;
+	int inFlight;
+	int flushing;
+	int stopping;
+
+	pthread_t *workers;
+};
+
+/* bytes a record counts against the PutRecords request limit */
+static long recordBytes(const QueuedRecord *record){
+
+	return record->len + (long)strlen(record->partitionKey);
+}
+
+/*************************************************************************************************/
+/* Number of records from the head of the queue that fit in one batch. Always at least one so a */
+/* single oversized record is still sent, and rejected by Kinesis, rather than blocking forever. */
+/*************************************************************************************************/
+static int producerBatchSize(const Producer *producer){
+
+	int n = 0;
+	long bytes = 0;
+
+	while(n < producer->count && n < producer->batchLimit){
+		long b = recordBytes(&producer->queue[(producer->head + n) % producer->opts.maxQueuedRecords]);
+		if(n > 0 && bytes + b > producer->opts.maxBatchBytes)
+			break;
+		bytes += b;
+		n++;
+	}
+
+	return n;
+}
+
+/**********************************************************************************************/
+/* Decide whether a batch should go now. If not and records are waiting, deadline is set to  */
+/* the time the oldest record's linger expires. Called with the lock held.                  */
+/**********************************************************************************************/
+static int producerBatchDue(const Producer *producer, struct timespec *deadline){
+
+	if(producer->count == 0)
+		return 0;
+
+	if(producer->flushing || producer->stopping)
+		return 1;
+
+	if(producer->count >= producer->batchLimit || producer->queuedBytes >= producer->opts.maxBatchBytes)
+		return 1;
+
+	struct timespec now;
+	monotonicNow(&now);
+	*deadline = producer->queue[producer->head].queued;
+	addMilliseconds(deadline, producer->opts.lingerMs);
+
+	return !timespecBefore(&now, deadline);
+}
+
+/*******************************************************************************/
+/* Worker thread. Sends batches until the producer stops and the queue is empty */
+/*******************************************************************************/
+static void* producerWorker(void *arg){
+
+	Producer *producer = (Producer*)arg;
+
+	int maxBatch = producer->batchLimit;
+	QueuedRecord *batch = malloct(maxBatch * sizeof(QueuedRecord));
+	char **partitionKeyArray = malloct(maxBatch * sizeof(char*));
+	unsigned char **dataArray = malloct(maxBatch * sizeof(unsigned char*));
+	int *lenArray = malloct(maxBatch * sizeof(int));
+	RecordResult *results = malloct(maxBatch * sizeof(RecordResult));
+
+	pthread_mutex_lock(&producer->lock);
+
+	for(;;){
+
+		struct timespec deadline;
+		while(!producerBatchDue(producer, &deadline)){
+
+			if(producer->stopping && producer->count == 0)
+				break;
+
+			if(producer->count > 0)
+				pthread_cond_timedwait(&producer->workAvailable, &producer->lock, &deadline);
+			else
+				pthread_cond_wait(&producer->workAvailable, &producer->lock);
+		}
+
+		if(producer->count == 0)
+			break;
+
+		/* take a batch off the head of the queue */
+		int n = producerBatchSize(producer);
+		int i;
+		for(i=0; i<n; i++){
+			batch[i] = producer->queue[producer->head];
+			producer->head = (producer->head + 1) % producer->opts.maxQueuedRecords;
+			producer->queuedBytes -= recordBytes(&batch[i]);
+		}
+		producer->count -= n;
+		producer->inFlight += n;
+
+		pthread_cond_broadcast(&producer->spaceAvailable);
+
+		/* let another worker start on whatever is left while this batch is in flight */
+		if(producer->count > 0)
+			pthread_cond_signal(&producer->workAvailable);
+
+		pthread_mutex_unlock(&producer->lock);
+
+		for(i=0; i<n; i++){
+			partitionKeyArray[i] = batch[i].partitionKey;
+			dataArray[i] = batch[i].data;
+			lenArray[i] = batch[i].len;
+		}
+
+		ProducerResult result;
+		if(producer->opts.shardAware)
+			result.retcode = putRecordsByShard(producer->ctx, producer->streamName, n, partitionKeyArray, dataArray, lenArray, &producer->opts.retry, producer->opts.aggregate, results, NULL);
+		else if(producer->opts.aggregate)
+			result.retcode = putRecordsAggregatedWithRetry(producer->ctx, producer->streamName, n, partitionKeyArray, NULL, dataArray, lenArray, &producer->opts.retry, results, NULL);
+		else
+			result.retcode = putRecordsWithRetry(producer->ctx, producer->streamName, n, partitionKeyArray, NULL, dataArray, lenArray, &producer->opts.retry, results, NULL);
+
+		/* keep records that couldn't get through for a later replay, the first spooled of them if the spool fills */
+		int spooled = producer->opts.spool ? ktSpoolRecords(producer->opts.spool, n, partitionKeyArray, dataArray, lenArray, results, NULL) : 0;
+
+		for(i=0; i<n; i++){
+			result.spooled = spooled > 0 && spoolableRecord(&results[i]);
+			if(result.spooled)
+				spooled--;
+			if(batch[i].callback){
+				result.record = &results[i];
+				result.errorMsg = results[i].success ? NULL : results[i].errorMessage;
+				batch[i].callback(&result, batch[i].userData);
+			}
+			free(batch[i].partitionKey);
+		}
+
+		pthread_mutex_lock(&producer->lock);
+
+		producer->inFlight -= n;
+		if(producer->count == 0 && producer->inFlight == 0)
+			pthread_cond_broadcast(&producer->allDone);
+	}
+
+	/* wake the other workers so they see the stop too */
+	pthread_cond_broadcast(&producer->workAvailable);
+	pthread_mutex_unlock(&producer->lock);
+
+	free(batch);
+	free(partitionKeyArray);
+	free(dataArray);
+	free(lenArray);
+	free(results);
+
+	return NULL;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktDefaultProducerOptions(ProducerOptions *opts){
+
+	opts->maxQueuedRecords = 10000;
+	opts->maxBatchRecords = MAX_PUT_RECORDS_COUNT;
+	opts->maxBatchBytes = MAX_PUT_RECORDS_BYTES;
+	opts->lingerMs = 100;
+	opts->workerCount = 2;
+	opts->blockWhenFull = 0;
+	opts->aggregate = 0;
+	opts->shardAware = 0;
+	ktDefaultRetryPolicy(&opts->retry);
+	opts->spool = NULL;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+Producer* ktMakeProducer(const AWSContext *ctx, const char *streamName, const ProducerOptions *opts){
+
+	ProducerOptions defaults;
+	if(!opts){
+		ktDefaultProducerOptions(&defaults);
+		opts = &defaults;
+	}
+
+	Producer *producer = malloct(sizeof(Producer));
+
+	producer->ctx = ctx;
+	producer->streamName = malloct(strlen(streamName)+1);
+	strcpy(producer->streamName, streamName);
+
+	/* clamp options to the PutRecords limits */
+	producer->opts = *opts;
+	if(producer->opts.maxBatchRecords < 1 || producer->opts.maxBatchRecords > MAX_PUT_RECORDS_COUNT)
+		producer->opts.maxBatchRecords = MAX_PUT_RECORDS_COUNT;
+	if(producer->opts.maxBatchBytes < 1 || producer->opts.maxBatchBytes > MAX_PUT_RECORDS_BYTES)
+		producer->opts.maxBatchBytes = MAX_PUT_RECORDS_BYTES;
+	if(producer->opts.maxQueuedRecords < 1)
+		producer->opts.maxQueuedRecords = 1;
+	if(producer->opts.workerCount < 1)
+		producer->opts.workerCount = 1;
+	if(producer->opts.lingerMs < 0)
+		producer->opts.lingerMs = 0;
+
+	/* aggregated batches are bounded by bytes, any number of user records can share a Kinesis record */
+	producer->batchLimit = producer->opts.aggregate ? producer->opts.maxQueuedRecords : producer->opts.maxBatchRecords;
+
+	pthread_mutex_init(&producer->lock, NULL);
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&producer->workAvailable, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&producer->spaceAvailable, NULL);
+	pthread_cond_init(&producer->allDone, NULL);
+
+	producer->queue = malloct(producer->opts.maxQueuedRecords * sizeof(QueuedRecord));
+	producer->head = 0;
+	producer->count = 0;
+	producer->queuedBytes = 0;
+	producer->inFlight = 0;
+	producer->flushing = 0;
+	producer->stopping = 0;
+
+	producer->workers = malloct(producer->opts.workerCount * sizeof(pthread_t));
+	int i;
+	for(i=0; i<producer->opts.workerCount; i++)
+		if(pthread_create(&producer->workers[i], NULL, producerWorker, producer))
+			errorExit("Fatal Error", "Cannot create producer thread");
+
+	return producer;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktProducerPut(Producer *producer, const char *partitionKey, const unsigned char *data, int len, ProducerCallback callback, void *userData){
+
+	/* copy record outside the lock, partition key and data share one allocation */
+	size_t partitionKeyLen = strlen(partitionKey);
+	char *copy = malloct(partitionKeyLen + 1 + len);
+	memcpy(copy, partitionKey, partitionKeyLen + 1);
+	memcpy(copy + partitionKeyLen + 1, data, len);
+
+	QueuedRecord record;
+	record.partitionKey = copy;
+	record.data = (unsigned char*)copy + partitionKeyLen + 1;
+	record.len = len;
+	record.callback = callback;
+	record.userData = userData;
+	monotonicNow(&record.queued);
+
+	pthread_mutex_lock(&producer->lock);
+
+	while(producer->count == producer->opts.maxQueuedRecords && producer->opts.blockWhenFull)
+		pthread_cond_wait(&producer->spaceAvailable, &producer->lock);
+
+	if(producer->count == producer->opts.maxQueuedRecords){
+		pthread_mutex_unlock(&producer->lock);
+		free(copy);
+		return 0;
+	}
+
+	producer->queue[(producer->head + producer->count) % producer->opts.maxQueuedRecords] = record;
+	producer->count++;
+	producer->queuedBytes += recordBytes(&record);
+
+	/* the first record starts a linger timer, a full batch needs sending now */
+	if(producer->count == 1 || producer->count % producer->batchLimit == 0 || producer->queuedBytes >= producer->opts.maxBatchBytes)
+		pthread_cond_signal(&producer->workAvailable);
+
+	pthread_mutex_unlock(&producer->lock);
+
+	return 1;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktProducerFlush(Producer *producer){
+
+	pthread_mutex_lock(&producer->lock);
+
+	producer->flushing++;
+	pthread_cond_broadcast(&producer->workAvailable);
+
+	while(producer->count > 0 || producer->inFlight > 0)
+		pthread_cond_wait(&producer->allDone, &producer->lock);
+
+	producer->flushing--;
+
+	pthread_mutex_unlock(&producer->lock);
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktFreeProducer(Producer *producer){
+
+	ktProducerFlush(producer);
+
+	pthread_mutex_lock(&producer->lock);
+	producer->stopping = 1;
+	pthread_cond_broadcast(&producer->workAvailable);
+	pthread_mutex_unlock(&producer->lock);
+
+	int i;
+	for(i=0; i<producer->opts.workerCount; i++)
+		pthread_join(producer->workers[i], NULL);
+
+	pthread_cond_destroy(&producer->workAvailable);
+	pthread_cond_destroy(&producer->spaceAvailable);
+	pthread_cond_destroy(&producer->allDone);
+	pthread_mutex_destroy(&producer->lock);
+
+	free(producer->workers);
+	free(producer->queue);
+	free(producer->streamName);
+	free(producer);
+}
+
+/*****************************************************************************************************************/
+/* Record parsing, shared by GetRecords responses and SubscribeToShard events. Fields are copied, and record     */
+/* data base64 decoded, straight from the JSON into buffer, each taking no more room than its JSON string with   */
+/* one quote, so the JSON's length always suffices. buffer may also be the JSON itself, decoding in place: each  */
+/* record's fields are found first and then converted in the order they appear, so writes only ever land on      */
+/* JSON already read.                                                                                            */
+/*****************************************************************************************************************/
+
+/* Copy the JSON string at p into buffer at *used, advancing *used past it and its null. NULL if not a string or it won't fit */
+static const char* copyRecordString(const char *p, const char *end, unsigned char *buffer, size_t bufferSize, size_t *used){
+
+	const char *after = p ? jsonSkipValue(p, end) : NULL;
+	if(!after || *p != '"' || (size_t)(after - p) - 1 > bufferSize - *used)
+		return NULL;
+
+	char *out = (char*)buffer + *used;
+	*used += jsonCopyString(p, end, out, bufferSize - *used) + 1;
+
+	return out;
+}
+
+/* Decode the base64 JSON string at p into buffer at *used, advancing *used. Returns the length, or -1 */
+static long decodeRecordData(const char *p, const char *end, unsigned char *buffer, size_t bufferSize, size_t *used){
+
+	const char *after = p ? jsonSkipValue(p, end) : NULL;
+	if(!after || *p != '"')
+		return -1;
+
+	size_t len = after - p - 2;
+	if(len + 1 > bufferSize - *used)
+		return -1;
+
+	unsigned char *out = buffer + *used;
+	long n;
+	if(memchr(p + 1, '\\', len)){
+		/* escaped, say \/ , so unescape first then decode in place */
+		int unescaped = jsonCopyString(p, end, (char*)out, len + 1);
+		n = base64DecodeTo((const char*)out, unescaped, out);
+	}
+	else
+		n = base64DecodeTo(p + 1, len, out);
+
+	if(n >= 0)
+		*used += n;
+
+	return n;
+}
+
+/***************************************************************************************************************/
+/* Parse the JSON array of records at list into up to maxRecords records, their fields in buffer as above.     */
+/* Returns the number of records, or -1 if one is malformed, there are too many or buffer is too small.        */
+/***************************************************************************************************************/
+int parseRecordArray(const char *list, const char *end, ConsumerRecord *records, int maxRecords, unsigned char *buffer, size_t bufferSize){
+
+	enum {SEQUENCE_NUMBER, PARTITION_KEY, DATA, FIELD_COUNT};
+	static const char *names[FIELD_COUNT] = {"SequenceNumber", "PartitionKey", "Data"};
+
+	size_t used = 0;
+	int count = 0;
+	const char *record, *next;
+	for(record = jsonArrayFirst(list, end); record; record = next){
+
+		if(count == maxRecords)
+			return -1;
+
+		/* everything is read from the record, the next one located too, before anything is written */
+		const char *fields[FIELD_COUNT];
+		int i, order[FIELD_COUNT] = {SEQUENCE_NUMBER, PARTITION_KEY, DATA};
+		for(i=0; i<FIELD_COUNT; i++)
+			if(!(fields[i] = jsonFindMember(record, end, names[i])))
+				return -1;
+
+		ConsumerRecord *r = &records[count++];
+		const char *arrival = jsonFindMember(record, end, "ApproximateArrivalTimestamp");
+		r->arrivalTime = arrival ? strtod(arrival, NULL) : 0;
+		r->shardId = NULL;
+		next = jsonArrayNext(record, end);
+
+		/* three fields, sorted by position */
+		int j, t;
+		for(i=1; i<FIELD_COUNT; i++)
+			for(j=i; j>0 && fields[order[j]] < fields[order[j-1]]; j--){
+				t = order[j];
+				order[j] = order[j-1];
+				order[j-1] = t;
+			}
+
+		for(i=0; i<FIELD_COUNT; i++){
+			if(order[i] == DATA){
+				r->data = buffer + used;
+				long n = decodeRecordData(fields[DATA], end, buffer, bufferSize, &used);
+				if(n < 0)
+					return -1;
+				r->len = (int)n;
+			}
+			else{
+				const char *copy = copyRecordString(fields[order[i]], end, buffer, bufferSize, &used);
+				if(!copy)
+					return -1;
+				if(order[i] == SEQUENCE_NUMBER)
+					r->sequenceNumber = copy;
+				else
+					r->partitionKey = copy;
+			}
+		}
+	}
+
+	return count;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktParseGetRecords(const char *body, size_t len, ConsumerRecord *records, int maxRecords, unsigned char *buffer, size_t bufferSize, char *nextShardIterator, size_t iteratorSize, long long *millisBehindLatest){
+
+	const char *end = body + len;
+	const char *list = jsonFindMember(body, end, "Records");
+	if(!list)
+		return -1;
+
+	if(nextShardIterator){
+		const char *next = jsonFindMember(body, end, "NextShardIterator");
+		const char *after = next ? jsonSkipValue(next, end) : NULL;
+		if(next && *next == '"' && (!after || (size_t)(after - next) - 1 > iteratorSize))
+			return -1;
+		if(!next || jsonCopyString(next, end, nextShardIterator, iteratorSize) < 0)
+			*nextShardIterator = '\0';
+	}
+
+	if(millisBehindLatest){
+		const char *behind = jsonFindMember(body, end, "MillisBehindLatest");
+		*millisBehindLatest = behind ? strtoll(behind, NULL, 10) : 0;
+	}
+
+	return parseRecordArray(list, end, records, maxRecords, buffer, bufferSize);
+}
+
+/*****************************************************************************************************************/
+/* Event stream parser. Bytes are gathered in one buffer until a whole message is there, then the message is     */
+/* checked and handed to the callback where it lies, so payloads are never copied again. Whatever follows the    */
+/* last whole message is moved to the front of the buffer to wait for the rest.                                  */
+/*****************************************************************************************************************/
+#define EVENT_STREAM_PRELUDE_SIZE 12
+#define EVENT_STREAM_OVERHEAD 16
+
+struct EventStreamParser{
+	unsigned char *buffer;
+	size_t len;
+	size_t capacity;
+	size_t maxMessageLen;
+	int failed;
+};
+
+static uint32_t readBigEndian32(const unsigned char *p){
+
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* copy a string header value of len chars to out, truncating to fit outSize */
+static void copyHeaderValue(const unsigned char *value, size_t len, char *out, size_t outSize){
+
+	if(len >= outSize)
+		len = outSize - 1;
+	memcpy(out, value, len);
+	out[len] = '\0';
+}
+
+/***************************************************************************************************************/
+/* Read the headers of len bytes at p into message, keeping the ones kt acts on. Returns 0 if malformed.       */
+/* Each is a 1 byte name length, the name, a 1 byte type and a value whose size depends on the type.           */
+/***************************************************************************************************************/
+static int parseEventStreamHeaders(const unsigned char *p, size_t len, EventStreamMessage *message){
+
+	static const int fixedSizes[10] = {0, 0, 1, 2, 4, 8, -1, -1, 8, 16};
+	const unsigned char *end = p + len;
+
+	*message->messageType = *message->eventType = *message->contentType = '\0';
+
+	while(p < end){
+
+		size_t nameLen = *p++;
+		if(nameLen == 0 || (size_t)(end - p) < nameLen + 1)
+			return 0;
+		const char *name = (const char*)p;
+		p += nameLen;
+
+		unsigned char type = *p++;
+		if(type > 9)
+			return 0;
+
+		size_t valueLen;
+		if(fixedSizes[type] >= 0)
+			valueLen = fixedSizes[type];
+		else{
+			/* byte array or string, 2 byte length first */
+			if(end - p < 2)
+				return 0;
+			valueLen = (size_t)p[0] << 8 | p[1];
+			p += 2;
+		}
+		if((size_t)(end - p) < valueLen)
+			return 0;
+
+		if(type == 7){
+			if(nameLen == 13 && memcmp(name, ":message-type", 13) == 0)
+				copyHeaderValue(p, valueLen, message->messageType, sizeof(message->messageType));
+			else if((nameLen == 11 && memcmp(name, ":event-type", 11) == 0) || (nameLen == 15 && memcmp(name, ":exception-type", 15) == 0) || (nameLen == 11 && memcmp(name, ":error-code", 11) == 0))
+				copyHeaderValue(p, valueLen, message->eventType, sizeof(message->eventType));
+			else if(nameLen == 13 && memcmp(name, ":content-type", 13) == 0)
+				copyHeaderValue(p, valueLen, message->contentType, sizeof(message->contentType));
+		}
+		p += valueLen;
+	}
+
+	return 1;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+EventStreamParser* ktMakeEventStreamParser(size_t maxMessageLen){
+
+	EventStreamParser *parser = malloct(sizeof(EventStreamParser));
+	memset(parser, 0, sizeof(EventStreamParser));
+	parser->maxMessageLen = maxMessageLen;
+
+	return parser;
+}
+
+/* stop parser for good, with the reason in errorMsg */
+static int eventStreamFailed(EventStreamParser *parser, const char *reason, char *errorMsg){
+
+	parser->failed = 1;
+	if(errorMsg)
+		snprintf(errorMsg, CURL_ERROR_SIZE, "Event stream %s", reason);
+
+	return 0;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktEventStreamParse(EventStreamParser *parser, const void *data, size_t len, EventStreamCallback callback, void *userData, char *errorMsg){
+
+	if(parser->failed)
+		return eventStreamFailed(parser, "has already failed", errorMsg);
+
+	if(parser->len + len > parser->capacity){
+		size_t capacity = parser->capacity ? parser->capacity : 65536;
+		while(parser->len + len > capacity)
+			capacity *= 2;
+		parser->buffer = realloc(parser->buffer, capacity);
+		if(!parser->buffer)
+			errorExit("Fatal Error", "Cannot malloc memory");
+		parser->capacity = capacity;
+	}
+	memcpy(parser->buffer + parser->len, data, len);
+	parser->len += len;
+
+	size_t offset = 0;
+	while(parser->len - offset >= EVENT_STREAM_PRELUDE_SIZE){
+
+		unsigned char *m = parser->buffer + offset;
+		uint32_t total = readBigEndian32(m), headersLen = readBigEndian32(m + 4);
+
+		/* the prelude is checked as soon as it is in, so a corrupt length can't have us wait for bytes that never come */
+		if(crc32(0, m, 8) != readBigEndian32(m + 8))
+			return eventStreamFailed(parser, "prelude CRC mismatch", errorMsg);
+		if(total < EVENT_STREAM_OVERHEAD || headersLen > total - EVENT_STREAM_OVERHEAD || total > parser->maxMessageLen)
+			return eventStreamFailed(parser, "message length invalid", errorMsg);
+		if(parser->len - offset < total)
+			break;
+		if(crc32(0, m, total - 4) != readBigEndian32(m + total - 4))
+			return eventStreamFailed(parser, "message CRC mismatch", errorMsg);
+
+		EventStreamMessage message;
+		if(!parseEventStreamHeaders(m + EVENT_STREAM_PRELUDE_SIZE, headersLen, &message))
+			return eventStreamFailed(parser, "headers malformed", errorMsg);
+		message.payload = m + EVENT_STREAM_PRELUDE_SIZE + headersLen;
+		message.payloadLen = total - EVENT_STREAM_OVERHEAD - headersLen;
+
+		if(!callback(&message, userData))
+			return eventStreamFailed(parser, "stopped by callback", errorMsg);
+
+		offset += total;
+	}
+
+	memmove(parser->buffer, parser->buffer + offset, parser->len - offset);
+	parser->len -= offset;
+
+	return 1;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktFreeEventStreamParser(EventStreamParser *parser){
+
+	if(!parser)
+		return;
+
+	free(parser->buffer);
+	free(parser);
+}
+
+/*****************************************************************************************************************/
+/* SubscribeToShard. The response body goes through a streaming sink into an EventStreamParser, and each         */
+/* SubscribeToShardEvent is decoded in place in its message and passed on. A refused subscription has a JSON     */
+/* body instead, told apart by the status line, which curl has passed to the header sink by the first body byte. */
+/* Events are at most a few MB, so messages over EVENT_STREAM_MAX_MESSAGE break the stream.                      */
+/*****************************************************************************************************************/
+#define EVENT_STREAM_MAX_MESSAGE (16*1024*1024)
+
+typedef struct{
+	const char *shardId;
+	SubscribeToShardCallback callback;
+	void *userData;
+	EventStreamParser *parser;
+	httpResponseSink header;
+	httpResponseSink refusal;
+	int status;
+	int stopped;
+	char errorType[128];
+	char exceptionMessage[CURL_ERROR_SIZE];
+	char errorMessage[CURL_ERROR_SIZE];
+	ConsumerRecord *records;
+	int recordCapacity;
+}Subscription;
+
+/* status of the last response in the header sink, after any 100 Continue */
+static int lastResponseStatus(const httpResponseSink *header){
+
+	const char *line = NULL, *p = header->text;
+	while(p && (p = strstr(p, "HTTP/")) != NULL){
+		if(p == header->text || p[-1] == '\n')
+			line = p;
+		p += 5;
+	}
+
+	const char *space = line ? strchr(line, ' ') : NULL;
+
+	return space ? atoi(space + 1) : 0;
+}
+
+/* Decode a SubscribeToShardEvent payload in place and pass it to the callback. Returns the callback's answer, or 0 if malformed. */
+static int subscriptionEvent(Subscription *subscription, char *payload, size_t len){
+
+	const char *end = payload + len;
+	SubscribeToShardEvent event;
+	memset(&event, 0, sizeof(event));
+	event.shardId = subscription->shardId;
+
+	/* everything but the records is read before they are decoded over the payload */
+	char continuation[130];
+	event.continuationSequenceNumber = jsonCopyMember(payload, end, "ContinuationSequenceNumber", continuation, sizeof(continuation)) > 0 ? continuation : NULL;
+	const char *behind = jsonFindMember(payload, end, "MillisBehindLatest");
+	event.millisBehindLatest = behind ? strtoll(behind, NULL, 10) : 0;
+
+	const char *children = jsonFindMember(payload, end, "ChildShards");
+	const char *child;
+	for(child = children ? jsonArrayFirst(children, end) : NULL; child && event.childShardCount < 2; child = jsonArrayNext(child, end)){
+		ChildShard *c = &event.childShards[event.childShardCount];
+		memset(c, 0, sizeof(ChildShard));
+		if(jsonCopyMember(child, end, "ShardId", c->shardId, sizeof(c->shardId)) < 1)
+			continue;
+		const char *parents = jsonFindMember(child, end, "ParentShards");
+		const char *parent;
+		int i = 0;
+		for(parent = parents ? jsonArrayFirst(parents, end) : NULL; parent && i < 2; parent = jsonArrayNext(parent, end))
+			if(jsonCopyString(parent, end, c->parentShardIds[i], sizeof(c->parentShardIds[i])) > 0)
+				i++;
+		event.childShardCount++;
+	}
+
+	const char *list = jsonFindMember(payload, end, "Records");
+	const char *record;
+	int count = 0;
+	for(record = list ? jsonArrayFirst(list, end) : NULL; record; record = jsonArrayNext(record, end))
+		count++;
+	if(count > subscription->recordCapacity){
+		free(subscription->records);
+		subscription->recordCapacity = count;
+		subscription->records = malloct(count * sizeof(ConsumerRecord));
+	}
+
+	event.records = subscription->records;
+	event.recordCount = list ? parseRecordArray(list, end, event.records, count, (unsigned char*)payload, len) : 0;
+	if(event.recordCount < 0)
+		return 0;
+
+	int i;
+	for(i=0; i<event.recordCount; i++)
+		event.records[i].shardId = subscription->shardId;
+
+	if(!subscription->callback(&event, subscription->userData)){
+		subscription->stopped = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* EventStreamCallback for a subscription: events go to subscriptionEvent, exceptions end it */
+static int subscriptionMessage(const EventStreamMessage *message, void *userData){
+
+	Subscription *subscription = (Subscription*)userData;
+
+	if(strcmp(message->messageType, "event") == 0){
+		if(strcmp(message->eventType, "SubscribeToShardEvent") == 0)
+			return subscriptionEvent(subscription, (char*)message->payload, message->payloadLen);
+		return 1; /* initial-response */
+	}
+
+	snprintf(subscription->errorType, sizeof(subscription->errorType), "%s", *message->eventType ? message->eventType : "UnknownException");
+	/* kept apart from errorMessage, which the parser then fills with why it stopped */
+	if(jsonCopyMember((const char*)message->payload, (const char*)message->payload + message->payloadLen, "message", subscription->exceptionMessage, sizeof(subscription->exceptionMessage)) < 0)
+		*subscription->exceptionMessage = '\0';
+
+	return 0;
+}
+
+/* httpResponseSink chunk handler for a subscription's body */
+static size_t subscriptionChunk(const char *chunk, size_t len, void *userData){
+
+	Subscription *subscription = (Subscription*)userData;
+
+	if(!subscription->status)
+		subscription->status = lastResponseStatus(&subscription->header);
+
+	if(subscription->status != 200)
+		return curlResponseCallback((void*)chunk, 1, len, &subscription->refusal);
+
+	return ktEventStreamParse(subscription->parser, chunk, len, subscriptionMessage, subscription, subscription->errorMessage) ? len : 0;
+}
+
+/***************************************************************************************************************/
+/* ktSubscribeToShard, with cancel as for curlDoEventStreamPost. A cancelled subscription returns 200.         */
+/***************************************************************************************************************/
+int subscribeToShard(const AWSContext *ctx, const char *consumerARN, const char *shardId, const char *startingPositionType, const char *startingSequenceNumber, SubscribeToShardCallback callback, void *userData, const int *cancel, char *errorMsg){
+
+	static const char *target = "Kinesis_20131202.SubscribeToShard";
+
+	/* make date strings */
+	char longDate[17], shortDate[9];
+	makeDateStrings(longDate, shortDate);
+
+	/* make payload */
+	char payloadHash[65];
+	char *payload = makeSubscribeToShardPayload(consumerARN, shardId, startingPositionType, startingSequenceNumber, payloadHash);
+
+	/* make Authorization header, signed with today's cached signing key */
+	unsigned char signingKey[32];
+	const Credentials *credentials = currentCredentials(ctx);
+	getSigningKey(ctx, credentials, shortDate, signingKey);
+	char *authHeader = makeAuthHeader(signingKey, credentials->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payloadHash, jsonContentType, NULL);
+
+	/* make all headers */
+	AWSHeaders *headers = makeAWSHeaders(authHeader, credentials->sessionToken, target, longDate, jsonContentType, NULL);
+
+	Subscription subscription;
+	memset(&subscription, 0, sizeof(subscription));
+	subscription.shardId = shardId;
+	subscription.callback = callback;
+	subscription.userData = userData;
+	subscription.parser = ktMakeEventStreamParser(EVENT_STREAM_MAX_MESSAGE);
+
+	httpResponseSink body;
+	ktInitResponseSink(&body);
+	body.onChunk = subscriptionChunk;
+	body.userData = &subscription;
+
+	char curlError[CURL_ERROR_SIZE] = "";
+	int retcode = curlDoEventStreamPost(ctx->pool, ctx->url, headers, payload, strlen(payload), &subscription.header, &body, cancel, curlError);
+
+	if(subscription.stopped || (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED)))
+		retcode = 200;
+	else if(*subscription.errorType){
+		retcode = 0;
+		if(errorMsg)
+			snprintf(errorMsg, CURL_ERROR_SIZE, "%.100s: %.150s", subscription.errorType, subscription.exceptionMessage);
+	}
+	else if(retcode == 200 && subscription.parser->failed){
+		retcode = 0;
+		if(errorMsg)
+			snprintf(errorMsg, CURL_ERROR_SIZE, "%s", subscription.errorMessage);
+	}
+	else if(retcode != 200 && errorMsg){
+		char type[128] = "", message[CURL_ERROR_SIZE - 130] = "";
+		if(retcode && subscription.refusal.text){
+			const char *end = subscription.refusal.text + subscription.refusal.len;
+			jsonCopyMember(subscription.refusal.text, end, "__type", type, sizeof(type));
+			jsonCopyMember(subscription.refusal.text, end, "message", message, sizeof(message));
+		}
+		if(*type)
+			snprintf(errorMsg, CURL_ERROR_SIZE, "%s: %s", type, message);
+		else
+			snprintf(errorMsg, CURL_ERROR_SIZE, "%s", retcode ? "Subscription refused" : curlError);
+	}
+
+	/* cleanup */
+	ktFreeEventStreamParser(subscription.parser);
+	ktFreeResponseSink(&subscription.header);
+	ktFreeResponseSink(&subscription.refusal);
+	free(subscription.records);
+	free(payload);
+	free(authHeader);
+	freeAWSHeaders(headers);
+
+	return retcode;
+}
+
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+int ktSubscribeToShard(const AWSContext *ctx, const char *consumerARN, const char *shardId, const char *startingPositionType, const char *startingSequenceNumber, SubscribeToShardCallback callback, void *userData, char *errorMsg){
+
+	return subscribeToShard(ctx, consumerARN, shardId, startingPositionType, startingSequenceNumber, callback, userData, NULL, errorMsg);
+}
+
+/*****************************************************************************************************************/
+/* Consumer internals. Shards live in an array guarded by lock, only ever appended to, so workers keep indices   */
+/* across unlocked calls. A worker claims the due shard that has waited longest by setting busy, polls it        */
+/* without the lock, then records the new iterator and checkpoint and sets when it is next due. Refreshing the   */
+/* shard list and saving checkpoints fall to whichever worker finds them due. A shard's sequenceNumber is its    */
+/* checkpoint: the last record handed to the callback, or CONSUMER_SHARD_END once it is closed and fully read.   */
+/*****************************************************************************************************************/
+#define CONSUMER_MIN_POLL_MS 200
+#define CONSUMER_THROTTLED_WAIT_MS 1000
+#define CONSUMER_SHARD_END "SHARD_END"
+#define MAX_SEQUENCE_NUMBER_LENGTH 128
+#define MAX_SHARD_ITERATOR_LENGTH 1024
+
+typedef struct{
+	char shardId[64];
+	char parentShardIds[2][64];
+	char *iterator;
+	char sequenceNumber[MAX_SEQUENCE_NUMBER_LENGTH + 1];
+	int startAtLatest;
+	int busy;
+	struct timespec due;
+}ConsumerShard;
+
+struct Consumer{
+	const AWSContext *ctx;
+	char *streamName;
+	ConsumerOptions opts;
+	char *checkpointFile;
+	char *consumerARN;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_mutex_t checkpointLock;
+
+	ConsumerShard *shards;
+	int shardCount;
+	int shardCapacity;
+	int stopping;
+	int dirty;
+	int refreshing;
+	struct timespec nextRefresh;
+	struct timespec nextCheckpoint;
+	ConsumerStats stats;
+
+	pthread_t *workers;
+};
+
+/* Outcome of one poll of a shard, applied to the shard and stats under the lock */
+typedef struct{
+	char *iterator;
+	char sequenceNumber[MAX_SEQUENCE_NUMBER_LENGTH + 1];
+	int waitMs;
+	int records;
+	long long bytes;
+	int calls;
+	int throttled;
+	int failed;
+}ShardPoll;
+
+/* index of shardId, or -1. Caller holds the lock */
+static int findConsumerShard(const Consumer *consumer, const char *shardId){
+
+	int i;
+	for(i=0; i<consumer->shardCount; i++)
+		if(strcmp(consumer->shards[i].shardId, shardId) == 0)
+			return i;
+
+	return -1;
+}
+
+/* append a shard with no checkpoint, due now. Caller holds the lock */
+static ConsumerShard* addConsumerShard(Consumer *consumer, const char *shardId){
+
+	if(consumer->shardCount == consumer->shardCapacity){
+		consumer->shardCapacity = consumer->shardCapacity ? 2 * consumer->shardCapacity : 16;
+		consumer->shards = realloc(consumer->shards, consumer->shardCapacity * sizeof(ConsumerShard));
+		if(!consumer->shards)
+			errorExit("Fatal Error", "Cannot malloc memory");
+	}
+
+	ConsumerShard *shard = &consumer->shards[consumer->shardCount++];
+	memset(shard, 0, sizeof(ConsumerShard));
+	snprintf(shard->shardId, sizeof(shard->shardId), "%s", shardId);
+	monotonicNow(&shard->due);
+
+	return shard;
+}
+
+/* a shard may be read once the parents still listed have been read to their end. Caller holds the lock */
+static int consumerShardReady(const Consumer *consumer, const ConsumerShard *shard){
+
+	if(shard->busy || strcmp(shard->sequenceNumber, CONSUMER_SHARD_END) == 0)
+		return 0;
+
+	int i;
+	for(i=0; i<2; i++){
+		int parent = *shard->parentShardIds[i] ? findConsumerShard(consumer, shard->parentShardIds[i]) : -1;
+		if(parent >= 0 && strcmp(consumer->shards[parent].sequenceNumber, CONSUMER_SHARD_END) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* error type of a failed call's body, "" if there is none */
+static void consumerErrorType(const httpResponseSink *body, char *type, size_t size){
+
+	*type = '\0';
+	if(body->text && jsonCopyMember(body->text, body->text + body->len, "__type", type, size) < 0)
+		*type = '\0';
+}
+
+/***************************************************************************************************************/
+/* List every shard of the stream, open and closed, with paged DescribeStream calls, adding those not yet      */
+/* known. Shards found on the first listing start at the newest record if the options ask; shards found later  */
+/* are children of a reshard and always start at their oldest. Returns as the kt* functions.                   */
+/***************************************************************************************************************/
+static int refreshConsumerShards(Consumer *consumer, int first, char *errorMsg){
+
+	httpResponseSink body;
+	ktInitResponseSink(&body);
+
+	char lastShardId[64] = "";
+	int hasMore = 1, retcode = 200, added = 0;
+
+	while(hasMore && retcode == 200){
+
+		retcode = describeStream(consumer->ctx, consumer->streamName, *lastShardId ? lastShardId : NULL, NULL, &body, errorMsg);
+		if(retcode != 200){
+			char type[128];
+			consumerErrorType(&body, type, sizeof(type));
+			if(retcode && errorMsg)
+				snprintf(errorMsg, 256, "DescribeStream failed with HTTP %d %s", retcode, type);
+			break;
+		}
+
+		const char *end = body.text + body.len;
+		const char *description = jsonFindMember(body.text, end, "StreamDescription");
+		const char *shards = description ? jsonFindMember(description, end, "Shards") : NULL;
+		const char *more = description ? jsonFindMember(description, end, "HasMoreShards") : NULL;
+		hasMore = more && strncmp(more, "true", 4) == 0;
+
+		if(!shards){
+			if(errorMsg)
+				strcpy(errorMsg, "DescribeStream response has no shard list");
+			retcode = 0;
+			break;
+		}
+
+		const char *item;
+		*lastShardId = '\0';
+		pthread_mutex_lock(&consumer->lock);
+		for(item = jsonArrayFirst(shards, end); item; item = jsonArrayNext(item, end)){
+
+			char shardId[64];
+			if(jsonCopyMember(item, end, "ShardId", shardId, sizeof(shardId)) < 1)
+				continue;
+			strcpy(lastShardId, shardId);
+
+			/* shards already known may have come from the checkpoint file, without their parents */
+			int i = findConsumerShard(consumer, shardId);
+			ConsumerShard *shard = i >= 0 ? &consumer->shards[i] : addConsumerShard(consumer, shardId);
+			jsonCopyMember(item, end, "ParentShardId", shard->parentShardIds[0], sizeof(shard->parentShardIds[0]));
+			jsonCopyMember(item, end, "AdjacentParentShardId", shard->parentShardIds[1], sizeof(shard->parentShardIds[1]));
+			if(i < 0){
+				shard->startAtLatest = first && consumer->opts.startAtLatest;
+				added++;
+			}
+		}
+		if(added)
+			pthread_cond_broadcast(&consumer->wake);
+		pthread_mutex_unlock(&consumer->lock);
+
+		if(hasMore && !*lastShardId)
+			break;
+	}
+
+	ktFreeResponseSink(&body);
+
+	return retcode;
+}
+
+/* Read checkpoints from the file, one "shardId sequenceNumber" line per shard. A missing file is no checkpoints. */
+static int loadConsumerCheckpoint(Consumer *consumer, char *errorMsg){
+
+	FILE *file = fopen(consumer->checkpointFile, "r");
+	if(!file){
+		if(errno == ENOENT)
+			return 1;
+		if(errorMsg)
+			snprintf(errorMsg, 256, "Cannot read checkpoint file %s: %s", consumer->checkpointFile, strerror(errno));
+		return 0;
+	}
+
+	char shardId[64], sequenceNumber[MAX_SEQUENCE_NUMBER_LENGTH + 1];
+	while(fscanf(file, "%63s %128s", shardId, sequenceNumber) == 2){
+		int i = findConsumerShard(consumer, shardId);
+		ConsumerShard *shard = i >= 0 ? &consumer->shards[i] : addConsumerShard(consumer, shardId);
+		strcpy(shard->sequenceNumber, sequenceNumber);
+	}
+
+	fclose(file);
+
+	return 1;
+}
+
+/* Write every shard's checkpoint to a temporary file, then rename it over the checkpoint file */
+static int saveConsumerCheckpoint(Consumer *consumer, char *errorMsg){
+
+	pthread_mutex_lock(&consumer->checkpointLock);
+
+	/* take the checkpoints under the lock, write them without it */
+	pthread_mutex_lock(&consumer->lock);
+	size_t size = 1, len = 0;
+	int i;
+	for(i=0; i<consumer->shardCount; i++)
+		size += sizeof(consumer->shards[i].shardId) + sizeof(consumer->shards[i].sequenceNumber) + 2;
+	char *text = malloct(size);
+	for(i=0; i<consumer->shardCount; i++)
+		if(*consumer->shards[i].sequenceNumber)
+			len += sprintf(text + len, "%s %s\n", consumer->shards[i].shardId, consumer->shards[i].sequenceNumber);
+	consumer->dirty = 0;
+	pthread_mutex_unlock(&consumer->lock);
+
+	char *temporary = malloct(strlen(consumer->checkpointFile) + 5);
+	sprintf(temporary, "%s.tmp", consumer->checkpointFile);
+
+	int ok = 0;
+	int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd >= 0){
+		ok = write(fd, text, len) == (ssize_t)len && fsync(fd) == 0;
+		ok = close(fd) == 0 && ok;
+		ok = ok && rename(temporary, consumer->checkpointFile) == 0;
+	}
+	if(!ok){
+		if(errorMsg)
+			snprintf(errorMsg, 256, "Cannot write checkpoint file %s: %s", consumer->checkpointFile, strerror(errno));
+		pthread_mutex_lock(&consumer->lock);
+		consumer->dirty = 1;
+		pthread_mutex_unlock(&consumer->lock);
+	}
+
+	free(temporary);
+	free(text);
+	pthread_mutex_unlock(&consumer->checkpointLock);
+
+	return ok;
 }
 
-/****************************************************************************************************************/
-/* AWSHeaders wraps headers required for HTTP post. Use makeAWSHeaders to construct and freeAWSHeaders to free. */
-/****************************************************************************************************************/
+/***************************************************************************************************************/
+/* Refresh the shard list or save checkpoints if either is due, dropping the lock meanwhile. Caller holds the  */
+/* lock. Returns 1 if it did either, so the caller can look again at what changed.                             */
+/***************************************************************************************************************/
+static int consumerHousekeeping(Consumer *consumer){
+
+	struct timespec now;
+	monotonicNow(&now);
+
+	if(!consumer->refreshing && !timespecBefore(&now, &consumer->nextRefresh)){
+		consumer->refreshing = 1;
+		pthread_mutex_unlock(&consumer->lock);
+		refreshConsumerShards(consumer, 0, NULL);
+		pthread_mutex_lock(&consumer->lock);
+		consumer->refreshing = 0;
+		monotonicNow(&consumer->nextRefresh);
+		addMilliseconds(&consumer->nextRefresh, consumer->opts.shardRefreshMs);
+		return 1;
+	}
+
+	if(consumer->checkpointFile && consumer->dirty && !timespecBefore(&now, &consumer->nextCheckpoint)){
+		consumer->nextCheckpoint = now;
+		addMilliseconds(&consumer->nextCheckpoint, consumer->opts.checkpointIntervalMs);
+		pthread_mutex_unlock(&consumer->lock);
+		saveConsumerCheckpoint(consumer, NULL);
+		pthread_mutex_lock(&consumer->lock);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* a fan-out subscription in progress */
 typedef struct{
-	char *authorization;
-	char *contentType;
-	char *expect;
-	char *xAMZSecurityToken;
-	char *xAMZTarget;
-	char *xAMZDate;
-}AWSHeaders;
+	Consumer *consumer;
+	const char *shardId;
+	ShardPoll *poll;
+}ConsumerSubscription;
 
-/****************************************************************************************************************************************************/
-/* AWSHeaders constructor. Makes all headers need for a successful POST. sessionToken only required for temporary credentials otherwise set to NULL */
-/****************************************************************************************************************************************************/
-AWSHeaders* makeAWSHeaders(const char *authHeader, const char *sessionToken, const char *target, const char *longDate){
+/***************************************************************************************************************/
+/* SubscribeToShardCallback for a fan-out consumer. Records go to the consumer's callback, then the shard's    */
+/* checkpoint moves to the continuation sequence number at once, as the subscription may run for minutes, and  */
+/* any child shards are added. Housekeeping is done here too in case every worker is subscribed.               */
+/***************************************************************************************************************/
+static int consumerSubscriptionEvent(const SubscribeToShardEvent *event, void *userData){
 
-	AWSHeaders* headers = malloct(sizeof(AWSHeaders));
+	ConsumerSubscription *subscription = (ConsumerSubscription*)userData;
+	Consumer *consumer = subscription->consumer;
+	ShardPoll *poll = subscription->poll;
 
-	headers->authorization = malloct(strlen(authHeader)+1);
-	strcpy(headers->authorization, authHeader);
-	
-	headers->contentType = "Content-Type: application/x-amz-json-1.1";
-	headers->expect = "Expect:";
+	if(event->recordCount > 0)
+		consumer->opts.callback(event->records, event->recordCount, event->millisBehindLatest, consumer->opts.userData);
 
-	headers->xAMZSecurityToken = NULL;
-	if(sessionToken){
-		headers->xAMZSecurityToken = (char*) malloct(strlen(sessionToken) + 25);
-		sprintf(headers->xAMZSecurityToken, "x-amz-security-token: %s", sessionToken);
+	long long bytes = 0;
+	int i;
+	for(i=0; i<event->recordCount; i++)
+		bytes += event->records[i].len;
+
+	snprintf(poll->sequenceNumber, sizeof(poll->sequenceNumber), "%s", event->continuationSequenceNumber ? event->continuationSequenceNumber : CONSUMER_SHARD_END);
+
+	pthread_mutex_lock(&consumer->lock);
+
+	ConsumerShard *shard = &consumer->shards[findConsumerShard(consumer, subscription->shardId)];
+	if(strcmp(shard->sequenceNumber, poll->sequenceNumber) != 0){
+		strcpy(shard->sequenceNumber, poll->sequenceNumber);
+		consumer->dirty = 1;
+		if(!event->continuationSequenceNumber)
+			consumer->stats.finishedShards++;
 	}
-	
-	headers->xAMZTarget = (char*) malloct(strlen(target) + 25);
-	sprintf(headers->xAMZTarget, "x-amz-target: %s", target);
-	
-	headers->xAMZDate = (char*) malloct(strlen(longDate) + 25);
-	sprintf(headers->xAMZDate, "x-amz-date: %s", longDate);
-	
-	return headers;
-};
+	consumer->stats.records += event->recordCount;
+	consumer->stats.bytes += bytes;
 
-/*************************/
-/* AWSHeaders destructor */
-/*************************/
-void freeAWSHeaders(AWSHeaders* headers){
-	
-	free(headers->authorization);
-	free(headers->xAMZSecurityToken);
-	free(headers->xAMZTarget);
-	free(headers->xAMZDate);
-	free(headers);
+	for(i=0; i<event->childShardCount; i++)
+		if(findConsumerShard(consumer, event->childShards[i].shardId) < 0){
+			ConsumerShard *child = addConsumerShard(consumer, event->childShards[i].shardId);
+			memcpy(child->parentShardIds, event->childShards[i].parentShardIds, sizeof(child->parentShardIds));
+		}
+	if(event->childShardCount || !event->continuationSequenceNumber)
+		pthread_cond_broadcast(&consumer->wake);
+
+	consumerHousekeeping(consumer);
+	int stopping = consumer->stopping;
+
+	pthread_mutex_unlock(&consumer->lock);
+
+	return !stopping && event->continuationSequenceNumber;
 }
 
-/**************************************************************************************/
-/* Curl specific callback function to process response header and response body data. */
-/* First MAX_CURL_RESPONSE_DATA_SIZE maximum chars are saved.                         */
-/**************************************************************************************/
-static size_t curlResponseCallback(void *contents, size_t size, size_t nmemb, void *userp)
-{
-	httpResponse *response = (httpResponse*)userp;
+/***************************************************************************************************************/
+/* Read a shard by SubscribeToShard, without the lock, from after its checkpoint, until the subscription ends. */
+/***************************************************************************************************************/
+static void subscribeConsumerShard(Consumer *consumer, const char *shardId, int startAtLatest, ShardPoll *poll){
 
-	int realSize = size*nmemb;
-	int spaceRemaining = MAX_HTTP_RESPONSE_SIZE -1 - response->len;
-	int copySize = 0;
-	
-	if(realSize <= spaceRemaining)
-		copySize=realSize;
-	else
-		copySize=spaceRemaining;
-	
-	/* copy and null terminate */
-	memcpy(&(response->text[response->len]), contents, copySize);
-	response->len+=copySize;
-	response->text[(response->len)]='\0';
-	
-	return realSize;
+	ConsumerSubscription subscription = {consumer, shardId, poll};
+	char errorMsg[CURL_ERROR_SIZE], sequenceNumber[MAX_SEQUENCE_NUMBER_LENGTH + 1];
+
+	strcpy(sequenceNumber, poll->sequenceNumber);
+	const char *positionType = *sequenceNumber ? "AFTER_SEQUENCE_NUMBER" : startAtLatest ? "LATEST" : "TRIM_HORIZON";
+
+	/* counted now rather than in poll, as a subscription lasts minutes */
+	pthread_mutex_lock(&consumer->lock);
+	consumer->stats.getRecordsCalls++;
+	pthread_mutex_unlock(&consumer->lock);
+
+	*errorMsg = '\0';
+	int retcode = subscribeToShard(consumer->ctx, consumer->consumerARN, shardId, positionType, *sequenceNumber ? sequenceNumber : NULL,
+		consumerSubscriptionEvent, &subscription, &consumer->stopping, errorMsg);
+
+	/* a subscription that ran its course is renewed at once */
+	poll->waitMs = 0;
+	if(retcode == 200)
+		return;
+
+	if(strncmp(errorMsg, "ResourceNotFoundException:", 26) == 0)
+		strcpy(poll->sequenceNumber, CONSUMER_SHARD_END); /* trimmed away */
+	else if(strncmp(errorMsg, "LimitExceededException:", 23) == 0 || strncmp(errorMsg, "ResourceInUseException:", 23) == 0){
+		/* subscribing too often, or the consumer isn't active yet */
+		poll->throttled++;
+		poll->waitMs = CONSUMER_THROTTLED_WAIT_MS;
+	}
+	else{
+		poll->failed++;
+		poll->waitMs = consumer->opts.idleWaitMs;
+	}
 }
 
-/*****************************************************************************************************************************/
-/* Curl specific HTTP post routine.                                                                                          */
-/* Set respHeader, respBody, errorMsg to NULL to ignore response header, response body and curl error messages respectively. */
-/* If supplied, errorMsg must have minimum size CURL_ERROR_SIZE.                                                             */
-/* Maximum MAX_CURL_RESPONSE_DATA_SIZE chars will be saved in respHeader and respBody.                                       */
-/* Returns 0 for a curl level error (see errorMsg for details) otherwise HTTP status code. 200 indicates success.            */
-/*****************************************************************************************************************************/
-int curlDoPost(const char *url, const AWSHeaders *headers, const char *payload, httpResponse *respHeader, httpResponse *respBody, char *errorMsg){
-	
-	/* curl init */
-	CURL *curl = curl_easy_init();
-	if(!curl)
-		errorExit("Fatal curl error", "Cannot initialize curl");
+/***************************************************************************************************************/
+/* Poll a shard once, without the lock: get an iterator if it has none, from its checkpoint, then GetRecords,  */
+/* decode the records into the worker's buffer and hand them to the callback. The outcome goes in poll.        */
+/***************************************************************************************************************/
+static void pollConsumerShard(Consumer *consumer, const char *shardId, int startAtLatest, ShardPoll *poll, httpResponseSink *body, ConsumerRecord *records, unsigned char **buffer, size_t *bufferSize){
 
-	/* uncomment for verbose */
-	//curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-		
-	/* set url */
-	curl_easy_setopt(curl, CURLOPT_URL, url);
- 
- 	/* set timeout */
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
+	const AWSContext *ctx = consumer->ctx;
+	char errorMsg[CURL_ERROR_SIZE], type[128];
+	int retcode;
 
-	/* (too) permissive SSL options */
-	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+	if(consumer->consumerARN){
+		subscribeConsumerShard(consumer, shardId, startAtLatest, poll);
+		return;
+	}
 
-	/* set headers */
-	struct curl_slist *list = NULL;
-	list = curl_slist_append(list, headers->authorization);
-	list = curl_slist_append(list, headers->contentType);
-	list = curl_slist_append(list, headers->expect);
-	if(headers->xAMZSecurityToken) /* only included for temporary credentials */
-		list = curl_slist_append(list, headers->xAMZSecurityToken);
-	list = curl_slist_append(list, headers->xAMZTarget);
-	list = curl_slist_append(list, headers->xAMZDate);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
-	
-	/* set post data */
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload);
-	
-	/* set error message buffer if required */
-	if(errorMsg)
-		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorMsg);
-	
-	/* set callbacks if we want to save response header or body */
-	if(respHeader){
-		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curlResponseCallback);
-		curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)respHeader);
-		respHeader->len=0; /* empty buffer prior to call */
+	poll->waitMs = consumer->opts.idleWaitMs;
+
+	if(!poll->iterator){
+
+		const char *iteratorType = *poll->sequenceNumber ? "AFTER_SEQUENCE_NUMBER" : startAtLatest ? "LATEST" : "TRIM_HORIZON";
+		*errorMsg = '\0';
+		retcode = ktGetShardIteratorSink(ctx, consumer->streamName, shardId, iteratorType, *poll->sequenceNumber ? poll->sequenceNumber : NULL, NULL, body, errorMsg);
+
+		char iterator[MAX_SHARD_ITERATOR_LENGTH];
+		if(retcode == 200 && jsonCopyMember(body->text, body->text + body->len, "ShardIterator", iterator, sizeof(iterator)) > 0){
+			poll->iterator = malloct(strlen(iterator) + 1);
+			strcpy(poll->iterator, iterator);
+		}
+		else if(retcode == 200){
+			/* no iterator, the shard is closed and there is nothing after the checkpoint */
+			strcpy(poll->sequenceNumber, CONSUMER_SHARD_END);
+			return;
+		}
+		else{
+			consumerErrorType(body, type, sizeof(type));
+			if(strcmp(type, "ResourceNotFoundException") == 0)
+				strcpy(poll->sequenceNumber, CONSUMER_SHARD_END); /* trimmed away */
+			else if(strcmp(type, "ProvisionedThroughputExceededException") == 0 || strcmp(type, "LimitExceededException") == 0){
+				poll->throttled++;
+				poll->waitMs = CONSUMER_THROTTLED_WAIT_MS;
+			}
+			else
+				poll->failed++;
+			return;
+		}
 	}
 
-	if(respBody){
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlResponseCallback);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)respBody);
-		respBody->len=0; /* empty buffer prior to call */
+	*errorMsg = '\0';
+	retcode = ktGetRecordsSink(ctx, poll->iterator, consumer->opts.maxRecords, NULL, body, errorMsg);
+	poll->calls++;
+
+	if(retcode != 200){
+		consumerErrorType(body, type, sizeof(type));
+		if(strcmp(type, "ProvisionedThroughputExceededException") == 0){
+			poll->throttled++;
+			poll->waitMs = CONSUMER_THROTTLED_WAIT_MS;
+			return;
+		}
+		/* anything else, an expired iterator included, starts again from the checkpoint */
+		if(strcmp(type, "ExpiredIteratorException") == 0)
+			poll->waitMs = 0;
+		else
+			poll->failed++;
+		free(poll->iterator);
+		poll->iterator = NULL;
+		return;
 	}
- 
-	long retcode = 0;
-	/* Perform request, on success set retcode to HTTP status code*/
-	if(CURLE_OK == curl_easy_perform(curl)){
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &retcode);
+
+	if(*bufferSize < body->len){
+		free(*buffer);
+		*bufferSize = body->len;
+		*buffer = malloct(*bufferSize);
 	}
-	
-	/* Curl cleanup */
-	curl_slist_free_all(list);
-	curl_easy_cleanup(curl);
-	
-	return retcode;
+
+	char next[MAX_SHARD_ITERATOR_LENGTH];
+	long long millisBehindLatest;
+	int count = ktParseGetRecords(body->text, body->len, records, consumer->opts.maxRecords, *buffer, *bufferSize, next, sizeof(next), &millisBehindLatest);
+	if(count < 0){
+		poll->failed++;
+		free(poll->iterator);
+		poll->iterator = NULL;
+		return;
+	}
+
+	int i;
+	for(i=0; i<count; i++){
+		records[i].shardId = shardId;
+		poll->bytes += records[i].len;
+	}
+	poll->records = count;
+
+	if(count > 0){
+		consumer->opts.callback(records, count, millisBehindLatest, consumer->opts.userData);
+		snprintf(poll->sequenceNumber, sizeof(poll->sequenceNumber), "%s", records[count-1].sequenceNumber);
+	}
+
+	free(poll->iterator);
+	poll->iterator = NULL;
+	if(*next){
+		poll->iterator = malloct(strlen(next) + 1);
+		strcpy(poll->iterator, next);
+		if(count > 0 || millisBehindLatest > 0)
+			poll->waitMs = CONSUMER_MIN_POLL_MS;
+	}
+	else
+		strcpy(poll->sequenceNumber, CONSUMER_SHARD_END);
+}
+
+/* Worker thread. Polls whichever shard is due until the consumer stops */
+static void* consumerWorker(void *arg){
+
+	Consumer *consumer = (Consumer*)arg;
+
+	httpResponseSink body;
+	ktInitResponseSink(&body);
+	ConsumerRecord *records = malloct(consumer->opts.maxRecords * sizeof(ConsumerRecord));
+	unsigned char *buffer = NULL;
+	size_t bufferSize = 0;
+
+	pthread_mutex_lock(&consumer->lock);
+
+	while(!consumer->stopping){
+
+		if(consumerHousekeeping(consumer))
+			continue;
+
+		struct timespec now;
+		monotonicNow(&now);
+
+		/* the ready shard that has been due longest */
+		int i, chosen = -1;
+		for(i=0; i<consumer->shardCount; i++)
+			if(consumerShardReady(consumer, &consumer->shards[i]) && (chosen < 0 || timespecBefore(&consumer->shards[i].due, &consumer->shards[chosen].due)))
+				chosen = i;
+
+		if(chosen < 0 || timespecBefore(&now, &consumer->shards[chosen].due)){
+			struct timespec deadline = consumer->nextRefresh;
+			if(chosen >= 0 && timespecBefore(&consumer->shards[chosen].due, &deadline))
+				deadline = consumer->shards[chosen].due;
+			if(consumer->checkpointFile && consumer->dirty && timespecBefore(&consumer->nextCheckpoint, &deadline))
+				deadline = consumer->nextCheckpoint;
+			pthread_cond_timedwait(&consumer->wake, &consumer->lock, &deadline);
+			continue;
+		}
+
+		/* claim it, taking its iterator and checkpoint to work on */
+		ConsumerShard *shard = &consumer->shards[chosen];
+		shard->busy = 1;
+		char shardId[64];
+		strcpy(shardId, shard->shardId);
+		int startAtLatest = shard->startAtLatest;
+		ShardPoll poll;
+		memset(&poll, 0, sizeof(poll));
+		poll.iterator = shard->iterator;
+		shard->iterator = NULL;
+		strcpy(poll.sequenceNumber, shard->sequenceNumber);
+		pthread_mutex_unlock(&consumer->lock);
+
+		pollConsumerShard(consumer, shardId, startAtLatest, &poll, &body, records, &buffer, &bufferSize);
+
+		pthread_mutex_lock(&consumer->lock);
+		shard = &consumer->shards[chosen];
+		shard->busy = 0;
+		shard->iterator = poll.iterator;
+		if(strcmp(shard->sequenceNumber, poll.sequenceNumber) != 0){
+			strcpy(shard->sequenceNumber, poll.sequenceNumber);
+			consumer->dirty = 1;
+			if(strcmp(poll.sequenceNumber, CONSUMER_SHARD_END) == 0)
+				consumer->stats.finishedShards++;
+		}
+		monotonicNow(&shard->due);
+		addMilliseconds(&shard->due, poll.waitMs);
+		consumer->stats.records += poll.records;
+		consumer->stats.bytes += poll.bytes;
+		consumer->stats.getRecordsCalls += poll.calls;
+		consumer->stats.throttledCalls += poll.throttled;
+		consumer->stats.failedCalls += poll.failed;
+
+		/* a finished shard may free its children for other workers */
+		pthread_cond_broadcast(&consumer->wake);
+	}
+
+	pthread_mutex_unlock(&consumer->lock);
+
+	ktFreeResponseSink(&body);
+	free(records);
+	free(buffer);
+
+	return NULL;
 }
 
 /**************************************************/
 /* See comments in header file for kt* functions  */
 /**************************************************/
-int ktPutRecord(const AWSContext *ctx, const char *streamName, const char *partitionKey, const unsigned char *data, int len, httpResponse *respHeader, httpResponse *respBody, char *errorMsg){
-	
-	static const char *target = "Kinesis_20131202.PutRecord";
-	
-	/* make date strings */
-	char longDate[17], shortDate[9];
-	makeDateStrings(longDate, shortDate);
+void ktDefaultConsumerOptions(ConsumerOptions *opts){
 
-	/* make payload */
-	char *payload = makePutRecordPayload(data, len, streamName, partitionKey);
-	
-	/* make Authorization header */
-	char *authHeader = makeAuthHeader(ctx->key, ctx->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payload);
-	
-	/* make all headers */
-	AWSHeaders *headers = makeAWSHeaders(authHeader, ctx->sessionToken, target, longDate);
-		
-	/* do the post */
-	int retcode = curlDoPost(ctx->url, headers, payload, respHeader, respBody, errorMsg);
-	
-	/* cleanup */
-	free(payload);
-	free(authHeader);
-	freeAWSHeaders(headers);
-	
-	return retcode;
+	opts->workerCount = 4;
+	opts->maxRecords = 10000;
+	opts->idleWaitMs = 1000;
+	opts->startAtLatest = 0;
+	opts->shardRefreshMs = 60000;
+	opts->checkpointFile = NULL;
+	opts->checkpointIntervalMs = 5000;
+	opts->consumerARN = NULL;
+	opts->callback = NULL;
+	opts->userData = NULL;
 }
 
 /**************************************************/
 /* See comments in header file for kt* functions  */
 /**************************************************/
-int ktPutRecords(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, httpResponse *respHeader, httpResponse *respBody, char *errorMsg){
+Consumer* ktMakeConsumer(const AWSContext *ctx, const char *streamName, const ConsumerOptions *opts, char *errorMsg){
 
-	static const char *target = "Kinesis_20131202.PutRecords";
-	
-	/* make date strings */
-	char longDate[17], shortDate[9];
-	makeDateStrings(longDate, shortDate);
+	Consumer *consumer = malloct(sizeof(Consumer));
+	memset(consumer, 0, sizeof(Consumer));
 
-	/* make payload */
-	char *payload = makePutRecordsPayload(streamName, recordCount, partitionKeyArray, dataArray, lenArray);
-	
-	/* make Authorization header */
-	char *authHeader = makeAuthHeader(ctx->key, ctx->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payload);
-	
-	/* make all headers */
-	AWSHeaders *headers = makeAWSHeaders(authHeader, ctx->sessionToken, target, longDate);
-		
-	/* do the post */
-	int retcode = curlDoPost(ctx->url, headers, payload, respHeader, respBody, errorMsg);
-	
-	/* cleanup */
-	free(payload);
-	free(authHeader);
-	freeAWSHeaders(headers);
-	
-	return retcode;	
+	consumer->ctx = ctx;
+	consumer->streamName = malloct(strlen(streamName)+1);
+	strcpy(consumer->streamName, streamName);
+
+	consumer->opts = *opts;
+	if(consumer->opts.workerCount < 1)
+		consumer->opts.workerCount = 1;
+	if(consumer->opts.maxRecords < 1 || consumer->opts.maxRecords > 10000)
+		consumer->opts.maxRecords = 10000;
+	if(consumer->opts.idleWaitMs < CONSUMER_MIN_POLL_MS)
+		consumer->opts.idleWaitMs = CONSUMER_MIN_POLL_MS;
+	if(consumer->opts.shardRefreshMs < 1000)
+		consumer->opts.shardRefreshMs = 1000;
+	if(consumer->opts.checkpointIntervalMs < 0)
+		consumer->opts.checkpointIntervalMs = 0;
+	if(opts->checkpointFile){
+		consumer->checkpointFile = malloct(strlen(opts->checkpointFile)+1);
+		strcpy(consumer->checkpointFile, opts->checkpointFile);
+	}
+	consumer->opts.checkpointFile = consumer->checkpointFile;
+	if(opts->consumerARN){
+		consumer->consumerARN = malloct(strlen(opts->consumerARN)+1);
+		strcpy(consumer->consumerARN, opts->consumerARN);
+	}
+	consumer->opts.consumerARN = consumer->consumerARN;
+
+	pthread_mutex_init(&consumer->lock, NULL);
+	pthread_mutex_init(&consumer->checkpointLock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&consumer->wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if((consumer->checkpointFile && !loadConsumerCheckpoint(consumer, errorMsg)) || refreshConsumerShards(consumer, 1, errorMsg) != 200){
+		ktFreeConsumer(consumer);
+		return NULL;
+	}
+
+	int i;
+	for(i=0; i<consumer->shardCount; i++)
+		if(strcmp(consumer->shards[i].sequenceNumber, CONSUMER_SHARD_END) == 0)
+			consumer->stats.finishedShards++;
+
+	monotonicNow(&consumer->nextRefresh);
+	addMilliseconds(&consumer->nextRefresh, consumer->opts.shardRefreshMs);
+	monotonicNow(&consumer->nextCheckpoint);
+	addMilliseconds(&consumer->nextCheckpoint, consumer->opts.checkpointIntervalMs);
+
+	consumer->workers = malloct(consumer->opts.workerCount * sizeof(pthread_t));
+	for(i=0; i<consumer->opts.workerCount; i++)
+		if(pthread_create(&consumer->workers[i], NULL, consumerWorker, consumer))
+			errorExit("Fatal Error", "Cannot create consumer thread");
+
+	return consumer;
 }
 
 /**************************************************/
 /* See comments in header file for kt* functions  */
 /**************************************************/
-int ktDescribeStream(const AWSContext *ctx, const char *streamName, httpResponse *respHeader, httpResponse *respBody, char *errorMsg){
+int ktConsumerCheckpoint(Consumer *consumer, char *errorMsg){
 
-	static const char *target = "Kinesis_20131202.DescribeStream";
-	
-	/* make date strings */
-	char longDate[17], shortDate[9];
-	makeDateStrings(longDate, shortDate);
+	if(!consumer->checkpointFile){
+		if(errorMsg)
+			strcpy(errorMsg, "Consumer has no checkpoint file");
+		return 0;
+	}
 
-	/* make payload */
-	char *payload = makeDescribeStreamPayload(streamName);
-	
-	/* make Authorization header */
-	char *authHeader = makeAuthHeader(ctx->key, ctx->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payload);
-	
-	/* make all headers */
-	AWSHeaders *headers = makeAWSHeaders(authHeader, ctx->sessionToken, target, longDate);
-		
-	/* do the post */
-	int retcode = curlDoPost(ctx->url, headers, payload, respHeader, respBody, errorMsg);
-	
-	/* cleanup */
-	free(payload);
-	free(authHeader);
-	freeAWSHeaders(headers);
-	
-	return retcode;
+	return saveConsumerCheckpoint(consumer, errorMsg);
 }
 
 /**************************************************/
 /* See comments in header file for kt* functions  */
 /**************************************************/
-int ktListStreams(const AWSContext *ctx, httpResponse *respHeader, httpResponse *respBody, char *errorMsg){
-
-	static const char *target = "Kinesis_20131202.ListStreams";
-	
-	/* make date strings */
-	char longDate[17], shortDate[9];
-	makeDateStrings(longDate, shortDate);
+void ktGetConsumerStats(Consumer *consumer, ConsumerStats *stats){
 
-	/* make payload */
-	char *payload = makeListStreamsPayload();
-	
-	/* make Authorization header */
-	char *authHeader = makeAuthHeader(ctx->key, ctx->keyId, longDate, shortDate, ctx->region, ctx->endpoint, payload);
-	
-	/* make all headers */
-	AWSHeaders *headers = makeAWSHeaders(authHeader, ctx->sessionToken, target, longDate);
-		
-	/* do the post */
-	int retcode = curlDoPost(ctx->url, headers, payload, respHeader, respBody, errorMsg);
-	
-	/* cleanup */
-	free(payload);
-	free(authHeader);
-	freeAWSHeaders(headers);
-	
-	return retcode;
+	pthread_mutex_lock(&consumer->lock);
+	*stats = consumer->stats;
+	stats->shards = consumer->shardCount;
+	pthread_mutex_unlock(&consumer->lock);
 }
 
+/**************************************************/
+/* See comments in header file for kt* functions  */
+/**************************************************/
+void ktFreeConsumer(Consumer *consumer){
+
+	/* subscriptions read stopping without the lock */
+	pthread_mutex_lock(&consumer->lock);
+	__atomic_store_n(&consumer->stopping, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&consumer->wake);
+	pthread_mutex_unlock(&consumer->lock);
+
+	int i;
+	if(consumer->workers)
+		for(i=0; i<consumer->opts.workerCount; i++)
+			pthread_join(consumer->workers[i], NULL);
+
+	if(consumer->workers && consumer->checkpointFile && consumer->dirty)
+		saveConsumerCheckpoint(consumer, NULL);
+
+	for(i=0; i<consumer->shardCount; i++)
+		free(consumer->shards[i].iterator);
+
+	pthread_cond_destroy(&consumer->wake);
+	pthread_mutex_destroy(&consumer->checkpointLock);
+	pthread_mutex_destroy(&consumer->lock);
+
+	free(consumer->workers);
+	free(consumer->shards);
+	free(consumer->checkpointFile);
+	free(consumer->consumerARN);
+	free(consumer->streamName);
+	free(consumer);
+}
@@ -1,35 +1,264 @@
 #ifndef KT_H
 #define KT_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /***********************************************************************************/
-/* AWSContext objects store static credentials and stream information.             */
+/* AWSContext objects store credentials and stream information.                    */
 /* Use ktMakeAWSContext and ktFreeAWSContext to create and destroy.                */
 /* sessionToken is only required for temporary credentials, otherwise set to NULL. */
+/* ktMakeAWSContextWithCredentials takes them from a provider instead, see below.  */
+/* Each context owns a thread safe pool of curl handles. Requests check a handle   */
+/* out and return it afterwards so keep-alive connections (and the DNS and TLS     */
+/* session caches) are reused across calls and threads. The SigV4 signing key is  */
+/* derived once per UTC day and cached in the context, as are shard maps.          */
+/* endpoint is a host name, optionally with :port, and is reached over HTTPS. An   */
+/* http:// prefix connects in plain HTTP instead, e.g. to a local ktmock server:   */
+/* "http://localhost:4567". Requests are signed for the host part either way.      */
 /***********************************************************************************/
 
+typedef struct ConnectionPool ConnectionPool;
+typedef struct SigningKeyCache SigningKeyCache;
+typedef struct ShardMapCache ShardMapCache;
+typedef struct RateLimiter RateLimiter;
+typedef struct Compressor Compressor;
+typedef struct Metrics Metrics;
+typedef struct CredentialsCache CredentialsCache;
+
 typedef struct{
-	char *key;
-	char *keyId;
-	char *sessionToken;
+	CredentialsCache *credentials;
 	char *region;
 	char *endpoint;
 	char *url;
+	ConnectionPool *pool;
+	SigningKeyCache *keyCache;
+	ShardMapCache *shardMaps;
+	RateLimiter *limiter;
+	int streamPayloads;
+	const Compressor *compressor;
+	int cbor;
+	Metrics *metrics;
 }AWSContext;
 
+/*************************************************************************************************************/
+/* Metrics. A context made with AWSContextOptions metrics set times each stage of its requests into latency  */
+/* histograms and keeps counters, per thread and without locks, for ktGetMetrics to add up on demand. With  */
+/* metrics off (the default) the only cost is a NULL test per stage.                                        */
+/* Stages, all in nanoseconds:                                                                               */
+/*  - KT_STAGE_CALL: a whole PutRecord or PutRecords call, or a Pipeline request from start to completion.   */
+/*  - KT_STAGE_COMPRESS, KT_STAGE_PAYLOAD, KT_STAGE_SIGN: record compression, building and hashing the       */
+/*    payload (base64 and SHA-256 included), and signing (canonical request, HMAC and headers).              */
+/*  - KT_STAGE_DNS, KT_STAGE_CONNECT, KT_STAGE_TLS: name lookup, TCP connect and TLS handshake, taken from    */
+/*    curl for requests that opened a new connection. Reused connections skip them.                         */
+/*  - KT_STAGE_SERVER: from the connection being ready to the end of the response: sending the request,     */
+/*    Kinesis' time and reading the reply. curl's first byte time marks the start of a POST's upload, not   */
+/*    of the response, so the three can't be told apart.                                                    */
+/*  - KT_STAGE_RATE_LIMIT: each wait imposed by the rate limiter.                                            */
+/* Counters are requests posted (every action), records sent in PutRecord(s) calls (retries included), their */
+/* payload bytes, new connections, transport errors, non 200 responses, records returned failed by the      */
+/* retrying paths, and retry attempts.                                                                      */
+/* Histograms are HDR style: 16 linear buckets per power of two, so any value is known to within 1/16.      */
+/* ktHistogramPercentile gives the value below which percentile (0 to 100) of samples fall, as the upper     */
+/* bound of its bucket. ktMetricsStageName and ktMetricsCounterName name stages and counters for output.    */
+/* ktGetMetrics fills snapshot with totals since the context was made and returns 1, or returns 0 if the    */
+/* context has no metrics. A snapshot is about 40 KB.                                                       */
+/* If metricsExporter is also set, a background thread calls it every metricsIntervalMs (default 10000)    */
+/* with a fresh snapshot and metricsUserData, and once more when the context is freed. Take deltas between  */
+/* calls for rates.                                                                                          */
+/*************************************************************************************************************/
+
+enum{
+	KT_STAGE_CALL,
+	KT_STAGE_COMPRESS,
+	KT_STAGE_PAYLOAD,
+	KT_STAGE_SIGN,
+	KT_STAGE_DNS,
+	KT_STAGE_CONNECT,
+	KT_STAGE_TLS,
+	KT_STAGE_SERVER,
+	KT_STAGE_RATE_LIMIT,
+	KT_STAGE_COUNT
+};
+
+enum{
+	KT_COUNTER_REQUESTS,
+	KT_COUNTER_RECORDS,
+	KT_COUNTER_PAYLOAD_BYTES,
+	KT_COUNTER_CONNECTIONS,
+	KT_COUNTER_TRANSPORT_ERRORS,
+	KT_COUNTER_HTTP_ERRORS,
+	KT_COUNTER_FAILED_RECORDS,
+	KT_COUNTER_RETRIES,
+	KT_COUNTER_COUNT
+};
+
+#define KT_HISTOGRAM_BUCKETS 544
+
+typedef struct{
+	unsigned long long count;
+	unsigned long long sumNs;
+	unsigned long long maxNs;
+	unsigned long long buckets[KT_HISTOGRAM_BUCKETS];
+}LatencyHistogram;
+
+typedef struct{
+	unsigned long long counters[KT_COUNTER_COUNT];
+	LatencyHistogram stages[KT_STAGE_COUNT];
+}MetricsSnapshot;
+
+typedef void (*MetricsExporter)(const MetricsSnapshot *snapshot, void *userData);
+
+int ktGetMetrics(const AWSContext *ctx, MetricsSnapshot *snapshot);
+unsigned long long ktHistogramPercentile(const LatencyHistogram *histogram, double percentile);
+const char* ktMetricsStageName(int stage);
+const char* ktMetricsCounterName(int counter);
+
+/***********************************************************************************/
+/* AWSContextOptions tune a context. Use ktDefaultAWSContextOptions to initialise  */
+/* then override fields as required before calling ktMakeAWSContextEx.            */
+/* poolSize is the maximum number of idle curl handles kept for reuse, normally at */
+/* least the number of threads sharing the context. 0 disables connection reuse.  */
+/* idleTimeout is the number of seconds an idle connection may be reused.          */
+/* If rateLimit is set, PutRecords sends made with retries (ktPutRecordsWithRetry, */
+/* ktPutRecordsByShard and the Producer) wait as needed to keep each shard under   */
+/* shardBytesPerSecond and shardRecordsPerSecond, charging records to shards with  */
+/* the context's shard map. Defaults sit a little under the Kinesis limits of     */
+/* 1 MiB/s and 1000 records/s per shard. While the map can't be fetched the whole  */
+/* stream is held to the shards it had when last mapped, or to one shard.          */
+/* If streamPayloads is set, PutRecords bodies are never built in memory: they are */
+/* hashed in one pass over the records, then generated again in small pieces as   */
+/* curl sends them. This trades a second base64 pass for a peak of a few KB extra */
+/* memory per request, whatever the batch size.                                   */
+/* If compressor is set, record data is compressed with it before sending, see    */
+/* ktMakeCompressor. The compressor must outlive the context.                     */
+/* If cbor is set, PutRecord and PutRecords use the binary CBOR protocol          */
+/* (application/x-amz-cbor-1.1) instead of JSON: record data is sent as raw bytes */
+/* rather than base64, and Kinesis answers in CBOR. ktPutRecord, ktPutRecords and */
+/* ktPutRecordsAggregated convert the response to JSON before saving it in        */
+/* respBody, as do the retrying, shard aware and Producer paths. Bodies handed to */
+/* the Sink and Arena variants' sinks stay CBOR; ktCBORToJSON converts them.      */
+/* streamPayloads applies to JSON only. Other actions and Pipelines always use    */
+/* JSON.                                                                          */
+/* metrics, metricsExporter, metricsUserData and metricsIntervalMs turn on and     */
+/* export request metrics, see Metrics above.                                     */
+/* If http2 is set, requests from every thread are multiplexed as HTTP/2 streams   */
+/* over http2Connections (default 1) shared connections, at most http2MaxStreams   */
+/* (default 100) on each, saving a connection and TLS handshake per thread.        */
+/* Requests beyond that wait their turn. Requests are run by a context thread,     */
+/* which also calls response sinks' onChunk. A server that won't negotiate         */
+/* HTTP/2, or an http:// endpoint, gets a HTTP/1.1 connection per request in       */
+/* flight as without http2, and new connections try HTTP/2 again after 5 minutes.  */
+/* Pipelines multiplex too; SubscribeToShard uses HTTP/2 either way, on a          */
+/* connection of its own.                                                          */
+/***********************************************************************************/
+
+typedef struct{
+	int poolSize;
+	long idleTimeout;
+	int rateLimit;
+	long shardBytesPerSecond;
+	int shardRecordsPerSecond;
+	int streamPayloads;
+	const Compressor *compressor;
+	int cbor;
+	int metrics;
+	MetricsExporter metricsExporter;
+	void *metricsUserData;
+	int metricsIntervalMs;
+	int http2;
+	int http2MaxStreams;
+	int http2Connections;
+}AWSContextOptions;
+
+void ktDefaultAWSContextOptions(AWSContextOptions *opts);
+
 AWSContext* ktMakeAWSContext(const char *key, const char *keyId, const char *sessionToken, const char *region, const char *endpoint);
+AWSContext* ktMakeAWSContextEx(const char *key, const char *keyId, const char *sessionToken, const char *region, const char *endpoint, const AWSContextOptions *opts);
 void ktFreeAWSContext(AWSContext* ctx);
 
+/*************************************************************************************************************/
+/* Credential providers. ktMakeAWSContextWithCredentials makes a context whose credentials come from a       */
+/* provider rather than fixed strings, and are kept fresh in the background. credentials->source picks it:   */
+/*  - KT_CREDENTIALS_ENVIRONMENT: AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and optionally AWS_SESSION_TOKEN  */
+/*    and AWS_CREDENTIAL_EXPIRATION (ISO 8601).                                                              */
+/*  - KT_CREDENTIALS_FILE: profile (else AWS_PROFILE, else "default") of the shared credentials file at file */
+/*    (else AWS_SHARED_CREDENTIALS_FILE, else ~/.aws/credentials).                                           */
+/*  - KT_CREDENTIALS_CONTAINER: the ECS/EKS container credentials endpoint at url (else                      */
+/*    AWS_CONTAINER_CREDENTIALS_FULL_URI, else http://169.254.170.2 plus                                     */
+/*    AWS_CONTAINER_CREDENTIALS_RELATIVE_URI), sent authorization (else AWS_CONTAINER_AUTHORIZATION_TOKEN,   */
+/*    else the contents of AWS_CONTAINER_AUTHORIZATION_TOKEN_FILE) as its Authorization header.              */
+/*  - KT_CREDENTIALS_IMDS: the instance role's credentials from the EC2 instance metadata service, IMDSv2,   */
+/*    at url (else AWS_EC2_METADATA_SERVICE_ENDPOINT, else http://169.254.169.254).                          */
+/*  - KT_CREDENTIALS_CALLBACK: callback fills credentials and returns 1, or returns 0 with the reason in     */
+/*    errorMsg. It is passed userData and is called from the refresh thread as well as the caller's.         */
+/*  - KT_CREDENTIALS_CHAIN (the default): environment, file, container then IMDS, taking the first that      */
+/*    answers as the AWS SDKs do. url and authorization are ignored; the container is only tried when its    */
+/*    variables are set, and IMDS is skipped if AWS_EC2_METADATA_DISABLED is true.                           */
+/* An AWSCredentials expiration is in seconds since the epoch, 0 for credentials that never expire; an       */
+/* empty sessionToken means none. Session tokens of KT_MAX_SESSION_TOKEN chars or more are refused.          */
+/* Credentials that expire are refreshed by a context thread refreshSeconds (default 300) before they do,    */
+/* or half way through their life if that is sooner. A failed refresh is retried every retrySeconds          */
+/* (default 10) while the old credentials carry on. Requests never wait for a refresh: each takes the        */
+/* current credentials with one atomic load, and a refresh publishes new ones with an atomic swap.           */
+/* The first fetch is made by ktMakeAWSContextWithCredentials, which returns NULL with errorMsg set if it    */
+/* fails. ktRefreshCredentials fetches now, say after a request is refused as expired, returning 1, or 0     */
+/* with errorMsg set (always for a context with static credentials). ktFetchCredentials runs a provider      */
+/* once, without a context, returning as ktRefreshCredentials. Strings in CredentialsOptions are copied.     */
+/* AWSContext no longer has key, keyId and sessionToken fields, as a refresh can replace them at any time.   */
+/* ktGetCredentials copies the context's current credentials into credentials instead. It returns 1, or 0,   */
+/* with credentials zeroed, if one of them doesn't fit its AWSCredentials field.                             */
+/*************************************************************************************************************/
+
+#define KT_MAX_SESSION_TOKEN 4096
+
+enum{
+	KT_CREDENTIALS_CHAIN,
+	KT_CREDENTIALS_ENVIRONMENT,
+	KT_CREDENTIALS_FILE,
+	KT_CREDENTIALS_CONTAINER,
+	KT_CREDENTIALS_IMDS,
+	KT_CREDENTIALS_CALLBACK
+};
+
+typedef struct{
+	char key[128];
+	char keyId[128];
+	char sessionToken[KT_MAX_SESSION_TOKEN];
+	long long expiration;
+}AWSCredentials;
+
+typedef int (*CredentialsCallback)(AWSCredentials *credentials, void *userData, char *errorMsg);
+
+typedef struct{
+	int source;
+	const char *file;
+	const char *profile;
+	const char *url;
+	const char *authorization;
+	CredentialsCallback callback;
+	void *userData;
+	int refreshSeconds;
+	int retrySeconds;
+}CredentialsOptions;
+
+void ktDefaultCredentialsOptions(CredentialsOptions *opts);
+int ktFetchCredentials(const CredentialsOptions *opts, AWSCredentials *credentials, char *errorMsg);
+AWSContext* ktMakeAWSContextWithCredentials(const CredentialsOptions *credentials, const char *region, const char *endpoint, const AWSContextOptions *opts, char *errorMsg);
+int ktRefreshCredentials(const AWSContext *ctx, char *errorMsg);
+int ktGetCredentials(const AWSContext *ctx, AWSCredentials *credentials);
+
 /************************************************************************************************************/
 /* kt* functions below map to the similarly named actions in the AWS Kinesis API.                           */
 /* Functions return 0 if a transport level error has occurred, in which case errorMsg will contain details. */
 /* Otherwise functions return HTTP status code - 200 indicates success. Any output will be in respBody.     */
 /* For non 200 HTTP status codes, respBody will contain error messages.                                     */
 /* respHeader, respBody, errorMsg can be set to NULL if the respective data is not required.                */
-/* Only the first MAX_HTTP_RESPONSE_SIZE chars are saved in respHeader and respBody.                        */
+/* Only the first MAX_HTTP_RESPONSE_SIZE chars are saved in respHeader and respBody. Use the kt*Sink        */
+/* variants below to receive complete responses.                                                            */
 /* errorMsg should be at least 256 characters long if set.                                                  */
 /************************************************************************************************************/
 
@@ -44,6 +273,465 @@ int ktDescribeStream(const AWSContext *ctx, const char *streamName, httpResponse
 int ktPutRecord(const AWSContext *ctx, const char *streamName, const char *partitionKey, const unsigned char *data, int len, httpResponse *respHeader, httpResponse *respBody, char *errorMsg);
 int ktPutRecords(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, httpResponse *respHeader, httpResponse *respBody, char *errorMsg);
 
+/*************************************************************************************************************/
+/* kt*Sink functions behave as the kt* functions above but deliver responses to httpResponseSinks, which    */
+/* are not limited in size. Initialise a sink with ktInitResponseSink, then either:                        */
+/*  - leave onChunk NULL to collect the whole response in text (len chars, null terminated). The buffer     */
+/*    grows with allocator, a realloc-like function called as allocator(ptr, size, userData), or realloc   */
+/*    if allocator is NULL. The buffer is kept across calls; free it with ktFreeResponseSink, which calls    */
+/*    allocator(text, 0, userData).                                                                          */
+/*  - set onChunk to receive each fragment straight from curl, without copying, as it arrives. chunk is only */
+/*    valid during the call. Return len to continue, any other value aborts the transfer.                  */
+/* Running out of memory or an aborted transfer is reported as a transport level error.                    */
+/*************************************************************************************************************/
+
+typedef struct{
+	char *text;
+	size_t len;
+	size_t capacity;
+	void* (*allocator)(void *ptr, size_t size, void *userData);
+	size_t (*onChunk)(const char *chunk, size_t len, void *userData);
+	void *userData;
+}httpResponseSink;
+
+void ktInitResponseSink(httpResponseSink *sink);
+void ktFreeResponseSink(httpResponseSink *sink);
+
+int ktListStreamsSink(const AWSContext *ctx, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg);
+int ktDescribeStreamSink(const AWSContext *ctx, const char *streamName, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg);
+int ktPutRecordSink(const AWSContext *ctx, const char *streamName, const char *partitionKey, const unsigned char *data, int len, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg);
+int ktPutRecordsSink(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg);
+
+/*************************************************************************************************************/
+/* ScratchArena is a caller owned buffer that request building allocates from instead of the heap. Set one  */
+/* up over any buffer with ktInitScratchArena. ktPutRecordArena and ktPutRecordsArena take every temporary  */
+/* they need (payload, signing strings, headers) from arena and give it all back before returning, so one  */
+/* arena per thread can be reused for every call. If arena is too small they return 0 with errorMsg set, as */
+/* for a transport error, rather than exiting as the heap based functions do when malloc fails.            */
+/* ktPutRecordsScratchSize is a safe arena size for a ktPutRecordsArena call. With the context's           */
+/* streamPayloads option set, PutRecords bodies are never built and the size needed is small and fixed.    */
+/* curl and OpenSSL still allocate internally; a warm pooled curl handle keeps that to a minimum. If they  */
+/* can't, because a new curl handle or a SHA-256 digest can't be made, the call also returns 0 with        */
+/* errorMsg set. Other allocation failures inside curl or OpenSSL, such as while signing, may still exit.  */
+/*************************************************************************************************************/
+
+typedef struct{
+	char *base;
+	size_t size;
+	size_t used;
+}ScratchArena;
+
+void ktInitScratchArena(ScratchArena *arena, void *buffer, size_t size);
+size_t ktPutRecordsScratchSize(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, const int *lenArray);
+
+int ktPutRecordArena(const AWSContext *ctx, const char *streamName, const char *partitionKey, const unsigned char *data, int len, ScratchArena *arena, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg);
+int ktPutRecordsArena(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, ScratchArena *arena, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg);
+
+/*************************************************************************************************************/
+/* Record compression. A Compressor, set in AWSContextOptions, compresses each record's data before it is    */
+/* sent; when aggregating, the user records are compressed before they are packed, so consumers find them    */
+/* compressed once de-aggregated. Compressed records start with a KT_CODEC_HEADER_SIZE byte header, 0xF3     */
+/* 'k' 't' then the codec, which consumers use to detect them: KT_CODEC_GZIP for a gzip member or            */
+/* KT_CODEC_ZSTD for a zstd frame. Data that compressing doesn't shrink by more than the header goes         */
+/* unchanged, so a record never grows, unless it starts like a header itself, when it follows a              */
+/* KT_CODEC_STORED header. ktMakeCompressor takes a codec, its level (zlib 1-9, zstd 1-22) and, for zstd     */
+/* only, an optional dictionary; it returns NULL for an unsupported combination or a dictionary zstd can't   */
+/* load. zstd needs kt built with KT_WITH_ZSTD defined (make ZSTD=1); without it zstd compressors can't be   */
+/* made. A compressor is thread safe. ktCompressRecord writes a record to out, which must hold               */
+/* len + KT_CODEC_HEADER_SIZE bytes, and returns its length. Consumers use ktDecompressedLength, which       */
+/* returns the length of data with no codec header as it is, or -1 if the length can't be told, then         */
+/* ktDecompressRecord, which returns the length written to out or -1; data with no header is copied.         */
+/* Records compressed with a dictionary need a compressor made with the same dictionary to decompress.       */
+/* ktTrainDictionary trains a zstd dictionary of up to capacity bytes from sample records, typically a few   */
+/* thousand, and returns its size, or 0 if it fails or zstd isn't built in. About 100 KB suits small JSON.   */
+/*************************************************************************************************************/
+
+#define KT_CODEC_HEADER_SIZE 4
+#define KT_CODEC_STORED 0
+#define KT_CODEC_GZIP 1
+#define KT_CODEC_ZSTD 2
+
+Compressor* ktMakeCompressor(int codec, int level, const void *dictionary, size_t dictionaryLen);
+void ktFreeCompressor(Compressor *compressor);
+int ktCompressRecord(const Compressor *compressor, const unsigned char *data, int len, unsigned char *out);
+long ktDecompressedLength(const unsigned char *data, int len);
+int ktDecompressRecord(const Compressor *compressor, const unsigned char *data, int len, unsigned char *out, int outCapacity);
+size_t ktTrainDictionary(unsigned char * const *sampleArray, const int *lenArray, int sampleCount, void *dictionary, size_t capacity);
+
+/*************************************************************************************************************/
+/* ktCBORToJSON converts a CBOR response body of len bytes, as received with AWSContextOptions cbor set, to  */
+/* JSON as the JSON protocol would have sent it: byte strings become base64 strings and tags (timestamps)   */
+/* are reduced to their values. Returns null terminated text the caller frees, or NULL if data isn't a      */
+/* single well formed CBOR item.                                                                            */
+/*************************************************************************************************************/
+
+char* ktCBORToJSON(const void *data, size_t len);
+
+/*************************************************************************************************************/
+/* ktPutRecordsAggregated packs many small user records into few Kinesis records using the KPL aggregated   */
+/* record format (magic number, protobuf body, MD5 trailer), so KCL consumers de-aggregate them             */
+/* transparently. Each aggregated record stays within the 1 MiB record limit and is posted with the         */
+/* partition key and explicit hash key of its first user record. Only user records bound for the same shard */
+/* share an aggregated record: those the context's shard map puts on one shard or, if the map can't be      */
+/* fetched, those with the same partition key or explicit hash key. explicitHashKeyArray, or any entry in   */
+/* it, may be NULL; explicit hash keys that are given are carried per user record. The aggregated records   */
+/* are sent in as many PutRecords calls as the request limits need. The return code and responses are       */
+/* those of the last call made; sending stops at the first call that doesn't return 200.                    */
+/*************************************************************************************************************/
+
+int ktPutRecordsAggregated(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, httpResponse *respHeader, httpResponse *respBody, char *errorMsg);
+
+/*************************************************************************************************************/
+/* ktPutRecordsWithRetry posts records like ktPutRecords but reads the whole response and resends only the  */
+/* records that came back with an ErrorCode (e.g. throttled), or all outstanding records if the call itself */
+/* failed with a transport error, a 5xx or a throttling 400. Retries wait an exponential backoff with full  */
+/* jitter: a random delay up to baseDelayMs * 2^(retry-1), capped at maxDelayMs. At most maxAttempts calls  */
+/* are made per record. Use ktDefaultRetryPolicy to initialise a RetryPolicy, or pass NULL for defaults.    */
+/* results must hold recordCount entries and receives each record's final status. success is 1 for records */
+/* Kinesis accepted, with shardId and sequenceNumber set. Failed records have errorCode and errorMessage    */
+/* from Kinesis, or TransportError/HTTPError/the AWS error type if the call failed as a whole. Records a    */
+/* 200 response doesn't account for fail with InvalidResponse and are not resent, as they may be written.   */
+/* Returns the status of the last call made, as the kt* functions.                                          */
+/*************************************************************************************************************/
+
+typedef struct{
+	int maxAttempts;
+	int baseDelayMs;
+	int maxDelayMs;
+}RetryPolicy;
+
+typedef struct{
+	int success;
+	int attempts;
+	char shardId[64];
+	char sequenceNumber[129];
+	char errorCode[64];
+	char errorMessage[256];
+	long rateLimitDelayMs;
+}RecordResult;
+
+void ktDefaultRetryPolicy(RetryPolicy *policy);
+int ktPutRecordsWithRetry(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, const RetryPolicy *policy, RecordResult *results, char *errorMsg);
+
+/*************************************************************************************************************/
+/* Shard aware posting. The context caches each stream's open shards and their hash key ranges, fetched     */
+/* once with paged DescribeStream calls. ktPutRecordsByShard computes each partition key's MD5 hash key     */
+/* locally, queues records per shard, then forms batches taking records from each shard in turn so one hot */
+/* shard can't dominate (and throttle) a batch. Batches are sent as ktPutRecordsWithRetry; arguments and   */
+/* results follow it, and recordCount is not limited to one call's worth. When Kinesis puts a record on an */
+/* unexpected shard the stream has been resharded and the map is refetched on the next call. If the map    */
+/* can't be fetched, records are sent in order as ktPutRecordsWithRetry would; a failed fetch is retried     */
+/* after a backoff of 1 s doubling to 60 s, to keep within DescribeStream's 10 calls a second.               */
+/* ktRefreshShardMap refetches the map now; it returns as the kt* functions.                                */
+/* ktShardIdForPartitionKey writes the id of the shard partitionKey maps to (shardId holds 64 chars), and   */
+/* returns 1, or 0 if it can't be determined.                                                               */
+/*************************************************************************************************************/
+
+int ktRefreshShardMap(const AWSContext *ctx, const char *streamName, char *errorMsg);
+int ktShardIdForPartitionKey(const AWSContext *ctx, const char *streamName, const char *partitionKey, char *shardId, char *errorMsg);
+int ktPutRecordsByShard(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, const RetryPolicy *policy, RecordResult *results, char *errorMsg);
+
+/*************************************************************************************************************/
+/* ktGetRateLimitStats reports how much the context's rate limiter has held sends back: sends counts calls  */
+/* through the limiter, delayedSends those made to wait and delayMs the total wait. unmappedSends counts    */
+/* sends limited stream-wide because the stream's shard map couldn't be fetched. It returns 0, with        */
+/* stats zeroed, if the context has no rate limiter. RecordResult.rateLimitDelayMs gives the wait per      */
+/* record over all of its attempts.                                                                         */
+/*************************************************************************************************************/
+
+typedef struct{
+	long long sends;
+	long long delayedSends;
+	long long delayMs;
+	long long unmappedSends;
+}RateLimitStats;
+
+int ktGetRateLimitStats(const AWSContext *ctx, RateLimitStats *stats);
+
+/*************************************************************************************************************/
+/* Pipeline objects keep up to maxInFlight PutRecords requests in flight at once from a single thread,     */
+/* using the curl multi interface, so many shards can be kept busy without a thread per request.           */
+/* A pipeline belongs to the thread that made it; use one pipeline per thread. The context must outlive it. */
+/* ktPipelinePutRecords builds and signs the request, then starts it and returns 1. If maxInFlight requests */
+/* are already in flight it first drives transfers until one completes. Record arrays may be reused as soon */
+/* as it returns. callback is called once per request, from within ktPipelinePutRecords, ktPipelinePoll or */
+/* ktPipelineDrain, as each request completes. The PipelineResult is only valid during the callback.       */
+/* retcode and errorMsg follow the kt* function rules, and respBody holds the whole response. results holds */
+/* recordCount RecordResults in request order, each after its one attempt: success with shardId and         */
+/* sequenceNumber, the ErrorCode and ErrorMessage of its entry in the response, the error of the whole      */
+/* request (TransportError or the AWS error type), or InvalidResponse if the response's Records array       */
+/* doesn't match the request. failedRecordCount counts those not successful. Nothing is retried.            */
+/* ktPipelinePoll drives transfers for up to timeoutMs and returns the number of requests still in flight. */
+/* ktPipelineDrain drives transfers until every request has completed. ktFreePipeline drains first.        */
+/*************************************************************************************************************/
+
+typedef struct Pipeline Pipeline;
+
+typedef struct{
+	int retcode;
+	const char *errorMsg;
+	const httpResponseSink *respBody;
+	int recordCount;
+	const RecordResult *results;
+	int failedRecordCount;
+}PipelineResult;
+
+typedef void (*PipelineCallback)(const PipelineResult *result, void *userData);
+
+Pipeline* ktMakePipeline(const AWSContext *ctx, int maxInFlight);
+int ktPipelinePutRecords(Pipeline *pipeline, const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, PipelineCallback callback, void *userData);
+int ktPipelinePoll(Pipeline *pipeline, int timeoutMs);
+void ktPipelineDrain(Pipeline *pipeline);
+void ktFreePipeline(Pipeline *pipeline);
+
+/*************************************************************************************************************/
+/* Spool objects keep records on disk while Kinesis can't be reached and send them later, in order.         */
+/* ktOpenSpool opens (making it if need be) a directory of segment files, recovering any records left by an */
+/* earlier run, or returns NULL with errorMsg set. Segments are segmentSize byte files mapped into memory;  */
+/* at most maxSegments are kept, and when a new one is needed beyond that the oldest is evicted with its    */
+/* records. Records are checksummed, so any cut short by a crash are dropped on recovery. If sync is set    */
+/* each append is flushed to disk before returning, otherwise the OS writes mapped pages back in its own    */
+/* time, which survives the process dying but not the device losing power.                                 */
+/* ktSpoolRecords appends records, or if results is not NULL (as filled by ktPutRecordsWithRetry) only the   */
+/* records that failed for want of connectivity or capacity, e.g. TransportError or throttling; records    */
+/* Kinesis rejected outright are left out. It returns the number of records spooled, stopping early with    */
+/* errorMsg set if a record is too large or a segment can't be made.                                         */
+/* ktReplaySpool sends spooled records oldest first as ktPutRecordsWithRetry batches of up to 500, passing  */
+/* record data straight from the mapped segments, and returns the number delivered. It stops at the first   */
+/* record that still fails for want of connectivity or capacity, which stays spooled with the records after */
+/* it; records rejected outright are dropped. Records of a batch sent after such a failure are sent again   */
+/* on the next replay, so delivery is at least once. Replays may run alongside ktSpoolRecords.              */
+/* ktGetSpoolStats reports records and bytes (data plus partition keys) waiting, segments in use, and       */
+/* running totals of records evicted, replayed and dropped.                                                  */
+/* ktCloseSpool unmaps the segments, leaving waiting records on disk for the next ktOpenSpool.              */
+/*************************************************************************************************************/
+
+typedef struct Spool Spool;
+
+typedef struct{
+	size_t segmentSize;
+	int maxSegments;
+	int sync;
+}SpoolOptions;
+
+typedef struct{
+	long long records;
+	long long bytes;
+	int segments;
+	long long evictedRecords;
+	long long replayedRecords;
+	long long droppedRecords;
+}SpoolStats;
+
+void ktDefaultSpoolOptions(SpoolOptions *opts);
+Spool* ktOpenSpool(const char *directory, const SpoolOptions *opts, char *errorMsg);
+int ktSpoolRecords(Spool *spool, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray, const RecordResult *results, char *errorMsg);
+int ktReplaySpool(const AWSContext *ctx, Spool *spool, const char *streamName, const RetryPolicy *policy, char *errorMsg);
+void ktGetSpoolStats(Spool *spool, SpoolStats *stats);
+void ktCloseSpool(Spool *spool);
+
+/*************************************************************************************************************/
+/* Producer objects post records in the background so callers never wait on the network.                    */
+/* ktProducerPut copies the record into a bounded queue and returns straight away. Worker threads drain the */
+/* queue into ktPutRecords batches, sending a batch once it reaches maxBatchRecords records or              */
+/* maxBatchBytes bytes (data plus partition key), or once its oldest record has waited lingerMs.            */
+/* Use ktDefaultProducerOptions to initialise ProducerOptions then override fields as required.             */
+/* When the queue holds maxQueuedRecords records, ktProducerPut blocks if blockWhenFull is set, otherwise   */
+/* it returns 0 and the record is not queued. It returns 1 when the record is queued.                       */
+/* Batches are sent as ktPutRecordsWithRetry using the retry policy, so only failed records are resent.    */
+/* callback, if not NULL, is called once per record from a worker thread when its batch completes. The     */
+/* ProducerResult is only valid during the callback. retcode is the status of the batch's last call,       */
+/* record is the record's final status and errorMsg its error message, NULL when record->success is set.  */
+/* Aggregated user records share the status of the Kinesis record that carried them.                       */
+/* If aggregate is set, batches are packed with ktPutRecordsAggregated and maxBatchRecords does not apply; */
+/* with shardAware off, records only share an aggregated record with records bound for the same shard.     */
+/* If shardAware is set, batches are sent as ktPutRecordsByShard, aggregating per shard if aggregate is set. */
+/* If spool is set, records that fail for want of connectivity or capacity are appended to it, as           */
+/* ktSpoolRecords, before their callback, which sees spooled set. The spool must outlive the producer.     */
+/* ktProducerFlush blocks until every record queued so far has completed.                                  */
+/* ktFreeProducer flushes, stops the workers and frees the producer. The context must outlive the producer. */
+/*************************************************************************************************************/
+
+typedef struct Producer Producer;
+
+typedef struct{
+	int retcode;
+	const char *errorMsg;
+	const RecordResult *record;
+	int spooled;
+}ProducerResult;
+
+typedef void (*ProducerCallback)(const ProducerResult *result, void *userData);
+
+typedef struct{
+	int maxQueuedRecords;
+	int maxBatchRecords;
+	int maxBatchBytes;
+	int lingerMs;
+	int workerCount;
+	int blockWhenFull;
+	int aggregate;
+	int shardAware;
+	RetryPolicy retry;
+	Spool *spool;
+}ProducerOptions;
+
+void ktDefaultProducerOptions(ProducerOptions *opts);
+Producer* ktMakeProducer(const AWSContext *ctx, const char *streamName, const ProducerOptions *opts);
+int ktProducerPut(Producer *producer, const char *partitionKey, const unsigned char *data, int len, ProducerCallback callback, void *userData);
+void ktProducerFlush(Producer *producer);
+void ktFreeProducer(Producer *producer);
+
+/*************************************************************************************************************/
+/* Reading. ktGetShardIteratorSink and ktGetRecordsSink map to the GetShardIterator and GetRecords actions   */
+/* and return as the kt*Sink functions. iteratorType is TRIM_HORIZON, LATEST, AT_SEQUENCE_NUMBER or          */
+/* AFTER_SEQUENCE_NUMBER, the last two with startingSequenceNumber, otherwise NULL. limit caps the records   */
+/* returned, 0 for the Kinesis default of 10000. Both always use JSON.                                       */
+/* ktParseGetRecords reads a GetRecords response body of len chars into up to maxRecords ConsumerRecords,    */
+/* decoding record data from base64 and copying sequence numbers and partition keys into buffer. A buffer    */
+/* of len bytes is always big enough. The records point into buffer. The next shard iterator is copied to    */
+/* nextShardIterator (iteratorSize chars, 1024 is ample), empty if the shard is closed and fully read, and   */
+/* MillisBehindLatest to millisBehindLatest; either may be NULL. Returns the number of records, or -1 if     */
+/* the body is malformed, holds more than maxRecords records or buffer is too small. shardId is left NULL.   */
+/*************************************************************************************************************/
+
+typedef struct{
+	const char *shardId;
+	const char *sequenceNumber;
+	const char *partitionKey;
+	const unsigned char *data;
+	int len;
+	double arrivalTime;
+}ConsumerRecord;
+
+int ktGetShardIteratorSink(const AWSContext *ctx, const char *streamName, const char *shardId, const char *iteratorType, const char *startingSequenceNumber, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg);
+int ktGetRecordsSink(const AWSContext *ctx, const char *shardIterator, int limit, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg);
+int ktParseGetRecords(const char *body, size_t len, ConsumerRecord *records, int maxRecords, unsigned char *buffer, size_t bufferSize, char *nextShardIterator, size_t iteratorSize, long long *millisBehindLatest);
+
+/*************************************************************************************************************/
+/* Event streams. SubscribeToShard answers with a stream of application/vnd.amazon.eventstream messages:     */
+/* a 12 byte prelude of total length, headers length and a CRC32 of the two, typed headers, the payload and  */
+/* a CRC32 of everything before it. An EventStreamParser takes the stream in whatever pieces it arrives,     */
+/* checks both CRCs and calls callback once per whole message. The message, its payload included, is only    */
+/* valid during the call; callback may modify the payload in place. It returns 1 to go on, 0 to stop.        */
+/* Header values are truncated to fit EventStreamMessage. messageType is event, exception or error, and      */
+/* eventType the :event-type, :exception-type or :error-code header to match.                                */
+/* ktEventStreamParse returns 1, or 0 with errorMsg set if a CRC fails, a message is malformed or longer     */
+/* than maxMessageLen, or callback stopped. A parser that has failed stays failed.                           */
+/*************************************************************************************************************/
+
+typedef struct{
+	char messageType[16];
+	char eventType[64];
+	char contentType[64];
+	unsigned char *payload;
+	size_t payloadLen;
+}EventStreamMessage;
+
+typedef struct EventStreamParser EventStreamParser;
+
+typedef int (*EventStreamCallback)(const EventStreamMessage *message, void *userData);
+
+EventStreamParser* ktMakeEventStreamParser(size_t maxMessageLen);
+int ktEventStreamParse(EventStreamParser *parser, const void *data, size_t len, EventStreamCallback callback, void *userData, char *errorMsg);
+void ktFreeEventStreamParser(EventStreamParser *parser);
+
+/*************************************************************************************************************/
+/* Enhanced fan-out. ktRegisterStreamConsumerSink registers consumerName on the stream with ARN streamARN    */
+/* (see DescribeStream) and returns as the kt*Sink functions. The ConsumerARN in its response can be         */
+/* subscribed once the consumer is ACTIVE, which takes a few seconds.                                        */
+/* ktSubscribeToShard subscribes consumerARN to shardId from startingPositionType, TRIM_HORIZON, LATEST,     */
+/* AT_SEQUENCE_NUMBER or AFTER_SEQUENCE_NUMBER, the last two with startingSequenceNumber, and calls          */
+/* callback with each SubscribeToShardEvent as Kinesis pushes it, until Kinesis ends the subscription        */
+/* after 5 minutes or callback returns 0. Records are decoded in place in the received message, so they      */
+/* and the event are valid only during the call. Resume with AFTER_SEQUENCE_NUMBER and the last              */
+/* continuationSequenceNumber, which is NULL once the shard is closed and fully read; its children are       */
+/* then in childShards. The subscription uses HTTP/2 where the endpoint offers it, as Kinesis does for       */
+/* https endpoints, otherwise HTTP/1.1, as ktmock serves it.                                                 */
+/* Returns 200 if the subscription ran to its end or callback stopped it, the HTTP status if it was          */
+/* refused, or 0 if the connection failed or Kinesis ended it with an exception event. Unless 200,           */
+/* errorMsg (CURL_ERROR_SIZE chars) is set, starting with the error type and a colon if there is one,        */
+/* say "ResourceInUseException: ...".                                                                        */
+/*************************************************************************************************************/
+
+typedef struct{
+	char shardId[64];
+	char parentShardIds[2][64];
+}ChildShard;
+
+typedef struct{
+	const char *shardId;
+	ConsumerRecord *records;
+	int recordCount;
+	const char *continuationSequenceNumber;
+	long long millisBehindLatest;
+	ChildShard childShards[2];
+	int childShardCount;
+}SubscribeToShardEvent;
+
+typedef int (*SubscribeToShardCallback)(const SubscribeToShardEvent *event, void *userData);
+
+int ktRegisterStreamConsumerSink(const AWSContext *ctx, const char *streamARN, const char *consumerName, httpResponseSink *respHeader, httpResponseSink *respBody, char *errorMsg);
+int ktSubscribeToShard(const AWSContext *ctx, const char *consumerARN, const char *shardId, const char *startingPositionType, const char *startingSequenceNumber, SubscribeToShardCallback callback, void *userData, char *errorMsg);
+
+/*************************************************************************************************************/
+/* Consumer objects read every shard of a stream in parallel on workerCount threads and hand each batch of   */
+/* records to callback, in order within a shard. A shard is polled by one worker at a time, at most every    */
+/* 200 ms to respect the 5 GetRecords calls a second Kinesis allows per shard, and every idleWaitMs once it  */
+/* has caught up. maxRecords is the GetRecords limit. Child shards of a reshard are only read once their     */
+/* parents are finished; the shard list is refreshed every shardRefreshMs to find them.                      */
+/* callback is called from a worker thread with records valid only during the call (arrivalTime is in        */
+/* seconds since the epoch, millisBehindLatest how far the shard is behind its tip). Once it returns the     */
+/* batch's last sequence number is the shard's checkpoint, so records are delivered at least once.           */
+/* If checkpointFile is set, checkpoints are loaded from it when the consumer is made and saved to it every  */
+/* checkpointIntervalMs and when it is freed, so a restarted consumer resumes after the last records         */
+/* handled. It is replaced atomically by rename. Shards without a checkpoint start at the oldest record, or  */
+/* with startAtLatest at the newest for shards already open when the consumer is made.                       */
+/* With consumerARN set, an enhanced fan-out consumer, shards are read with SubscribeToShard instead and     */
+/* records are pushed as they arrive. A subscription holds its worker for up to 5 minutes, so workerCount    */
+/* should cover the shards read at once; shards rotate between workers as subscriptions end.                 */
+/* Record data is as written; records compressed by a Compressor can be expanded with ktDecompressRecord.    */
+/* ktMakeConsumer returns NULL with errorMsg set if the shard list or checkpoint file can't be read.         */
+/* ktConsumerCheckpoint saves checkpoints now, returning 1, or 0 with errorMsg set.                          */
+/* ktGetConsumerStats reports records and bytes delivered, GetRecords or SubscribeToShard calls, throttled   */
+/* calls, other failed calls, and the number of shards being read and finished.                              */
+/* ktFreeConsumer lets callbacks in progress finish, stops the workers, saves checkpoints and frees the      */
+/* consumer. The context must outlive the consumer.                                                          */
+/*************************************************************************************************************/
+
+typedef struct Consumer Consumer;
+
+typedef void (*ConsumerCallback)(const ConsumerRecord *records, int recordCount, long long millisBehindLatest, void *userData);
+
+typedef struct{
+	int workerCount;
+	int maxRecords;
+	int idleWaitMs;
+	int startAtLatest;
+	int shardRefreshMs;
+	const char *checkpointFile;
+	int checkpointIntervalMs;
+	const char *consumerARN;
+	ConsumerCallback callback;
+	void *userData;
+}ConsumerOptions;
+
+typedef struct{
+	long long records;
+	long long bytes;
+	long long getRecordsCalls;
+	long long throttledCalls;
+	long long failedCalls;
+	int shards;
+	int finishedShards;
+}ConsumerStats;
+
+void ktDefaultConsumerOptions(ConsumerOptions *opts);
+Consumer* ktMakeConsumer(const AWSContext *ctx, const char *streamName, const ConsumerOptions *opts, char *errorMsg);
+int ktConsumerCheckpoint(Consumer *consumer, char *errorMsg);
+void ktGetConsumerStats(Consumer *consumer, ConsumerStats *stats);
+void ktFreeConsumer(Consumer *consumer);
+
 #ifdef __cplusplus
 }
 #endif
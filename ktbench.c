@@ -0,0 +1,224 @@
+#include "kt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+/*****************************************************************************************************************/
+/* Microbenchmarks for the CPU bound request building paths. Runs offline, nothing here touches the network.    */
+/* Each benchmark repeats its operation, doubling the count until a run takes at least the minimum time, and    */
+/* reports that run. Output is tab separated with a header line so runs of two versions can be compared with    */
+/* join, awk or a spreadsheet. allocs_per_op counts malloc, calloc and realloc calls made by kt itself; they are */
+/* wrapped at link time (see the bench target in Makefile), so allocations inside OpenSSL are not counted.      */
+/*****************************************************************************************************************/
+
+/* kt internals under test, not part of the public API in kt.h */
+char* base64Encode(const unsigned char *data, int len);
+char* string2HexSHA256(const char *s);
+void makeSignature(const unsigned char *kSigning, const char *stringToSign, char *hex);
+char* makeAuthHeader(const unsigned char *signingKey, const char *keyId, const char *longDate, const char *shortDate, const char *region,  const char *endpoint, const char *payloadHash, const char *contentType, ScratchArena *arena);
+char* makePutRecordsPayload(const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, char *payloadHash, ScratchArena *arena);
+
+/* allocation counting, linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc */
+static long long allocations;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+
+void* __wrap_malloc(size_t size){
+
+	allocations++;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size){
+
+	allocations++;
+	return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size){
+
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+/* inputs shared by the benchmarks, sized for the largest case */
+#define MAX_RECORD_BYTES (1024*1024)
+#define MAX_BATCH 500
+#define MAX_BATCH_BYTES (5*1024*1024)
+
+static unsigned char *recordData;
+static char *text;
+static char *partitionKeyArray[MAX_BATCH];
+static unsigned char *dataArray[MAX_BATCH];
+static int lenArray[MAX_BATCH];
+static unsigned char signingKey[32];
+static const char *stringToSign =
+	"AWS4-HMAC-SHA256\n"
+	"20240101T000000Z\n"
+	"20240101/us-east-1/kinesis/aws4_request\n"
+	"5d672d79c15b13162d9279b0855cfba6789a8edb4c82c400e06b5924a6f2b5d7";
+
+/* what a benchmark operation works on, set before timing */
+static int benchRecordBytes;
+static int benchBatch;
+
+static void opBase64Encode(void){
+
+	free(base64Encode(recordData, benchRecordBytes));
+}
+
+static void opString2HexSHA256(void){
+
+	free(string2HexSHA256(text + MAX_RECORD_BYTES - benchRecordBytes));
+}
+
+static void opMakeSignature(void){
+
+	char hex[65];
+	makeSignature(signingKey, stringToSign, hex);
+}
+
+static void opMakeAuthHeader(void){
+
+	free(makeAuthHeader(signingKey, "AKIDEXAMPLE", "20240101T000000Z", "20240101", "us-east-1", "kinesis.us-east-1.amazonaws.com",
+		"e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", "application/x-amz-json-1.1", NULL));
+}
+
+static void opMakePutRecordsPayload(void){
+
+	char payloadHash[65];
+	int i;
+	for(i=0; i<benchBatch; i++)
+		lenArray[i] = benchRecordBytes;
+	free(makePutRecordsPayload("benchmark-stream", benchBatch, partitionKeyArray, NULL, dataArray, lenArray, payloadHash, NULL));
+}
+
+static double elapsedNs(const struct timespec *start){
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+/* time op at recordBytes and batch, reporting bytes/s for bytesPerOp bytes of input per operation */
+static void bench(const char *name, void (*op)(void), int recordBytes, int batch, long long bytesPerOp, double minTimeNs, const char *filter){
+
+	if(filter && !strstr(name, filter))
+		return;
+
+	benchRecordBytes = recordBytes;
+	benchBatch = batch;
+
+	/* warm caches and any lazily set up state */
+	op();
+
+	long long iterations = 1;
+	double ns;
+	long long allocs;
+	for(;;){
+		struct timespec start;
+		long long i;
+		allocations = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(i=0; i<iterations; i++)
+			op();
+		ns = elapsedNs(&start);
+		allocs = allocations;
+		if(ns >= minTimeNs)
+			break;
+		iterations *= 2;
+	}
+
+	double nsPerOp = ns / iterations;
+	printf("%s\t%d\t%d\t%lld\t%.1f\t%.0f\t%.2f\n", name, recordBytes, batch, iterations, nsPerOp, bytesPerOp * 1e9 / nsPerOp, (double)allocs / iterations);
+	fflush(stdout);
+}
+
+void printUsageThenExit(){
+
+	printf(
+		"Usage:\n"
+		"  ktbench [-t min_seconds] [-f filter]\n\n"
+		"  Time kt's encode, sign and payload building paths. Each benchmark runs for at\n"
+		"  least min_seconds (default 0.2). -f runs only benchmarks whose name contains\n"
+		"  filter. Output is tab separated, one line per benchmark and case.\n\n"
+		);
+
+	exit(1);
+}
+
+int main(int argc, char **argv){
+
+	double minTimeNs = 0.2e9;
+	const char *filter = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "t:f:")) != -1){
+		switch(opt){
+			case 't':
+				minTimeNs = atof(optarg) * 1e9;
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			default:
+				printUsageThenExit();
+		}
+	}
+
+	/* deterministic inputs: pseudo random record bytes, printable text, and a batch whose records all share one buffer */
+	int i;
+	recordData = malloc(MAX_BATCH_BYTES);
+	text = malloc(MAX_RECORD_BYTES + 1);
+	unsigned int seed = 1;
+	for(i=0; i<MAX_BATCH_BYTES; i++){
+		seed = seed * 1103515245 + 12345;
+		recordData[i] = seed >> 16;
+	}
+	for(i=0; i<MAX_RECORD_BYTES; i++)
+		text[i] = 'a' + recordData[i] % 26;
+	text[MAX_RECORD_BYTES] = '\0';
+	for(i=0; i<MAX_BATCH; i++){
+		partitionKeyArray[i] = malloc(16);
+		sprintf(partitionKeyArray[i], "pk-%d", i);
+		dataArray[i] = recordData;
+	}
+	for(i=0; i<32; i++)
+		signingKey[i] = i;
+
+	static const int recordSizes[] = {64, 256, 1024, 4096, 65536, 1024*1024};
+	static const int batchSizes[] = {1, 10, 100, 500};
+	const int recordSizeCount = sizeof(recordSizes)/sizeof(recordSizes[0]);
+	const int batchSizeCount = sizeof(batchSizes)/sizeof(batchSizes[0]);
+
+	printf("benchmark\trecord_bytes\tbatch\titerations\tns_per_op\tbytes_per_s\tallocs_per_op\n");
+
+	int r, b;
+	for(r=0; r<recordSizeCount; r++)
+		bench("base64Encode", opBase64Encode, recordSizes[r], 1, recordSizes[r], minTimeNs, filter);
+
+	for(r=0; r<recordSizeCount; r++)
+		bench("string2HexSHA256", opString2HexSHA256, recordSizes[r], 1, recordSizes[r], minTimeNs, filter);
+
+	bench("makeSignature", opMakeSignature, strlen(stringToSign), 1, strlen(stringToSign), minTimeNs, filter);
+
+	bench("makeAuthHeader", opMakeAuthHeader, 0, 1, 0, minTimeNs, filter);
+
+	/* batches within the 5 MB PutRecords limit */
+	for(r=0; r<recordSizeCount; r++)
+		for(b=0; b<batchSizeCount; b++)
+			if((long long)recordSizes[r] * batchSizes[b] <= MAX_BATCH_BYTES)
+				bench("makePutRecordsPayload", opMakePutRecordsPayload, recordSizes[r], batchSizes[b], (long long)recordSizes[r] * batchSizes[b], minTimeNs, filter);
+
+	for(i=0; i<MAX_BATCH; i++)
+		free(partitionKeyArray[i]);
+	free(recordData);
+	free(text);
+
+	return 0;
+}
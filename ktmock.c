@@ -0,0 +1,1231 @@
+#define _GNU_SOURCE
+#include "kt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+/*****************************************************************************************************************/
+/* ktmock, a local stand in for Kinesis for load testing producers and consumers without AWS. It serves the      */
+/* actions kt uses, ListStreams, DescribeStream, PutRecord, PutRecords, GetShardIterator, GetRecords,            */
+/* RegisterStreamConsumer and SubscribeToShard, over plain HTTP/1.1 with keep-alive, one thread per connection.  */
+/* Point a context at it with an http:// endpoint, e.g. http://localhost:4567.                                   */
+/* Requests are checked like Kinesis would: the SigV4 signature against -k/-i credentials, the stream name,      */
+/* then each record against its shard's throughput limits, token buckets refilled continuously and holding one   */
+/* second's worth. Records over the limit fail with ProvisionedThroughputExceededException; a further -f share   */
+/* fail with InternalFailure. Every response is held back -l ms, plus up to -j ms of jitter.                     */
+/* Accepted records are kept, up to -m per shard, oldest dropped first, for GetRecords to read back. Reads are   */
+/* limited like Kinesis to 5 calls and 2 MiB a second per shard, over which ProvisionedThroughputExceeded.       */
+/* Shard iterators are "shardId/next sequence" and never expire.                                                 */
+/* SubscribeToShard streams event stream messages in a chunked HTTP/1.1 response, where Kinesis uses HTTP/2,     */
+/* pushing new records within 100 ms at up to 2 MiB a second and an empty event each second otherwise, for -u    */
+/* seconds. A -f share of events is replaced by an InternalFailure exception, which ends the subscription.       */
+/* ktmock speaks HTTP/1.1 only, so it never exercises kt's HTTP/2 paths: subscriptions over HTTP/2 and the       */
+/* opts.http2 multiplexer fall back to HTTP/1.1 against it and are only tested against Kinesis itself.           */
+/* Any consumer name registers at once as ACTIVE.                                                                */
+/* Temporary credentials are served over GET and PUT as the EC2 instance metadata service and a container        */
+/* credentials endpoint would, with session tokens that expire after -x seconds, to exercise credential refresh. */
+/* Requests may be JSON or CBOR; responses are always JSON, which kt reads either way.                           */
+/*****************************************************************************************************************/
+
+/* kt internals reused here, not part of the public API in kt.h */
+void data2HexSHA256(const void *data, size_t len, char *hex);
+void makeSigningKey(const char *key, const char *shortDate, const char *region, const char *service, unsigned char *kSigning);
+char* makeStringToSign(const char *longDate, const char *shortDate, const char *region, const char *service, const char *canonicalRequest, ScratchArena *arena);
+void makeSignature(const unsigned char *kSigning, const char *stringToSign, char *hex);
+void makeHashKey(const char *partitionKey, unsigned char *hashKey);
+int parseHashKey(const char *decimal, unsigned char *hashKey);
+const char* jsonFindMember(const char *p, const char *end, const char *key);
+const char* jsonArrayFirst(const char *p, const char *end);
+const char* jsonArrayNext(const char *p, const char *end);
+int jsonCopyString(const char *p, const char *end, char *out, size_t outSize);
+int jsonCopyMember(const char *p, const char *end, const char *key, char *out, size_t outSize);
+
+#define MAX_HEADERS 32
+#define MAX_HEADER_BYTES 16384
+#define MAX_BODY_BYTES (16*1024*1024)
+#define READ_CALLS_PER_SECOND 5
+#define READ_BYTES_PER_SECOND (2*1024*1024)
+#define MAX_GET_RECORDS_BYTES (10*1024*1024)
+#define SUBSCRIBE_BYTES_PER_SECOND (2*1024*1024)
+#define SUBSCRIBE_POLL_MS 100
+
+typedef struct{
+	const char *address;
+	int port;
+	const char *key;
+	const char *keyId;
+	const char *streamName;
+	int shardCount;
+	double shardBytesPerSecond;
+	double shardRecordsPerSecond;
+	double failureRate;
+	int latencyMs;
+	int jitterMs;
+	int retainedRecords;
+	int subscriptionSeconds;
+	int credentialsSeconds;
+	int quiet;
+}MockOptions;
+
+/* a record kept for GetRecords, with its data still base64 as it was put */
+typedef struct{
+	char *partitionKey;
+	char *data;
+	long dataLen;
+	double arrivalTime;
+}MockRecord;
+
+/* per shard throughput, as token buckets, and the records kept in a ring indexed by sequence */
+typedef struct{
+	double bytes;
+	double records;
+	struct timespec refilled;
+	double readCalls;
+	double readBytes;
+	struct timespec readRefilled;
+	unsigned long long sequence;
+	MockRecord *stored;
+	char startingHashKey[41];
+	char endingHashKey[41];
+}MockShard;
+
+static MockOptions opts;
+static MockShard *shards;
+static pthread_mutex_t shardLock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_llong requestCount, recordCount, throttledCount, failedCount, rejectedCount;
+
+/* growable response body */
+typedef struct{
+	char *text;
+	size_t len;
+	size_t capacity;
+}MockBuffer;
+
+static void appendf(MockBuffer *b, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendf(MockBuffer *b, const char *format, ...){
+
+	va_list args;
+	for(;;){
+		va_start(args, format);
+		int n = vsnprintf(b->text + b->len, b->capacity - b->len, format, args);
+		va_end(args);
+		if(b->len + n < b->capacity){
+			b->len += n;
+			return;
+		}
+		b->capacity = 2 * (b->len + n + 1);
+		b->text = realloc(b->text, b->capacity);
+		if(!b->text){
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+}
+
+static void appendBytes(MockBuffer *b, const void *data, size_t len){
+
+	if(b->len + len > b->capacity){
+		b->capacity = 2 * (b->len + len);
+		b->text = realloc(b->text, b->capacity);
+		if(!b->text){
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(b->text + b->len, data, len);
+	b->len += len;
+}
+
+/*****************************************************************************************************************/
+/* 128 bit hash key arithmetic on big endian byte strings. Shard i of n starts at ceil(i * 2^128 / n), so the    */
+/* shard for hash key h is floor(h * n / 2^128), the bytes of h * n above the low 128 bits.                      */
+/*****************************************************************************************************************/
+
+/* divide len big endian bytes at x by divisor in place, returning the remainder */
+static unsigned int divideBytes(unsigned char *x, int len, unsigned int divisor){
+
+	unsigned long long remainder = 0;
+	int i;
+	for(i=0; i<len; i++){
+		unsigned long long v = remainder << 8 | x[i];
+		x[i] = (unsigned char)(v / divisor);
+		remainder = v % divisor;
+	}
+
+	return (unsigned int)remainder;
+}
+
+static void bytesToDecimal(const unsigned char *x, int len, char *decimal){
+
+	unsigned char v[17];
+	char digits[48];
+	int n = 0, i;
+
+	memcpy(v, x, len);
+	for(;;){
+		digits[n++] = '0' + divideBytes(v, len, 10);
+		for(i=0; i<len && !v[i]; i++)
+			;
+		if(i == len)
+			break;
+	}
+
+	for(i=0; i<n; i++)
+		decimal[i] = digits[n - 1 - i];
+	decimal[n] = '\0';
+}
+
+/* subtract one from len big endian bytes at x, which must not be zero */
+static void decrementBytes(unsigned char *x, int len){
+
+	int i;
+	for(i=len-1; i>=0 && x[i]-- == 0; i--)
+		;
+}
+
+static void makeShards(void){
+
+	shards = calloc(opts.shardCount, sizeof(MockShard));
+
+	int i;
+	for(i=0; i<opts.shardCount; i++){
+		/* start = ceil(i * 2^128 / n), as 17 bytes so i * 2^128 fits */
+		unsigned char start[17] = {0};
+		start[0] = (unsigned char)i;
+		if(divideBytes(start, 17, opts.shardCount)){
+			int j;
+			for(j=16; j>=0 && ++start[j] == 0; j--)
+				;
+		}
+		bytesToDecimal(start, 17, shards[i].startingHashKey);
+
+		/* end = next start - 1, or 2^128 - 1 for the last shard */
+		unsigned char end[17] = {0};
+		if(i == opts.shardCount - 1)
+			memset(end + 1, 0xFF, 16);
+		else{
+			end[0] = (unsigned char)(i + 1);
+			if(divideBytes(end, 17, opts.shardCount)){
+				int j;
+				for(j=16; j>=0 && ++end[j] == 0; j--)
+					;
+			}
+			decrementBytes(end, 17);
+		}
+		bytesToDecimal(end, 17, shards[i].endingHashKey);
+
+		shards[i].bytes = opts.shardBytesPerSecond;
+		shards[i].records = opts.shardRecordsPerSecond;
+		clock_gettime(CLOCK_MONOTONIC, &shards[i].refilled);
+		shards[i].readCalls = READ_CALLS_PER_SECOND;
+		shards[i].readBytes = READ_BYTES_PER_SECOND;
+		shards[i].readRefilled = shards[i].refilled;
+		shards[i].stored = calloc(opts.retainedRecords, sizeof(MockRecord));
+	}
+}
+
+static int shardForHashKey(const unsigned char *hashKey){
+
+	/* top byte of hashKey * shardCount, carried out of the 128 bits */
+	unsigned int carry = 0;
+	int i;
+	for(i=15; i>=0; i--)
+		carry = (hashKey[i] * (unsigned int)opts.shardCount + carry) >> 8;
+
+	return (int)carry;
+}
+
+/*****************************************************************************************************************/
+/* Charge a record of bytes to shard, refilling its buckets for the time since the last charge. Returns 0 if     */
+/* the shard is over its limit, in which case nothing is charged.                                                */
+/*****************************************************************************************************************/
+static int chargeShard(int shard, long bytes){
+
+	MockShard *s = &shards[shard];
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&shardLock);
+
+	double seconds = (now.tv_sec - s->refilled.tv_sec) + (now.tv_nsec - s->refilled.tv_nsec) / 1e9;
+	s->refilled = now;
+	s->bytes += seconds * opts.shardBytesPerSecond;
+	if(s->bytes > opts.shardBytesPerSecond)
+		s->bytes = opts.shardBytesPerSecond;
+	s->records += seconds * opts.shardRecordsPerSecond;
+	if(s->records > opts.shardRecordsPerSecond)
+		s->records = opts.shardRecordsPerSecond;
+
+	int ok = s->bytes >= bytes && s->records >= 1;
+	if(ok){
+		s->bytes -= bytes;
+		s->records -= 1;
+	}
+
+	pthread_mutex_unlock(&shardLock);
+
+	return ok;
+}
+
+/* keep an accepted record, dropping the oldest if the shard is full, and return its sequence */
+static unsigned long long storeRecord(int shard, const char *partitionKey, const char *data, long dataLen){
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	MockRecord record;
+	record.partitionKey = strdup(partitionKey);
+	record.data = strndup(data, dataLen);
+	record.dataLen = dataLen;
+	record.arrivalTime = now.tv_sec + now.tv_nsec / 1e9;
+
+	pthread_mutex_lock(&shardLock);
+	MockShard *s = &shards[shard];
+	unsigned long long sequence = ++s->sequence;
+	MockRecord *slot = &s->stored[sequence % opts.retainedRecords];
+	free(slot->partitionKey);
+	free(slot->data);
+	*slot = record;
+	pthread_mutex_unlock(&shardLock);
+
+	return sequence;
+}
+
+/* oldest sequence still kept. Caller holds shardLock */
+static unsigned long long oldestSequence(const MockShard *s){
+
+	return s->sequence < (unsigned long long)opts.retainedRecords ? 1 : s->sequence - opts.retainedRecords + 1;
+}
+
+/* a parsed request: method, path, lower cased header names and values point into the connection's buffer */
+typedef struct{
+	const char *method;
+	const char *path;
+	char *names[MAX_HEADERS];
+	char *values[MAX_HEADERS];
+	int headerCount;
+	const char *body;
+	size_t bodyLen;
+}MockRequest;
+
+static const char* requestHeader(const MockRequest *request, const char *name){
+
+	int i;
+	for(i=0; i<request->headerCount; i++)
+		if(strcmp(request->names[i], name) == 0)
+			return request->values[i];
+
+	return NULL;
+}
+
+/*****************************************************************************************************************/
+/* Check the request's SigV4 signature, rebuilding the canonical request from the headers it says it signed.     */
+/* Returns NULL if it verifies, otherwise the AWS error type, with the reason in message.                        */
+/*****************************************************************************************************************/
+static const char* verifySignature(const MockRequest *request, char *message, size_t messageSize){
+
+	const char *authorization = requestHeader(request, "authorization");
+	const char *longDate = requestHeader(request, "x-amz-date");
+	char keyId[128], shortDate[16], region[64], service[64], signedHeaders[512], signature[128];
+
+	if(!authorization || !longDate || sscanf(authorization,
+		"AWS4-HMAC-SHA256 Credential=%127[^/]/%15[^/]/%63[^/]/%63[^/]/aws4_request, SignedHeaders=%511[^,], Signature=%127s",
+		keyId, shortDate, region, service, signedHeaders, signature) != 6){
+		snprintf(message, messageSize, "Missing or malformed Authorization");
+		return "MissingAuthenticationTokenException";
+	}
+
+	if(strcmp(keyId, opts.keyId) != 0){
+		snprintf(message, messageSize, "The security token included in the request is invalid");
+		return "UnrecognizedClientException";
+	}
+
+	/* canonical request: method, path, empty query, each signed header, the header list and the payload hash */
+	MockBuffer creq = {NULL, 0, 0};
+	appendf(&creq, "POST\n/\n\n");
+	char *names = strdup(signedHeaders), *save = NULL, *name;
+	for(name = strtok_r(names, ";", &save); name; name = strtok_r(NULL, ";", &save)){
+		const char *value = requestHeader(request, name);
+		appendf(&creq, "%s:%s\n", name, value ? value : "");
+	}
+	free(names);
+	char payloadHash[65];
+	data2HexSHA256(request->body, request->bodyLen, payloadHash);
+	appendf(&creq, "\n%s\n%s", signedHeaders, payloadHash);
+
+	unsigned char signingKey[32];
+	makeSigningKey(opts.key, shortDate, region, service, signingKey);
+	char *stringToSign = makeStringToSign(longDate, shortDate, region, service, creq.text, NULL);
+	char expected[65];
+	makeSignature(signingKey, stringToSign, expected);
+	free(stringToSign);
+	free(creq.text);
+
+	if(strcmp(expected, signature) != 0){
+		snprintf(message, messageSize, "The request signature we calculated does not match the signature you provided");
+		return "InvalidSignatureException";
+	}
+
+	return NULL;
+}
+
+/* bytes of the base64 string at p once decoded, or -1 if p isn't a string */
+static long base64StringBytes(const char *p, const char *end){
+
+	if(!p || *p != '"')
+		return -1;
+
+	const char *q = ++p;
+	while(q < end && *q != '"')
+		q++;
+	long len = (long)(q - p);
+	long padding = (len > 0 && p[len-1] == '=') + (len > 1 && p[len-2] == '=');
+
+	return len / 4 * 3 - padding;
+}
+
+/*****************************************************************************************************************/
+/* Put one record from the PutRecords entry or PutRecord request at p: find its shard, charge it and write       */
+/* the outcome as a PutRecordsResultEntry. Returns 1 if it was accepted.                                         */
+/*****************************************************************************************************************/
+static int putMockRecord(const char *p, const char *end, MockBuffer *out){
+
+	char partitionKey[300], explicitHashKey[64];
+	unsigned char hashKey[16];
+
+	int keyLen = jsonCopyMember(p, end, "PartitionKey", partitionKey, sizeof(partitionKey));
+	long dataLen = base64StringBytes(jsonFindMember(p, end, "Data"), end);
+	if(keyLen < 1 || dataLen < 0){
+		appendf(out, "{\"ErrorCode\":\"ValidationException\",\"ErrorMessage\":\"Record needs PartitionKey and Data\"}");
+		return 0;
+	}
+
+	if(jsonCopyMember(p, end, "ExplicitHashKey", explicitHashKey, sizeof(explicitHashKey)) > 0)
+		parseHashKey(explicitHashKey, hashKey);
+	else
+		makeHashKey(partitionKey, hashKey);
+	int shard = shardForHashKey(hashKey);
+
+	atomic_fetch_add(&recordCount, 1);
+
+	if(!chargeShard(shard, dataLen + keyLen)){
+		atomic_fetch_add(&throttledCount, 1);
+		appendf(out, "{\"ErrorCode\":\"ProvisionedThroughputExceededException\",\"ErrorMessage\":\"Rate exceeded for shard shardId-%012d in stream %s.\"}", shard, opts.streamName ? opts.streamName : "mock");
+		return 0;
+	}
+
+	if(opts.failureRate > 0 && rand() < opts.failureRate * ((double)RAND_MAX + 1)){
+		atomic_fetch_add(&failedCount, 1);
+		appendf(out, "{\"ErrorCode\":\"InternalFailure\",\"ErrorMessage\":\"Internal service failure.\"}");
+		return 0;
+	}
+
+	const char *data = jsonFindMember(p, end, "Data") + 1;
+	unsigned long long sequence = storeRecord(shard, partitionKey, data, (const char*)memchr(data, '"', end - data) - data);
+	appendf(out, "{\"SequenceNumber\":\"%020llu%010d\",\"ShardId\":\"shardId-%012d\"}", sequence, shard, shard);
+
+	return 1;
+}
+
+/*****************************************************************************************************************/
+/* Charge a GetRecords call to shard, refilling its read buckets. The call is refused if the shard has made 5    */
+/* calls in the last second or read more than 2 MiB; bytes are charged afterwards by chargeShardRead, so one     */
+/* large read can take the byte bucket below zero and hold off the calls after it.                               */
+/*****************************************************************************************************************/
+static int chargeShardCall(int shard){
+
+	MockShard *s = &shards[shard];
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&shardLock);
+
+	double seconds = (now.tv_sec - s->readRefilled.tv_sec) + (now.tv_nsec - s->readRefilled.tv_nsec) / 1e9;
+	s->readRefilled = now;
+	s->readCalls += seconds * READ_CALLS_PER_SECOND;
+	if(s->readCalls > READ_CALLS_PER_SECOND)
+		s->readCalls = READ_CALLS_PER_SECOND;
+	s->readBytes += seconds * READ_BYTES_PER_SECOND;
+	if(s->readBytes > READ_BYTES_PER_SECOND)
+		s->readBytes = READ_BYTES_PER_SECOND;
+
+	int ok = s->readCalls >= 1 && s->readBytes > 0;
+	if(ok)
+		s->readCalls -= 1;
+
+	pthread_mutex_unlock(&shardLock);
+
+	return ok;
+}
+
+/*****************************************************************************************************************/
+/* Write kept records of shard from *sequence on as a JSON array, up to limit of them and no more than maxBytes  */
+/* of data, leaving *sequence at the next. Reading before the oldest kept record starts at it, as reading        */
+/* trimmed data does. Returns the data bytes written. Caller holds shardLock.                                    */
+/*****************************************************************************************************************/
+static long appendMockRecords(int shard, unsigned long long *sequence, int limit, long maxBytes, MockBuffer *out){
+
+	MockShard *s = &shards[shard];
+	long bytes = 0;
+	int count = 0;
+
+	if(*sequence < oldestSequence(s))
+		*sequence = oldestSequence(s);
+
+	appendf(out, "[");
+	for(; *sequence <= s->sequence && count < limit && bytes < maxBytes; (*sequence)++, count++){
+		const MockRecord *r = &s->stored[*sequence % opts.retainedRecords];
+		appendf(out, "%s{\"SequenceNumber\":\"%020llu%010d\",\"ApproximateArrivalTimestamp\":%.3f,\"Data\":\"%s\",\"PartitionKey\":\"%s\"}",
+			count ? "," : "", *sequence, shard, r->arrivalTime, r->data, r->partitionKey);
+		bytes += r->dataLen / 4 * 3;
+	}
+	appendf(out, "]");
+
+	return bytes;
+}
+
+/* how far behind the newest record a reader at sequence is, by the age of the record there. Caller holds shardLock. */
+static long long millisBehind(int shard, unsigned long long sequence){
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	const MockShard *s = &shards[shard];
+	if(sequence > s->sequence)
+		return 0;
+
+	return (long long)((now.tv_sec + now.tv_nsec / 1e9 - s->stored[sequence % opts.retainedRecords].arrivalTime) * 1000);
+}
+
+/* Write a GetRecords response for shard from sequence on, with the iterator to carry on from. Returns the data bytes read. */
+static long getMockRecords(int shard, unsigned long long sequence, int limit, MockBuffer *out){
+
+	pthread_mutex_lock(&shardLock);
+
+	appendf(out, "{\"Records\":");
+	long bytes = appendMockRecords(shard, &sequence, limit, MAX_GET_RECORDS_BYTES, out);
+	appendf(out, ",\"NextShardIterator\":\"shardId-%012d/%llu\",\"MillisBehindLatest\":%lld}", shard, sequence, millisBehind(shard, sequence));
+	shards[shard].readBytes -= bytes;
+
+	pthread_mutex_unlock(&shardLock);
+
+	return bytes;
+}
+
+/*****************************************************************************************************************/
+/* The first sequence to read from shard for a GetShardIterator or SubscribeToShard starting position of type,   */
+/* with startingSequence for the two that take one. Returns NULL, or the reason it is invalid.                   */
+/*****************************************************************************************************************/
+static const char* startingSequence(int shard, const char *type, const char *startingSequence, unsigned long long *sequence){
+
+	int hasSequence = startingSequence && strlen(startingSequence) == 30 && sscanf(startingSequence, "%20llu", sequence) == 1;
+	int at = strcmp(type, "AT_SEQUENCE_NUMBER") == 0, after = strcmp(type, "AFTER_SEQUENCE_NUMBER") == 0;
+
+	if((at || after) && !hasSequence)
+		return "StartingSequenceNumber is invalid";
+
+	pthread_mutex_lock(&shardLock);
+	if(strcmp(type, "TRIM_HORIZON") == 0)
+		*sequence = oldestSequence(&shards[shard]);
+	else if(strcmp(type, "LATEST") == 0)
+		*sequence = shards[shard].sequence + 1;
+	else if(after)
+		(*sequence)++;
+	pthread_mutex_unlock(&shardLock);
+
+	return at || after || strcmp(type, "TRIM_HORIZON") == 0 || strcmp(type, "LATEST") == 0 ? NULL : "Starting position type is not supported";
+}
+
+/*****************************************************************************************************************/
+/* Append an event stream message: prelude, string headers, payload and CRCs. type is the :event-type or, for    */
+/* an exception, the :exception-type.                                                                            */
+/*****************************************************************************************************************/
+static void appendEventMessage(MockBuffer *out, const char *messageType, const char *type, const char *payload, size_t payloadLen){
+
+	const char *names[3] = {":message-type", strcmp(messageType, "exception") == 0 ? ":exception-type" : ":event-type", ":content-type"};
+	const char *values[3] = {messageType, type, "application/json"};
+
+	MockBuffer headers = {NULL, 0, 0};
+	int i;
+	for(i=0; i<3; i++){
+		unsigned char nameLen = (unsigned char)strlen(names[i]), valueType = 7;
+		unsigned char valueLen[2] = {(unsigned char)(strlen(values[i]) >> 8), (unsigned char)strlen(values[i])};
+		appendBytes(&headers, &nameLen, 1);
+		appendBytes(&headers, names[i], nameLen);
+		appendBytes(&headers, &valueType, 1);
+		appendBytes(&headers, valueLen, 2);
+		appendBytes(&headers, values[i], strlen(values[i]));
+	}
+
+	uint32_t total = 16 + headers.len + payloadLen;
+	unsigned char prelude[12] = {total >> 24, total >> 16, total >> 8, total, headers.len >> 24, headers.len >> 16, headers.len >> 8, headers.len};
+	uint32_t crc = crc32(0, prelude, 8);
+	prelude[8] = crc >> 24, prelude[9] = crc >> 16, prelude[10] = crc >> 8, prelude[11] = crc;
+
+	size_t start = out->len;
+	appendBytes(out, prelude, 12);
+	appendBytes(out, headers.text, headers.len);
+	appendBytes(out, payload, payloadLen);
+	crc = crc32(0, (unsigned char*)out->text + start, out->len - start);
+	unsigned char messageCrc[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+	appendBytes(out, messageCrc, 4);
+
+	free(headers.text);
+}
+
+/* write an AWS style error body, returning its status */
+static int mockError(MockBuffer *out, int status, const char *type, const char *message){
+
+	appendf(out, "{\"__type\":\"%s\",\"message\":\"%s\"}", type, message);
+
+	return status;
+}
+
+/*****************************************************************************************************************/
+/* Answer one request, writing the JSON body to out and returning the HTTP status, or 0 for a subscription to    */
+/* stream, as set in subscription.                                                                               */
+/*****************************************************************************************************************/
+/* a subscription accepted by handleRequest, streamed by serveConnection */
+typedef struct{
+	int shard;
+	unsigned long long sequence;
+}MockSubscription;
+
+static int handleRequest(const MockRequest *request, MockBuffer *out, MockSubscription *subscription){
+
+	atomic_fetch_add(&requestCount, 1);
+
+	char message[512];
+	if(opts.key){
+		const char *type = verifySignature(request, message, sizeof(message));
+		if(type){
+			atomic_fetch_add(&rejectedCount, 1);
+			return mockError(out, 403, type, message);
+		}
+	}
+
+	/* session tokens issued by handleMetadataRequest carry their expiry */
+	const char *token = requestHeader(request, "x-amz-security-token");
+	long long expiry;
+	if(token && sscanf(token, "mock-session-%lld", &expiry) == 1 && expiry <= (long long)time(NULL)){
+		atomic_fetch_add(&rejectedCount, 1);
+		return mockError(out, 400, "ExpiredTokenException", "The security token included in the request is expired");
+	}
+
+	/* CBOR bodies are read as their JSON form */
+	const char *contentType = requestHeader(request, "content-type");
+	char *converted = NULL;
+	const char *body = request->body, *end = request->body + request->bodyLen;
+	if(contentType && strcmp(contentType, "application/x-amz-cbor-1.1") == 0){
+		converted = ktCBORToJSON(request->body, request->bodyLen);
+		if(!converted)
+			return mockError(out, 400, "SerializationException", "Malformed CBOR");
+		body = converted;
+		end = converted + strlen(converted);
+	}
+
+	const char *target = requestHeader(request, "x-amz-target");
+	const char *action = target && strncmp(target, "Kinesis_20131202.", 17) == 0 ? target + 17 : "";
+
+	char streamName[256];
+	int status = 200;
+	int i;
+
+	if(strcmp(action, "ListStreams") == 0)
+		appendf(out, "{\"HasMoreStreams\":false,\"StreamNames\":[\"%s\"]}", opts.streamName ? opts.streamName : "mock");
+
+	else if(strcmp(action, "GetRecords") == 0){
+
+		/* the iterator names the stream's shard, so GetRecords has no StreamName */
+		char iterator[128];
+		unsigned long long sequence;
+		int shard, limit = 10000;
+		const char *limitValue = jsonFindMember(body, end, "Limit");
+		if(limitValue && atoi(limitValue) > 0 && atoi(limitValue) < limit)
+			limit = atoi(limitValue);
+
+		if(jsonCopyMember(body, end, "ShardIterator", iterator, sizeof(iterator)) < 1 || sscanf(iterator, "shardId-%d/%llu", &shard, &sequence) != 2 || shard < 0 || shard >= opts.shardCount)
+			status = mockError(out, 400, "InvalidArgumentException", "Invalid ShardIterator");
+		else if(!chargeShardCall(shard)){
+			atomic_fetch_add(&throttledCount, 1);
+			snprintf(message, sizeof(message), "Rate exceeded for shard shardId-%012d in stream %s.", shard, opts.streamName ? opts.streamName : "mock");
+			status = mockError(out, 400, "ProvisionedThroughputExceededException", message);
+		}
+		else
+			getMockRecords(shard, sequence, limit, out);
+	}
+
+	else if(strcmp(action, "RegisterStreamConsumer") == 0 || strcmp(action, "SubscribeToShard") == 0){
+
+		/* these name the stream by ARN, arn:aws:kinesis:region:account:stream/name, the consumer's with /consumer/name:time after it */
+		char arn[512] = "", consumerName[256] = "";
+		int isRegister = strcmp(action, "RegisterStreamConsumer") == 0;
+		jsonCopyMember(body, end, isRegister ? "StreamARN" : "ConsumerARN", arn, sizeof(arn));
+		const char *name = strstr(arn, ":stream/");
+		const char *consumer = strstr(arn, "/consumer/");
+		size_t nameLen = name ? (consumer ? (size_t)(consumer - name) : strlen(name)) - 8 : 0;
+		if(isRegister)
+			jsonCopyMember(body, end, "ConsumerName", consumerName, sizeof(consumerName));
+
+		if(!name || (isRegister ? (consumer || !*consumerName) : !consumer))
+			status = mockError(out, 400, "ValidationException", isRegister ? "StreamARN and ConsumerName are required" : "ConsumerARN is invalid");
+		else if(opts.streamName && (nameLen != strlen(opts.streamName) || strncmp(name + 8, opts.streamName, nameLen) != 0)){
+			snprintf(message, sizeof(message), "%s %.400s not found.", isRegister ? "Stream" : "Consumer", arn);
+			status = mockError(out, 400, "ResourceNotFoundException", message);
+		}
+		else if(isRegister)
+			appendf(out, "{\"Consumer\":{\"ConsumerName\":\"%s\",\"ConsumerARN\":\"%s/consumer/%s:%lld\",\"ConsumerStatus\":\"ACTIVE\",\"ConsumerCreationTimestamp\":%lld}}",
+				consumerName, arn, consumerName, (long long)time(NULL), (long long)time(NULL));
+		else{
+			char shardId[64] = "", type[32] = "", sequenceNumber[64] = "";
+			int shard = -1;
+			if(jsonCopyMember(body, end, "ShardId", shardId, sizeof(shardId)) > 0)
+				sscanf(shardId, "shardId-%d", &shard);
+			const char *position = jsonFindMember(body, end, "StartingPosition");
+			int hasSequence = 0;
+			if(position){
+				jsonCopyMember(position, end, "Type", type, sizeof(type));
+				hasSequence = jsonCopyMember(position, end, "SequenceNumber", sequenceNumber, sizeof(sequenceNumber)) > 0;
+			}
+			const char *invalid;
+
+			if(shard < 0 || shard >= opts.shardCount){
+				snprintf(message, sizeof(message), "Shard %s does not exist", shardId);
+				status = mockError(out, 400, "ResourceNotFoundException", message);
+			}
+			else if((invalid = startingSequence(shard, type, hasSequence ? sequenceNumber : NULL, &subscription->sequence)) != NULL)
+				status = mockError(out, 400, "InvalidArgumentException", invalid);
+			else{
+				/* serveConnection streams it */
+				subscription->shard = shard;
+				status = 0;
+			}
+		}
+	}
+
+	else if(jsonCopyMember(body, end, "StreamName", streamName, sizeof(streamName)) < 1)
+		status = mockError(out, 400, "ValidationException", "StreamName is required");
+
+	else if(opts.streamName && strcmp(streamName, opts.streamName) != 0){
+		snprintf(message, sizeof(message), "Stream %s under account 000000000000 not found.", streamName);
+		status = mockError(out, 400, "ResourceNotFoundException", message);
+	}
+
+	else if(strcmp(action, "DescribeStream") == 0){
+
+		/* pages of up to Limit shards, after ExclusiveStartShardId */
+		char startShardId[64];
+		int first = 0, limit = 100;
+		if(jsonCopyMember(body, end, "ExclusiveStartShardId", startShardId, sizeof(startShardId)) > 0 && sscanf(startShardId, "shardId-%d", &first) == 1)
+			first++;
+		const char *limitValue = jsonFindMember(body, end, "Limit");
+		if(limitValue && atoi(limitValue) > 0)
+			limit = atoi(limitValue);
+		int last = first + limit < opts.shardCount ? first + limit : opts.shardCount;
+
+		appendf(out, "{\"StreamDescription\":{\"StreamName\":\"%s\",\"StreamARN\":\"arn:aws:kinesis:us-east-1:000000000000:stream/%s\",\"StreamStatus\":\"ACTIVE\",\"Shards\":[", streamName, streamName);
+		for(i=first; i<last; i++)
+			appendf(out, "%s{\"ShardId\":\"shardId-%012d\",\"HashKeyRange\":{\"StartingHashKey\":\"%s\",\"EndingHashKey\":\"%s\"},\"SequenceNumberRange\":{\"StartingSequenceNumber\":\"%020d%010d\"}}",
+				i > first ? "," : "", i, shards[i].startingHashKey, shards[i].endingHashKey, 0, i);
+		appendf(out, "],\"HasMoreShards\":%s,\"RetentionPeriodHours\":24}}", last < opts.shardCount ? "true" : "false");
+	}
+
+	else if(strcmp(action, "GetShardIterator") == 0){
+
+		char shardId[64] = "", type[32] = "", sequenceNumber[64] = "";
+		int shard = -1;
+		unsigned long long sequence = 0;
+		if(jsonCopyMember(body, end, "ShardId", shardId, sizeof(shardId)) > 0)
+			sscanf(shardId, "shardId-%d", &shard);
+		jsonCopyMember(body, end, "ShardIteratorType", type, sizeof(type));
+		int hasSequence = jsonCopyMember(body, end, "StartingSequenceNumber", sequenceNumber, sizeof(sequenceNumber)) > 0;
+		const char *invalid;
+
+		if(shard < 0 || shard >= opts.shardCount){
+			snprintf(message, sizeof(message), "Shard %s in stream %s under account 000000000000 does not exist", shardId, streamName);
+			status = mockError(out, 400, "ResourceNotFoundException", message);
+		}
+		else if((invalid = startingSequence(shard, type, hasSequence ? sequenceNumber : NULL, &sequence)) != NULL)
+			status = mockError(out, 400, "InvalidArgumentException", invalid);
+		else
+			appendf(out, "{\"ShardIterator\":\"shardId-%012d/%llu\"}", shard, sequence);
+	}
+
+	else if(strcmp(action, "PutRecord") == 0){
+
+		MockBuffer result = {NULL, 0, 0};
+		int accepted = putMockRecord(body, end, &result);
+		if(accepted)
+			appendf(out, "%s", result.text);
+		else{
+			/* a single record's error is the call's error */
+			char errorCode[64], errorMessage[256];
+			jsonCopyMember(result.text, result.text + result.len, "ErrorCode", errorCode, sizeof(errorCode));
+			jsonCopyMember(result.text, result.text + result.len, "ErrorMessage", errorMessage, sizeof(errorMessage));
+			status = mockError(out, strcmp(errorCode, "InternalFailure") == 0 ? 500 : 400, errorCode, errorMessage);
+		}
+		free(result.text);
+	}
+
+	else if(strcmp(action, "PutRecords") == 0){
+
+		const char *records = jsonFindMember(body, end, "Records");
+		const char *record;
+		int count = 0, failed = 0;
+
+		MockBuffer results = {NULL, 0, 0};
+		for(record = records ? jsonArrayFirst(records, end) : NULL; record; record = jsonArrayNext(record, end)){
+			if(count++)
+				appendf(&results, ",");
+			failed += !putMockRecord(record, end, &results);
+		}
+
+		if(count == 0 || count > 500)
+			status = mockError(out, 400, "ValidationException", "Records must hold 1 to 500 entries");
+		else
+			appendf(out, "{\"FailedRecordCount\":%d,\"Records\":[%s]}", failed, results.text);
+		free(results.text);
+	}
+
+	else{
+		snprintf(message, sizeof(message), "Operation %s is not supported by ktmock", target ? target : "(none)");
+		status = mockError(out, 400, "UnknownOperationException", message);
+	}
+
+	free(converted);
+
+	return status;
+}
+
+static int writeAll(int fd, const char *data, size_t len){
+
+	while(len > 0){
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+		if(n <= 0)
+			return 0;
+		data += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static int writeChunk(int fd, const char *data, size_t len){
+
+	char size[32];
+	int sizeLen = snprintf(size, sizeof(size), "%zx\r\n", len);
+
+	return writeAll(fd, size, sizeLen) && writeAll(fd, data, len) && writeAll(fd, "\r\n", 2);
+}
+
+static void sleepMs(int ms){
+
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+	while(nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+/*****************************************************************************************************************/
+/* Stream a subscription: the initial-response, then a SubscribeToShardEvent whenever there are new records,     */
+/* checked every SUBSCRIBE_POLL_MS and paced to SUBSCRIBE_BYTES_PER_SECOND, or each second regardless, until     */
+/* -u seconds are up. Returns 0 if the client went away.                                                         */
+/*****************************************************************************************************************/
+static int streamSubscription(int fd, const MockSubscription *subscription, unsigned int *seed){
+
+	char head[256];
+	int headLen = snprintf(head, sizeof(head),
+		"HTTP/1.1 200 OK\r\nContent-Type: application/vnd.amazon.eventstream\r\nTransfer-Encoding: chunked\r\nx-amzn-RequestId: %08x-mock\r\n\r\n",
+		(unsigned int)rand_r(seed));
+	MockBuffer out = {NULL, 0, 0};
+	appendEventMessage(&out, "event", "initial-response", "{}", 2);
+	int ok = writeAll(fd, head, headLen) && writeChunk(fd, out.text, out.len);
+
+	struct timespec start, last, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start;
+	unsigned long long sequence = subscription->sequence;
+	double budget = SUBSCRIBE_BYTES_PER_SECOND;
+	MockBuffer payload = {NULL, 0, 0};
+
+	while(ok){
+
+		sleepMs(SUBSCRIBE_POLL_MS);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double sinceLast = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+		if((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9 >= opts.subscriptionSeconds)
+			break;
+
+		budget += SUBSCRIBE_BYTES_PER_SECOND * SUBSCRIBE_POLL_MS / 1000.0;
+		if(budget > SUBSCRIBE_BYTES_PER_SECOND)
+			budget = SUBSCRIBE_BYTES_PER_SECOND;
+
+		pthread_mutex_lock(&shardLock);
+		int pending = sequence <= shards[subscription->shard].sequence;
+		if(!(pending && budget > 0) && sinceLast < 1){
+			pthread_mutex_unlock(&shardLock);
+			continue;
+		}
+		payload.len = 0;
+		appendf(&payload, "{\"Records\":");
+		budget -= appendMockRecords(subscription->shard, &sequence, budget > 0 ? 10000 : 0, (long)budget, &payload);
+		appendf(&payload, ",\"ContinuationSequenceNumber\":\"%020llu%010d\",\"MillisBehindLatest\":%lld}", sequence - 1, subscription->shard, millisBehind(subscription->shard, sequence));
+		pthread_mutex_unlock(&shardLock);
+
+		out.len = 0;
+		if(opts.failureRate > 0 && rand_r(seed) < opts.failureRate * ((double)RAND_MAX + 1)){
+			static const char *failure = "{\"message\":\"Internal service failure.\"}";
+			atomic_fetch_add(&failedCount, 1);
+			appendEventMessage(&out, "exception", "InternalFailure", failure, strlen(failure));
+			ok = writeChunk(fd, out.text, out.len);
+			break;
+		}
+		appendEventMessage(&out, "event", "SubscribeToShardEvent", payload.text, payload.len);
+		ok = writeChunk(fd, out.text, out.len);
+		last = now;
+	}
+
+	ok = ok && writeAll(fd, "0\r\n\r\n", 5);
+
+	free(payload.text);
+	free(out.text);
+
+	return ok;
+}
+
+/*****************************************************************************************************************/
+/* Answer a GET or PUT as the EC2 instance metadata service (IMDSv2, under /latest) or a container credentials   */
+/* endpoint (at /credentials) would, issuing the -k/-i credentials with a session token that expires after -x    */
+/* seconds. Requests signed with an expired token then fail in handleRequest.                                    */
+/*****************************************************************************************************************/
+#define MOCK_IMDS_TOKEN "mock-imds-token"
+#define MOCK_ROLE "ktmock-role"
+
+static int handleMetadataRequest(const MockRequest *request, MockBuffer *out){
+
+	static const char *rolesPath = "/latest/meta-data/iam/security-credentials/";
+
+	if(strcmp(request->method, "PUT") == 0 && strcmp(request->path, "/latest/api/token") == 0){
+		if(!requestHeader(request, "x-aws-ec2-metadata-token-ttl-seconds"))
+			return mockError(out, 400, "MissingParameter", "X-aws-ec2-metadata-token-ttl-seconds is required");
+		appendf(out, "%s", MOCK_IMDS_TOKEN);
+		return 200;
+	}
+
+	if(strcmp(request->method, "GET") != 0)
+		return mockError(out, 405, "InvalidAction", "Method not allowed");
+
+	if(strncmp(request->path, rolesPath, strlen(rolesPath)) == 0){
+		const char *token = requestHeader(request, "x-aws-ec2-metadata-token");
+		if(!token || strcmp(token, MOCK_IMDS_TOKEN) != 0)
+			return mockError(out, 401, "Unauthorized", "An IMDSv2 session token is required");
+		const char *role = request->path + strlen(rolesPath);
+		if(!*role){
+			appendf(out, "%s", MOCK_ROLE);
+			return 200;
+		}
+		if(strcmp(role, MOCK_ROLE) != 0)
+			return mockError(out, 404, "NotFound", "No such role");
+	}
+	else if(strcmp(request->path, "/credentials") != 0)
+		return mockError(out, 404, "NotFound", "Not found");
+
+	time_t expiry = time(NULL) + opts.credentialsSeconds;
+	struct tm tm;
+	char expiration[32];
+	gmtime_r(&expiry, &tm);
+	strftime(expiration, sizeof(expiration), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	appendf(out, "{\"Code\":\"Success\",\"Type\":\"AWS-HMAC\",\"AccessKeyId\":\"%s\",\"SecretAccessKey\":\"%s\",\"Token\":\"mock-session-%lld\",\"Expiration\":\"%s\"}",
+		opts.keyId ? opts.keyId : "MOCKACCESSKEYID", opts.key ? opts.key : "mock-secret-key", (long long)expiry, expiration);
+
+	return 200;
+}
+
+static const char* statusText(int status){
+
+	switch(status){
+		case 200: return "OK";
+		case 400: return "Bad Request";
+		case 401: return "Unauthorized";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 411: return "Length Required";
+		case 413: return "Payload Too Large";
+		default: return "Internal Server Error";
+	}
+}
+
+/*****************************************************************************************************************/
+/* Connection thread. Reads requests into one growing buffer, headers then Content-Length bytes of body, and     */
+/* answers each in turn until the client closes the connection.                                                  */
+/*****************************************************************************************************************/
+static void* serveConnection(void *arg){
+
+	int fd = (int)(intptr_t)arg;
+	size_t capacity = 65536, len = 0;
+	char *buffer = malloc(capacity);
+	unsigned int seed = (unsigned int)fd;
+
+	for(;;){
+
+		/* read until the end of the headers */
+		char *headerEnd;
+		while(!(headerEnd = len ? memmem(buffer, len, "\r\n\r\n", 4) : NULL)){
+			if(len >= MAX_HEADER_BYTES)
+				goto done;
+			ssize_t n = recv(fd, buffer + len, capacity - len - 1, 0);
+			if(n <= 0)
+				goto done;
+			len += n;
+		}
+		*headerEnd = '\0';
+
+		/* request line, then headers with lower cased names */
+		MockRequest request;
+		request.headerCount = 0;
+		char *line = strstr(buffer, "\r\n");
+		char *next;
+		if(line)
+			*line = '\0';
+		request.method = strtok_r(buffer, " ", &next);
+		request.path = request.method ? strtok_r(NULL, " ", &next) : NULL;
+		if(!request.path)
+			request.method = request.path = "";
+		for(line = line ? line + 2 : headerEnd; line < headerEnd && request.headerCount < MAX_HEADERS; line = next){
+			next = strstr(line, "\r\n");
+			next = next ? next : headerEnd;
+			*next = '\0';
+			next += 2;
+			char *colon = strchr(line, ':');
+			if(!colon)
+				continue;
+			*colon = '\0';
+			char *value = colon + 1;
+			while(*value == ' ' || *value == '\t')
+				value++;
+			char *trim = value + strlen(value);
+			while(trim > value && (trim[-1] == ' ' || trim[-1] == '\t'))
+				*--trim = '\0';
+			char *c;
+			for(c=line; *c; c++)
+				*c = (char)tolower((unsigned char)*c);
+			request.names[request.headerCount] = line;
+			request.values[request.headerCount++] = value;
+		}
+
+		const char *lengthHeader = requestHeader(&request, "content-length");
+		const char *expect = requestHeader(&request, "expect");
+		size_t headerLen = headerEnd + 4 - buffer;
+		size_t bodyLen = lengthHeader ? strtoul(lengthHeader, NULL, 10) : 0;
+		int status = 0;
+		MockBuffer out = {NULL, 0, 0};
+		appendf(&out, "%s", "");
+
+		if(!lengthHeader && strcmp(request.method, "POST") == 0)
+			status = mockError(&out, 411, "ValidationException", "Content-Length is required");
+		else if(bodyLen > MAX_BODY_BYTES)
+			status = mockError(&out, 413, "ValidationException", "Request too large");
+		else{
+			if(expect && strcasecmp(expect, "100-continue") == 0 && len < headerLen + bodyLen)
+				writeAll(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+
+			/* the body follows the headers; if the buffer has to grow the request line and header pointers move with it */
+			if(headerLen + bodyLen + 1 > capacity){
+				char *grown = malloc(headerLen + bodyLen + 1);
+				memcpy(grown, buffer, len);
+				if(*request.path){
+					request.method = grown + (request.method - buffer);
+					request.path = grown + (request.path - buffer);
+				}
+				int i;
+				for(i=0; i<request.headerCount; i++){
+					request.names[i] = grown + (request.names[i] - buffer);
+					request.values[i] = grown + (request.values[i] - buffer);
+				}
+				free(buffer);
+				buffer = grown;
+				capacity = headerLen + bodyLen + 1;
+			}
+			while(len < headerLen + bodyLen){
+				ssize_t n = recv(fd, buffer + len, capacity - len - 1, 0);
+				if(n <= 0)
+					goto done;
+				len += n;
+			}
+
+			request.body = buffer + headerLen;
+			request.bodyLen = bodyLen;
+			MockSubscription subscription;
+			if(strcmp(request.method, "POST") != 0)
+				status = handleMetadataRequest(&request, &out);
+			else
+				status = handleRequest(&request, &out, &subscription);
+			if(status == 0){
+				free(out.text);
+				if(!streamSubscription(fd, &subscription, &seed))
+					goto done;
+				size_t used = headerLen + bodyLen;
+				memmove(buffer, buffer + used, len - used);
+				len -= used;
+				continue;
+			}
+		}
+
+		int delay = opts.latencyMs + (opts.jitterMs > 0 ? (int)(rand_r(&seed) % (opts.jitterMs + 1)) : 0);
+		if(delay > 0)
+			sleepMs(delay);
+
+		char head[256];
+		int headLen = snprintf(head, sizeof(head),
+			"HTTP/1.1 %d %s\r\nContent-Type: application/x-amz-json-1.1\r\nContent-Length: %zu\r\nx-amzn-RequestId: %08x-mock\r\n\r\n",
+			status, statusText(status), out.len, (unsigned int)rand_r(&seed));
+		int written = writeAll(fd, head, headLen) && writeAll(fd, out.text, out.len);
+		free(out.text);
+		if(!written || status == 411 || status == 413)
+			goto done;
+
+		/* keep anything after this request for the next */
+		size_t used = headerLen + bodyLen;
+		memmove(buffer, buffer + used, len - used);
+		len -= used;
+	}
+
+done:
+	close(fd);
+	free(buffer);
+
+	return NULL;
+}
+
+/* print a line a second while requests are coming in */
+static void* reportStats(void *arg){
+
+	long long last[5] = {0};
+	for(;;){
+		sleep(1);
+		long long now[5] = {atomic_load(&requestCount), atomic_load(&recordCount), atomic_load(&throttledCount), atomic_load(&failedCount), atomic_load(&rejectedCount)};
+		if(now[0] != last[0])
+			fprintf(stderr, "%lld requests/s, %lld records/s, %lld throttled/s, %lld failed/s, %lld rejected/s\n",
+				now[0] - last[0], now[1] - last[1], now[2] - last[2], now[3] - last[3], now[4] - last[4]);
+		memcpy(last, now, sizeof(last));
+	}
+
+	return arg;
+}
+
+void printUsageThenExit(){
+
+	printf(
+		"Usage:\n"
+		"  ktmock [-a address] [-p port] [-k aws_key -i aws_key_id] [-s stream_name]\n"
+		"         [-n shards] [-b shard_bytes_per_second] [-r shard_records_per_second]\n"
+		"         [-f failure_rate] [-l latency_ms] [-j jitter_ms] [-m retained]\n"
+		"         [-u subscription_seconds] [-x credentials_seconds] [-q]\n\n"
+		"  Serve a mock Kinesis stream over plain HTTP on address:port (default\n"
+		"  127.0.0.1:4567), for clients made with an endpoint of http://address:port.\n"
+		"  With -k and -i requests must be signed with those credentials. Only\n"
+		"  stream_name exists if given, otherwise any name is accepted. The stream has\n"
+		"  shards shards (default 4), each limited to the Kinesis defaults of 1 MiB\n"
+		"  and 1000 records a second unless set. failure_rate (0 to 1) of records that\n"
+		"  pass the limits fail with InternalFailure. Responses are delayed latency_ms\n"
+		"  plus up to jitter_ms. The last retained records of each shard (default\n"
+		"  100000) are kept for GetRecords and SubscribeToShard, whose subscriptions\n"
+		"  last subscription_seconds (default 300). Temporary credentials are served as\n"
+		"  by EC2 instance metadata (IMDSv2), and at /credentials as by a container\n"
+		"  credentials endpoint: the -k/-i pair with a session token that expires after\n"
+		"  credentials_seconds (default 3600). Activity is reported each second unless\n"
+		"  -q is given.\n\n"
+		);
+
+	exit(1);
+}
+
+int main(int argc, char **argv){
+
+	opts.address = "127.0.0.1";
+	opts.port = 4567;
+	opts.shardCount = 4;
+	opts.shardBytesPerSecond = 1024 * 1024;
+	opts.shardRecordsPerSecond = 1000;
+	opts.retainedRecords = 100000;
+	opts.subscriptionSeconds = 300;
+	opts.credentialsSeconds = 3600;
+
+	int opt;
+	while((opt = getopt(argc, argv, "a:p:k:i:s:n:b:r:f:l:j:m:u:x:q")) != -1){
+		switch(opt){
+			case 'a': opts.address = optarg; break;
+			case 'p': opts.port = atoi(optarg); break;
+			case 'k': opts.key = optarg; break;
+			case 'i': opts.keyId = optarg; break;
+			case 's': opts.streamName = optarg; break;
+			case 'n': opts.shardCount = atoi(optarg); break;
+			case 'b': opts.shardBytesPerSecond = atof(optarg); break;
+			case 'r': opts.shardRecordsPerSecond = atof(optarg); break;
+			case 'f': opts.failureRate = atof(optarg); break;
+			case 'l': opts.latencyMs = atoi(optarg); break;
+			case 'j': opts.jitterMs = atoi(optarg); break;
+			case 'm': opts.retainedRecords = atoi(optarg); break;
+			case 'u': opts.subscriptionSeconds = atoi(optarg); break;
+			case 'x': opts.credentialsSeconds = atoi(optarg); break;
+			case 'q': opts.quiet = 1; break;
+			default: printUsageThenExit();
+		}
+	}
+
+	if(!opts.key != !opts.keyId || opts.shardCount < 1 || opts.shardCount > 255 || opts.port <= 0 || opts.retainedRecords < 1)
+		printUsageThenExit();
+
+	makeShards();
+	srand((unsigned int)time(NULL));
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(opts.port);
+	if(inet_pton(AF_INET, opts.address, &addr.sin_addr) != 1 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0){
+		fprintf(stderr, "Cannot listen on %s:%d: %s\n", opts.address, opts.port, strerror(errno));
+		exit(1);
+	}
+
+	fprintf(stderr, "ktmock serving %d shard%s on http://%s:%d%s\n", opts.shardCount, opts.shardCount == 1 ? "" : "s", opts.address, opts.port, opts.key ? ", checking signatures" : "");
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_t thread;
+	if(!opts.quiet)
+		pthread_create(&thread, &attr, reportStats, NULL);
+
+	for(;;){
+		int fd = accept(listener, NULL, NULL);
+		if(fd < 0)
+			continue;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if(pthread_create(&thread, &attr, serveConnection, (void*)(intptr_t)fd) != 0)
+			close(fd);
+	}
+}
@@ -3,20 +3,51 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 void printUsageThenExit(){	
 	printf(
 		"Usage:\n"
-		"  ktool -L -k aws_key -i aws_key_id -r region -e endpoint [-t session_token]\n"
-		"  ktool -D -k aws_key -i aws_key_id -r region -e endpoint [-t session_token]\n"
+		"  ktool -L [-k aws_key -i aws_key_id] -r region -e endpoint [-t session_token]\n"
+		"  ktool -D [-k aws_key -i aws_key_id] -r region -e endpoint [-t session_token]\n"
 		"        -s stream_name\n"
-		"  ktool -P -k aws_key -i aws_key_id -r region -e endpoint [-t session_token]\n"
-		"        -s stream_name -p partition_key [-f filename] [-x text]\n\n"
+		"  ktool -P [-k aws_key -i aws_key_id] -r region -e endpoint [-t session_token]\n"
+		"        -s stream_name -p partition_key [-f filename] [-x text]\n"
+		"        [-z gzip|zstd [-d dictionary_file]]\n"
+		"  ktool -B [-k aws_key -i aws_key_id] -r region -e endpoint [-t session_token]\n"
+		"        -s stream_name [-f filename] [-b] [-j jobs] [-m] [-p partition_key ...]\n"
+		"        [-z gzip|zstd [-d dictionary_file]] [-2]\n"
+		"  ktool -C [-k aws_key -i aws_key_id] -r region -e endpoint [-t session_token]\n"
+		"        -s stream_name [-o checkpoint_file] [-j jobs] [-a consumer_arn]\n"
+		"  ktool -T -o dictionary_file -f sample_file [-f sample_file ...]\n\n"
 		"  List Kinesis streams, describe a Kinesis stream or put data onto a Kinesis\n"
 		"  stream from file and/or text on the command line. Provide a session_token\n"
-		"  if using temporary AWS credentials. Specify a single -f or -x option to\n"
+		"  if using temporary AWS credentials. Without -k and -i, credentials are\n"
+		"  found as the AWS SDKs find them: from the environment, ~/.aws/credentials,\n"
+		"  a container credentials endpoint or EC2 instance metadata, and refreshed\n"
+		"  before they expire. Specify a single -f or -x option to\n"
 		"  make ktool to use the single record action 'PutRecord' otherwise\n"
-		"  'PutRecords' will be used.\n\n"
+		"  'PutRecords' will be used. -z compresses each record, zstd optionally\n"
+		"  with a dictionary trained by -T from sample records, one per file.\n"
+		"  -B bulk loads records from filename, or stdin without -f, one per line or\n"
+		"  with -b each preceded by its length as a 4 byte big endian integer.\n"
+		"  Records are sent in full PutRecords batches on jobs (default 4) parallel\n"
+		"  connections, keyed by the -p keys in turn or by record number without -p.\n"
+		"  -m then breaks down where request time went, stage by stage. -2 sends the\n"
+		"  jobs as HTTP/2 streams multiplexed over shared connections.\n"
+		"  -C reads every shard of the stream on jobs parallel workers, writing each\n"
+		"  record to stdout followed by a newline, until interrupted. With -o it\n"
+		"  resumes after the records already read, as saved in checkpoint_file.\n"
+		"  With -a records are pushed by SubscribeToShard to the registered enhanced\n"
+		"  fan-out consumer consumer_arn rather than polled with GetRecords.\n\n"
 		);
 	
 	exit(1);
@@ -51,21 +82,297 @@ unsigned char *readFile(const char *fname, int *len){
 	return buffer;
 }
 
+/*************************************************************************************************/
+/* Bulk load. Input is mapped rather than read where it can be, a regular file or redirected     */
+/* stdin, and records are split out of the mapping without another read buffer. ktProducerPut    */
+/* copies each into the Producer's queue, whose worker threads send full batches in parallel and */
+/* report each record to bulkRecordDone.                                                         */
+/*************************************************************************************************/
+#define BULK_MAX_RECORD (1024*1024)
+
+static atomic_llong bulkSent, bulkFailed, bulkBytes;
+static char bulkError[64 + 2 + 256];
+static atomic_flag bulkErrorSet = ATOMIC_FLAG_INIT;
+
+static void bulkRecordDone(const ProducerResult *result, void *userData){
+
+	if(result->record->success){
+		atomic_fetch_add(&bulkSent, 1);
+		atomic_fetch_add(&bulkBytes, (intptr_t)userData);
+	}
+	else{
+		atomic_fetch_add(&bulkFailed, 1);
+		if(!atomic_flag_test_and_set(&bulkErrorSet))
+			snprintf(bulkError, sizeof(bulkError), "%s: %s", result->record->errorCode, result->record->errorMessage);
+	}
+}
+
+/* queue one record, keyed by the -p keys in turn or by its number */
+static void bulkPut(Producer *producer, long long recordNumber, char **partitionKeys, int partitionKeyCount, const unsigned char *data, int len){
+
+	char numberKey[24];
+	const char *partitionKey = partitionKeys[recordNumber % (partitionKeyCount ? partitionKeyCount : 1)];
+	if(partitionKeyCount == 0){
+		sprintf(numberKey, "%lld", recordNumber);
+		partitionKey = numberKey;
+	}
+
+	ktProducerPut(producer, partitionKey, data, len, bulkRecordDone, (void*)(intptr_t)len);
+}
+
+/* cut records out of len bytes at data. Returns the record count, -1 if a length prefix runs past the end or -2 */
+/* if it is over the 1 MiB Kinesis record limit.                                                                   */
+static long long bulkPutBuffer(Producer *producer, const unsigned char *data, size_t len, int lengthPrefixed, char **partitionKeys, int partitionKeyCount){
+
+	long long count = 0;
+	size_t offset = 0;
+
+	while(offset < len){
+		size_t recordLen;
+		if(lengthPrefixed){
+			if(len - offset < 4)
+				return -1;
+			recordLen = (size_t)data[offset] << 24 | data[offset+1] << 16 | data[offset+2] << 8 | data[offset+3];
+			offset += 4;
+			if(recordLen > BULK_MAX_RECORD)
+				return -2;
+			if(recordLen > len - offset)
+				return -1;
+			bulkPut(producer, count++, partitionKeys, partitionKeyCount, data + offset, (int)recordLen);
+			offset += recordLen;
+		}
+		else{
+			const unsigned char *newline = memchr(data + offset, '\n', len - offset);
+			recordLen = newline ? (size_t)(newline - (data + offset)) : len - offset;
+			if(recordLen > 0) /* blank lines are skipped */
+				bulkPut(producer, count++, partitionKeys, partitionKeyCount, data + offset, (int)recordLen);
+			offset += recordLen + 1;
+		}
+	}
+
+	return count;
+}
+
+/* as bulkPutBuffer, for a pipe that can't be mapped */
+static long long bulkPutStream(Producer *producer, FILE *file, int lengthPrefixed, char **partitionKeys, int partitionKeyCount){
+
+	long long count = 0;
+	unsigned char *buffer = NULL;
+	size_t capacity = 0;
+
+	for(;;){
+		ssize_t recordLen;
+		if(lengthPrefixed){
+			unsigned char prefix[4];
+			size_t got = fread(prefix, 1, 4, file);
+			if(got == 0)
+				break;
+			if(got != 4){
+				count = -1;
+				break;
+			}
+			recordLen = (size_t)prefix[0] << 24 | prefix[1] << 16 | prefix[2] << 8 | prefix[3];
+			if(recordLen > BULK_MAX_RECORD){
+				count = -2;
+				break;
+			}
+			if((size_t)recordLen > capacity){
+				capacity = recordLen;
+				buffer = realloc(buffer, capacity);
+				if(!buffer){
+					fprintf(stderr, "Cannot malloc buffer\n");
+					exit(1);
+				}
+			}
+			if(fread(buffer, 1, recordLen, file) != (size_t)recordLen){
+				count = -1;
+				break;
+			}
+		}
+		else{
+			recordLen = getline((char**)&buffer, &capacity, file);
+			if(recordLen < 0)
+				break;
+			if(recordLen > 0 && buffer[recordLen-1] == '\n')
+				recordLen--;
+			if(recordLen == 0)
+				continue;
+		}
+		bulkPut(producer, count++, partitionKeys, partitionKeyCount, buffer, (int)recordLen);
+	}
+
+	free(buffer);
+
+	return count;
+}
+
+/* bulk load records from filename, or stdin if NULL, then report throughput. Returns 1 if every record was sent. */
+static int bulkLoad(const AWSContext *ctx, const char *streamName, const char *filename, int lengthPrefixed, int jobs, char **partitionKeys, int partitionKeyCount){
+
+	int fd = filename ? open(filename, O_RDONLY) : STDIN_FILENO;
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0){
+		fprintf(stderr, "Cannot open file %s\n", filename ? filename : "stdin");
+		exit(1);
+	}
+
+	/* keep every worker busy with a full batch while the next ones queue */
+	ProducerOptions opts;
+	ktDefaultProducerOptions(&opts);
+	opts.workerCount = jobs;
+	opts.maxQueuedRecords = 2 * jobs * opts.maxBatchRecords;
+	opts.blockWhenFull = 1;
+	opts.lingerMs = 10;
+	Producer *producer = ktMakeProducer(ctx, streamName, &opts);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	long long count;
+	if(S_ISREG(st.st_mode)){
+		unsigned char *data = NULL;
+		if(st.st_size > 0){
+			data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(data == MAP_FAILED){
+				fprintf(stderr, "Cannot map file %s\n", filename ? filename : "stdin");
+				exit(1);
+			}
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+		}
+		count = bulkPutBuffer(producer, data, st.st_size, lengthPrefixed, partitionKeys, partitionKeyCount);
+		ktFreeProducer(producer);
+		if(data)
+			munmap(data, st.st_size);
+	}
+	else{
+		FILE *file = fdopen(fd, "r");
+		count = bulkPutStream(producer, file, lengthPrefixed, partitionKeys, partitionKeyCount);
+		ktFreeProducer(producer);
+	}
+	if(filename)
+		close(fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if(count == -1)
+		fprintf(stderr, "Input ends inside a record, records before it were sent\n");
+	else if(count == -2)
+		fprintf(stderr, "Input has a record over the 1 MiB limit, records before it were sent\n");
+
+	long long sent = atomic_load(&bulkSent), failed = atomic_load(&bulkFailed);
+	double megabytes = atomic_load(&bulkBytes) / 1e6;
+	fprintf(stderr, "%lld records sent, %lld failed, %.1f MB in %.2f s: %.0f records/s, %.2f MB/s\n", sent, failed, megabytes, seconds, sent / seconds, megabytes / seconds);
+	if(failed)
+		fprintf(stderr, "First failure %s\n", bulkError);
+
+	return count >= 0 && failed == 0;
+}
+
+/* consume records to stdout until SIGINT or SIGTERM */
+static pthread_mutex_t consumeLock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t consumeStopping;
+
+static void consumeSignal(int signal){
+
+	consumeStopping = signal;
+}
+
+static void consumeRecords(const ConsumerRecord *records, int recordCount, long long millisBehindLatest, void *userData){
+
+	(void)millisBehindLatest;
+	(void)userData;
+
+	/* whole batches, so records from different shards aren't interleaved mid line */
+	pthread_mutex_lock(&consumeLock);
+	int i;
+	for(i=0; i<recordCount; i++){
+		fwrite(records[i].data, 1, records[i].len, stdout);
+		putchar('\n');
+	}
+	pthread_mutex_unlock(&consumeLock);
+}
+
+/* read the stream until interrupted, then report throughput. Returns 1 if the consumer could be started. */
+static int consume(const AWSContext *ctx, const char *streamName, const char *checkpointFile, const char *consumerARN, int jobs){
+
+	ConsumerOptions opts;
+	ktDefaultConsumerOptions(&opts);
+	opts.workerCount = jobs;
+	opts.checkpointFile = checkpointFile;
+	opts.consumerARN = consumerARN;
+	opts.callback = consumeRecords;
+
+	char errorMsg[256];
+	Consumer *consumer = ktMakeConsumer(ctx, streamName, &opts, errorMsg);
+	if(!consumer){
+		fprintf(stderr, "%s\n", errorMsg);
+		return 0;
+	}
+
+	signal(SIGINT, consumeSignal);
+	signal(SIGTERM, consumeSignal);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while(!consumeStopping)
+		pause();
+
+	ConsumerStats stats;
+	ktGetConsumerStats(consumer, &stats);
+	ktFreeConsumer(consumer);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fflush(stdout);
+
+	fprintf(stderr, "%lld records, %.1f MB in %.2f s from %d shards, %d finished: %.0f records/s, %lld %s calls, %lld throttled, %lld failed\n",
+		stats.records, stats.bytes / 1e6, seconds, stats.shards, stats.finishedShards, stats.records / seconds, stats.getRecordsCalls, consumerARN ? "SubscribeToShard" : "GetRecords", stats.throttledCalls, stats.failedCalls);
+
+	return 1;
+}
+
+/* print counters and per stage latencies from ctx's metrics */
+static void printMetrics(const AWSContext *ctx){
+
+	MetricsSnapshot *snapshot = malloc(sizeof(MetricsSnapshot));
+	if(!snapshot || !ktGetMetrics(ctx, snapshot)){
+		free(snapshot);
+		return;
+	}
+
+	int i;
+	for(i=0; i<KT_COUNTER_COUNT; i++)
+		fprintf(stderr, "%s%s %llu", i ? ", " : "", ktMetricsCounterName(i), snapshot->counters[i]);
+	fprintf(stderr, "\n%-10s %8s %10s %10s %10s %10s\n", "stage", "count", "mean ms", "p50 ms", "p99 ms", "max ms");
+	for(i=0; i<KT_STAGE_COUNT; i++){
+		const LatencyHistogram *h = &snapshot->stages[i];
+		if(h->count)
+			fprintf(stderr, "%-10s %8llu %10.3f %10.3f %10.3f %10.3f\n", ktMetricsStageName(i), h->count, h->sumNs / 1e6 / h->count,
+				ktHistogramPercentile(h, 50) / 1e6, ktHistogramPercentile(h, 99) / 1e6, h->maxNs / 1e6);
+	}
+
+	free(snapshot);
+}
+
 int main(int argc, char **argv){
 
 	char *key=NULL, *keyId=NULL, *sessionToken=NULL, *region=NULL, *endpoint=NULL, *streamName=NULL;
+	char *codecName=NULL, *dictionaryFile=NULL, *outputFile=NULL, *consumerARN=NULL;
 	char action=0;
-	int opt;
+	int opt, lengthPrefixed=0, jobs=4, metrics=0, http2=0;
 	
 	char *filenames[255], *strings[255], *partitionKeys[255];
 	int filenameCount=0, stringCount=0, partitionKeyCount=0;
 	
 	/* parse command line */
-	while ((opt = getopt(argc, argv,"PLDk:i:t:r:e:s:f:x:p:")) != -1){
+	while ((opt = getopt(argc, argv,"PLDTBCbm2k:i:t:r:e:s:f:x:p:z:d:o:j:a:")) != -1){
 		switch (opt){
 			case 'P': /* put record */
 			case 'L': /* list streams */
 			case 'D': /* describe stream */
+			case 'T': /* train dictionary */
+			case 'B': /* bulk load */
+			case 'C': /* consume */
 				action = opt;
 				break;
 			case 'k':
@@ -95,14 +402,72 @@ int main(int argc, char **argv){
 			case 'p':
 				partitionKeys[partitionKeyCount++] = optarg;
 				break;
+			case 'z':
+				codecName = optarg;
+				break;
+			case 'd':
+				dictionaryFile = optarg;
+				break;
+			case 'o':
+				outputFile = optarg;
+				break;
+			case 'b':
+				lengthPrefixed = 1;
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				break;
+			case 'm':
+				metrics = 1;
+				break;
+			case 'a':
+				consumerARN = optarg;
+				break;
+			case '2':
+				http2 = 1;
+				break;
 
 			default:
 				printUsageThenExit();
 		}
 	}
 
+	/* train a dictionary from sample files, no AWS access needed */
+	if(action == 'T'){
+
+		if(outputFile == NULL || filenameCount == 0)
+			printUsageThenExit();
+
+		unsigned char **samples = malloc(filenameCount * sizeof(unsigned char*));
+		int *sampleLens = malloc(filenameCount * sizeof(int));
+		int i;
+		for(i=0;i<filenameCount;i++)
+			samples[i]=readFile(filenames[i], &sampleLens[i]);
+
+		static unsigned char dictionary[112640];
+		size_t dictionaryLen = ktTrainDictionary(samples, sampleLens, filenameCount, dictionary, sizeof(dictionary));
+		if(dictionaryLen == 0){
+			fprintf(stderr, "Cannot train dictionary, too few samples or ktool built without zstd\n");
+			exit(1);
+		}
+
+		FILE *file = fopen(outputFile, "w");
+		if(!file || fwrite(dictionary, dictionaryLen, 1, file) != 1){
+			fprintf(stderr, "Cannot write %s\n", outputFile);
+			exit(1);
+		}
+		fclose(file);
+		fprintf(stderr, "%zu byte dictionary written to %s\n", dictionaryLen, outputFile);
+
+		for(i=0;i<filenameCount;i++)
+			free(samples[i]);
+		free(samples);
+		free(sampleLens);
+		exit(0);
+	}
+
 	/* ensure we have the right parameters for all actions */
-	if(key == NULL || keyId == NULL || region == NULL || endpoint == NULL)
+	if(!key != !keyId || region == NULL || endpoint == NULL)
 		printUsageThenExit();
 
 	/* test parameters for describe */
@@ -112,15 +477,74 @@ int main(int argc, char **argv){
 	/* test parameters for PutRecord(s) */
 	if(action == 'P' && (streamName == NULL || partitionKeyCount == 0 || filenameCount + stringCount == 0))
 		printUsageThenExit();
+
+	/* test parameters for bulk load */
+	if(action == 'B' && (streamName == NULL || filenameCount > 1 || stringCount > 0 || jobs < 1))
+		printUsageThenExit();
 	
+	/* test parameters for consume */
+	if(action == 'C' && (streamName == NULL || jobs < 1))
+		printUsageThenExit();
+
+	/* make a compressor if asked to */
+	Compressor *compressor = NULL;
+	if(codecName){
+
+		int dictionaryLen = 0;
+		unsigned char *dictionary = dictionaryFile ? readFile(dictionaryFile, &dictionaryLen) : NULL;
+
+		if(strcmp(codecName, "gzip") == 0 && !dictionary)
+			compressor = ktMakeCompressor(KT_CODEC_GZIP, 6, NULL, 0);
+		else if(strcmp(codecName, "zstd") == 0)
+			compressor = ktMakeCompressor(KT_CODEC_ZSTD, 3, dictionary, dictionaryLen);
+
+		if(!compressor){
+			fprintf(stderr, "Unsupported compression %s%s\n", codecName, dictionary ? " with dictionary" : "");
+			exit(1);
+		}
+		free(dictionary);
+	}
+
 	/* make a context object */
-	AWSContext* ctx = ktMakeAWSContext(key, keyId, sessionToken, region, endpoint);
+	AWSContextOptions opts;
+	ktDefaultAWSContextOptions(&opts);
+	opts.compressor = compressor;
+	if(action == 'B' && jobs > opts.poolSize)
+		opts.poolSize = jobs;
+	opts.metrics = metrics;
+	opts.http2 = http2;
 	
 	/* create response and error buffers */
 	httpResponse respHeader, respBody;
 	char errorMsg[256];
 	int retcode;
+
+	/* with no key given, credentials come from the default provider chain */
+	AWSContext* ctx;
+	if(key)
+		ctx = ktMakeAWSContextEx(key, keyId, sessionToken, region, endpoint, &opts);
+	else if(!(ctx = ktMakeAWSContextWithCredentials(NULL, region, endpoint, &opts, errorMsg))){
+		fprintf(stderr, "Cannot get AWS credentials: %s\n", errorMsg);
+		exit(1);
+	}
 	
+	/* bulk load reports for itself */
+	if(action == 'B'){
+		int ok = bulkLoad(ctx, streamName, filenameCount ? filenames[0] : NULL, lengthPrefixed, jobs, partitionKeys, partitionKeyCount);
+		printMetrics(ctx);
+		ktFreeAWSContext(ctx);
+		ktFreeCompressor(compressor);
+		exit(ok ? 0 : 1);
+	}
+
+	/* consume runs until interrupted */
+	if(action == 'C'){
+		int ok = consume(ctx, streamName, outputFile, consumerARN, jobs);
+		ktFreeAWSContext(ctx);
+		ktFreeCompressor(compressor);
+		exit(ok ? 0 : 1);
+	}
+
 	/* do requested action */
 	if(action == 'L')
 		retcode = ktListStreams(ctx, &respHeader, &respBody, errorMsg);
@@ -199,6 +623,7 @@ int main(int argc, char **argv){
 
 	/* cleanup */
 	ktFreeAWSContext(ctx);
+	ktFreeCompressor(compressor);
 }
 
 
@@ -0,0 +1,1614 @@
+#define _GNU_SOURCE
+#include "kt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <curl/curl.h>
+
+/*****************************************************************************************************************/
+/* Tests for kt. The offline tests check payloads byte for byte against known encodings, or against the simple   */
+/* builder kt used before payloads were written in one pass, and parsers and decoders against hand made input.   */
+/* Given an endpoint, the mock tests then put records through a ktmock started with -k test -i test -s kttest    */
+/* -n 1 and read them back, see the test target in Makefile. Given a second, the retry tests use a ktmock        */
+/* started the same way with -f 0.5. One line is printed per failed check, and the exit status is the number of  */
+/* failures.                                                                                                     */
+/*****************************************************************************************************************/
+
+/* kt internals under test, not part of the public API in kt.h */
+void data2HexSHA256(const void *data, size_t len, char *hex);
+char* makePutRecordsPayload(const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, char *payloadHash, ScratchArena *arena);
+char* makePutRecordCBORPayload(const unsigned char *data, int len, const char *streamName, const char *partitionKey, char *payloadHash, size_t *payloadLen, ScratchArena *arena);
+char* makePutRecordsCBORPayload(const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, char *payloadHash, size_t *payloadLen, ScratchArena *arena);
+const char* jsonFindMember(const char *p, const char *end, const char *key);
+int jsonCopyMember(const char *p, const char *end, const char *key, char *out, size_t outSize);
+int* aggregationGroups(const AWSContext *ctx, const char *streamName, int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray);
+int aggregateRecordsData(int recordCount, char * const *partitionKeyArray, char * const *explicitHashKeyArray, unsigned char * const *dataArray, const int *lenArray, const int *groupArray, unsigned char ***dataArrayOut, int **lenArrayOut);
+int base64Decoders(long (**decoders)(const char*, size_t, unsigned char*), const char **names, int max);
+
+static int failures;
+static int checks;
+
+/* count a check, reporting it if it failed. Returns ok */
+static int check(int ok, const char *test, const char *what){
+
+	checks++;
+	if(!ok){
+		failures++;
+		printf("FAIL %s: %s\n", test, what);
+	}
+
+	return ok;
+}
+
+/* check payload is expected, and payloadHash its SHA-256 */
+static void checkPayload(const char *test, const char *payload, size_t payloadLen, const char *payloadHash, const char *expected, size_t expectedLen){
+
+	char hash[65];
+
+	if(!check(payload != NULL, test, "no payload"))
+		return;
+	check(payloadLen == expectedLen && memcmp(payload, expected, expectedLen) == 0, test, "payload differs");
+	data2HexSHA256(payload, payloadLen, hash);
+	check(strcmp(hash, payloadHash) == 0, test, "payload hash differs");
+}
+
+/* base64 as kt first encoded it, one group of three bytes at a time. Caller frees */
+static char* referenceBase64Encode(const unsigned char *data, int len){
+
+	static const char *lookupTable = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	int padding = len % 3 > 0 ? 3 - len % 3 : 0;
+	char *data64 = malloc(4 * (len + padding) / 3 + 1);
+	int in = 0, out = 0;
+
+	while(in < len){
+		unsigned int threeBytes = data[in++] << 16;
+		if(in < len)
+			threeBytes += data[in++] << 8;
+		if(in < len)
+			threeBytes += data[in++];
+		data64[out++] = lookupTable[(threeBytes >> 18) & 0x3F];
+		data64[out++] = lookupTable[(threeBytes >> 12) & 0x3F];
+		data64[out++] = lookupTable[(threeBytes >>  6) & 0x3F];
+		data64[out++] = lookupTable[threeBytes & 0x3F];
+	}
+
+	data64[out] = '\0';
+	if(padding >= 1)
+		data64[out-1] = '=';
+	if(padding == 2)
+		data64[out-2] = '=';
+
+	return data64;
+}
+
+/* a PutRecords JSON payload as kt first built it, an entry per record joined with strcat. Caller frees */
+static char* referencePutRecordsPayload(const char *streamName, int recordCount, char * const *partitionKeyArray, unsigned char * const *dataArray, const int *lenArray){
+
+	char **entries = malloc((recordCount ? recordCount : 1) * sizeof(char*));
+	size_t size = strlen("{\"StreamName\": \"\",\"Records\": [") + strlen(streamName) + strlen("]}") + 1;
+	int i;
+
+	for(i=0; i<recordCount; i++){
+		char *data64 = referenceBase64Encode(dataArray[i], lenArray[i]);
+		entries[i] = malloc(strlen(partitionKeyArray[i]) + strlen(data64) + 64);
+		sprintf(entries[i], "{\"PartitionKey\":\"%s\",\"Data\":\"%s\"}", partitionKeyArray[i], data64);
+		size += strlen(entries[i]) + 1;
+		free(data64);
+	}
+
+	char *payload = malloc(size);
+	sprintf(payload, "{\"StreamName\": \"%s\",\"Records\": [", streamName);
+	for(i=0; i<recordCount; i++){
+		if(i > 0)
+			strcat(payload, ",");
+		strcat(payload, entries[i]);
+		free(entries[i]);
+	}
+	strcat(payload, "]}");
+	free(entries);
+
+	return payload;
+}
+
+/* JSON PutRecords payloads against the reference builder over random batches, empty records and batches included */
+static void testPutRecordsPayload(void){
+
+	#define EQUIVALENCE_BATCHES 300
+	#define MAX_BATCH 500
+
+	char *partitionKeyArray[MAX_BATCH];
+	unsigned char *dataArray[MAX_BATCH];
+	int lenArray[MAX_BATCH];
+	unsigned int seed = 1;
+	int batch, i, j;
+
+	for(batch=0; batch<EQUIVALENCE_BATCHES; batch++){
+
+		seed = seed * 1103515245 + 12345;
+		int recordCount = (seed >> 16) % (MAX_BATCH + 1);
+
+		for(i=0; i<recordCount; i++){
+			seed = seed * 1103515245 + 12345;
+			lenArray[i] = i % 7 == 0 ? 0 : (seed >> 16) % (i % 5 == 0 ? 10000 : 100);
+			partitionKeyArray[i] = malloc(32);
+			sprintf(partitionKeyArray[i], "pk-%u", seed % 1000);
+			dataArray[i] = malloc(lenArray[i] ? lenArray[i] : 1);
+			for(j=0; j<lenArray[i]; j++){
+				seed = seed * 1103515245 + 12345;
+				dataArray[i][j] = seed >> 16;
+			}
+		}
+
+		char hash[65];
+		char *payload = makePutRecordsPayload("stream", recordCount, partitionKeyArray, NULL, dataArray, lenArray, hash, NULL);
+		char *expected = referencePutRecordsPayload("stream", recordCount, partitionKeyArray, dataArray, lenArray);
+		checkPayload("makePutRecordsPayload", payload, payload ? strlen(payload) : 0, hash, expected, strlen(expected));
+		free(payload);
+		free(expected);
+
+		for(i=0; i<recordCount; i++){
+			free(partitionKeyArray[i]);
+			free(dataArray[i]);
+		}
+	}
+}
+
+/* CBOR payloads against hand encoded ones: definite length maps, text keys and record data as byte strings */
+static void testCBORPayloads(void){
+
+	static const char putRecord[] =
+		"\xA3"
+		"\x6A" "StreamName" "\x61" "s"
+		"\x6C" "PartitionKey" "\x61" "a"
+		"\x64" "Data" "\x42" "\x00\xFF";
+
+	static const char putRecords[] =
+		"\xA2"
+		"\x6A" "StreamName" "\x61" "s"
+		"\x67" "Records" "\x82"
+			"\xA2"
+			"\x6C" "PartitionKey" "\x61" "a"
+			"\x64" "Data" "\x42" "\x00\xFF"
+			"\xA3"
+			"\x6C" "PartitionKey" "\x61" "b"
+			"\x6F" "ExplicitHashKey" "\x61" "1"
+			"\x64" "Data" "\x58\x18" "aaaaaaaaaaaaaaaaaaaaaaaa";
+
+	unsigned char shortData[2] = {0x00, 0xFF};
+	unsigned char longData[24];
+	memset(longData, 'a', sizeof(longData));
+
+	char hash[65];
+	size_t len;
+
+	char *payload = makePutRecordCBORPayload(shortData, sizeof(shortData), "s", "a", hash, &len, NULL);
+	checkPayload("cbor PutRecord payload", payload, len, hash, putRecord, sizeof(putRecord) - 1);
+	free(payload);
+
+	char *partitionKeyArray[2] = {"a", "b"};
+	char *explicitHashKeyArray[2] = {NULL, "1"};
+	unsigned char *dataArray[2] = {shortData, longData};
+	int lenArray[2] = {sizeof(shortData), sizeof(longData)};
+
+	payload = makePutRecordsCBORPayload("s", 2, partitionKeyArray, explicitHashKeyArray, dataArray, lenArray, hash, &len, NULL);
+	checkPayload("cbor PutRecords payload", payload, len, hash, putRecords, sizeof(putRecords) - 1);
+	free(payload);
+}
+
+/* a CBOR PutRecords response converted to the JSON Kinesis would have sent */
+static void testCBORToJSON(void){
+
+	static const char response[] =
+		"\xA2"
+		"\x71" "FailedRecordCount" "\x00"
+		"\x67" "Records" "\x81"
+			"\xA3"
+			"\x6E" "SequenceNumber" "\x61" "1"
+			"\x67" "ShardId" "\x74" "shardId-000000000000"
+			"\x64" "Data" "\x42" "\x00\xFF";
+
+	char *json = ktCBORToJSON(response, sizeof(response) - 1);
+	if(!check(json != NULL, "ktCBORToJSON", "not converted"))
+		return;
+	check(strcmp(json, "{\"FailedRecordCount\":0,\"Records\":[{\"SequenceNumber\":\"1\",\"ShardId\":\"shardId-000000000000\",\"Data\":\"AP8=\"}]}") == 0, "ktCBORToJSON", json);
+	free(json);
+
+	check(ktCBORToJSON(response, sizeof(response) - 2) == NULL, "ktCBORToJSON", "truncated CBOR converted");
+}
+
+/* every base64 decoder the CPU runs against the scalar one, over encodings of every length mod 48 and a few    */
+/* blocks more, then the same encodings with one char made invalid at each position, or a char dropped          */
+static void testBase64Decoders(void){
+
+	#define MAX_DECODERS 4
+	#define MAX_DECODED (3 * 48 * 3)
+
+	long (*decoders[MAX_DECODERS])(const char*, size_t, unsigned char*);
+	const char *names[MAX_DECODERS];
+	int decoderCount = base64Decoders(decoders, names, MAX_DECODERS);
+	check(decoderCount > 0 && strcmp(names[0], "scalar") == 0, "base64Decoders", "no scalar decoder");
+
+	static const char invalid[] = {'!', '-', '_', '=', ' ', '\n', '\0', (char)0x80, (char)0xFF};
+	unsigned char data[MAX_DECODED], expected[MAX_DECODED], decoded[MAX_DECODED];
+	char what[128];
+	unsigned int seed = 1;
+	int len, d, i, k;
+
+	for(i=0; i<MAX_DECODED; i++){
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+
+	for(len=0; len<=MAX_DECODED; len++){
+
+		char *data64 = referenceBase64Encode(data, len);
+		size_t len64 = strlen(data64);
+
+		for(d=0; d<decoderCount; d++){
+			sprintf(what, "%s decoder, %d bytes", names[d], len);
+			long n = decoders[d](data64, len64, decoded);
+			check(n == len && memcmp(decoded, data, len) == 0, "base64 decode", what);
+			if(len64 > 0)
+				check(decoders[d](data64, len64 - 1, decoded) == -1, "base64 decode unpadded", what);
+		}
+
+		/* every position on short encodings, a stride on longer ones to keep the run short */
+		int agrees[MAX_DECODERS] = {1, 1, 1, 1};
+		size_t pos, step = len64 <= 96 ? 1 : 7;
+		for(pos=0; pos<len64; pos+=step){
+			char saved = data64[pos];
+			for(k=0; k<(int)sizeof(invalid); k++){
+				data64[pos] = invalid[k];
+				long n = decoders[0](data64, len64, expected);
+				/* padding is only valid in the last two chars */
+				if(n != -1 && (invalid[k] != '=' || pos + 2 < len64))
+					agrees[0] = 0;
+				for(d=1; d<decoderCount; d++){
+					long m = decoders[d](data64, len64, decoded);
+					if(m != n || (n > 0 && memcmp(decoded, expected, n) != 0))
+						agrees[d] = 0;
+				}
+			}
+			data64[pos] = saved;
+		}
+		for(d=0; d<decoderCount; d++){
+			sprintf(what, "%s decoder, %d bytes", names[d], len);
+			check(agrees[d], "base64 decode malformed", what);
+		}
+
+		free(data64);
+	}
+}
+
+/* GetRecords responses parsed: escaped chars in strings and data, in place, and the error returns */
+static void testParseGetRecords(void){
+
+	static const char response[] =
+		"{\"Records\":["
+			"{\"SequenceNumber\":\"1\",\"ApproximateArrivalTimestamp\":1.5,\"Data\":\"AP8\\/\",\"PartitionKey\":\"a\\/b\"},"
+			"{\"PartitionKey\":\"c\",\"Data\":\"\",\"SequenceNumber\":\"2\"}"
+		"],\"NextShardIterator\":\"shardId-000000000000\\/3\",\"MillisBehindLatest\":42}";
+
+	const size_t len = sizeof(response) - 1;
+	ConsumerRecord records[2];
+	unsigned char buffer[sizeof(response)];
+	char iterator[64];
+	long long behind;
+
+	int count = ktParseGetRecords(response, len, records, 2, buffer, len, iterator, sizeof(iterator), &behind);
+	if(check(count == 2, "ktParseGetRecords", "wrong record count")){
+		check(strcmp(records[0].sequenceNumber, "1") == 0 && strcmp(records[1].sequenceNumber, "2") == 0, "ktParseGetRecords", "sequence number differs");
+		check(strcmp(records[0].partitionKey, "a/b") == 0 && strcmp(records[1].partitionKey, "c") == 0, "ktParseGetRecords", "escaped partition key differs");
+		check(records[0].len == 3 && memcmp(records[0].data, "\x00\xFF\x3F", 3) == 0, "ktParseGetRecords", "escaped data differs");
+		check(records[1].len == 0, "ktParseGetRecords", "empty data not empty");
+		check(records[0].arrivalTime == 1.5 && records[1].arrivalTime == 0, "ktParseGetRecords", "arrival time differs");
+	}
+	check(strcmp(iterator, "shardId-000000000000/3") == 0, "ktParseGetRecords", "next shard iterator differs");
+	check(behind == 42, "ktParseGetRecords", "MillisBehindLatest differs");
+
+	/* in place, the response as the buffer */
+	char copy[sizeof(response)];
+	memcpy(copy, response, sizeof(response));
+	count = ktParseGetRecords(copy, len, records, 2, (unsigned char*)copy, len, NULL, 0, NULL);
+	check(count == 2 && strcmp(records[0].partitionKey, "a/b") == 0 && records[0].len == 3 && memcmp(records[0].data, "\x00\xFF\x3F", 3) == 0, "ktParseGetRecords in place", "record differs");
+
+	check(ktParseGetRecords(response, len, records, 1, buffer, len, NULL, 0, NULL) == -1, "ktParseGetRecords", "too many records accepted");
+	check(ktParseGetRecords(response, len, records, 2, buffer, 8, NULL, 0, NULL) == -1, "ktParseGetRecords", "small buffer accepted");
+	check(ktParseGetRecords(response, len, records, 2, buffer, len, iterator, 8, NULL) == -1, "ktParseGetRecords", "small iterator accepted");
+	check(ktParseGetRecords(response, 60, records, 2, buffer, len, NULL, 0, NULL) == -1, "ktParseGetRecords", "truncated response accepted");
+
+	static const char badData[] = "{\"Records\":[{\"SequenceNumber\":\"1\",\"PartitionKey\":\"a\",\"Data\":\"AP8\"}]}";
+	check(ktParseGetRecords(badData, sizeof(badData) - 1, records, 2, buffer, sizeof(buffer), NULL, 0, NULL) == -1, "ktParseGetRecords", "unpadded data accepted");
+}
+
+/* append an event stream message to out at *len as Kinesis frames it: string headers, with an int32 header kt */
+/* skips between them, the payload and both CRCs. Returns the message's length                                */
+static size_t appendEventMessage(unsigned char *out, size_t *len, const char *messageType, const char *eventType, const char *payload){
+
+	const char *names[4] = {":message-type", "x-ignored", strcmp(messageType, "exception") == 0 ? ":exception-type" : ":event-type", ":content-type"};
+	const char *values[4] = {messageType, NULL, eventType, "application/json"};
+	unsigned char *m = out + *len;
+	size_t headersLen = 0;
+	int i;
+
+	for(i=0; i<4; i++){
+		unsigned char *h = m + 12 + headersLen;
+		size_t nameLen = strlen(names[i]);
+		h[0] = nameLen;
+		memcpy(h + 1, names[i], nameLen);
+		h += 1 + nameLen;
+		if(values[i]){
+			size_t valueLen = strlen(values[i]);
+			h[0] = 7;
+			h[1] = valueLen >> 8;
+			h[2] = valueLen;
+			memcpy(h + 3, values[i], valueLen);
+			headersLen += 1 + nameLen + 3 + valueLen;
+		}
+		else{
+			h[0] = 4;
+			memcpy(h + 1, "\x00\x00\x00\x2A", 4);
+			headersLen += 1 + nameLen + 5;
+		}
+	}
+
+	size_t payloadLen = strlen(payload);
+	uint32_t total = 16 + headersLen + payloadLen;
+	m[0] = total >> 24, m[1] = total >> 16, m[2] = total >> 8, m[3] = total;
+	m[4] = headersLen >> 24, m[5] = headersLen >> 16, m[6] = headersLen >> 8, m[7] = headersLen;
+	uint32_t crc = crc32(0, m, 8);
+	m[8] = crc >> 24, m[9] = crc >> 16, m[10] = crc >> 8, m[11] = crc;
+	memcpy(m + 12 + headersLen, payload, payloadLen);
+	crc = crc32(0, m, total - 4);
+	m[total-4] = crc >> 24, m[total-3] = crc >> 16, m[total-2] = crc >> 8, m[total-1] = crc;
+
+	*len += total;
+
+	return total;
+}
+
+/* messages an EventStreamParser callback has been given, flattened to "type/event/content-type/payload;" */
+typedef struct{
+	char text[1024];
+	int count;
+}ParsedMessages;
+
+static int parsedMessagesCallback(const EventStreamMessage *message, void *userData){
+
+	ParsedMessages *parsed = userData;
+	size_t len = strlen(parsed->text);
+
+	snprintf(parsed->text + len, sizeof(parsed->text) - len, "%s/%s/%s/%.*s;", message->messageType, message->eventType, message->contentType, (int)message->payloadLen, (const char*)message->payload);
+	parsed->count++;
+
+	return 1;
+}
+
+/* event streams fed a byte at a time, and the corrupt or oversized messages that fail the parser for good */
+static void testEventStreamParser(void){
+
+	static const char *expected =
+		"event/initial-response/application/json/{};"
+		"event/SubscribeToShardEvent/application/json/{\"Records\":[]};"
+		"exception/InternalFailure/application/json/{\"message\":\"failed\"};";
+
+	unsigned char stream[1024];
+	size_t len = 0, i;
+	size_t first = appendEventMessage(stream, &len, "event", "initial-response", "{}");
+	size_t second = appendEventMessage(stream, &len, "event", "SubscribeToShardEvent", "{\"Records\":[]}");
+	appendEventMessage(stream, &len, "exception", "InternalFailure", "{\"message\":\"failed\"}");
+
+	ParsedMessages parsed;
+	char errorMsg[CURL_ERROR_SIZE] = "";
+	int ok = 1;
+
+	memset(&parsed, 0, sizeof(parsed));
+	EventStreamParser *parser = ktMakeEventStreamParser(1024);
+	for(i=0; i<len && ok; i++)
+		ok = ktEventStreamParse(parser, stream + i, 1, parsedMessagesCallback, &parsed, errorMsg);
+	check(ok, "event stream byte by byte", errorMsg);
+	check(parsed.count == 3 && strcmp(parsed.text, expected) == 0, "event stream byte by byte", parsed.text);
+	ktFreeEventStreamParser(parser);
+
+	memset(&parsed, 0, sizeof(parsed));
+	parser = ktMakeEventStreamParser(1024);
+	check(ktEventStreamParse(parser, stream, len, parsedMessagesCallback, &parsed, errorMsg) && strcmp(parsed.text, expected) == 0, "event stream in one piece", parsed.text);
+	ktFreeEventStreamParser(parser);
+
+	/* a corrupt prelude fails as soon as the prelude is in, before waiting for the rest of the message */
+	unsigned char corrupt[1024];
+	memcpy(corrupt, stream, len);
+	corrupt[10] ^= 1;
+	memset(&parsed, 0, sizeof(parsed));
+	parser = ktMakeEventStreamParser(1024);
+	check(!ktEventStreamParse(parser, corrupt, 12, parsedMessagesCallback, &parsed, errorMsg), "event stream prelude CRC", "not refused");
+	check(strstr(errorMsg, "prelude CRC") != NULL, "event stream prelude CRC", errorMsg);
+	check(!ktEventStreamParse(parser, stream, len, parsedMessagesCallback, &parsed, errorMsg) && parsed.count == 0, "event stream prelude CRC", "parser not left failed");
+	ktFreeEventStreamParser(parser);
+
+	/* a corrupt payload byte in the second message, after the first is handed over */
+	memcpy(corrupt, stream, len);
+	corrupt[first + second - 5] ^= 1;
+	memset(&parsed, 0, sizeof(parsed));
+	parser = ktMakeEventStreamParser(1024);
+	check(!ktEventStreamParse(parser, corrupt, len, parsedMessagesCallback, &parsed, errorMsg), "event stream message CRC", "not refused");
+	check(strstr(errorMsg, "message CRC") != NULL, "event stream message CRC", errorMsg);
+	check(parsed.count == 1, "event stream message CRC", "corrupt message handed over");
+	ktFreeEventStreamParser(parser);
+
+	/* longer than maxMessageLen, again refused on the prelude alone */
+	memset(&parsed, 0, sizeof(parsed));
+	parser = ktMakeEventStreamParser(first - 1);
+	check(!ktEventStreamParse(parser, stream, 12, parsedMessagesCallback, &parsed, errorMsg), "event stream oversized message", "not refused");
+	check(strstr(errorMsg, "length invalid") != NULL && parsed.count == 0, "event stream oversized message", errorMsg);
+	ktFreeEventStreamParser(parser);
+}
+
+/* an aggregated record taken apart: its key tables and user records, which point into the record */
+#define MAX_DECODED_KEYS 32
+#define MAX_DECODED_RECORDS 64
+
+typedef struct{
+	const unsigned char *keys[2][MAX_DECODED_KEYS];
+	size_t keyLens[2][MAX_DECODED_KEYS];
+	int keyCounts[2];
+	int keyIndices[2][MAX_DECODED_RECORDS];
+	const unsigned char *data[MAX_DECODED_RECORDS];
+	size_t lens[MAX_DECODED_RECORDS];
+	int count;
+}DecodedAggregate;
+
+/* read a protobuf varint at *p, before end. 0 if truncated */
+static int readVarint(const unsigned char **p, const unsigned char *end, uint64_t *v){
+
+	int shift;
+
+	*v = 0;
+	for(shift=0; *p < end && shift < 64; shift+=7){
+		unsigned char b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7F) << shift;
+		if(!(b & 0x80))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* decode an aggregated record per the KPL format, checking its magic number and MD5. 0 if malformed */
+static int decodeAggregatedRecord(const unsigned char *record, size_t len, DecodedAggregate *out){
+
+	static const unsigned char magic[4] = {0xF3, 0x89, 0x9A, 0xC2};
+	unsigned char md5[16];
+
+	memset(out, 0, sizeof(DecodedAggregate));
+	if(len < 20 || memcmp(record, magic, 4) != 0)
+		return 0;
+	if(!EVP_Digest(record + 4, len - 20, md5, NULL, EVP_md5(), NULL) || memcmp(md5, record + len - 16, 16) != 0)
+		return 0;
+
+	const unsigned char *p = record + 4, *end = record + len - 16;
+	while(p < end){
+
+		uint64_t tag, fieldLen;
+		if(!readVarint(&p, end, &tag) || (tag & 7) != 2 || !readVarint(&p, end, &fieldLen) || fieldLen > (uint64_t)(end - p))
+			return 0;
+
+		int field = tag >> 3;
+		if(field == 1 || field == 2){
+			int t = field - 1;
+			if(out->keyCounts[t] == MAX_DECODED_KEYS)
+				return 0;
+			out->keys[t][out->keyCounts[t]] = p;
+			out->keyLens[t][out->keyCounts[t]++] = fieldLen;
+		}
+		else if(field == 3){
+			/* a Record: partition key index, optional explicit hash key index, data */
+			const unsigned char *q = p, *recordEnd = p + fieldLen;
+			int n = out->count;
+			if(n == MAX_DECODED_RECORDS)
+				return 0;
+			out->keyIndices[0][n] = out->keyIndices[1][n] = -1;
+			out->data[n] = NULL;
+			while(q < recordEnd){
+				uint64_t recordTag, v;
+				if(!readVarint(&q, recordEnd, &recordTag) || !readVarint(&q, recordEnd, &v))
+					return 0;
+				if(recordTag == (1 << 3) || recordTag == (2 << 3))
+					out->keyIndices[(recordTag >> 3) - 1][n] = (int)v;
+				else if(recordTag == (3 << 3 | 2) && v <= (uint64_t)(recordEnd - q)){
+					out->data[n] = q;
+					out->lens[n] = v;
+					q += v;
+				}
+				else
+					return 0;
+			}
+			if(out->keyIndices[0][n] < 0 || !out->data[n])
+				return 0;
+			out->count++;
+		}
+		else
+			return 0;
+		p += fieldLen;
+	}
+
+	/* every index in range */
+	int i;
+	for(i=0; i<out->count; i++)
+		if(out->keyIndices[0][i] >= out->keyCounts[0] || out->keyIndices[1][i] >= out->keyCounts[1])
+			return 0;
+
+	return 1;
+}
+
+/* whether user record i of an aggregate has key, from table t (0 partition keys, 1 explicit hash keys) */
+static int decodedKeyIs(const DecodedAggregate *aggregate, int t, int i, const char *key){
+
+	int k = aggregate->keyIndices[t][i];
+
+	return k >= 0 && aggregate->keyLens[t][k] == strlen(key) && memcmp(aggregate->keys[t][k], key, strlen(key)) == 0;
+}
+
+/* aggregated records decoded: magic and MD5, de-duplicated key tables, splits at the size limit, and records */
+/* only sharing an aggregated record within an aggregation group                                               */
+static void testAggregation(const char *endpoint){
+
+	char *partitionKeyArray[12] = {"a", "b", "a", "c", "b", "a"};
+	char *explicitHashKeyArray[12] = {"1", NULL, "1", "2", NULL, "2"};
+	unsigned char *dataArray[12] = {(unsigned char*)"0", (unsigned char*)"11", (unsigned char*)"", (unsigned char*)"333", (unsigned char*)"4", (unsigned char*)"55"};
+	int lenArray[12] = {1, 2, 0, 3, 1, 2};
+	unsigned char **aggregated;
+	int *aggregatedLens;
+	DecodedAggregate decoded;
+	int i, count;
+
+	count = aggregateRecordsData(6, partitionKeyArray, explicitHashKeyArray, dataArray, lenArray, NULL, &aggregated, &aggregatedLens);
+	if(check(count == 1, "aggregated record", "not one record") && check(decodeAggregatedRecord(aggregated[0], aggregatedLens[0], &decoded), "aggregated record", "magic, MD5 or protobuf wrong")){
+		check(decoded.keyCounts[0] == 3 && decoded.keyCounts[1] == 2, "aggregated record", "key tables not de-duplicated");
+		if(check(decoded.count == 6, "aggregated record", "wrong user record count")){
+			for(i=0; i<6; i++){
+				check(decodedKeyIs(&decoded, 0, i, partitionKeyArray[i]), "aggregated record", "partition key differs");
+				check(explicitHashKeyArray[i] ? decodedKeyIs(&decoded, 1, i, explicitHashKeyArray[i]) : decoded.keyIndices[1][i] < 0, "aggregated record", "explicit hash key differs");
+				check(decoded.lens[i] == (size_t)lenArray[i] && memcmp(decoded.data[i], dataArray[i], lenArray[i]) == 0, "aggregated record", "data differs");
+			}
+		}
+	}
+	if(count == 1){
+		aggregated[0][aggregatedLens[0] - 20] ^= 1;
+		check(!decodeAggregatedRecord(aggregated[0], aggregatedLens[0], &decoded), "aggregated record", "MD5 not covering the protobuf");
+	}
+	for(i=0; i<count; i++)
+		free(aggregated[i]);
+	free(aggregated);
+	free(aggregatedLens);
+
+	/* 12 records of 100 KB fill one aggregated record to the limit, the rest going in a second */
+	unsigned char *big = malloc(100000);
+	for(i=0; i<100000; i++)
+		big[i] = i * 7;
+	for(i=0; i<12; i++){
+		partitionKeyArray[i] = "big";
+		dataArray[i] = big;
+		lenArray[i] = 100000;
+	}
+	count = aggregateRecordsData(12, partitionKeyArray, NULL, dataArray, lenArray, NULL, &aggregated, &aggregatedLens);
+	if(check(count == 2, "aggregated record split", "not two records")){
+		int records = 0;
+		for(i=0; i<count; i++){
+			check(aggregatedLens[i] <= 1024*1024 - 256, "aggregated record split", "record over the limit");
+			if(check(decodeAggregatedRecord(aggregated[i], aggregatedLens[i], &decoded), "aggregated record split", "malformed record"))
+				records += decoded.count;
+		}
+		check(aggregatedLens[0] + 100000 > 1024*1024 - 256, "aggregated record split", "first record not full");
+		check(records == 12, "aggregated record split", "user records lost");
+	}
+	for(i=0; i<count; i++)
+		free(aggregated[i]);
+	free(aggregated);
+	free(aggregatedLens);
+	free(big);
+
+	/* without a shard map, records group by key, and different keys never share an aggregated record; with the */
+	/* mock's one shard map they all do                                                                         */
+	char *keys[4] = {"a", "b", "a", "b"};
+	unsigned char *data[4] = {(unsigned char*)"0", (unsigned char*)"1", (unsigned char*)"2", (unsigned char*)"3"};
+	int lens[4] = {1, 1, 1, 1};
+	AWSContext *ctx = ktMakeAWSContext("test", "test", NULL, "us-east-1", endpoint ? endpoint : "localhost:1");
+	int *groups = aggregationGroups(ctx, "kttest", 4, keys, NULL);
+	if(endpoint)
+		check(groups[0] == groups[1] && groups[1] == groups[2] && groups[2] == groups[3], "aggregation groups", "one shard split");
+	else
+		check(groups[0] == groups[2] && groups[1] == groups[3] && groups[0] != groups[1], "aggregation groups", "not grouped by key");
+
+	count = aggregateRecordsData(4, keys, NULL, data, lens, groups, &aggregated, &aggregatedLens);
+	if(check(count == (endpoint ? 1 : 2), "aggregation groups", "wrong record count")){
+		for(i=0; i<count; i++){
+			if(check(decodeAggregatedRecord(aggregated[i], aggregatedLens[i], &decoded), "aggregation groups", "malformed record"))
+				check(decoded.keyCounts[0] == (endpoint ? 2 : 1) && decoded.count == (endpoint ? 4 : 2), "aggregation groups", "keys mixed");
+		}
+		if(!endpoint){
+			check(decodedKeyIs(&decoded, 0, 0, "b") && memcmp(decoded.data[0], "1", 1) == 0 && memcmp(decoded.data[1], "3", 1) == 0, "aggregation groups", "order within a group lost");
+		}
+	}
+	for(i=0; i<count; i++)
+		free(aggregated[i]);
+	free(aggregated);
+	free(aggregatedLens);
+	free(groups);
+	ktFreeAWSContext(ctx);
+}
+
+/* gzip records round trip through ktCompressRecord and ktDecompressRecord: compressible data goes compressed, */
+/* incompressible data as it is, and data that starts like a codec header under a KT_CODEC_STORED header      */
+static void testCompression(void){
+
+	#define COMPRESSION_LEN 4096
+
+	Compressor *compressor = ktMakeCompressor(KT_CODEC_GZIP, 6, NULL, 0);
+	if(!check(compressor != NULL, "gzip compressor", "not made"))
+		return;
+
+	static const int lens[] = {0, 1, 3, 4, 5, 64, 1000, COMPRESSION_LEN};
+	unsigned char data[COMPRESSION_LEN], compressed[COMPRESSION_LEN + KT_CODEC_HEADER_SIZE], decompressed[COMPRESSION_LEN];
+	char what[96];
+	unsigned int seed = 1;
+	int kind, l, i;
+
+	for(kind=0; kind<4; kind++){
+		for(l=0; l<(int)(sizeof(lens)/sizeof(lens[0])); l++){
+
+			/* compressible text or random bytes, either of them starting 0xF3 'k' 't' for kinds 2 and 3 */
+			int len = lens[l];
+			for(i=0; i<len; i++){
+				seed = seed * 1103515245 + 12345;
+				data[i] = kind % 2 == 0 ? "kinesis record "[i % 15] : seed >> 16;
+			}
+			if(kind >= 2)
+				memcpy(data, "\xF3kt", len < 3 ? len : 3);
+			int header = kind >= 2 && len >= 4;
+
+			sprintf(what, "%s%s, %d bytes", kind % 2 == 0 ? "text" : "random", kind >= 2 ? " with a header" : "", len);
+			int n = ktCompressRecord(compressor, data, len, compressed);
+			int packed = n > KT_CODEC_HEADER_SIZE && compressed[3] == KT_CODEC_GZIP && memcmp(compressed, "\xF3kt", 3) == 0;
+			if(kind % 2 == 1 || len < 64){
+				/* not worth compressing */
+				if(header)
+					check(n == len + KT_CODEC_HEADER_SIZE && memcmp(compressed, "\xF3kt", 3) == 0 && compressed[3] == KT_CODEC_STORED && memcmp(compressed + KT_CODEC_HEADER_SIZE, data, len) == 0, "gzip stored", what);
+				else
+					check(n == len && memcmp(compressed, data, len) == 0, "gzip unchanged", what);
+			}
+			else
+				check(packed && n < len, "gzip compressed", what);
+
+			check(ktDecompressedLength(compressed, n) == len, "gzip decompressed length", what);
+			int m = ktDecompressRecord(compressor, compressed, n, decompressed, sizeof(decompressed));
+			check(m == len && memcmp(decompressed, data, len) == 0, "gzip round trip", what);
+		}
+	}
+
+	/* a corrupt member fails rather than giving back garbage */
+	for(i=0; i<COMPRESSION_LEN; i++)
+		data[i] = "kinesis record "[i % 15];
+	int n = ktCompressRecord(compressor, data, COMPRESSION_LEN, compressed);
+	compressed[n / 2] ^= 0xFF;
+	check(ktDecompressRecord(compressor, compressed, n, decompressed, sizeof(decompressed)) == -1, "gzip corrupt", "decompressed");
+
+	ktFreeCompressor(compressor);
+}
+
+/* read every record of the mock's only shard, as a JSON context would. Returns the record count or -1 */
+static int readShard(const AWSContext *ctx, ConsumerRecord *records, int maxRecords, unsigned char *buffer, size_t bufferSize){
+
+	httpResponseSink body;
+	char iterator[1024], errorMsg[CURL_ERROR_SIZE];
+	int count = -1;
+
+	ktInitResponseSink(&body);
+	if(ktGetShardIteratorSink(ctx, "kttest", "shardId-000000000000", "TRIM_HORIZON", NULL, NULL, &body, errorMsg) == 200 && jsonCopyMember(body.text, body.text + body.len, "ShardIterator", iterator, sizeof(iterator)) > 0){
+		if(ktGetRecordsSink(ctx, iterator, 0, NULL, &body, errorMsg) == 200 && body.len <= bufferSize)
+			count = ktParseGetRecords(body.text, body.len, records, maxRecords, buffer, bufferSize, NULL, 0, NULL);
+	}
+	ktFreeResponseSink(&body);
+
+	return count;
+}
+
+/* put records over CBOR and read them back over JSON: every byte of data has to survive both encodings */
+static void testCBORMock(const char *endpoint){
+
+	#define MOCK_RECORDS 8
+	static const int lens[MOCK_RECORDS] = {1, 23, 24, 255, 256, 1000, 65535, 65536};
+
+	AWSContextOptions opts;
+	ktDefaultAWSContextOptions(&opts);
+	opts.cbor = 1;
+	AWSContext *ctx = ktMakeAWSContextEx("test", "test", NULL, "us-east-1", endpoint, &opts);
+	AWSContext *jsonCtx = ktMakeAWSContext("test", "test", NULL, "us-east-1", endpoint);
+
+	char *partitionKeyArray[MOCK_RECORDS];
+	unsigned char *dataArray[MOCK_RECORDS];
+	int lenArray[MOCK_RECORDS];
+	int i, j;
+	unsigned int seed = 1;
+	for(i=0; i<MOCK_RECORDS; i++){
+		partitionKeyArray[i] = malloc(16);
+		sprintf(partitionKeyArray[i], "pk-%d", i);
+		lenArray[i] = lens[i];
+		dataArray[i] = malloc(lens[i]);
+		for(j=0; j<lens[i]; j++){
+			seed = seed * 1103515245 + 12345;
+			dataArray[i][j] = seed >> 16;
+		}
+	}
+
+	httpResponse header, body;
+	char errorMsg[CURL_ERROR_SIZE];
+
+	/* the last record goes alone with PutRecord, the rest in one PutRecords */
+	int status = ktPutRecords(ctx, "kttest", MOCK_RECORDS - 1, partitionKeyArray, dataArray, lenArray, &header, &body, errorMsg);
+	check(status == 200, "cbor ktPutRecords", status ? body.text : errorMsg);
+	check(strstr(body.text, "\"FailedRecordCount\":0") != NULL, "cbor ktPutRecords", "response not JSON");
+
+	status = ktPutRecord(ctx, "kttest", partitionKeyArray[MOCK_RECORDS - 1], dataArray[MOCK_RECORDS - 1], lenArray[MOCK_RECORDS - 1], &header, &body, errorMsg);
+	check(status == 200, "cbor ktPutRecord", status ? body.text : errorMsg);
+	check(strstr(body.text, "\"SequenceNumber\"") != NULL, "cbor ktPutRecord", "response not JSON");
+
+	size_t bufferSize = 1024*1024;
+	unsigned char *buffer = malloc(bufferSize);
+	ConsumerRecord records[MOCK_RECORDS + 1];
+	int count = readShard(jsonCtx, records, MOCK_RECORDS + 1, buffer, bufferSize);
+	if(check(count == MOCK_RECORDS, "cbor records read back", "wrong record count")){
+		for(i=0; i<MOCK_RECORDS; i++){
+			check(strcmp(records[i].partitionKey, partitionKeyArray[i]) == 0, "cbor records read back", "partition key differs");
+			check(records[i].len == lenArray[i] && memcmp(records[i].data, dataArray[i], lenArray[i]) == 0, "cbor records read back", "data differs");
+		}
+	}
+
+	/* an error answered by Kinesis comes back as JSON too */
+	status = ktPutRecords(ctx, "nostream", 1, partitionKeyArray, dataArray, lenArray, &header, &body, errorMsg);
+	check(status == 400, "cbor error response", "not refused");
+	check(body.text[0] == '{', "cbor error response", "response not JSON");
+
+	free(buffer);
+	for(i=0; i<MOCK_RECORDS; i++){
+		free(partitionKeyArray[i]);
+		free(dataArray[i]);
+	}
+	ktFreeAWSContext(ctx);
+	ktFreeAWSContext(jsonCtx);
+}
+
+/* ktGetCredentials copies a context's static credentials, and refuses ones too long for AWSCredentials */
+static void testGetCredentials(void){
+
+	AWSCredentials credentials;
+	AWSContext *ctx = ktMakeAWSContext("secret", "id", "token", "us-east-1", "localhost:1");
+	check(ktGetCredentials(ctx, &credentials) == 1, "ktGetCredentials", "refused");
+	check(strcmp(credentials.key, "secret") == 0 && strcmp(credentials.keyId, "id") == 0, "ktGetCredentials", "key differs");
+	check(strcmp(credentials.sessionToken, "token") == 0 && credentials.expiration == 0, "ktGetCredentials", "session token differs");
+	ktFreeAWSContext(ctx);
+
+	ctx = ktMakeAWSContext("secret", "id", NULL, "us-east-1", "localhost:1");
+	check(ktGetCredentials(ctx, &credentials) == 1 && *credentials.sessionToken == '\0', "ktGetCredentials", "session token not empty");
+	ktFreeAWSContext(ctx);
+
+	char key[200];
+	memset(key, 'k', sizeof(key) - 1);
+	key[sizeof(key) - 1] = '\0';
+	ctx = ktMakeAWSContext(key, "id", NULL, "us-east-1", "localhost:1");
+	check(ktGetCredentials(ctx, &credentials) == 0 && *credentials.key == '\0', "ktGetCredentials", "long key not refused");
+	ktFreeAWSContext(ctx);
+}
+
+/* arena puts give an error return, leaving the arena as it was, when the arena is too small; given an endpoint, a */
+/* ktPutRecordsScratchSize arena is enough                                                                      */
+static void testScratchArena(const char *endpoint){
+
+	AWSContext *ctx = ktMakeAWSContext("test", "test", NULL, "us-east-1", endpoint ? endpoint : "localhost:1");
+
+	char *partitionKeyArray[2] = {"pk-0", "pk-1"};
+	unsigned char *dataArray[2] = {(unsigned char*)"first", (unsigned char*)"second"};
+	int lenArray[2] = {5, 6};
+	httpResponseSink header, body;
+	ktInitResponseSink(&header);
+	ktInitResponseSink(&body);
+	char errorMsg[CURL_ERROR_SIZE] = "";
+
+	char small[64];
+	ScratchArena arena;
+	ktInitScratchArena(&arena, small, sizeof(small));
+	arena.used = 8;
+	int status = ktPutRecordsArena(ctx, "kttest", 2, partitionKeyArray, dataArray, lenArray, &arena, &header, &body, errorMsg);
+	check(status == 0, "small arena", "not refused");
+	check(strstr(errorMsg, "Scratch arena") != NULL, "small arena", "no error message");
+	check(arena.used == 8, "small arena", "arena not restored");
+
+	if(endpoint){
+		size_t size = ktPutRecordsScratchSize(ctx, "kttest", 2, partitionKeyArray, lenArray);
+		char *buffer = malloc(size);
+		ktInitScratchArena(&arena, buffer, size);
+		status = ktPutRecordsArena(ctx, "kttest", 2, partitionKeyArray, dataArray, lenArray, &arena, &header, &body, errorMsg);
+		check(status == 200, "sized arena", status ? body.text : errorMsg);
+		check(arena.used == 0, "sized arena", "arena not restored");
+		free(buffer);
+	}
+
+	ktFreeResponseSink(&header);
+	ktFreeResponseSink(&body);
+	ktFreeAWSContext(ctx);
+}
+
+/* partition keys a consumer callback has seen */
+typedef struct{
+	pthread_mutex_t lock;
+	char keys[16][16];
+	int count;
+}ConsumedKeys;
+
+static void consumedKeysCallback(const ConsumerRecord *records, int recordCount, long long millisBehindLatest, void *userData){
+
+	ConsumedKeys *consumed = userData;
+	int i;
+
+	(void)millisBehindLatest;
+	pthread_mutex_lock(&consumed->lock);
+	for(i=0; i<recordCount; i++){
+		/* records earlier tests left in the stream are only counted */
+		if(strncmp(records[i].partitionKey, "consumer-", 9) == 0 && consumed->count < 16)
+			snprintf(consumed->keys[consumed->count++], sizeof(consumed->keys[0]), "%s", records[i].partitionKey);
+	}
+	pthread_mutex_unlock(&consumed->lock);
+}
+
+/* run a consumer until it has seen partition key last, or for 10 s. Returns the number of consumer-* keys seen */
+static int consumeUntil(const AWSContext *ctx, const char *checkpointFile, ConsumedKeys *consumed, const char *last){
+
+	ConsumerOptions opts;
+	ktDefaultConsumerOptions(&opts);
+	opts.workerCount = 1;
+	opts.idleWaitMs = 50;
+	opts.checkpointFile = checkpointFile;
+	opts.callback = consumedKeysCallback;
+	opts.userData = consumed;
+
+	char errorMsg[CURL_ERROR_SIZE] = "";
+	Consumer *consumer = ktMakeConsumer(ctx, "kttest", &opts, errorMsg);
+	if(!check(consumer != NULL, "ktMakeConsumer", errorMsg))
+		return -1;
+
+	int i, seen = 0;
+	for(i=0; i<200 && !seen; i++){
+		usleep(50000);
+		pthread_mutex_lock(&consumed->lock);
+		seen = consumed->count > 0 && strcmp(consumed->keys[consumed->count - 1], last) == 0;
+		pthread_mutex_unlock(&consumed->lock);
+	}
+	check(seen, "ktMakeConsumer", "last record not consumed");
+
+	/* saves the checkpoint */
+	ktFreeConsumer(consumer);
+
+	return consumed->count;
+}
+
+/* a consumer reads the records put, saves its checkpoint, and a second one made from the checkpoint file only */
+/* reads the records put after it                                                                              */
+static void testConsumerMock(const char *endpoint){
+
+	AWSContext *ctx = ktMakeAWSContext("test", "test", NULL, "us-east-1", endpoint);
+
+	char checkpointFile[] = "/tmp/kttest-checkpoint-XXXXXX";
+	int fd = mkstemp(checkpointFile);
+	if(!check(fd >= 0, "consumer checkpoint", "no temporary file"))
+		return;
+	close(fd);
+	unlink(checkpointFile);
+
+	char *partitionKeyArray[4] = {"consumer-0", "consumer-1", "consumer-2", "consumer-3"};
+	unsigned char *dataArray[4] = {(unsigned char*)"0", (unsigned char*)"1", (unsigned char*)"2", (unsigned char*)"3"};
+	int lenArray[4] = {1, 1, 1, 1};
+	httpResponse header, body;
+	char errorMsg[CURL_ERROR_SIZE];
+
+	ConsumedKeys consumed;
+	memset(&consumed, 0, sizeof(consumed));
+	pthread_mutex_init(&consumed.lock, NULL);
+
+	int status = ktPutRecords(ctx, "kttest", 2, partitionKeyArray, dataArray, lenArray, &header, &body, errorMsg);
+	check(status == 200, "consumer records put", status ? body.text : errorMsg);
+	int count = consumeUntil(ctx, checkpointFile, &consumed, "consumer-1");
+	check(count == 2 && strcmp(consumed.keys[0], "consumer-0") == 0, "consumer first run", "wrong records consumed");
+	check(access(checkpointFile, R_OK) == 0, "consumer first run", "no checkpoint file");
+
+	consumed.count = 0;
+	status = ktPutRecords(ctx, "kttest", 2, partitionKeyArray + 2, dataArray + 2, lenArray + 2, &header, &body, errorMsg);
+	check(status == 200, "consumer records put", status ? body.text : errorMsg);
+	count = consumeUntil(ctx, checkpointFile, &consumed, "consumer-3");
+	check(count == 2 && strcmp(consumed.keys[0], "consumer-2") == 0, "consumer restarted from checkpoint", "wrong records consumed");
+
+	pthread_mutex_destroy(&consumed.lock);
+	unlink(checkpointFile);
+	ktFreeAWSContext(ctx);
+}
+
+/* what a subscription has delivered: subscribe-* partition keys, and where to resume */
+typedef struct{
+	char keys[8][16];
+	int count;
+	int events;
+	char continuation[64];
+	int hasShardId;
+	const char *last;
+}SubscribedRecords;
+
+/* collect the subscribe-* records, stopping once last arrives or after 10 events, about 10 s */
+static int subscribedRecordsCallback(const SubscribeToShardEvent *event, void *userData){
+
+	SubscribedRecords *subscribed = userData;
+	int i;
+
+	for(i=0; i<event->recordCount; i++){
+		if(strncmp(event->records[i].partitionKey, "subscribe-", 10) == 0 && subscribed->count < 8)
+			snprintf(subscribed->keys[subscribed->count++], sizeof(subscribed->keys[0]), "%s", event->records[i].partitionKey);
+	}
+	if(event->continuationSequenceNumber)
+		snprintf(subscribed->continuation, sizeof(subscribed->continuation), "%s", event->continuationSequenceNumber);
+	subscribed->hasShardId = event->shardId && strcmp(event->shardId, "shardId-000000000000") == 0;
+
+	return ++subscribed->events < 10 && (subscribed->count == 0 || strcmp(subscribed->keys[subscribed->count - 1], subscribed->last) != 0);
+}
+
+/* register a consumer, subscribe from the oldest record until the records put arrive, then resume after the */
+/* continuation sequence number and see only the record put since                                           */
+static void testSubscribeToShardMock(const char *endpoint){
+
+	AWSContext *ctx = ktMakeAWSContext("test", "test", NULL, "us-east-1", endpoint);
+
+	char *partitionKeyArray[3] = {"subscribe-0", "subscribe-1", "subscribe-2"};
+	unsigned char *dataArray[3] = {(unsigned char*)"0", (unsigned char*)"1", (unsigned char*)"2"};
+	int lenArray[3] = {1, 1, 1};
+	httpResponse header, body;
+	char errorMsg[CURL_ERROR_SIZE] = "", consumerARN[512] = "";
+
+	int status = ktPutRecords(ctx, "kttest", 2, partitionKeyArray, dataArray, lenArray, &header, &body, errorMsg);
+	check(status == 200, "subscribe records put", status ? body.text : errorMsg);
+
+	httpResponseSink registered;
+	ktInitResponseSink(&registered);
+	status = ktRegisterStreamConsumerSink(ctx, "arn:aws:kinesis:us-east-1:123456789012:stream/kttest", "kttest", NULL, &registered, errorMsg);
+	const char *consumer = status == 200 ? jsonFindMember(registered.text, registered.text + registered.len, "Consumer") : NULL;
+	int found = consumer && jsonCopyMember(consumer, registered.text + registered.len, "ConsumerARN", consumerARN, sizeof(consumerARN)) > 0;
+	ktFreeResponseSink(&registered);
+	if(!check(found, "ktRegisterStreamConsumerSink", status ? "no ConsumerARN" : errorMsg)){
+		ktFreeAWSContext(ctx);
+		return;
+	}
+
+	SubscribedRecords subscribed;
+	memset(&subscribed, 0, sizeof(subscribed));
+	subscribed.last = "subscribe-1";
+	status = ktSubscribeToShard(ctx, consumerARN, "shardId-000000000000", "TRIM_HORIZON", NULL, subscribedRecordsCallback, &subscribed, errorMsg);
+	check(status == 200, "ktSubscribeToShard", errorMsg);
+	check(subscribed.count == 2 && strcmp(subscribed.keys[0], "subscribe-0") == 0 && strcmp(subscribed.keys[1], "subscribe-1") == 0, "ktSubscribeToShard", "wrong records delivered");
+	check(subscribed.hasShardId && *subscribed.continuation, "ktSubscribeToShard", "no shard id or continuation");
+
+	status = ktPutRecords(ctx, "kttest", 1, partitionKeyArray + 2, dataArray + 2, lenArray + 2, &header, &body, errorMsg);
+	check(status == 200, "subscribe records put", status ? body.text : errorMsg);
+
+	char continuation[64];
+	strcpy(continuation, subscribed.continuation);
+	memset(&subscribed, 0, sizeof(subscribed));
+	subscribed.last = "subscribe-2";
+	status = ktSubscribeToShard(ctx, consumerARN, "shardId-000000000000", "AFTER_SEQUENCE_NUMBER", continuation, subscribedRecordsCallback, &subscribed, errorMsg);
+	check(status == 200, "ktSubscribeToShard resumed", errorMsg);
+	check(subscribed.count == 1 && strcmp(subscribed.keys[0], "subscribe-2") == 0, "ktSubscribeToShard resumed", "wrong records delivered");
+
+	/* refused before the event stream starts */
+	status = ktSubscribeToShard(ctx, consumerARN, "shardId-000000000009", "TRIM_HORIZON", NULL, subscribedRecordsCallback, &subscribed, errorMsg);
+	check(status == 400 && strstr(errorMsg, "ResourceNotFoundException") != NULL, "ktSubscribeToShard unknown shard", errorMsg);
+
+	ktFreeAWSContext(ctx);
+}
+
+/* what a pipeline callback was given, copied out */
+typedef struct{
+	int calls;
+	int retcode;
+	int recordCount;
+	int failedRecordCount;
+	int successes;
+	int withSequenceNumbers;
+	char firstErrorCode[64];
+	size_t bodyLen;
+}PipelineOutcome;
+
+static void pipelineOutcomeCallback(const PipelineResult *result, void *userData){
+
+	PipelineOutcome *outcome = userData;
+	int i;
+
+	outcome->calls++;
+	outcome->retcode = result->retcode;
+	outcome->recordCount = result->recordCount;
+	outcome->failedRecordCount = result->failedRecordCount;
+	outcome->bodyLen = result->respBody->len;
+	outcome->successes = outcome->withSequenceNumbers = 0;
+	for(i=0; i<result->recordCount; i++){
+		outcome->successes += result->results[i].success && result->results[i].attempts == 1;
+		outcome->withSequenceNumbers += *result->results[i].sequenceNumber && strcmp(result->results[i].shardId, "shardId-000000000000") == 0;
+	}
+	snprintf(outcome->firstErrorCode, sizeof(outcome->firstErrorCode), "%s", result->recordCount ? result->results[0].errorCode : "");
+}
+
+/* a pipelined batch whose response is far over 512 bytes still gives every record its result, and a refused */
+/* request fails every record with the error                                                                 */
+static void testPipelineMock(const char *endpoint){
+
+	#define PIPELINE_RECORDS 500
+
+	AWSContext *ctx = ktMakeAWSContext("test", "test", NULL, "us-east-1", endpoint);
+	Pipeline *pipeline = ktMakePipeline(ctx, 2);
+
+	char *partitionKeyArray[PIPELINE_RECORDS];
+	unsigned char *dataArray[PIPELINE_RECORDS];
+	int lenArray[PIPELINE_RECORDS];
+	int i;
+	for(i=0; i<PIPELINE_RECORDS; i++){
+		partitionKeyArray[i] = "pipeline";
+		dataArray[i] = (unsigned char*)"x";
+		lenArray[i] = 1;
+	}
+
+	PipelineOutcome outcome, refused;
+	memset(&outcome, 0, sizeof(outcome));
+	memset(&refused, 0, sizeof(refused));
+	ktPipelinePutRecords(pipeline, "kttest", PIPELINE_RECORDS, partitionKeyArray, dataArray, lenArray, pipelineOutcomeCallback, &outcome);
+	ktPipelinePutRecords(pipeline, "nostream", 3, partitionKeyArray, dataArray, lenArray, pipelineOutcomeCallback, &refused);
+	ktPipelineDrain(pipeline);
+
+	check(outcome.calls == 1 && outcome.retcode == 200, "pipeline results", "request failed");
+	check(outcome.bodyLen > 512, "pipeline results", "response truncated");
+	check(outcome.recordCount == PIPELINE_RECORDS && outcome.failedRecordCount == 0, "pipeline results", "wrong record counts");
+	check(outcome.successes == PIPELINE_RECORDS && outcome.withSequenceNumbers == PIPELINE_RECORDS, "pipeline results", "records without results");
+
+	check(refused.calls == 1 && refused.retcode == 400, "pipeline refused", "not refused");
+	check(refused.recordCount == 3 && refused.failedRecordCount == 3 && refused.successes == 0, "pipeline refused", "records not failed");
+	check(strcmp(refused.firstErrorCode, "ResourceNotFoundException") == 0, "pipeline refused", refused.firstErrorCode);
+
+	ktFreePipeline(pipeline);
+	ktFreeAWSContext(ctx);
+}
+
+/* a scripted stand in for Kinesis on a loopback port: each request's body is kept and answered, after delayMs, */
+/* with the next response of the script, as JSON with status 200                                               */
+#define MAX_STUB_REQUESTS 8
+
+typedef struct{
+	int listener;
+	char url[64];
+	pthread_t thread;
+	pthread_mutex_t lock;
+	const char *responses[MAX_STUB_REQUESTS];
+	char *bodies[MAX_STUB_REQUESTS];
+	int requests;
+	int delayMs;
+}StubServer;
+
+/* read one request on fd, keeping its body and answering from the script. 0 once the connection ends */
+static int serveStubRequest(StubServer *stub, int fd){
+
+	char head[8192];
+	size_t len = 0;
+	char *end = NULL;
+	while(!end){
+		ssize_t n = len < sizeof(head) - 1 ? read(fd, head + len, sizeof(head) - 1 - len) : 0;
+		if(n <= 0)
+			return 0;
+		len += n;
+		head[len] = '\0';
+		end = strstr(head, "\r\n\r\n");
+	}
+
+	const char *field = strcasestr(head, "\r\nContent-Length:");
+	size_t bodyLen = field ? strtoul(field + 17, NULL, 10) : 0;
+	if(strcasestr(head, "\r\nExpect: 100-continue") && write(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) != 25)
+		return 0;
+
+	char *body = malloc(bodyLen + 1);
+	size_t have = len - (end + 4 - head);
+	memcpy(body, end + 4, have);
+	while(have < bodyLen){
+		ssize_t n = read(fd, body + have, bodyLen - have);
+		if(n <= 0){
+			free(body);
+			return 0;
+		}
+		have += n;
+	}
+	body[bodyLen] = '\0';
+
+	pthread_mutex_lock(&stub->lock);
+	int i = stub->requests < MAX_STUB_REQUESTS ? stub->requests++ : -1;
+	const char *response = i >= 0 && stub->responses[i] ? stub->responses[i] : "{\"__type\":\"InternalFailure\"}";
+	if(i >= 0)
+		stub->bodies[i] = body;
+	else
+		free(body);
+	pthread_mutex_unlock(&stub->lock);
+
+	usleep(stub->delayMs * 1000);
+
+	char reply[8192];
+	int replyLen = snprintf(reply, sizeof(reply), "HTTP/1.1 %d OK\r\nContent-Type: application/x-amz-json-1.1\r\nContent-Length: %zu\r\n\r\n%s",
+		i >= 0 && stub->responses[i] ? 200 : 500, strlen(response), response);
+
+	return write(fd, reply, replyLen) == replyLen;
+}
+
+static void* stubConnectionThread(void *arg){
+
+	StubServer *stub = ((void**)arg)[0];
+	int fd = (int)(intptr_t)((void**)arg)[1];
+
+	free(arg);
+	while(serveStubRequest(stub, fd))
+		;
+	close(fd);
+
+	return NULL;
+}
+
+static void* stubServerThread(void *arg){
+
+	StubServer *stub = arg;
+	int fd;
+
+	while((fd = accept(stub->listener, NULL, NULL)) >= 0){
+		void **connection = malloc(2 * sizeof(void*));
+		connection[0] = stub;
+		connection[1] = (void*)(intptr_t)fd;
+		pthread_t thread;
+		pthread_create(&thread, NULL, stubConnectionThread, connection);
+		pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+/* start serving the script on a free loopback port, its endpoint in stub->url. Returns 0 if it can't listen */
+static int startStubServer(StubServer *stub){
+
+	struct sockaddr_in addr;
+	socklen_t addrLen = sizeof(addr);
+
+	pthread_mutex_init(&stub->lock, NULL);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	stub->listener = socket(AF_INET, SOCK_STREAM, 0);
+	if(stub->listener < 0 || bind(stub->listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(stub->listener, 8) != 0 || getsockname(stub->listener, (struct sockaddr*)&addr, &addrLen) != 0)
+		return 0;
+	snprintf(stub->url, sizeof(stub->url), "http://127.0.0.1:%d", ntohs(addr.sin_port));
+
+	return pthread_create(&stub->thread, NULL, stubServerThread, stub) == 0;
+}
+
+/* stop accepting and free the kept bodies; connections end as their clients close them */
+static void stopStubServer(StubServer *stub){
+
+	int i;
+
+	shutdown(stub->listener, SHUT_RDWR);
+	pthread_join(stub->thread, NULL);
+	close(stub->listener);
+	for(i=0; i<MAX_STUB_REQUESTS; i++)
+		free(stub->bodies[i]);
+}
+
+/* ktPutRecordsWithRetry against scripted responses: only the record with an ErrorCode is resent, attempts count */
+/* each record's sends, and a Records array that doesn't match the request fails every record as InvalidResponse */
+/* without a resend                                                                                             */
+static void testRetryStub(void){
+
+	static StubServer stub;
+	memset(&stub, 0, sizeof(stub));
+	stub.responses[0] = "{\"FailedRecordCount\":1,\"Records\":[{\"SequenceNumber\":\"1\",\"ShardId\":\"shardId-000000000000\"},"
+		"{\"ErrorCode\":\"ProvisionedThroughputExceededException\",\"ErrorMessage\":\"Rate exceeded\"},{\"SequenceNumber\":\"3\",\"ShardId\":\"shardId-000000000000\"}]}";
+	stub.responses[1] = "{\"FailedRecordCount\":0,\"Records\":[{\"SequenceNumber\":\"2\",\"ShardId\":\"shardId-000000000000\"}]}";
+	stub.responses[2] = "{\"FailedRecordCount\":0,\"Records\":[{\"SequenceNumber\":\"4\",\"ShardId\":\"shardId-000000000000\"}]}";
+	if(!check(startStubServer(&stub), "retry stub", "cannot listen"))
+		return;
+
+	AWSContext *ctx = ktMakeAWSContext("test", "test", NULL, "us-east-1", stub.url);
+	RetryPolicy policy = {5, 1, 10};
+	char *partitionKeyArray[3] = {"retry-a", "retry-b", "retry-c"};
+	unsigned char *dataArray[3] = {(unsigned char*)"a", (unsigned char*)"b", (unsigned char*)"c"};
+	int lenArray[3] = {1, 1, 1};
+	RecordResult results[3];
+	char errorMsg[CURL_ERROR_SIZE] = "";
+
+	int status = ktPutRecordsWithRetry(ctx, "kttest", 3, partitionKeyArray, dataArray, lenArray, &policy, results, errorMsg);
+	check(status == 200, "retry ErrorCode", errorMsg);
+	check(stub.requests == 2, "retry ErrorCode", "not resent once");
+	check(stub.bodies[1] && strstr(stub.bodies[1], "retry-b") && !strstr(stub.bodies[1], "retry-a") && !strstr(stub.bodies[1], "retry-c"), "retry ErrorCode", "resent more than the failed record");
+	check(results[0].success && results[1].success && results[2].success, "retry ErrorCode", "records not all put");
+	check(results[0].attempts == 1 && results[1].attempts == 2 && results[2].attempts == 1, "retry attempts", "wrong attempt counts");
+	check(strcmp(results[1].sequenceNumber, "2") == 0 && strcmp(results[2].sequenceNumber, "3") == 0, "retry ErrorCode", "results out of order");
+
+	/* one entry for three records */
+	status = ktPutRecordsWithRetry(ctx, "kttest", 3, partitionKeyArray, dataArray, lenArray, &policy, results, errorMsg);
+	check(status == 200, "retry mismatched response", errorMsg);
+	check(stub.requests == 3, "retry mismatched response", "resent");
+	check(!results[0].success && !results[1].success && !results[2].success, "retry mismatched response", "records put");
+	check(strcmp(results[0].errorCode, "InvalidResponse") == 0 && strcmp(results[2].errorCode, "InvalidResponse") == 0, "retry mismatched response", results[0].errorCode);
+	check(results[0].attempts == 1 && results[2].attempts == 1, "retry mismatched response", "wrong attempt counts");
+
+	ktFreeAWSContext(ctx);
+	stopStubServer(&stub);
+}
+
+/* ktPutRecordsWithRetry against a ktmock failing half the records it accepts with InternalFailure: with one attempt */
+/* both outcomes are reported, and with enough attempts every record is put exactly once                           */
+static void testRetryFailingMock(const char *endpoint){
+
+	#define RETRY_RECORDS 50
+
+	AWSContext *ctx = ktMakeAWSContext("test", "test", NULL, "us-east-1", endpoint);
+	char *partitionKeyArray[RETRY_RECORDS];
+	unsigned char *dataArray[RETRY_RECORDS];
+	int lenArray[RETRY_RECORDS];
+	RecordResult results[RETRY_RECORDS];
+	char errorMsg[CURL_ERROR_SIZE] = "";
+	int i, j;
+
+	for(i=0; i<RETRY_RECORDS; i++){
+		partitionKeyArray[i] = malloc(16);
+		sprintf(partitionKeyArray[i], "once-%d", i);
+		dataArray[i] = (unsigned char*)partitionKeyArray[i];
+		lenArray[i] = strlen(partitionKeyArray[i]);
+	}
+
+	RetryPolicy policy = {1, 1, 10};
+	int status = ktPutRecordsWithRetry(ctx, "kttest", RETRY_RECORDS, partitionKeyArray, dataArray, lenArray, &policy, results, errorMsg);
+	int succeeded = 0, failed = 0, attempts = 1;
+	for(i=0; i<RETRY_RECORDS; i++){
+		succeeded += results[i].success;
+		failed += !results[i].success && strcmp(results[i].errorCode, "InternalFailure") == 0;
+		attempts = attempts && results[i].attempts == 1;
+	}
+	check(status == 200, "failing mock, one attempt", errorMsg);
+	check(succeeded > 0 && failed > 0 && succeeded + failed == RETRY_RECORDS, "failing mock, one attempt", "outcomes not reported");
+	check(attempts, "failing mock, one attempt", "attempts not 1");
+
+	for(i=0; i<RETRY_RECORDS; i++)
+		sprintf(partitionKeyArray[i], "many-%d", i);
+	policy.maxAttempts = 40;
+	status = ktPutRecordsWithRetry(ctx, "kttest", RETRY_RECORDS, partitionKeyArray, dataArray, lenArray, &policy, results, errorMsg);
+	int retried = 0, maxAttempts = 0;
+	succeeded = 0;
+	for(i=0; i<RETRY_RECORDS; i++){
+		succeeded += results[i].success;
+		retried += results[i].attempts > 1;
+		if(results[i].attempts > maxAttempts)
+			maxAttempts = results[i].attempts;
+	}
+	check(status == 200 && succeeded == RETRY_RECORDS, "failing mock, retried", "records not all put");
+	check(retried > 0 && maxAttempts <= 40, "failing mock, retried", "wrong attempt counts");
+
+	/* each record in the shard once: records that succeeded were never resent */
+	size_t bufferSize = 1024*1024;
+	unsigned char *buffer = malloc(bufferSize);
+	ConsumerRecord *records = malloc(1000 * sizeof(ConsumerRecord));
+	int count = readShard(ctx, records, 1000, buffer, bufferSize);
+	int once = count > 0;
+	for(i=0; i<RETRY_RECORDS && once; i++){
+		int copies = 0;
+		for(j=0; j<count; j++)
+			copies += strcmp(records[j].partitionKey, partitionKeyArray[i]) == 0;
+		once = copies == 1;
+	}
+	check(once, "failing mock, retried", "records missing or duplicated");
+
+	free(records);
+	free(buffer);
+	for(i=0; i<RETRY_RECORDS; i++)
+		free(partitionKeyArray[i]);
+	ktFreeAWSContext(ctx);
+}
+
+/* a fresh temporary directory for a spool, in dir. 0 if it can't be made */
+static int makeSpoolDirectory(char *dir){
+
+	strcpy(dir, "/tmp/kttest-spool-XXXXXX");
+
+	return mkdtemp(dir) != NULL;
+}
+
+/* remove a spool directory and its segments */
+static void removeSpoolDirectory(const char *dir){
+
+	DIR *d = opendir(dir);
+	struct dirent *entry;
+	char path[512];
+
+	while(d && (entry = readdir(d))){
+		if(*entry->d_name == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		unlink(path);
+	}
+	if(d)
+		closedir(d);
+	rmdir(dir);
+}
+
+/* offset in a segment of record i of n records with keyLens and dataLens chars: a 24 byte segment header, then */
+/* each record a 12 byte header, its key with null and its data, padded to 4 bytes                              */
+static size_t spoolRecordOffset(int i, const size_t *keyLens, const int *dataLens){
+
+	size_t offset = 24;
+	int j;
+
+	for(j=0; j<i; j++)
+		offset += (12 + keyLens[j] + 1 + dataLens[j] + 3) & ~(size_t)3;
+
+	return offset;
+}
+
+/* spool records in place in a directory, on their own. Returns the number spooled */
+static int spoolKeys(const char *dir, int count, char * const *keys){
+
+	unsigned char *data[8];
+	int lens[8], i;
+	for(i=0; i<count; i++){
+		data[i] = (unsigned char*)keys[i];
+		lens[i] = strlen(keys[i]);
+	}
+
+	Spool *spool = ktOpenSpool(dir, NULL, NULL);
+	int spooled = spool ? ktSpoolRecords(spool, count, keys, data, lens, NULL, NULL) : 0;
+	if(spool)
+		ktCloseSpool(spool);
+
+	return spooled;
+}
+
+/* records in a spool reopened from dir, or -1 */
+static long long spooledRecords(const char *dir){
+
+	SpoolStats stats;
+	Spool *spool = ktOpenSpool(dir, NULL, NULL);
+	if(!spool)
+		return -1;
+	ktGetSpoolStats(spool, &stats);
+	ktCloseSpool(spool);
+
+	return stats.records;
+}
+
+/* a record cut short before its crc is dropped on recovery and the next append takes its place; replayed to */
+/* ktmock, the records arrive once, and the read offset saved in the segment keeps them from being sent again */
+static void testSpoolMock(const char *endpoint){
+
+	char dir[64];
+	if(!check(makeSpoolDirectory(dir), "spool", "no temporary directory"))
+		return;
+
+	char *keys[4] = {"spool-0", "spool-1", "spool-2", "spool-3"};
+	check(spoolKeys(dir, 3, keys) == 3, "spool", "records not spooled");
+
+	/* the last record's data half written, as if the process died appending it */
+	char path[128];
+	size_t keyLens[3] = {7, 7, 7};
+	int dataLens[3] = {7, 7, 7};
+	snprintf(path, sizeof(path), "%s/0000000000000000.ktspool", dir);
+	FILE *file = fopen(path, "r+b");
+	if(check(file != NULL, "spool truncated record", "no segment file")){
+		fseek(file, spoolRecordOffset(2, keyLens, dataLens) + 12 + 8 + 4, SEEK_SET);
+		fwrite("\0\0\0", 1, 3, file);
+		fclose(file);
+	}
+	check(spooledRecords(dir) == 2, "spool truncated record", "not dropped on recovery");
+	check(spoolKeys(dir, 1, keys + 3) == 1 && spooledRecords(dir) == 3, "spool truncated record", "append after recovery lost");
+
+	AWSContext *ctx = ktMakeAWSContext("test", "test", NULL, "us-east-1", endpoint);
+	RetryPolicy policy = {3, 1, 10};
+	char errorMsg[CURL_ERROR_SIZE] = "";
+	Spool *spool = ktOpenSpool(dir, NULL, errorMsg);
+	if(check(spool != NULL, "spool replay", errorMsg)){
+		check(ktReplaySpool(ctx, spool, "kttest", &policy, errorMsg) == 3, "spool replay", "records not replayed");
+		ktCloseSpool(spool);
+	}
+
+	/* the read offset was saved: nothing is left to replay once reopened, and new records replay alone */
+	check(spooledRecords(dir) == 0, "spool read offset", "replayed records recovered");
+	check(spoolKeys(dir, 1, keys + 2) == 1, "spool read offset", "record not spooled");
+	spool = ktOpenSpool(dir, NULL, errorMsg);
+	if(spool){
+		check(ktReplaySpool(ctx, spool, "kttest", &policy, errorMsg) == 1, "spool read offset", "wrong records replayed");
+		ktCloseSpool(spool);
+	}
+
+	/* spool-0, spool-1 and spool-3, then spool-2 once appended whole, each once */
+	size_t bufferSize = 4*1024*1024;
+	unsigned char *buffer = malloc(bufferSize);
+	ConsumerRecord *records = malloc(4000 * sizeof(ConsumerRecord));
+	int count = readShard(ctx, records, 4000, buffer, bufferSize);
+	int i, j, order[4] = {-1, -1, -1, -1}, copies[4] = {0, 0, 0, 0};
+	for(j=0; j<count; j++)
+		for(i=0; i<4; i++)
+			if(strcmp(records[j].partitionKey, keys[i]) == 0){
+				copies[i]++;
+				order[i] = j;
+			}
+	check(copies[0] == 1 && copies[1] == 1 && copies[2] == 1 && copies[3] == 1, "spool replay", "records missing or duplicated");
+	check(order[0] < order[1] && order[1] < order[3] && order[3] < order[2], "spool replay", "records out of order");
+
+	free(records);
+	free(buffer);
+	ktFreeAWSContext(ctx);
+	removeSpoolDirectory(dir);
+}
+
+/* a replay running in its own thread */
+typedef struct{
+	const AWSContext *ctx;
+	Spool *spool;
+	int replayed;
+}SpoolReplay;
+
+static void* spoolReplayThread(void *arg){
+
+	SpoolReplay *replay = arg;
+	RetryPolicy policy = {1, 1, 10};
+
+	replay->replayed = ktReplaySpool(replay->ctx, replay->spool, "kttest", &policy, NULL);
+
+	return NULL;
+}
+
+/* replay against scripted responses: it stops at the first record that fails for want of capacity, keeping it */
+/* and the records after it, and a segment evicted while its batch is in flight is freed once the batch is done */
+static void testSpoolReplayStub(void){
+
+	static StubServer stub;
+	memset(&stub, 0, sizeof(stub));
+	stub.responses[0] = "{\"FailedRecordCount\":1,\"Records\":[{\"SequenceNumber\":\"1\",\"ShardId\":\"shardId-000000000000\"},"
+		"{\"ErrorCode\":\"ProvisionedThroughputExceededException\",\"ErrorMessage\":\"Rate exceeded\"},{\"SequenceNumber\":\"3\",\"ShardId\":\"shardId-000000000000\"}]}";
+	stub.responses[1] = "{\"FailedRecordCount\":0,\"Records\":[{\"SequenceNumber\":\"2\",\"ShardId\":\"shardId-000000000000\"},{\"SequenceNumber\":\"3\",\"ShardId\":\"shardId-000000000000\"}]}";
+	stub.responses[2] = "{\"FailedRecordCount\":0,\"Records\":[{\"SequenceNumber\":\"4\",\"ShardId\":\"shardId-000000000000\"}]}";
+	if(!check(startStubServer(&stub), "spool stub", "cannot listen"))
+		return;
+
+	char dir[64];
+	if(!check(makeSpoolDirectory(dir), "spool", "no temporary directory")){
+		stopStubServer(&stub);
+		return;
+	}
+
+	AWSContext *ctx = ktMakeAWSContext("test", "test", NULL, "us-east-1", stub.url);
+	RetryPolicy policy = {1, 1, 10};
+	char *keys[3] = {"spool-a", "spool-b", "spool-c"};
+	SpoolStats stats;
+	char errorMsg[CURL_ERROR_SIZE] = "", path[128];
+
+	spoolKeys(dir, 3, keys);
+	Spool *spool = ktOpenSpool(dir, NULL, errorMsg);
+	if(check(spool != NULL, "spool replay failure", errorMsg)){
+		check(ktReplaySpool(ctx, spool, "kttest", &policy, errorMsg) == 1, "spool replay failure", "not stopped at the failed record");
+		ktGetSpoolStats(spool, &stats);
+		check(stats.records == 2 && stats.replayedRecords == 1 && stats.droppedRecords == 0, "spool replay failure", "wrong records kept");
+		ktCloseSpool(spool);
+	}
+	check(spooledRecords(dir) == 2, "spool replay failure", "kept records lost on reopening");
+
+	/* the record after the failed one goes again with it */
+	spool = ktOpenSpool(dir, NULL, errorMsg);
+	if(spool){
+		check(ktReplaySpool(ctx, spool, "kttest", &policy, errorMsg) == 2, "spool replay failure", "kept records not replayed");
+		check(stub.bodies[1] && !strstr(stub.bodies[1], "spool-a") && strstr(stub.bodies[1], "spool-b") && strstr(stub.bodies[1], "spool-c"), "spool replay failure", "wrong records resent");
+		ktCloseSpool(spool);
+	}
+	removeSpoolDirectory(dir);
+
+	/* one small record in the first segment, pinned by a slow replay while three of the largest records take the */
+	/* spool past its two segments and evict it, with the first of them                                            */
+	if(!check(makeSpoolDirectory(dir), "spool", "no temporary directory")){
+		ktFreeAWSContext(ctx);
+		stopStubServer(&stub);
+		return;
+	}
+	SpoolOptions opts;
+	ktDefaultSpoolOptions(&opts);
+	opts.segmentSize = 0;
+	opts.maxSegments = 2;
+	spool = ktOpenSpool(dir, &opts, errorMsg);
+	if(check(spool != NULL, "spool eviction", errorMsg)){
+
+		char *key = "spool-small";
+		unsigned char *data = (unsigned char*)key;
+		int len = strlen(key);
+		ktSpoolRecords(spool, 1, &key, &data, &len, NULL, errorMsg);
+
+		stub.delayMs = 500;
+		SpoolReplay replay = {ctx, spool, -1};
+		pthread_t thread;
+		pthread_create(&thread, NULL, spoolReplayThread, &replay);
+		usleep(200000);
+
+		char *bigKeys[3] = {"spool-big-0", "spool-big-1", "spool-big-2"};
+		unsigned char *big = calloc(1, 1024*1024);
+		unsigned char *bigData[3] = {big, big, big};
+		int bigLens[3] = {1024*1024, 1024*1024, 1024*1024};
+		check(ktSpoolRecords(spool, 3, bigKeys, bigData, bigLens, NULL, errorMsg) == 3, "spool eviction", errorMsg);
+		ktGetSpoolStats(spool, &stats);
+		check(stats.segments == 2 && stats.evictedRecords == 2, "spool eviction", "pinned segment not evicted");
+
+		pthread_join(thread, NULL);
+		ktGetSpoolStats(spool, &stats);
+		check(replay.replayed == 1 && stats.replayedRecords == 1, "spool eviction", "evicted batch not reported");
+		check(stats.evictedRecords == 1 && stats.records == 2, "spool eviction", "delivered record counted as evicted");
+		snprintf(path, sizeof(path), "%s/0000000000000000.ktspool", dir);
+		check(access(path, F_OK) != 0, "spool eviction", "evicted segment file kept");
+
+		free(big);
+		ktCloseSpool(spool);
+	}
+
+	ktFreeAWSContext(ctx);
+	stopStubServer(&stub);
+	removeSpoolDirectory(dir);
+}
+
+int main(int argc, char **argv){
+
+	if(argc > 3){
+		printf("Usage:\n  kttest [ktmock_endpoint [failing_ktmock_endpoint]]\n");
+		return 1;
+	}
+
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+
+	testPutRecordsPayload();
+	testCBORPayloads();
+	testCBORToJSON();
+	testBase64Decoders();
+	testParseGetRecords();
+	testEventStreamParser();
+	testAggregation(NULL);
+	testCompression();
+	testRetryStub();
+	testSpoolReplayStub();
+	testScratchArena(NULL);
+	testGetCredentials();
+
+	if(argc >= 2){
+		testCBORMock(argv[1]);
+		testScratchArena(argv[1]);
+		testAggregation(argv[1]);
+		testPipelineMock(argv[1]);
+		testConsumerMock(argv[1]);
+		testSubscribeToShardMock(argv[1]);
+		testSpoolMock(argv[1]);
+	}
+	if(argc == 3)
+		testRetryFailingMock(argv[2]);
+
+	printf("%d of %d checks failed\n", failures, checks);
+
+	curl_global_cleanup();
+
+	return failures;
+}